@@ -0,0 +1,179 @@
+// ----------------------------------------------------------------------
+// File: DiamondBlockCache.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#include "DiamondBlockCache.hh"
+
+//------------------------------------------------------------------------------
+// Lookup a block
+//------------------------------------------------------------------------------
+bool
+DiamondBlockCache::Get (const std::string& path, off_t size, time_t mtime,
+                        uint64_t index, block_ptr_t& block,
+                        unsigned long long& generation)
+{
+  block_key_t key(path, index);
+  mCond.Lock();
+
+  while (1)
+  {
+    std::unordered_map<std::string, File>::iterator it = mFiles.find(path);
+
+    if ((it != mFiles.end()) &&
+        ((it->second.size != size) || (it->second.mtime != mtime)))
+    {
+      // the file has been modified behind our back
+      DropFile(it);
+      it = mFiles.end();
+    }
+
+    if (it == mFiles.end())
+    {
+      File& file = mFiles[path];
+      file.size = size;
+      file.mtime = mtime;
+      file.generation = ++mGeneration;
+      it = mFiles.find(path);
+    }
+
+    std::map<uint64_t, Block>::iterator bit = it->second.blocks.find(index);
+    if (bit != it->second.blocks.end())
+    {
+      mLru.splice(mLru.begin(), mLru, bit->second.lru);
+      block = bit->second.data;
+      mStats.hits++;
+      mCond.UnLock();
+      return true;
+    }
+
+    if (!mLoading.count(key))
+    {
+      mLoading.insert(key);
+      generation = it->second.generation;
+      mStats.misses++;
+      mCond.UnLock();
+      return false;
+    }
+
+    // somebody else is reading this block - wait for it
+    mCond.Wait();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Finish the load of a block
+//------------------------------------------------------------------------------
+void
+DiamondBlockCache::Fill (const std::string& path, uint64_t index,
+                         unsigned long long generation, block_ptr_t block)
+{
+  block_key_t key(path, index);
+  mCond.Lock();
+  mLoading.erase(key);
+
+  std::unordered_map<std::string, File>::iterator it = mFiles.find(path);
+  if (block && (it != mFiles.end()) && (it->second.generation == generation) &&
+      !it->second.blocks.count(index))
+  {
+    mLru.push_front(key);
+    Block& entry = it->second.blocks[index];
+    entry.data = block;
+    entry.lru = mLru.begin();
+    mSize += block->size();
+    Evict();
+  }
+
+  mCond.Broadcast();
+  mCond.UnLock();
+}
+
+//------------------------------------------------------------------------------
+// Drop all blocks of a path
+//------------------------------------------------------------------------------
+void
+DiamondBlockCache::Invalidate (const std::string& path)
+{
+  mCond.Lock();
+  std::unordered_map<std::string, File>::iterator it = mFiles.find(path);
+  if (it != mFiles.end())
+  {
+    DropFile(it);
+    mStats.invalidations++;
+  }
+  mCond.UnLock();
+}
+
+//------------------------------------------------------------------------------
+// Return the counters
+//------------------------------------------------------------------------------
+DiamondBlockCache::Stats
+DiamondBlockCache::GetStats ()
+{
+  mCond.Lock();
+  Stats stats = mStats;
+  stats.bytes = mSize;
+  stats.blocks = mLru.size();
+  mCond.UnLock();
+  return stats;
+}
+
+//------------------------------------------------------------------------------
+// Remove a file entry with all its blocks - requires the lock
+//------------------------------------------------------------------------------
+void
+DiamondBlockCache::DropFile (std::unordered_map<std::string, File>::iterator it)
+{
+  std::map<uint64_t, Block>::iterator bit;
+  for (bit = it->second.blocks.begin(); bit != it->second.blocks.end(); bit++)
+  {
+    mSize -= bit->second.data->size();
+    mLru.erase(bit->second.lru);
+  }
+  mFiles.erase(it);
+}
+
+//------------------------------------------------------------------------------
+// Drop least recently used blocks until the cache fits - requires the lock
+//------------------------------------------------------------------------------
+void
+DiamondBlockCache::Evict ()
+{
+  while ((mSize > mMaxSize) && !mLru.empty())
+  {
+    block_key_t key = mLru.back();
+    std::unordered_map<std::string, File>::iterator it = mFiles.find(key.first);
+    if (it != mFiles.end())
+    {
+      std::map<uint64_t, Block>::iterator bit = it->second.blocks.find(key.second);
+      if (bit != it->second.blocks.end())
+      {
+        mSize -= bit->second.data->size();
+        it->second.blocks.erase(bit);
+      }
+      if (it->second.blocks.empty())
+        mFiles.erase(it);
+    }
+    mLru.pop_back();
+    mStats.evictions++;
+  }
+}
@@ -0,0 +1,129 @@
+// ----------------------------------------------------------------------
+// File: DiamondBlockCache.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#ifndef __DIAMONDBLOCKCACHE_API_H__
+#define __DIAMONDBLOCKCACHE_API_H__
+#include "XrdSys/XrdSysPthread.hh"
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define DIAMOND_DEFAULT_BLOCKCACHE_SIZE 0
+#define DIAMOND_DEFAULT_BLOCKCACHE_BLOCKSIZE 4*1024*1024
+
+//------------------------------------------------------------------------------
+//! Process wide LRU cache of file blocks shared by all read-only DiamondFile
+//! instances. A file is identified by its path together with size and
+//! modification time at open, a block by its index in the file. Concurrent
+//! misses of the same block are collapsed into one backend read.
+//------------------------------------------------------------------------------
+class DiamondBlockCache {
+public:
+  typedef std::shared_ptr<std::vector<char> > block_ptr_t;
+
+  struct Stats {
+    Stats () : hits(0), misses(0), evictions(0), invalidations(0), bytes(0),
+               blocks(0) { }
+    unsigned long long hits; //< blocks served from memory
+    unsigned long long misses; //< blocks read from the backend
+    unsigned long long evictions; //< blocks dropped to stay within size
+    unsigned long long invalidations; //< files dropped by modifications
+    unsigned long long bytes; //< bytes currently cached
+    unsigned long long blocks; //< blocks currently cached
+  };
+
+  DiamondBlockCache () : mCond(0),
+                         mMaxSize(DIAMOND_DEFAULT_BLOCKCACHE_SIZE),
+                         mBlockSize(DIAMOND_DEFAULT_BLOCKCACHE_BLOCKSIZE),
+                         mSize(0),
+                         mGeneration(0) { }
+
+  ~DiamondBlockCache () { }
+
+  //----------------------------------------------------------------------------
+  //! Lookup a block. On a miss the caller owns the load of the block and has
+  //! to call Fill with the returned generation - with the block read or with
+  //! an empty pointer if the read failed.
+  //!
+  //! @return true if block has been filled from the cache
+  //----------------------------------------------------------------------------
+  bool Get (const std::string& path, off_t size, time_t mtime, uint64_t index,
+            block_ptr_t& block, unsigned long long& generation);
+
+  //----------------------------------------------------------------------------
+  //! Finish the load of a block announced by a missing Get
+  //----------------------------------------------------------------------------
+  void Fill (const std::string& path, uint64_t index,
+             unsigned long long generation, block_ptr_t block);
+
+  //----------------------------------------------------------------------------
+  //! Drop all blocks of path
+  //----------------------------------------------------------------------------
+  void Invalidate (const std::string& path);
+
+  Stats GetStats ();
+
+  void SetMaxSize (size_t maxsize) { mMaxSize = maxsize; }
+  void SetBlockSize (size_t blocksize) { mBlockSize = blocksize; }
+  size_t BlockSize () const { return mBlockSize; }
+  bool Enabled () const { return mMaxSize && mBlockSize; }
+
+private:
+  typedef std::pair<std::string, uint64_t> block_key_t;
+
+  struct Block {
+    block_ptr_t data;
+    std::list<block_key_t>::iterator lru; //< position in mLru
+  };
+
+  struct File {
+    off_t size; //< size of the file the blocks belong to
+    time_t mtime; //< modification time of the file the blocks belong to
+    unsigned long long generation; //< identifies this incarnation of the entry
+    std::map<uint64_t, Block> blocks; //< block index => block
+  };
+
+  void DropFile (std::unordered_map<std::string, File>::iterator it);
+  void Evict ();
+
+  XrdSysCondVar mCond; //< protects all members, signals finished loads
+  std::unordered_map<std::string, File> mFiles; //< path => cached blocks
+  std::list<block_key_t> mLru; //< cached blocks, most recently used first
+  std::set<block_key_t> mLoading; //< blocks currently read by a miss
+  size_t mMaxSize; //< maximum number of cached bytes - 0 disables the cache
+  size_t mBlockSize; //< size of a cached block
+  size_t mSize; //< number of cached bytes
+  unsigned long long mGeneration; //< last generation handed to a File
+  Stats mStats; //< counters
+};
+
+#endif
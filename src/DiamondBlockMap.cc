@@ -0,0 +1,488 @@
+// ----------------------------------------------------------------------
+// File: DiamondBlockMap.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#include "DiamondBlockMap.hh"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <zlib.h>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+#define DIAMOND_CRC32C_POLY 0x82f63b78
+
+//------------------------------------------------------------------------------
+// Lookup tables of the software CRC32C - slicing by 8
+//------------------------------------------------------------------------------
+namespace {
+struct Crc32cTable {
+  uint32_t t[8][256];
+
+  Crc32cTable () {
+    for (uint32_t n = 0; n < 256; n++)
+    {
+      uint32_t crc = n;
+      for (int k = 0; k < 8; k++)
+        crc = (crc & 1) ? ((crc >> 1) ^ DIAMOND_CRC32C_POLY) : (crc >> 1);
+      t[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++)
+      for (int k = 1; k < 8; k++)
+        t[k][n] = (t[k - 1][n] >> 8) ^ t[0][t[k - 1][n] & 0xff];
+  }
+};
+
+const Crc32cTable sCrc32c;
+
+//------------------------------------------------------------------------------
+// GF(2) matrix helpers of the CRC combination - as in zlib's crc32_combine
+//------------------------------------------------------------------------------
+uint32_t
+Gf2Times (const uint32_t* mat, uint32_t vec)
+{
+  uint32_t sum = 0;
+  while (vec)
+  {
+    if (vec & 1)
+      sum ^= *mat;
+    vec >>= 1;
+    mat++;
+  }
+  return sum;
+}
+
+void
+Gf2Square (uint32_t* square, const uint32_t* mat)
+{
+  for (int n = 0; n < 32; n++)
+    square[n] = Gf2Times(mat, mat[n]);
+}
+}
+
+//------------------------------------------------------------------------------
+// CRC32C - with SSE4.2 the crc32 instruction is used
+//------------------------------------------------------------------------------
+uint32_t
+DiamondBlockMap::Crc32c (uint32_t crc, const char* data, size_t length)
+{
+  const unsigned char* p = (const unsigned char*) data;
+  crc = ~crc;
+#ifdef __SSE4_2__
+  uint64_t crc64 = crc;
+  while (length >= 8)
+  {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+    p += 8;
+    length -= 8;
+  }
+  crc = crc64;
+  while (length--)
+    crc = _mm_crc32_u8(crc, *p++);
+#else
+  while (length >= 8)
+  {
+    uint32_t lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) |
+                         ((uint32_t) p[3] << 24));
+    crc = sCrc32c.t[7][lo & 0xff] ^ sCrc32c.t[6][(lo >> 8) & 0xff] ^
+      sCrc32c.t[5][(lo >> 16) & 0xff] ^ sCrc32c.t[4][lo >> 24] ^
+      sCrc32c.t[3][p[4]] ^ sCrc32c.t[2][p[5]] ^
+      sCrc32c.t[1][p[6]] ^ sCrc32c.t[0][p[7]];
+    p += 8;
+    length -= 8;
+  }
+  while (length--)
+    crc = (crc >> 8) ^ sCrc32c.t[0][(crc ^ *p++) & 0xff];
+#endif
+  return ~crc;
+}
+
+//------------------------------------------------------------------------------
+// Combine two CRC32C sums
+//------------------------------------------------------------------------------
+uint32_t
+DiamondBlockMap::Crc32cCombine (uint32_t crc1, uint32_t crc2, off_t length2)
+{
+  if (length2 <= 0)
+    return crc1;
+
+  uint32_t even[32];
+  uint32_t odd[32];
+
+  // operator for one zero bit
+  odd[0] = DIAMOND_CRC32C_POLY;
+  uint32_t row = 1;
+  for (int n = 1; n < 32; n++)
+  {
+    odd[n] = row;
+    row <<= 1;
+  }
+  Gf2Square(even, odd);
+  Gf2Square(odd, even);
+
+  // apply length2 zero bytes to crc1
+  do
+  {
+    Gf2Square(even, odd);
+    if (length2 & 1)
+      crc1 = Gf2Times(even, crc1);
+    length2 >>= 1;
+    if (!length2)
+      break;
+    Gf2Square(odd, even);
+    if (length2 & 1)
+      crc1 = Gf2Times(odd, crc1);
+    length2 >>= 1;
+  }
+  while (length2);
+
+  return crc1 ^ crc2;
+}
+
+//------------------------------------------------------------------------------
+// Load the map attribute
+//------------------------------------------------------------------------------
+bool
+DiamondBlockMap::Load (int fd)
+{
+  if (fd < 0)
+    return false;
+
+  std::vector<char> value(DIAMOND_BLOCKMAP_MAX_LENGTH);
+  ssize_t len = fgetxattr(fd, DIAMOND_BLOCKMAP_XATTR, &value[0], value.size());
+  if (len <= 0)
+    return false;
+
+  unsigned long bsize = 0;
+  unsigned long long size = 0;
+  unsigned long long bsz = 0;
+  unsigned long long sec = 0;
+  unsigned long long nsec = 0;
+  const char* eol = (const char*) memchr(&value[0], '\n', len);
+  if (!eol)
+    return false;
+  size_t pos = eol - &value[0] + 1;
+  std::string header(&value[0], pos - 1);
+  if ((sscanf(header.c_str(), "%lu %llu %llu %llu %llu", &bsize, &size,
+              &bsz, &sec, &nsec) != 5) || !bsize)
+    return false;
+
+  struct stat buf;
+  if (fstat(fd, &buf) ||
+      (bsz != (unsigned long long) buf.st_size) ||
+      (sec != (unsigned long long) buf.st_mtim.tv_sec) ||
+      (nsec != (unsigned long long) buf.st_mtim.tv_nsec))
+    return false;
+
+  size_t nblocks = (size + bsize - 1) / bsize;
+  if ((len - pos) != (nblocks * 2 * sizeof(uint32_t)))
+    return false;
+
+  XrdSysMutexHelper lock(mMutex);
+  mBlockSize = bsize;
+  mSize = size;
+  mBlocks.resize(nblocks);
+  const char* sums = &value[pos];
+  for (size_t i = 0; i < nblocks; i++)
+  {
+    uint32_t crc;
+    uint32_t adler;
+    memcpy(&crc, sums + 8 * i, sizeof(crc));
+    memcpy(&adler, sums + 8 * i + 4, sizeof(adler));
+    mBlocks[i].crc = ntohl(crc);
+    mBlocks[i].adler = ntohl(adler);
+    mBlocks[i].length = Length(i);
+    mBlocks[i].stale = false;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Store the map attribute - blocks are merged until the map fits
+//------------------------------------------------------------------------------
+int
+DiamondBlockMap::Store (int fd)
+{
+  if (fd < 0)
+    return EBADF;
+
+  struct stat buf;
+  if (fstat(fd, &buf))
+    return errno;
+
+  XrdSysMutexHelper lock(mMutex);
+  for (size_t i = 0; i < mBlocks.size(); i++)
+  {
+    if (mBlocks[i].stale || (mBlocks[i].length != Length(i)))
+      return EINVAL;
+  }
+
+  while (1)
+  {
+    char header[128];
+    int hlen = snprintf(header, sizeof(header), "%lu %llu %llu %llu %llu\n",
+                        (unsigned long) mBlockSize,
+                        (unsigned long long) mSize,
+                        (unsigned long long) buf.st_size,
+                        (unsigned long long) buf.st_mtim.tv_sec,
+                        (unsigned long long) buf.st_mtim.tv_nsec);
+
+    if ((hlen + mBlocks.size() * 8) <= DIAMOND_BLOCKMAP_MAX_LENGTH)
+    {
+      std::string value(header, hlen);
+      value.reserve(hlen + mBlocks.size() * 8);
+      for (size_t i = 0; i < mBlocks.size(); i++)
+      {
+        uint32_t sums[2] = { htonl(mBlocks[i].crc), htonl(mBlocks[i].adler) };
+        value.append((const char*) sums, sizeof(sums));
+      }
+
+      if (!fsetxattr(fd, DIAMOND_BLOCKMAP_XATTR, value.c_str(), value.length(),
+                     0))
+        return 0;
+
+      // file systems with small attributes get a coarser map
+      if (((errno != E2BIG) && (errno != ENOSPC) && (errno != ERANGE)) ||
+          (mBlocks.size() <= 1))
+        return errno;
+    }
+    Merge();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Remove the map attribute
+//------------------------------------------------------------------------------
+void
+DiamondBlockMap::Drop (int fd)
+{
+  if (fd >= 0)
+    fremovexattr(fd, DIAMOND_BLOCKMAP_XATTR);
+}
+
+//------------------------------------------------------------------------------
+// Account a write
+//------------------------------------------------------------------------------
+void
+DiamondBlockMap::Update (off_t offset, const char* data, size_t length)
+{
+  if (!length)
+    return;
+
+  XrdSysMutexHelper lock(mMutex);
+  if ((off_t) (offset + length) > mSize)
+    mSize = offset + length;
+
+  size_t nblocks = (mSize + mBlockSize - 1) / mBlockSize;
+  if (mBlocks.size() < nblocks)
+  {
+    Block empty = { 0, 1, 0, false };
+    mBlocks.resize(nblocks, empty);
+  }
+
+  size_t done = 0;
+  while (done < length)
+  {
+    off_t pos = offset + done;
+    size_t index = pos / mBlockSize;
+    size_t start = pos - (off_t) index * mBlockSize;
+    size_t len = mBlockSize - start;
+    if (len > (length - done))
+      len = length - done;
+
+    Block& block = mBlocks[index];
+    if (!start)
+    {
+      // a write from the block start restarts its sums
+      block.crc = Crc32c(0, data + done, len);
+      block.adler = adler32(adler32(0L, Z_NULL, 0), (const Bytef*) data + done,
+                            len);
+      block.length = len;
+      block.stale = false;
+    }
+    else if (!block.stale && (start == block.length))
+    {
+      block.crc = Crc32c(block.crc, data + done, len);
+      block.adler = adler32(block.adler, (const Bytef*) data + done, len);
+      block.length += len;
+    }
+    else
+    {
+      block.stale = true;
+    }
+    done += len;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Account a truncation
+//------------------------------------------------------------------------------
+void
+DiamondBlockMap::Truncate (off_t size)
+{
+  XrdSysMutexHelper lock(mMutex);
+  mSize = size;
+
+  // an extension is a hole read back as zeros when the map is completed
+  size_t nblocks = (size + mBlockSize - 1) / mBlockSize;
+  Block empty = { 0, 1, 0, false };
+  mBlocks.resize(nblocks, empty);
+  if (nblocks && (mBlocks[nblocks - 1].length > Length(nblocks - 1)))
+    mBlocks[nblocks - 1].stale = true;
+}
+
+//------------------------------------------------------------------------------
+// Return the incomplete blocks
+//------------------------------------------------------------------------------
+void
+DiamondBlockMap::Stale (std::vector<size_t>& blocks)
+{
+  XrdSysMutexHelper lock(mMutex);
+  blocks.clear();
+  for (size_t i = 0; i < mBlocks.size(); i++)
+  {
+    if (mBlocks[i].stale || (mBlocks[i].length != Length(i)))
+      blocks.push_back(i);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Recompute the sums of a block
+//------------------------------------------------------------------------------
+void
+DiamondBlockMap::Set (size_t block, const char* data, size_t length)
+{
+  XrdSysMutexHelper lock(mMutex);
+  if (block >= mBlocks.size())
+    return;
+  mBlocks[block].crc = Crc32c(0, data, length);
+  mBlocks[block].adler = adler32(adler32(0L, Z_NULL, 0), (const Bytef*) data,
+                                 length);
+  mBlocks[block].length = length;
+  mBlocks[block].stale = false;
+}
+
+//------------------------------------------------------------------------------
+// Verify the blocks contained in a read
+//------------------------------------------------------------------------------
+bool
+DiamondBlockMap::Verify (off_t offset, const char* data, size_t length)
+{
+  XrdSysMutexHelper lock(mMutex);
+  size_t index = (offset + mBlockSize - 1) / mBlockSize;
+  while (index < mBlocks.size())
+  {
+    off_t start = (off_t) index * mBlockSize;
+    size_t len = Length(index);
+    if ((start + (off_t) len) > (off_t) (offset + length))
+      break;
+
+    const Block& block = mBlocks[index];
+    if (!block.stale && (block.length == len) &&
+        (Crc32c(0, data + (start - offset), len) != block.crc))
+      return false;
+    index++;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Combine the whole file adler32
+//------------------------------------------------------------------------------
+bool
+DiamondBlockMap::Adler (uint32_t& adler)
+{
+  XrdSysMutexHelper lock(mMutex);
+  uint32_t sum = adler32(0L, Z_NULL, 0);
+  for (size_t i = 0; i < mBlocks.size(); i++)
+  {
+    if (mBlocks[i].stale || (mBlocks[i].length != Length(i)))
+      return false;
+    sum = adler32_combine(sum, mBlocks[i].adler, mBlocks[i].length);
+  }
+  adler = sum;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Return the block size
+//------------------------------------------------------------------------------
+size_t
+DiamondBlockMap::BlockSize ()
+{
+  XrdSysMutexHelper lock(mMutex);
+  return mBlockSize;
+}
+
+//------------------------------------------------------------------------------
+// Return the logical size
+//------------------------------------------------------------------------------
+off_t
+DiamondBlockMap::Size ()
+{
+  XrdSysMutexHelper lock(mMutex);
+  return mSize;
+}
+
+//------------------------------------------------------------------------------
+// Length of a block - called with mMutex held
+//------------------------------------------------------------------------------
+size_t
+DiamondBlockMap::Length (size_t index)
+{
+  off_t start = (off_t) index * mBlockSize;
+  if (start >= mSize)
+    return 0;
+  return ((mSize - start) < (off_t) mBlockSize) ? (mSize - start) : mBlockSize;
+}
+
+//------------------------------------------------------------------------------
+// Merge adjacent blocks - called with mMutex held on complete blocks
+//------------------------------------------------------------------------------
+void
+DiamondBlockMap::Merge ()
+{
+  std::vector<Block> merged((mBlocks.size() + 1) / 2);
+  for (size_t i = 0; i < merged.size(); i++)
+  {
+    merged[i] = mBlocks[2 * i];
+    if ((2 * i + 1) < mBlocks.size())
+    {
+      const Block& next = mBlocks[2 * i + 1];
+      merged[i].crc = Crc32cCombine(merged[i].crc, next.crc, next.length);
+      merged[i].adler = adler32_combine(merged[i].adler, next.adler,
+                                        next.length);
+      merged[i].length += next.length;
+    }
+  }
+  mBlocks.swap(merged);
+  mBlockSize *= 2;
+}
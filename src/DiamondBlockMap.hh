@@ -0,0 +1,154 @@
+// ----------------------------------------------------------------------
+// File: DiamondBlockMap.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#ifndef __DIAMONDBLOCKMAP_API_H__
+#define __DIAMONDBLOCKMAP_API_H__
+#include "XrdSys/XrdSysPthread.hh"
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+
+#define DIAMOND_BLOCKMAP_XATTR "user.diamond.blockmap"
+#define DIAMOND_DEFAULT_BLOCKMAP_BLOCKSIZE 1024*1024
+#define DIAMOND_BLOCKMAP_MAX_LENGTH 64*1024
+#define DIAMOND_BLOCKMAP_MAX_STALE 64
+
+//------------------------------------------------------------------------------
+//! Per-block CRC32C and adler32 sums of a file, maintained while the file is
+//! written and stored as an extended attribute of the backend file:
+//!
+//!   <blocksize> <size> <backend size> <mtime.sec> <mtime.nsec>\n<sums>
+//!
+//! The sums are binary pairs of crc32c and adler32 in network byte order. Like
+//! the checksum attribute the map is only valid for the recorded backend size
+//! and modification time. Maps which do not fit into an attribute are stored
+//! with merged (larger) blocks, sums of adjacent blocks are combined without
+//! reading the data.
+//------------------------------------------------------------------------------
+class DiamondBlockMap {
+public:
+  DiamondBlockMap (size_t blocksize) : mBlockSize(blocksize), mSize(0) { }
+
+  //----------------------------------------------------------------------------
+  //! Continue the CRC32C crc with length bytes of data - crc 0 starts a new sum
+  //----------------------------------------------------------------------------
+  static uint32_t Crc32c (uint32_t crc, const char* data, size_t length);
+
+  //----------------------------------------------------------------------------
+  //! Return the CRC32C of two concatenated ranges from the sums of both ranges
+  //----------------------------------------------------------------------------
+  static uint32_t Crc32cCombine (uint32_t crc1, uint32_t crc2, off_t length2);
+
+  //----------------------------------------------------------------------------
+  //! Load the map attribute of fd
+  //!
+  //! @return true if the attribute exists and matches the file
+  //----------------------------------------------------------------------------
+  bool Load (int fd);
+
+  //----------------------------------------------------------------------------
+  //! Store the map as the map of the current content of fd - all blocks have
+  //! to be complete
+  //!
+  //! @return 0 or an errno
+  //----------------------------------------------------------------------------
+  int Store (int fd);
+
+  //----------------------------------------------------------------------------
+  //! Remove the map attribute of fd
+  //----------------------------------------------------------------------------
+  static void Drop (int fd);
+
+  //----------------------------------------------------------------------------
+  //! Account length bytes of data written at offset - sums are restarted by a
+  //! write at the block start and extended while a block is written
+  //! sequentially, otherwise the block becomes stale
+  //----------------------------------------------------------------------------
+  void Update (off_t offset, const char* data, size_t length);
+
+  //----------------------------------------------------------------------------
+  //! Account a truncation of the file to size
+  //----------------------------------------------------------------------------
+  void Truncate (off_t size);
+
+  //----------------------------------------------------------------------------
+  //! Return the blocks whose sums have to be recomputed from the data
+  //----------------------------------------------------------------------------
+  void Stale (std::vector<size_t>& blocks);
+
+  //----------------------------------------------------------------------------
+  //! Set the sums of a block from its complete data
+  //----------------------------------------------------------------------------
+  void Set (size_t block, const char* data, size_t length);
+
+  //----------------------------------------------------------------------------
+  //! Verify the blocks completely contained in length bytes read at offset
+  //!
+  //! @return false if a block does not match its sums
+  //----------------------------------------------------------------------------
+  bool Verify (off_t offset, const char* data, size_t length);
+
+  //----------------------------------------------------------------------------
+  //! Combine the block sums into the adler32 checksum of the whole file
+  //!
+  //! @return false if a block is not complete
+  //----------------------------------------------------------------------------
+  bool Adler (uint32_t& adler);
+
+  //----------------------------------------------------------------------------
+  //! Return the block size of the map
+  //----------------------------------------------------------------------------
+  size_t BlockSize ();
+
+  //----------------------------------------------------------------------------
+  //! Return the logical size of the file described by the map
+  //----------------------------------------------------------------------------
+  off_t Size ();
+
+private:
+  struct Block {
+    uint32_t crc; //< crc32c of the first length bytes
+    uint32_t adler; //< adler32 of the first length bytes
+    uint32_t length; //< bytes of the block covered by the sums
+    bool stale; //< the block was modified out of order
+  };
+
+  //----------------------------------------------------------------------------
+  //! Return the length of block index for the current size
+  //----------------------------------------------------------------------------
+  size_t Length (size_t index);
+
+  //----------------------------------------------------------------------------
+  //! Merge pairs of adjacent blocks doubling the block size
+  //----------------------------------------------------------------------------
+  void Merge ();
+
+  XrdSysMutex mMutex;
+  size_t mBlockSize;
+  off_t mSize; //< logical size
+  std::vector<Block> mBlocks;
+};
+
+#endif
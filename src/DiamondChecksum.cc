@@ -0,0 +1,283 @@
+// ----------------------------------------------------------------------
+// File: DiamondChecksum.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#include "DiamondChecksum.hh"
+
+#include "XrdCl/XrdClBuffer.hh"
+#include "XrdCl/XrdClFileSystem.hh"
+#include "XrdCl/XrdClURL.hh"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <zlib.h>
+
+//------------------------------------------------------------------------------
+// Load a checksum attribute - "<adler32> <size> <mtime.sec> <mtime.nsec>"
+//------------------------------------------------------------------------------
+bool
+DiamondChecksum::Load (int fd, uint32_t& adler)
+{
+  if (fd < 0)
+    return false;
+
+  char value[128];
+  ssize_t len = fgetxattr(fd, DIAMOND_CHECKSUM_XATTR, value, sizeof(value) - 1);
+  if (len <= 0)
+    return false;
+  value[len] = 0;
+
+  unsigned int cks = 0;
+  unsigned long long size = 0;
+  unsigned long long sec = 0;
+  unsigned long long nsec = 0;
+  if (sscanf(value, "%x %llu %llu %llu", &cks, &size, &sec, &nsec) != 4)
+    return false;
+
+  struct stat buf;
+  if (fstat(fd, &buf) ||
+      (size != (unsigned long long) buf.st_size) ||
+      (sec != (unsigned long long) buf.st_mtim.tv_sec) ||
+      (nsec != (unsigned long long) buf.st_mtim.tv_nsec))
+    return false;
+
+  adler = cks;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Sum of a block
+//------------------------------------------------------------------------------
+uint64_t
+DiamondChecksum::BlockSum (const char* data, size_t length)
+{
+  uint32_t adler = adler32(adler32(0L, Z_NULL, 0), (const Bytef*) data, length);
+  uint32_t crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef*) data, length);
+  return (((uint64_t) adler) << 32) | crc;
+}
+
+//------------------------------------------------------------------------------
+// Encode block sums
+//------------------------------------------------------------------------------
+std::string
+DiamondChecksum::EncodeBlockSums (off_t size, size_t blocksize,
+                                  const std::vector<uint64_t>& sums)
+{
+  char header[128];
+  snprintf(header, sizeof(header), "size=%llu blocksize=%lu sums=",
+           (unsigned long long) size, (unsigned long) blocksize);
+
+  std::string encoded = header;
+  encoded.reserve(encoded.length() + 16 * sums.size());
+  for (size_t i = 0; i < sums.size(); i++)
+  {
+    char sum[17];
+    snprintf(sum, sizeof(sum), "%016llx", (unsigned long long) sums[i]);
+    encoded += sum;
+  }
+  return encoded;
+}
+
+//------------------------------------------------------------------------------
+// Decode block sums
+//------------------------------------------------------------------------------
+bool
+DiamondChecksum::DecodeBlockSums (const std::string& encoded, off_t& size,
+                                  size_t& blocksize,
+                                  std::vector<uint64_t>& sums)
+{
+  unsigned long long fsize = 0;
+  unsigned long bsize = 0;
+  int pos = 0;
+  if ((sscanf(encoded.c_str(), "size=%llu blocksize=%lu sums=%n", &fsize,
+              &bsize, &pos) != 2) || !pos || !bsize ||
+      (bsize > DIAMOND_CHECKSUM_MAX_BLOCKSIZE))
+    return false;
+
+  // the sizes come from the source - a bounded number of blocks is checked
+  // against the encoded length before anything is allocated
+  unsigned long long nblocks = fsize / bsize + ((fsize % bsize) ? 1 : 0);
+  if (nblocks > DIAMOND_CHECKSUM_MAX_BLOCKS)
+    return false;
+  std::string hex = encoded.substr(pos);
+  while (hex.length() && (hex[hex.length() - 1] == '\0'))
+    hex.erase(hex.length() - 1);
+  if (hex.length() != (16 * nblocks))
+    return false;
+
+  sums.resize(nblocks);
+  for (size_t i = 0; i < nblocks; i++)
+  {
+    char* end = 0;
+    std::string sum = hex.substr(16 * i, 16);
+    sums[i] = strtoull(sum.c_str(), &end, 16);
+    if (*end)
+      return false;
+  }
+  size = fsize;
+  blocksize = bsize;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Store a checksum attribute for the current size and modification time
+//------------------------------------------------------------------------------
+int
+DiamondChecksum::Store (int fd, uint32_t adler)
+{
+  if (fd < 0)
+    return EBADF;
+
+  struct stat buf;
+  if (fstat(fd, &buf))
+    return errno;
+
+  char value[128];
+  int len = snprintf(value, sizeof(value), "%08x %llu %llu %llu", adler,
+                     (unsigned long long) buf.st_size,
+                     (unsigned long long) buf.st_mtim.tv_sec,
+                     (unsigned long long) buf.st_mtim.tv_nsec);
+
+  if (fsetxattr(fd, DIAMOND_CHECKSUM_XATTR, value, len, 0))
+    return errno;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Remove a checksum attribute
+//------------------------------------------------------------------------------
+void
+DiamondChecksum::Drop (int fd)
+{
+  if (fd >= 0)
+    fremovexattr(fd, DIAMOND_CHECKSUM_XATTR);
+}
+
+//------------------------------------------------------------------------------
+// Parse a checksum query response
+//------------------------------------------------------------------------------
+bool
+DiamondChecksum::Parse (const std::string& response, uint32_t& adler)
+{
+  std::string value = response;
+  while (value.length() && ((value[value.length() - 1] == '\n') ||
+                            (value[value.length() - 1] == '\0') ||
+                            (value[value.length() - 1] == ' ')))
+    value.erase(value.length() - 1);
+
+  size_t pos = value.find(" ");
+  if (pos != std::string::npos)
+  {
+    if (value.substr(0, pos) != "adler32")
+      return false;
+    value.erase(0, pos + 1);
+  }
+
+  if (!value.length() || (value.length() > 8))
+    return false;
+
+  char* end = 0;
+  unsigned long cks = strtoul(value.c_str(), &end, 16);
+  if (*end)
+    return false;
+
+  adler = cks;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Start the query on its own thread
+//------------------------------------------------------------------------------
+void
+DiamondRemoteChecksumJob::Start ()
+{
+  mStarted = !XrdSysThread::Run(&mThread,
+                                DiamondRemoteChecksumJob::StartQuery,
+                                static_cast<void*>(this), XRDSYSTHREAD_HOLD,
+                                "Diamond Checksum Query");
+}
+
+//------------------------------------------------------------------------------
+// Wait for the query - it runs in the calling thread if it has not started
+//------------------------------------------------------------------------------
+void
+DiamondRemoteChecksumJob::Wait ()
+{
+  if (mStarted)
+  {
+    XrdSysThread::Join(mThread, NULL);
+    mStarted = false;
+  }
+  else if (!mValid && mMessage.empty())
+  {
+    DoIt();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Static thread entry point
+//------------------------------------------------------------------------------
+void*
+DiamondRemoteChecksumJob::StartQuery (void* arg)
+{
+  reinterpret_cast<DiamondRemoteChecksumJob*>(arg)->DoIt();
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Query the remote checksum
+//------------------------------------------------------------------------------
+void
+DiamondRemoteChecksumJob::DoIt ()
+{
+  // HTTP(S) sources are given with their scheme
+  std::string url = (mHost.find("://") == std::string::npos) ? "root://" : "";
+  url += mHost;
+  url += "/";
+
+  XrdCl::FileSystem fs((XrdCl::URL(url)));
+  XrdCl::Buffer arg;
+  arg.FromString(mCgi.length() ? mPath + "?" + mCgi : mPath);
+  XrdCl::Buffer* response = 0;
+
+  XrdCl::XRootDStatus status = fs.Query(XrdCl::QueryCode::Checksum, arg,
+                                        response,
+                                        DIAMOND_CHECKSUM_QUERY_TIMEOUT);
+  if (!status.IsOK())
+  {
+    mMessage = status.ToString();
+  }
+  else if (!response ||
+           !DiamondChecksum::Parse(response->ToString(), mAdler))
+  {
+    mMessage = "unsupported checksum response";
+  }
+  else
+  {
+    mValid = true;
+  }
+  delete response;
+}
@@ -0,0 +1,132 @@
+// ----------------------------------------------------------------------
+// File: DiamondChecksum.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#ifndef __DIAMONDCHECKSUM_API_H__
+#define __DIAMONDCHECKSUM_API_H__
+#include "DiamondWorkerPool.hh"
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+#define DIAMOND_CHECKSUM_XATTR "user.diamond.adler32"
+#define DIAMOND_CHECKSUM_QUERY_TIMEOUT 1800
+#define DIAMOND_CHECKSUM_MAX_BLOCKS 1024*1024
+#define DIAMOND_CHECKSUM_MAX_BLOCKSIZE (1ull << 30)
+
+//------------------------------------------------------------------------------
+//! Adler32 checksums stored as an extended attribute of the backend file. The
+//! attribute records size and modification time of the file it was computed
+//! for, a file modified afterwards has no valid checksum attribute.
+//------------------------------------------------------------------------------
+class DiamondChecksum {
+public:
+  //----------------------------------------------------------------------------
+  //! Load the checksum attribute of fd
+  //!
+  //! @return true if the attribute exists and matches the file
+  //----------------------------------------------------------------------------
+  static bool Load (int fd, uint32_t& adler);
+
+  //----------------------------------------------------------------------------
+  //! Store adler as the checksum of the current content of fd
+  //!
+  //! @return 0 or an errno
+  //----------------------------------------------------------------------------
+  static int Store (int fd, uint32_t adler);
+
+  //----------------------------------------------------------------------------
+  //! Remove the checksum attribute of fd
+  //----------------------------------------------------------------------------
+  static void Drop (int fd);
+
+  //----------------------------------------------------------------------------
+  //! Parse a checksum query response - "adler32 <hex>" or a plain "<hex>"
+  //----------------------------------------------------------------------------
+  static bool Parse (const std::string& response, uint32_t& adler);
+
+  //----------------------------------------------------------------------------
+  //! Return the 64 bit sum of a block - adler32 and crc32 of the data
+  //----------------------------------------------------------------------------
+  static uint64_t BlockSum (const char* data, size_t length);
+
+  //----------------------------------------------------------------------------
+  //! Encode the block sums of a file - "size=<n> blocksize=<n> sums=<hex>..."
+  //----------------------------------------------------------------------------
+  static std::string EncodeBlockSums (off_t size, size_t blocksize,
+                                      const std::vector<uint64_t>& sums);
+
+  //----------------------------------------------------------------------------
+  //! Decode block sums encoded by EncodeBlockSums
+  //!
+  //! @return true if the encoding is complete and consistent
+  //----------------------------------------------------------------------------
+  static bool DecodeBlockSums (const std::string& encoded, off_t& size,
+                               size_t& blocksize, std::vector<uint64_t>& sums);
+};
+
+//------------------------------------------------------------------------------
+//! Job asking a remote server for the adler32 checksum of a file - it runs on
+//! a thread of its own while a transfer is in flight
+//------------------------------------------------------------------------------
+class DiamondRemoteChecksumJob : public DiamondJob {
+public:
+  DiamondRemoteChecksumJob (const std::string& host, const std::string& path,
+                            const std::string& cgi = "") :
+    mHost(host), mPath(path), mCgi(cgi), mValid(false), mAdler(0),
+    mStarted(false), mThread(0) { }
+
+  ~DiamondRemoteChecksumJob () {
+    if (mStarted)
+      XrdSysThread::Join(mThread, NULL);
+  }
+
+  void DoIt ();
+
+  //----------------------------------------------------------------------------
+  //! Start the query on its own thread - Wait runs it if no thread starts
+  //----------------------------------------------------------------------------
+  void Start ();
+
+  //----------------------------------------------------------------------------
+  //! Wait until the query has been answered
+  //----------------------------------------------------------------------------
+  void Wait ();
+
+  static void* StartQuery (void* arg);
+
+  std::string mHost; //< host[:port] of the remote server or an HTTP(S) URL
+  std::string mPath; //< path of the file on the remote server
+  std::string mCgi; //< CGI of the query, e.g. the token of an HTTP(S) source
+  bool mValid; //< mAdler has been filled
+  uint32_t mAdler; //< remote checksum
+  std::string mMessage; //< reason why no checksum has been returned
+
+private:
+  bool mStarted; //< the query runs on mThread
+  pthread_t mThread; //< thread running the query
+};
+
+#endif
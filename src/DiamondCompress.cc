@@ -0,0 +1,499 @@
+// ----------------------------------------------------------------------
+// File: DiamondCompress.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#include "DiamondCompress.hh"
+#include "DiamondFs.hh"
+
+#include "XrdOfs/XrdOfs.hh"
+#include "XrdOss/XrdOss.hh"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/xattr.h>
+#include <zlib.h>
+
+//------------------------------------------------------------------------------
+// Little endian encoding of the header, index and trailer fields
+//------------------------------------------------------------------------------
+static void
+Put (char* buf, uint64_t value, size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+    buf[i] = (char) ((value >> (8 * i)) & 0xff);
+}
+
+static uint64_t
+Get (const char* buf, size_t len)
+{
+  uint64_t value = 0;
+  for (size_t i = 0; i < len; i++)
+    value |= ((uint64_t) (unsigned char) buf[i]) << (8 * i);
+  return value;
+}
+
+//------------------------------------------------------------------------------
+// Compress one block - a block which does not shrink is stored raw
+//------------------------------------------------------------------------------
+void
+DiamondCompressJob::DoIt ()
+{
+  uLongf len = compressBound(mRaw.size());
+  mOut.resize(len);
+  if ((compress2((Bytef*) &mOut[0], &len, (const Bytef*) &mRaw[0],
+                 mRaw.size(), mLevel) != Z_OK) || (len >= mRaw.size()))
+  {
+    mOut.clear();
+    return;
+  }
+  mOut.resize(len);
+}
+
+//------------------------------------------------------------------------------
+// Wait for blocks still being compressed
+//------------------------------------------------------------------------------
+DiamondCompressedFile::~DiamondCompressedFile ()
+{
+  for (size_t i = 0; i < mPending.size(); i++)
+    mPending[i]->mDone.Wait();
+}
+
+//------------------------------------------------------------------------------
+// Map an algorithm name
+//------------------------------------------------------------------------------
+int
+DiamondCompressedFile::Algorithm (const char* name)
+{
+  if (name && (!strcmp(name, "zlib") || !strcmp(name, "deflate")))
+    return kZlib;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Write the header of a new file
+//------------------------------------------------------------------------------
+int
+DiamondCompressedFile::Create (int algorithm, size_t blocksize, int level)
+{
+  char header[DIAMOND_COMPRESS_HEADER];
+  memset(header, 0, sizeof(header));
+  memcpy(header, DIAMOND_COMPRESS_MAGIC, 8);
+  Put(header + 8, 1, 4);
+  Put(header + 12, algorithm, 4);
+  Put(header + 16, blocksize, 8);
+
+  if (mFile->XrdOfsFile::write(0, header, sizeof(header)) !=
+      (XrdSfsXferSize) sizeof(header))
+    return EIO;
+
+  mAlgorithm = algorithm;
+  mBlockSize = blocksize;
+  mLevel = level;
+  mOffset = sizeof(header);
+  mSize = 0;
+  mWriting = true;
+  mBlock.reserve(mBlockSize);
+  // the attribute marks the file as compressed for later opens
+  return StoreSize();
+}
+
+//------------------------------------------------------------------------------
+// Check for the logical size attribute
+//------------------------------------------------------------------------------
+bool
+DiamondCompressedFile::Candidate (int fd)
+{
+  char value[128];
+  return (fd < 0) ||
+    (fgetxattr(fd, DIAMOND_COMPRESS_XATTR, value, sizeof(value)) >= 0);
+}
+
+//------------------------------------------------------------------------------
+// Read header, trailer and index of an existing file
+//------------------------------------------------------------------------------
+int
+DiamondCompressedFile::Load ()
+{
+  struct stat buf;
+  if (mFile->XrdOfsFile::stat(&buf))
+    return EIO;
+  if (buf.st_size < (DIAMOND_COMPRESS_HEADER + DIAMOND_COMPRESS_TRAILER))
+    return ENOENT;
+
+  char header[DIAMOND_COMPRESS_HEADER];
+  if (mFile->XrdOfsFile::read(0, header, sizeof(header)) !=
+      (XrdSfsXferSize) sizeof(header))
+    return EIO;
+  if (memcmp(header, DIAMOND_COMPRESS_MAGIC, 8))
+    return ENOENT;
+
+  char trailer[DIAMOND_COMPRESS_TRAILER];
+  if ((mFile->XrdOfsFile::read(buf.st_size - sizeof(trailer), trailer,
+                               sizeof(trailer)) !=
+       (XrdSfsXferSize) sizeof(trailer)) ||
+      memcmp(trailer + 24, DIAMOND_COMPRESS_MAGIC, 8))
+  {
+    // a compressed file which has never been finished
+    return EIO;
+  }
+
+  if ((Get(header + 8, 4) != 1) || (Get(header + 12, 4) != kZlib))
+    return ENOTSUP;
+
+  mAlgorithm = Get(header + 12, 4);
+  mBlockSize = Get(header + 16, 8);
+  uint64_t indexoffset = Get(trailer, 8);
+  uint64_t nblocks = Get(trailer + 8, 8);
+  mSize = Get(trailer + 16, 8);
+
+  if (!mBlockSize || (mBlockSize > DIAMOND_COMPRESS_MAX_BLOCKSIZE) ||
+      (nblocks > (uint64_t) buf.st_size / DIAMOND_COMPRESS_INDEX_ENTRY) ||
+      (indexoffset < DIAMOND_COMPRESS_HEADER) ||
+      (indexoffset + nblocks * DIAMOND_COMPRESS_INDEX_ENTRY +
+       DIAMOND_COMPRESS_TRAILER != (uint64_t) buf.st_size) ||
+      (nblocks != (mSize + mBlockSize - 1) / mBlockSize))
+    return EIO;
+
+  std::vector<char> index(nblocks * DIAMOND_COMPRESS_INDEX_ENTRY);
+  if (nblocks &&
+      (mFile->XrdOfsFile::read(indexoffset, &index[0], index.size()) !=
+       (XrdSfsXferSize) index.size()))
+    return EIO;
+
+  // a corrupt index must not size buffers or point outside of the blocks
+  mIndex.resize(nblocks);
+  for (size_t i = 0; i < nblocks; i++)
+  {
+    const char* entry = &index[i * DIAMOND_COMPRESS_INDEX_ENTRY];
+    mIndex[i].offset = Get(entry, 8);
+    mIndex[i].length = Get(entry + 8, 4);
+    mIndex[i].rawlength = Get(entry + 12, 4);
+    uint64_t rawlength = (i + 1 < nblocks) ? mBlockSize :
+      mSize - (uint64_t) i * mBlockSize;
+    if ((mIndex[i].rawlength != rawlength) ||
+        (mIndex[i].length > mIndex[i].rawlength) ||
+        (mIndex[i].offset < DIAMOND_COMPRESS_HEADER) ||
+        (mIndex[i].offset + mIndex[i].length > indexoffset))
+    {
+      mIndex.clear();
+      return EIO;
+    }
+  }
+  mOffset = indexoffset;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Decode one block
+//------------------------------------------------------------------------------
+int
+DiamondCompressedFile::Decode (size_t index, block_ptr_t& block)
+{
+  const Entry& entry = mIndex[index];
+  block.reset(new std::vector<char>(entry.rawlength));
+
+  if (entry.length == entry.rawlength)
+  {
+    if (mFile->XrdOfsFile::read(entry.offset, &(*block)[0], entry.length) !=
+        (XrdSfsXferSize) entry.length)
+      return EIO;
+    return 0;
+  }
+
+  std::vector<char> stored(entry.length);
+  if (mFile->XrdOfsFile::read(entry.offset, &stored[0], entry.length) !=
+      (XrdSfsXferSize) entry.length)
+    return EIO;
+
+  uLongf len = entry.rawlength;
+  if ((uncompress((Bytef*) &(*block)[0], &len, (const Bytef*) &stored[0],
+                  entry.length) != Z_OK) || (len != entry.rawlength))
+    return EIO;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Read logical data - blocks are decoded outside of the cache lock, so the
+// parallel reads of a readv decode in parallel
+//------------------------------------------------------------------------------
+XrdSfsXferSize
+DiamondCompressedFile::Read (XrdSfsFileOffset offset, char* buffer,
+                             XrdSfsXferSize size)
+{
+  if (mWriting)
+  {
+    errno = ENOTSUP;
+    return SFS_ERROR;
+  }
+
+  if ((offset < 0) || (offset >= mSize))
+    return 0;
+  if ((off_t) (offset + size) > mSize)
+    size = mSize - offset;
+
+  XrdSfsXferSize done = 0;
+  while (done < size)
+  {
+    XrdSfsFileOffset pos = offset + done;
+    size_t index = pos / mBlockSize;
+    block_ptr_t block;
+
+    {
+      XrdSysMutexHelper cLock(mCacheMutex);
+      if (mCachedBlock == (long long) index)
+        block = mCached;
+    }
+
+    if (!block)
+    {
+      if ((errno = Decode(index, block)))
+        return SFS_ERROR;
+      XrdSysMutexHelper cLock(mCacheMutex);
+      mCachedBlock = index;
+      mCached = block;
+    }
+
+    size_t blockoffset = pos - (off_t) index * mBlockSize;
+    if (blockoffset >= block->size())
+    {
+      errno = EIO;
+      return SFS_ERROR;
+    }
+
+    size_t len = block->size() - blockoffset;
+    if (len > (size_t) (size - done))
+      len = size - done;
+    memcpy(buffer + done, &(*block)[blockoffset], len);
+    done += len;
+  }
+  return done;
+}
+
+//------------------------------------------------------------------------------
+// Append logical data
+//------------------------------------------------------------------------------
+XrdSfsXferSize
+DiamondCompressedFile::Write (XrdSfsFileOffset offset, const char* buffer,
+                              XrdSfsXferSize size)
+{
+  if (!mWriting)
+  {
+    errno = EBADF;
+    return SFS_ERROR;
+  }
+
+  if (mError)
+  {
+    errno = mError;
+    return SFS_ERROR;
+  }
+
+  if (offset != mSize)
+  {
+    errno = ESPIPE;
+    return SFS_ERROR;
+  }
+
+  XrdSfsXferSize done = 0;
+  while (done < size)
+  {
+    size_t len = mBlockSize - mBlock.size();
+    if (len > (size_t) (size - done))
+      len = size - done;
+    mBlock.insert(mBlock.end(), buffer + done, buffer + done + len);
+    done += len;
+    mSize += len;
+
+    if ((mBlock.size() == mBlockSize) && (mError = Submit()))
+    {
+      errno = mError;
+      return SFS_ERROR;
+    }
+  }
+  return done;
+}
+
+//------------------------------------------------------------------------------
+// Hand the filled block to the worker pool - the oldest blocks are written
+// once more blocks are in flight than there are workers
+//------------------------------------------------------------------------------
+int
+DiamondCompressedFile::Submit ()
+{
+  job_ptr_t job(new DiamondCompressJob(mLevel));
+  job->mRaw.swap(mBlock);
+  mBlock.reserve(mBlockSize);
+  mPending.push_back(job);
+  mPool->Schedule(job.get(), &job->mDone);
+
+  while (mPending.size() > (mPool->Size() + 1))
+  {
+    job_ptr_t oldest = mPending.front();
+    mPending.pop_front();
+    oldest->mDone.Wait();
+    int rc = Append(*oldest);
+    if (rc)
+      return rc;
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Write a compressed block behind the previous one
+//------------------------------------------------------------------------------
+int
+DiamondCompressedFile::Append (DiamondCompressJob& job)
+{
+  const std::vector<char>& data = job.mOut.empty() ? job.mRaw : job.mOut;
+  if (mFile->XrdOfsFile::write(mOffset, &data[0], data.size()) !=
+      (XrdSfsXferSize) data.size())
+    return EIO;
+
+  Entry entry;
+  entry.offset = mOffset;
+  entry.length = data.size();
+  entry.rawlength = job.mRaw.size();
+  mIndex.push_back(entry);
+  mOffset += data.size();
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Flush all blocks, write index and trailer and store the logical size
+//------------------------------------------------------------------------------
+int
+DiamondCompressedFile::Finish ()
+{
+  if (!mWriting)
+    return mError;
+  mWriting = false;
+
+  if (!mError && !mBlock.empty())
+    mError = Submit();
+
+  while (!mPending.empty())
+  {
+    job_ptr_t oldest = mPending.front();
+    mPending.pop_front();
+    oldest->mDone.Wait();
+    if (!mError)
+      mError = Append(*oldest);
+  }
+
+  if (mError)
+    return mError;
+
+  std::vector<char> tail(mIndex.size() * DIAMOND_COMPRESS_INDEX_ENTRY +
+                         DIAMOND_COMPRESS_TRAILER);
+  for (size_t i = 0; i < mIndex.size(); i++)
+  {
+    char* entry = &tail[i * DIAMOND_COMPRESS_INDEX_ENTRY];
+    Put(entry, mIndex[i].offset, 8);
+    Put(entry + 8, mIndex[i].length, 4);
+    Put(entry + 12, mIndex[i].rawlength, 4);
+  }
+
+  char* trailer = &tail[mIndex.size() * DIAMOND_COMPRESS_INDEX_ENTRY];
+  Put(trailer, mOffset, 8);
+  Put(trailer + 8, mIndex.size(), 8);
+  Put(trailer + 16, mSize, 8);
+  memcpy(trailer + 24, DIAMOND_COMPRESS_MAGIC, 8);
+
+  if (mFile->XrdOfsFile::write(mOffset, &tail[0], tail.size()) !=
+      (XrdSfsXferSize) tail.size())
+    return (mError = EIO);
+
+  return StoreSize();
+}
+
+//------------------------------------------------------------------------------
+// Store "<size> <backend size> <mtime.sec> <mtime.nsec>" for FixStat
+//------------------------------------------------------------------------------
+int
+DiamondCompressedFile::StoreSize ()
+{
+  XrdOucErrInfo fd_error;
+  if (mFile->XrdOfsFile::fctl(SFS_FCTL_GETFD, 0, fd_error) ||
+      (fd_error.getErrInfo() < 0))
+  {
+    // without a local file the logical size is only known to open files
+    return 0;
+  }
+
+  int fd = fd_error.getErrInfo();
+  struct stat buf;
+  if (fstat(fd, &buf))
+    return errno;
+
+  char value[128];
+  int len = snprintf(value, sizeof(value), "%llu %llu %llu %llu",
+                     (unsigned long long) mSize,
+                     (unsigned long long) buf.st_size,
+                     (unsigned long long) buf.st_mtim.tv_sec,
+                     (unsigned long long) buf.st_mtim.tv_nsec);
+  if (fsetxattr(fd, DIAMOND_COMPRESS_XATTR, value, len, 0))
+    return errno;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Replace the backend size of a compressed file by its logical size
+//------------------------------------------------------------------------------
+void
+DiamondCompressedFile::FixStat (const char* path, struct stat* buf)
+{
+  if (!S_ISREG(buf->st_mode) ||
+      (buf->st_size < (DIAMOND_COMPRESS_HEADER + DIAMOND_COMPRESS_TRAILER)))
+    return;
+
+  char pfn[MAXPATHLEN + 1];
+  if (XrdOfsOss->Lfn2Pfn(path, pfn, sizeof(pfn)))
+    return;
+
+  char value[128];
+  ssize_t len = getxattr(pfn, DIAMOND_COMPRESS_XATTR, value, sizeof(value) - 1);
+  if (len <= 0)
+    return;
+  value[len] = 0;
+
+  unsigned long long size = 0;
+  unsigned long long stored = 0;
+  unsigned long long sec = 0;
+  unsigned long long nsec = 0;
+  if ((sscanf(value, "%llu %llu %llu %llu", &size, &stored, &sec, &nsec) == 4) &&
+      (stored == (unsigned long long) buf->st_size) &&
+      (sec == (unsigned long long) buf->st_mtim.tv_sec) &&
+      (nsec == (unsigned long long) buf->st_mtim.tv_nsec))
+    buf->st_size = size;
+}
+
+//------------------------------------------------------------------------------
+// Remove the logical size attribute
+//------------------------------------------------------------------------------
+void
+DiamondCompressedFile::DropSize (int fd)
+{
+  if (fd >= 0)
+    fremovexattr(fd, DIAMOND_COMPRESS_XATTR);
+}
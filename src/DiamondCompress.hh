@@ -0,0 +1,187 @@
+// ----------------------------------------------------------------------
+// File: DiamondCompress.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#ifndef __DIAMONDCOMPRESS_API_H__
+#define __DIAMONDCOMPRESS_API_H__
+#include "XrdSfs/XrdSfsInterface.hh"
+#include "XrdSys/XrdSysPthread.hh"
+
+#include "DiamondWorkerPool.hh"
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+class XrdOfsFile;
+
+#define DIAMOND_DEFAULT_COMPRESS_BLOCKSIZE 1024*1024
+#define DIAMOND_DEFAULT_COMPRESS_LEVEL 6
+#define DIAMOND_COMPRESS_MAGIC "DIAMONDZ"
+#define DIAMOND_COMPRESS_HEADER 32
+#define DIAMOND_COMPRESS_TRAILER 32
+#define DIAMOND_COMPRESS_INDEX_ENTRY 16
+#define DIAMOND_COMPRESS_XATTR "user.diamond.zsize"
+#define DIAMOND_COMPRESS_MAX_BLOCKSIZE (1ull << 30)
+
+//------------------------------------------------------------------------------
+//! Job compressing one block
+//------------------------------------------------------------------------------
+class DiamondCompressJob : public DiamondJob {
+public:
+  DiamondCompressJob (int level) : mLevel(level) { }
+
+  void DoIt ();
+
+  int mLevel; //< zlib compression level
+  std::vector<char> mRaw; //< block to compress
+  std::vector<char> mOut; //< compressed block - empty if it does not shrink
+  DiamondJobGroup mDone; //< completion of this job
+};
+
+//------------------------------------------------------------------------------
+//! Block-compressed file layout on top of the backend file of an XrdOfsFile.
+//!
+//! header  : magic[8] version:u32 algorithm:u32 blocksize:u64 reserved:u64
+//! blocks  : independently deflated blocks, stored raw if they do not shrink
+//! index   : per block offset:u64 length:u32 rawlength:u32
+//! trailer : index-offset:u64 blocks:u64 size:u64 magic[8]
+//!
+//! All integers are little endian. Files are written sequentially, blocks are
+//! compressed in parallel on the worker pool and appended in order. Reads
+//! decompress only the blocks they touch. The logical size is also stored in
+//! an extended attribute, so a path stat does not need to open the file.
+//------------------------------------------------------------------------------
+class DiamondCompressedFile {
+public:
+
+  enum Algorithm_t {
+    kZlib = 1,
+  };
+
+  DiamondCompressedFile (XrdOfsFile* file, DiamondWorkerPool* pool) :
+    mFile(file), mPool(pool), mWriting(false), mError(0),
+    mBlockSize(DIAMOND_DEFAULT_COMPRESS_BLOCKSIZE),
+    mLevel(DIAMOND_DEFAULT_COMPRESS_LEVEL), mSize(0), mOffset(0),
+    mCachedBlock(-1) { }
+
+  ~DiamondCompressedFile ();
+
+  //----------------------------------------------------------------------------
+  //! Map an algorithm name - returns 0 if unsupported
+  //----------------------------------------------------------------------------
+  static int Algorithm (const char* name);
+
+  //----------------------------------------------------------------------------
+  //! Start a new compressed file in an empty backend file
+  //!
+  //! @return 0 or an errno
+  //----------------------------------------------------------------------------
+  int Create (int algorithm, size_t blocksize, int level);
+
+  //----------------------------------------------------------------------------
+  //! Check if the backend file fd can be compressed - compressed files carry
+  //! the logical size attribute from their creation, a file without local
+  //! descriptor has to be recognized by its header
+  //----------------------------------------------------------------------------
+  static bool Candidate (int fd);
+
+  //----------------------------------------------------------------------------
+  //! Load the index of an existing file - the index is checked against the
+  //! header and the backend size before it is trusted
+  //!
+  //! @return 0 if compressed, ENOENT for a plain file, otherwise an errno
+  //----------------------------------------------------------------------------
+  int Load ();
+
+  //----------------------------------------------------------------------------
+  //! Read logical data
+  //----------------------------------------------------------------------------
+  XrdSfsXferSize Read (XrdSfsFileOffset offset, char* buffer,
+                       XrdSfsXferSize size);
+
+  //----------------------------------------------------------------------------
+  //! Append logical data - offset has to be the current size
+  //----------------------------------------------------------------------------
+  XrdSfsXferSize Write (XrdSfsFileOffset offset, const char* buffer,
+                        XrdSfsXferSize size);
+
+  //----------------------------------------------------------------------------
+  //! Flush all blocks and write index and trailer - the file is read-only
+  //! afterwards
+  //!
+  //! @return 0 or an errno
+  //----------------------------------------------------------------------------
+  int Finish ();
+
+  bool Writing () const { return mWriting; }
+  int Error () const { return mError; }
+  off_t Size () const { return mSize; }
+
+  //----------------------------------------------------------------------------
+  //! Replace the backend size of a compressed file by its logical size
+  //----------------------------------------------------------------------------
+  static void FixStat (const char* path, struct stat* buf);
+
+  //----------------------------------------------------------------------------
+  //! Remove the logical size attribute of a rewritten file
+  //----------------------------------------------------------------------------
+  static void DropSize (int fd);
+
+private:
+  struct Entry {
+    uint64_t offset; //< backend offset of the block
+    uint32_t length; //< stored length
+    uint32_t rawlength; //< logical length
+  };
+
+  typedef std::shared_ptr<DiamondCompressJob> job_ptr_t;
+  typedef std::shared_ptr<std::vector<char> > block_ptr_t;
+
+  int Submit ();
+  int Append (DiamondCompressJob& job);
+  int Decode (size_t index, block_ptr_t& block);
+  int StoreSize ();
+
+  XrdOfsFile* mFile; //< file giving access to the backend
+  DiamondWorkerPool* mPool; //< pool running compression jobs
+  bool mWriting; //< created and not yet finished
+  int mError; //< sticky errno of a failed write
+  int mAlgorithm;
+  size_t mBlockSize; //< logical size of a block
+  int mLevel; //< zlib compression level
+  off_t mSize; //< logical size
+  off_t mOffset; //< backend offset of the next block
+  std::vector<char> mBlock; //< block being filled by Write
+  std::deque<job_ptr_t> mPending; //< blocks being compressed - in file order
+  std::vector<Entry> mIndex; //< blocks stored in the backend
+
+  XrdSysMutex mCacheMutex; //< protects the decoded block cache
+  long long mCachedBlock; //< index of the cached block - -1 if none
+  block_ptr_t mCached; //< last decoded block - sequential reads hit it
+};
+
+#endif
@@ -0,0 +1,661 @@
+// ----------------------------------------------------------------------
+// File: DiamondDedup.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "DiamondDedup.hh"
+#include "DiamondFs.hh"
+
+#include "XrdOss/XrdOss.hh"
+#include "XrdSys/XrdSysError.hh"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// SHA-256 round constants
+//------------------------------------------------------------------------------
+static const uint32_t sha256K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t
+sha256Rotr (uint32_t x, int n)
+{
+  return (x >> n) | (x << (32 - n));
+}
+
+//------------------------------------------------------------------------------
+// Start a new hash
+//------------------------------------------------------------------------------
+void
+DiamondSha256::Reset ()
+{
+  mState[0] = 0x6a09e667;
+  mState[1] = 0xbb67ae85;
+  mState[2] = 0x3c6ef372;
+  mState[3] = 0xa54ff53a;
+  mState[4] = 0x510e527f;
+  mState[5] = 0x9b05688c;
+  mState[6] = 0x1f83d9ab;
+  mState[7] = 0x5be0cd19;
+  mLength = 0;
+  mFill = 0;
+}
+
+//------------------------------------------------------------------------------
+// Hash one 64 byte block
+//------------------------------------------------------------------------------
+void
+DiamondSha256::Transform (const unsigned char* block)
+{
+  uint32_t w[64];
+  for (size_t i = 0; i < 16; i++)
+  {
+    w[i] = ((uint32_t) block[4 * i] << 24) | ((uint32_t) block[4 * i + 1] << 16) |
+      ((uint32_t) block[4 * i + 2] << 8) | (uint32_t) block[4 * i + 3];
+  }
+  for (size_t i = 16; i < 64; i++)
+  {
+    uint32_t s0 = sha256Rotr(w[i - 15], 7) ^ sha256Rotr(w[i - 15], 18) ^
+      (w[i - 15] >> 3);
+    uint32_t s1 = sha256Rotr(w[i - 2], 17) ^ sha256Rotr(w[i - 2], 19) ^
+      (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = mState[0], b = mState[1], c = mState[2], d = mState[3];
+  uint32_t e = mState[4], f = mState[5], g = mState[6], h = mState[7];
+  for (size_t i = 0; i < 64; i++)
+  {
+    uint32_t s1 = sha256Rotr(e, 6) ^ sha256Rotr(e, 11) ^ sha256Rotr(e, 25);
+    uint32_t ch = (e & f) ^ (~e & g);
+    uint32_t t1 = h + s1 + ch + sha256K[i] + w[i];
+    uint32_t s0 = sha256Rotr(a, 2) ^ sha256Rotr(a, 13) ^ sha256Rotr(a, 22);
+    uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+    uint32_t t2 = s0 + maj;
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  mState[0] += a;
+  mState[1] += b;
+  mState[2] += c;
+  mState[3] += d;
+  mState[4] += e;
+  mState[5] += f;
+  mState[6] += g;
+  mState[7] += h;
+}
+
+//------------------------------------------------------------------------------
+// Hash data - full blocks are hashed straight from the caller's buffer
+//------------------------------------------------------------------------------
+void
+DiamondSha256::Update (const char* data, size_t length)
+{
+  const unsigned char* in = (const unsigned char*) data;
+  mLength += length;
+
+  if (mFill)
+  {
+    size_t n = (length < (64 - mFill)) ? length : (64 - mFill);
+    memcpy(mBlock + mFill, in, n);
+    mFill += n;
+    in += n;
+    length -= n;
+    if (mFill < 64)
+      return;
+    Transform(mBlock);
+    mFill = 0;
+  }
+
+  while (length >= 64)
+  {
+    Transform(in);
+    in += 64;
+    length -= 64;
+  }
+
+  memcpy(mBlock, in, length);
+  mFill = length;
+}
+
+//------------------------------------------------------------------------------
+// Pad the data and return the digest in hex
+//------------------------------------------------------------------------------
+std::string
+DiamondSha256::Final ()
+{
+  uint64_t bits = mLength * 8;
+  mBlock[mFill++] = 0x80;
+  if (mFill > 56)
+  {
+    memset(mBlock + mFill, 0, 64 - mFill);
+    Transform(mBlock);
+    mFill = 0;
+  }
+  memset(mBlock + mFill, 0, 56 - mFill);
+  for (size_t i = 0; i < 8; i++)
+    mBlock[56 + i] = (unsigned char) (bits >> (56 - 8 * i));
+  Transform(mBlock);
+  mFill = 0;
+
+  char hex[65];
+  for (size_t i = 0; i < 8; i++)
+    snprintf(hex + 8 * i, 9, "%08x", mState[i]);
+  return std::string(hex, 64);
+}
+
+//------------------------------------------------------------------------------
+// Hash data written at offset - a write out of order invalidates the hash
+//------------------------------------------------------------------------------
+void
+DiamondDedupHash::Update (off_t offset, const char* data, size_t length)
+{
+  XrdSysMutexHelper lock(mMutex);
+  if (!mValid)
+    return;
+  if (offset != mOffset)
+  {
+    mValid = false;
+    return;
+  }
+  mSha.Update(data, length);
+  mOffset += length;
+}
+
+//------------------------------------------------------------------------------
+// A truncation keeps the hash only if it does not change the written data
+//------------------------------------------------------------------------------
+void
+DiamondDedupHash::Truncate (off_t size)
+{
+  XrdSysMutexHelper lock(mMutex);
+  if (size != mOffset)
+    mValid = false;
+}
+
+//------------------------------------------------------------------------------
+// Give up the hash - the file has been written in another way
+//------------------------------------------------------------------------------
+void
+DiamondDedupHash::Invalidate ()
+{
+  XrdSysMutexHelper lock(mMutex);
+  mValid = false;
+}
+
+//------------------------------------------------------------------------------
+// Return the hash of the written data
+//------------------------------------------------------------------------------
+bool
+DiamondDedupHash::Final (std::string& hash, off_t& size)
+{
+  XrdSysMutexHelper lock(mMutex);
+  if (!mValid)
+    return false;
+  hash = mSha.Final();
+  size = mOffset;
+  mValid = false;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Collect the objects and temporary files left by a previous run
+//------------------------------------------------------------------------------
+int
+DiamondDedup::Start (XrdSysError& err)
+{
+  if (mDir.empty())
+    return 0;
+
+  DIR* dir = opendir(mDir.c_str());
+  if (!dir)
+  {
+    err.Emsg("Config", errno, "open deduplication directory", mDir.c_str());
+    return 1;
+  }
+
+  unsigned long long collected = 0;
+  struct dirent* entry = 0;
+  while ((entry = readdir(dir)))
+  {
+    std::string name = entry->d_name;
+    std::string path = mDir + "/" + name;
+    if (!name.compare(0, 5, ".tmp."))
+    {
+      ::unlink(path.c_str());
+      continue;
+    }
+    struct stat buf;
+    if (!Valid(name) || ::lstat(path.c_str(), &buf))
+      continue;
+    if (buf.st_nlink > 1)
+    {
+      mStats.objects++;
+    }
+    else if (!::unlink(path.c_str()))
+    {
+      collected++;
+    }
+  }
+  closedir(dir);
+
+  char count[128];
+  snprintf(count, sizeof(count), "%llu objects, %llu unreferenced removed",
+           mStats.objects, collected);
+  err.Say("++++++ diamond dedup found ", count);
+  mStats.collected += collected;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Check a hex SHA-256 digest
+//------------------------------------------------------------------------------
+bool
+DiamondDedup::Valid (const std::string& hash)
+{
+  if (hash.length() != 64)
+    return false;
+  for (size_t i = 0; i < hash.length(); i++)
+  {
+    if (!isdigit(hash[i]) && ((hash[i] < 'a') || (hash[i] > 'f')))
+      return false;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Parse a hash attribute - "<sha256> <size> <mtime.sec> <mtime.nsec>"
+//------------------------------------------------------------------------------
+bool
+DiamondDedup::Parse (const char* value, const struct stat& buf,
+                     std::string& hash)
+{
+  char hex[65];
+  unsigned long long size = 0;
+  unsigned long long sec = 0;
+  unsigned long long nsec = 0;
+  if ((sscanf(value, "%64s %llu %llu %llu", hex, &size, &sec, &nsec) != 4) ||
+      !Valid(hex) ||
+      (size != (unsigned long long) buf.st_size) ||
+      (sec != (unsigned long long) buf.st_mtim.tv_sec) ||
+      (nsec != (unsigned long long) buf.st_mtim.tv_nsec))
+    return false;
+  hash = hex;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Load the hash attribute of an open file
+//------------------------------------------------------------------------------
+bool
+DiamondDedup::Load (int fd, std::string& hash)
+{
+  if (fd < 0)
+    return false;
+
+  char value[256];
+  ssize_t len = fgetxattr(fd, DIAMOND_DEDUP_XATTR, value, sizeof(value) - 1);
+  if (len <= 0)
+    return false;
+  value[len] = 0;
+
+  struct stat buf;
+  if (fstat(fd, &buf))
+    return false;
+  return Parse(value, buf, hash);
+}
+
+//------------------------------------------------------------------------------
+// Store the hash attribute for the current size and modification time
+//------------------------------------------------------------------------------
+int
+DiamondDedup::Store (int fd, const std::string& hash)
+{
+  struct stat buf;
+  if (fstat(fd, &buf))
+    return errno;
+
+  char value[256];
+  int len = snprintf(value, sizeof(value), "%s %llu %llu %llu", hash.c_str(),
+                     (unsigned long long) buf.st_size,
+                     (unsigned long long) buf.st_mtim.tv_sec,
+                     (unsigned long long) buf.st_mtim.tv_nsec);
+
+  if (fsetxattr(fd, DIAMOND_DEDUP_XATTR, value, len, 0))
+    return errno;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Map a namespace path to the backend
+//------------------------------------------------------------------------------
+bool
+DiamondDedup::Pfn (const char* path, std::string& pfn)
+{
+  char buffer[MAXPATHLEN + 1];
+  if (!path || XrdOfsOss->Lfn2Pfn(path, buffer, sizeof(buffer)))
+    return false;
+  pfn = buffer;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Return the hash attribute of a path
+//------------------------------------------------------------------------------
+std::string
+DiamondDedup::PathHash (const char* path)
+{
+  std::string pfn;
+  struct stat buf;
+  if (!Pfn(path, pfn) || ::lstat(pfn.c_str(), &buf) || !S_ISREG(buf.st_mode))
+    return "";
+
+  char value[256];
+  ssize_t len = getxattr(pfn.c_str(), DIAMOND_DEDUP_XATTR, value,
+                         sizeof(value) - 1);
+  if (len <= 0)
+    return "";
+  value[len] = 0;
+
+  std::string hash;
+  if (!Parse(value, buf, hash))
+    return "";
+  return hash;
+}
+
+//------------------------------------------------------------------------------
+// Path of the stored object of hash
+//------------------------------------------------------------------------------
+std::string
+DiamondDedup::Object (const std::string& hash)
+{
+  return mDir + "/" + hash;
+}
+
+//------------------------------------------------------------------------------
+// Path of a new temporary file - requires mMutex
+//------------------------------------------------------------------------------
+std::string
+DiamondDedup::TempPath ()
+{
+  char name[64];
+  snprintf(name, sizeof(name), "/.tmp.%lu.%llu", (unsigned long) getpid(),
+           ++mTemp);
+  return mDir + name;
+}
+
+//------------------------------------------------------------------------------
+// Replace the file opened through fd at pfn by a link to object - requires
+// mMutex. The new link is renamed over the file, so readers always find
+// either of them.
+//------------------------------------------------------------------------------
+int
+DiamondDedup::Replace (int fd, const std::string& pfn,
+                       const std::string& object)
+{
+  std::string tmp = TempPath();
+  if (::link(object.c_str(), tmp.c_str()))
+    return errno;
+
+  // the path may have been renamed or rewritten since fd has been opened
+  int rc = 0;
+  struct stat fbuf;
+  struct stat pbuf;
+  if (fstat(fd, &fbuf) || ::stat(pfn.c_str(), &pbuf))
+    rc = errno;
+  else if ((fbuf.st_dev != pbuf.st_dev) || (fbuf.st_ino != pbuf.st_ino))
+    rc = ESTALE;
+  else if (::rename(tmp.c_str(), pfn.c_str()))
+    rc = errno;
+
+  if (rc)
+    ::unlink(tmp.c_str());
+  return rc;
+}
+
+//------------------------------------------------------------------------------
+// Deduplicate a written file
+//------------------------------------------------------------------------------
+int
+DiamondDedup::Commit (int fd, const char* path, const std::string& hash,
+                      off_t size, bool& linked)
+{
+  linked = false;
+  std::string pfn;
+  if (!Enabled() || !Valid(hash) || !Pfn(path, pfn))
+    return EINVAL;
+
+  std::string object = Object(hash);
+  XrdSysMutexHelper lock(mMutex);
+  struct stat buf;
+  if (!::lstat(object.c_str(), &buf))
+  {
+    // an object of another size is a hash collision and is left alone
+    if (!S_ISREG(buf.st_mode) || (buf.st_size != size))
+      return EEXIST;
+    int rc = Replace(fd, pfn, object);
+    if (rc)
+      return rc;
+    linked = true;
+    mStats.linked++;
+    mStats.saved += size;
+    return 0;
+  }
+  if (errno != ENOENT)
+    return errno;
+
+  // the file becomes the object of its content - it is linked through its
+  // descriptor, so a concurrent rename of the path does not matter
+  int rc = Store(fd, hash);
+  if (rc)
+    return rc;
+  char fdpath[64];
+  snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", fd);
+  if (::linkat(AT_FDCWD, fdpath, AT_FDCWD, object.c_str(), AT_SYMLINK_FOLLOW))
+    return errno;
+  mStats.stored++;
+  mStats.objects++;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Replace an open file by a reference to a stored object
+//------------------------------------------------------------------------------
+int
+DiamondDedup::Reference (int fd, const char* path, const std::string& hash,
+                         off_t size)
+{
+  std::string pfn;
+  if (!Enabled() || !Valid(hash) || !Pfn(path, pfn))
+    return EINVAL;
+
+  std::string object = Object(hash);
+  XrdSysMutexHelper lock(mMutex);
+  struct stat buf;
+  if (::lstat(object.c_str(), &buf) || !S_ISREG(buf.st_mode) ||
+      (buf.st_size != size))
+    return ENOENT;
+
+  int rc = Replace(fd, pfn, object);
+  if (rc)
+    return rc;
+  mStats.linked++;
+  mStats.saved += size;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Replace a referenced file by a private copy - the copy is written outside
+// of the mutex and renamed over the path if it still is the referenced file
+//------------------------------------------------------------------------------
+int
+DiamondDedup::Unshare (const char* path, bool truncate)
+{
+  std::string pfn;
+  struct stat buf;
+  if (!Enabled() || !Pfn(path, pfn) || ::lstat(pfn.c_str(), &buf) ||
+      !S_ISREG(buf.st_mode) || (buf.st_nlink < 2))
+    return 0;
+
+  std::string hash = PathHash(path);
+  if (hash.empty())
+    return 0;
+
+  std::string tmp;
+  {
+    XrdSysMutexHelper lock(mMutex);
+    tmp = TempPath();
+  }
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL, buf.st_mode & 07777);
+  if (fd < 0)
+    return errno;
+
+  int rc = 0;
+  if (!truncate)
+  {
+    int sfd = ::open(pfn.c_str(), O_RDONLY);
+    if (sfd < 0)
+    {
+      rc = errno;
+    }
+    else
+    {
+      std::vector<char> buffer(DIAMOND_DEDUP_COPY_BLOCKSIZE);
+      off_t offset = 0;
+      ssize_t nread = 0;
+      while ((nread = ::pread(sfd, &buffer[0], buffer.size(), offset)) > 0)
+      {
+        if (::pwrite(fd, &buffer[0], nread, offset) != nread)
+        {
+          rc = errno ? errno : EIO;
+          break;
+        }
+        offset += nread;
+      }
+      if (nread < 0)
+        rc = errno;
+      ::close(sfd);
+
+      // the copy keeps the modification time of the content
+      struct timespec times[2] = { buf.st_atim, buf.st_mtim };
+      if (!rc && futimens(fd, times))
+        rc = errno;
+    }
+  }
+  if (!rc && fsync(fd))
+    rc = errno;
+  ::close(fd);
+
+  if (!rc)
+  {
+    XrdSysMutexHelper lock(mMutex);
+    struct stat pbuf;
+    if (::lstat(pfn.c_str(), &pbuf))
+    {
+      rc = errno;
+    }
+    else if ((pbuf.st_dev != buf.st_dev) || (pbuf.st_ino != buf.st_ino))
+    {
+      // a concurrent writer unshared the path already
+      ::unlink(tmp.c_str());
+      return 0;
+    }
+    else if (::rename(tmp.c_str(), pfn.c_str()))
+    {
+      rc = errno;
+    }
+    else
+    {
+      mStats.unshared++;
+      Collect(hash);
+      return 0;
+    }
+  }
+  ::unlink(tmp.c_str());
+  return rc;
+}
+
+//------------------------------------------------------------------------------
+// A reference has been removed
+//------------------------------------------------------------------------------
+void
+DiamondDedup::Release (const std::string& hash)
+{
+  if (!Enabled() || !Valid(hash))
+    return;
+  XrdSysMutexHelper lock(mMutex);
+  Collect(hash);
+}
+
+//------------------------------------------------------------------------------
+// Remove the object of hash if only the directory links it - requires mMutex
+//------------------------------------------------------------------------------
+void
+DiamondDedup::Collect (const std::string& hash)
+{
+  std::string object = Object(hash);
+  struct stat buf;
+  if (::lstat(object.c_str(), &buf) || (buf.st_nlink > 1))
+    return;
+  if (!::unlink(object.c_str()))
+  {
+    if (mStats.objects)
+      mStats.objects--;
+    mStats.collected++;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Return the counters
+//------------------------------------------------------------------------------
+DiamondDedup::Stats
+DiamondDedup::GetStats ()
+{
+  XrdSysMutexHelper lock(mMutex);
+  return mStats;
+}
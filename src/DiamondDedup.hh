@@ -0,0 +1,197 @@
+// ----------------------------------------------------------------------
+// File: DiamondDedup.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef __DIAMONDDEDUP_API_H__
+#define __DIAMONDDEDUP_API_H__
+#include "XrdSys/XrdSysPthread.hh"
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+
+class XrdSysError;
+
+#define DIAMOND_DEFAULT_DEDUP_MINSIZE 1024*1024
+#define DIAMOND_DEDUP_COPY_BLOCKSIZE 4*1024*1024
+#define DIAMOND_DEDUP_XATTR "user.diamond.sha256"
+
+//------------------------------------------------------------------------------
+//! SHA-256 of a byte stream
+//------------------------------------------------------------------------------
+class DiamondSha256 {
+public:
+  DiamondSha256 () { Reset(); }
+
+  void Reset ();
+  void Update (const char* data, size_t length);
+
+  //----------------------------------------------------------------------------
+  //! Return the hex digest - the object has to be reset to be used again
+  //----------------------------------------------------------------------------
+  std::string Final ();
+
+private:
+  void Transform (const unsigned char* block);
+
+  uint32_t mState[8]; //< intermediate hash value
+  uint64_t mLength; //< number of bytes hashed
+  unsigned char mBlock[64]; //< partial input block
+  size_t mFill; //< bytes in mBlock
+};
+
+//------------------------------------------------------------------------------
+//! Content hash of a file computed while it is written - only a file written
+//! strictly in order has a hash, any other write invalidates it
+//------------------------------------------------------------------------------
+class DiamondDedupHash {
+public:
+  DiamondDedupHash () : mOffset(0), mValid(true) { }
+
+  void Update (off_t offset, const char* data, size_t length);
+  void Truncate (off_t size);
+  void Invalidate ();
+
+  //----------------------------------------------------------------------------
+  //! Return the hash and the size of the written data
+  //!
+  //! @return false if the file has not been written in order
+  //----------------------------------------------------------------------------
+  bool Final (std::string& hash, off_t& size);
+
+private:
+  XrdSysMutex mMutex; //< writes of a file can come from several threads
+  DiamondSha256 mSha; //< hash of the data up to mOffset
+  off_t mOffset; //< end of the data hashed so far
+  bool mValid; //< the file has been written in order
+};
+
+//------------------------------------------------------------------------------
+//! Content deduplication of written files. Every stored object is a hard link
+//! named by the SHA-256 of its content in the deduplication directory, which
+//! has to be on the file system of the backend. A new file with the content of
+//! a stored object is replaced by a hard link to it, so the link count of an
+//! object counts its references and an object only linked by the directory is
+//! collected. The hash is recorded in an extended attribute together with size
+//! and modification time, so a TPC source can announce it. A referenced file
+//! opened for writing is first replaced by a private copy.
+//------------------------------------------------------------------------------
+class DiamondDedup {
+public:
+
+  struct Stats {
+    Stats () : objects(0), stored(0), linked(0), saved(0), unshared(0),
+               collected(0) { }
+    unsigned long long objects; //< objects in the deduplication directory
+    unsigned long long stored; //< files which became a new object
+    unsigned long long linked; //< files replaced by a reference to an object
+    unsigned long long saved; //< bytes of the files replaced by a reference
+    unsigned long long unshared; //< references replaced by a private copy
+    unsigned long long collected; //< objects removed without references
+  };
+
+  DiamondDedup () : mMinSize(DIAMOND_DEFAULT_DEDUP_MINSIZE), mTemp(0) { }
+
+  //----------------------------------------------------------------------------
+  //! Remove unreferenced objects and temporary files left by a previous run -
+  //! does nothing without a deduplication directory
+  //----------------------------------------------------------------------------
+  int Start (XrdSysError& err);
+
+  bool Enabled () const { return mDir.length(); }
+
+  //----------------------------------------------------------------------------
+  //! Check if hash is a hex SHA-256 digest
+  //----------------------------------------------------------------------------
+  static bool Valid (const std::string& hash);
+
+  //----------------------------------------------------------------------------
+  //! Load the hash attribute of fd
+  //!
+  //! @return true if the attribute exists and matches the file
+  //----------------------------------------------------------------------------
+  static bool Load (int fd, std::string& hash);
+
+  //----------------------------------------------------------------------------
+  //! Return the hash attribute of path if it matches the file - empty if none
+  //----------------------------------------------------------------------------
+  static std::string PathHash (const char* path);
+
+  //----------------------------------------------------------------------------
+  //! Deduplicate the file written through fd at path - the file is replaced
+  //! by a reference to a stored object or becomes a new object
+  //!
+  //! @param linked set if the file has been replaced by a reference
+  //! @return 0 or an errno
+  //----------------------------------------------------------------------------
+  int Commit (int fd, const char* path, const std::string& hash, off_t size,
+              bool& linked);
+
+  //----------------------------------------------------------------------------
+  //! Replace the file opened through fd at path by a reference to the stored
+  //! object of hash
+  //!
+  //! @return 0, ENOENT if no object of hash and size is stored or an errno
+  //----------------------------------------------------------------------------
+  int Reference (int fd, const char* path, const std::string& hash,
+                 off_t size);
+
+  //----------------------------------------------------------------------------
+  //! Replace a referenced file at path by a private copy before it is
+  //! modified - a truncated file is replaced by an empty one
+  //!
+  //! @return 0 or an errno
+  //----------------------------------------------------------------------------
+  int Unshare (const char* path, bool truncate);
+
+  //----------------------------------------------------------------------------
+  //! A reference to the object of hash went away - collects the object if the
+  //! directory holds its last link
+  //----------------------------------------------------------------------------
+  void Release (const std::string& hash);
+
+  Stats GetStats ();
+
+  off_t MinSize () const { return mMinSize; }
+
+  void SetDir (const std::string& dir) { mDir = dir; }
+  void SetMinSize (off_t minsize) { mMinSize = minsize; }
+
+private:
+  static bool Pfn (const char* path, std::string& pfn);
+  static bool Parse (const char* value, const struct stat& buf,
+                     std::string& hash);
+  static int Store (int fd, const std::string& hash);
+
+  std::string Object (const std::string& hash);
+  std::string TempPath ();
+  int Replace (int fd, const std::string& pfn, const std::string& object);
+  void Collect (const std::string& hash);
+
+  XrdSysMutex mMutex; //< serializes changes of the objects and their links
+  std::string mDir; //< deduplication directory - empty disables deduplication
+  off_t mMinSize; //< smallest file which is deduplicated
+  unsigned long long mTemp; //< counter naming temporary files
+  Stats mStats; //< counters
+};
+
+#endif
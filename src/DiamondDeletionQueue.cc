@@ -0,0 +1,399 @@
+// ----------------------------------------------------------------------
+// File: DiamondDeletionQueue.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#include "DiamondDeletionQueue.hh"
+#include "DiamondFs.hh"
+
+#include "XrdOfs/XrdOfsTrace.hh"
+#include "XrdSys/XrdSysError.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fstream>
+#include <vector>
+
+//------------------------------------------------------------------------------
+//! Job removing one path
+//------------------------------------------------------------------------------
+class DiamondDeletionJob : public DiamondJob {
+public:
+  DiamondDeletionJob (const std::string& path) : mPath(path), mRc(0) { }
+
+  void
+  DoIt () {
+    // removals are internal operations and run without a client identity
+    XrdOucErrInfo error;
+    mRc = DiamondFS.rem(mPath.c_str(), error, 0, 0);
+    if (mRc && (error.getErrInfo() == ENOENT))
+      mRc = 0;
+  }
+
+  std::string mPath;
+  int mRc; //< result of the removal
+};
+
+//------------------------------------------------------------------------------
+// Tell the dispatcher to exit
+//------------------------------------------------------------------------------
+DiamondDeletionQueue::~DiamondDeletionQueue ()
+{
+  mCond.Lock();
+  mShutdown = true;
+  mCond.Broadcast();
+  mCond.UnLock();
+}
+
+//------------------------------------------------------------------------------
+// Replay the journal and start the threads
+//------------------------------------------------------------------------------
+int
+DiamondDeletionQueue::Start (XrdSysError& err)
+{
+  if (Replay(err))
+    return 1;
+
+  if (mPool.Start(mThreads, "Diamond Deletion Thread"))
+  {
+    err.Emsg("Config", "failed to start diamond deletion threads");
+    return 1;
+  }
+
+  mCond.Lock();
+  mRunning = true;
+  mCond.UnLock();
+
+  if (XrdSysThread::Run(&mThread, DiamondDeletionQueue::StartDispatcher,
+                        static_cast<void*>(this), 0,
+                        "Diamond Deletion Dispatcher"))
+  {
+    mCond.Lock();
+    mRunning = false;
+    mCond.UnLock();
+    err.Emsg("Config", "failed to start diamond deletion dispatcher");
+    return 1;
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Read the journal, keep the paths which have not been removed and rewrite
+// the journal with those paths only
+//------------------------------------------------------------------------------
+int
+DiamondDeletionQueue::Replay (XrdSysError& err)
+{
+  if (mJournal.empty())
+    return 0;
+
+  std::vector<std::string> order;
+  std::set<std::string> pending;
+  std::ifstream in(mJournal.c_str());
+  std::string line;
+
+  while (std::getline(in, line))
+  {
+    if (line.length() < 2)
+      continue;
+    std::string path = line.substr(1);
+    if (line[0] == '+')
+    {
+      if (pending.insert(path).second)
+        order.push_back(path);
+    }
+    else if (line[0] == '-')
+    {
+      pending.erase(path);
+    }
+  }
+  in.close();
+
+  std::string tmp = mJournal + ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0)
+  {
+    err.Emsg("Config", errno, "create deletion journal", tmp.c_str());
+    return 1;
+  }
+  mJournalFd = fd;
+
+  for (size_t i = 0; i < order.size(); i++)
+  {
+    if (!pending.count(order[i]))
+      continue;
+    Request request;
+    request.path = order[i];
+    request.attempts = 0;
+    request.notbefore = 0;
+    mQueue.push_back(request);
+    mQueued.insert(order[i]);
+    mStats.queued++;
+    Journal('+', order[i]);
+  }
+
+  ::fsync(fd);
+  ::close(fd);
+  mJournalFd = -1;
+
+  if (::rename(tmp.c_str(), mJournal.c_str()))
+  {
+    err.Emsg("Config", errno, "rename deletion journal", mJournal.c_str());
+    return 1;
+  }
+
+  mJournalFd = ::open(mJournal.c_str(), O_WRONLY | O_APPEND);
+  if (mJournalFd < 0)
+  {
+    err.Emsg("Config", errno, "open deletion journal", mJournal.c_str());
+    return 1;
+  }
+
+  if (!mQueue.empty())
+  {
+    char count[32];
+    snprintf(count, sizeof(count), "%lu", (unsigned long) mQueue.size());
+    err.Say("++++++ diamond deletion journal replayed with ", count,
+            " pending removals");
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Append a record to the journal - requires the lock
+//------------------------------------------------------------------------------
+void
+DiamondDeletionQueue::Journal (char op, const std::string& path)
+{
+  if (mJournalFd < 0)
+    return;
+
+  std::string record;
+  record += op;
+  record += path;
+  record += "\n";
+  if (::write(mJournalFd, record.c_str(), record.length()) !=
+      (ssize_t) record.length())
+  {
+    const char* tident = "diamond";
+    EPNAME("deletion");
+    diamond_log("msg=\"failed to write deletion journal\" errno=%d path=\"%s\"",
+                errno, path.c_str());
+  }
+}
+
+//------------------------------------------------------------------------------
+// Queue the removal of a path
+//------------------------------------------------------------------------------
+void
+DiamondDeletionQueue::Add (const std::string& path)
+{
+  mCond.Lock();
+  if (!mRunning)
+  {
+    mCond.UnLock();
+    DiamondDeletionJob job(path);
+    job.DoIt();
+    return;
+  }
+
+  if (!mQueued.count(path))
+  {
+    Request request;
+    request.path = path;
+    request.attempts = 0;
+    request.notbefore = 0;
+    mQueue.push_back(request);
+    mQueued.insert(path);
+    mStats.queued++;
+    Journal('+', path);
+    mCond.Broadcast();
+  }
+  mCond.UnLock();
+}
+
+//------------------------------------------------------------------------------
+// Forget a queued removal
+//------------------------------------------------------------------------------
+void
+DiamondDeletionQueue::Cancel (const std::string& path)
+{
+  mCond.Lock();
+  while (mInFlight.count(path))
+    mCond.Wait();
+
+  if (mQueued.erase(path))
+  {
+    for (std::deque<Request>::iterator it = mQueue.begin();
+         it != mQueue.end(); it++)
+    {
+      if (it->path == path)
+      {
+        mQueue.erase(it);
+        break;
+      }
+    }
+    Journal('-', path);
+  }
+  mCond.UnLock();
+}
+
+//------------------------------------------------------------------------------
+// Return the counters
+//------------------------------------------------------------------------------
+DiamondDeletionQueue::Stats
+DiamondDeletionQueue::GetStats ()
+{
+  mCond.Lock();
+  Stats stats = mStats;
+  stats.pending = mQueue.size() + mInFlight.size();
+  mCond.UnLock();
+  return stats;
+}
+
+//------------------------------------------------------------------------------
+// Static thread entry point
+//------------------------------------------------------------------------------
+void*
+DiamondDeletionQueue::StartDispatcher (void* arg)
+{
+  return reinterpret_cast<DiamondDeletionQueue*>(arg)->Dispatcher();
+}
+
+//------------------------------------------------------------------------------
+// Take batches of due removals off the queue and run them in parallel
+//------------------------------------------------------------------------------
+void*
+DiamondDeletionQueue::Dispatcher ()
+{
+  const char* tident = "diamond";
+  EPNAME("deletion");
+
+  while (1)
+  {
+    std::vector<DiamondDeletionJob> jobs;
+    std::vector<size_t> attempts;
+
+    mCond.Lock();
+    while (!mShutdown)
+    {
+      time_t now = time(NULL);
+      std::deque<Request>::iterator it = mQueue.begin();
+      while ((it != mQueue.end()) && (jobs.size() < mBatch))
+      {
+        if (it->notbefore <= now)
+        {
+          jobs.push_back(DiamondDeletionJob(it->path));
+          attempts.push_back(it->attempts);
+          mInFlight.insert(it->path);
+          mQueued.erase(it->path);
+          it = mQueue.erase(it);
+        }
+        else
+        {
+          it++;
+        }
+      }
+
+      if (!jobs.empty())
+        break;
+
+      // retries become due by time - new requests signal
+      if (mQueue.empty())
+        mCond.Wait();
+      else
+        mCond.Wait(1);
+    }
+
+    if (mShutdown)
+    {
+      mCond.UnLock();
+      return 0;
+    }
+    mCond.UnLock();
+
+    DiamondJobGroup group;
+    for (size_t i = 0; i < jobs.size(); i++)
+      mPool.Schedule(&jobs[i], &group);
+    group.Wait();
+
+    mCond.Lock();
+    time_t now = time(NULL);
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+      mInFlight.erase(jobs[i].mPath);
+
+      if (!jobs[i].mRc)
+      {
+        mStats.removed++;
+        Journal('-', jobs[i].mPath);
+        continue;
+      }
+
+      if (attempts[i] >= mRetries)
+      {
+        mStats.failed++;
+        Journal('-', jobs[i].mPath);
+        diamond_log("msg=\"giving up removal\" path=\"%s\" attempts=%lu",
+                    jobs[i].mPath.c_str(), (unsigned long) attempts[i] + 1);
+        continue;
+      }
+
+      // a path which has been queued again meanwhile is already pending
+      if (mQueued.count(jobs[i].mPath))
+        continue;
+
+      Request request;
+      request.path = jobs[i].mPath;
+      request.attempts = attempts[i] + 1;
+      request.notbefore = now + ((request.attempts < 8) ?
+                                 (1 << request.attempts) : 300);
+      mQueue.push_back(request);
+      mQueued.insert(request.path);
+      mStats.retried++;
+      if (DIAMOND_DEBUG)diamond_log("msg=\"retry removal\" path=\"%s\" "
+                                    "attempt=%lu", request.path.c_str(),
+                                    (unsigned long) request.attempts);
+    }
+
+    if (mJournalFd >= 0)
+    {
+      ::fdatasync(mJournalFd);
+      // nothing is pending - start the journal from scratch
+      if (mQueue.empty() && mInFlight.empty() &&
+          (::lseek(mJournalFd, 0, SEEK_END) > DIAMOND_DELETION_JOURNAL_COMPACT))
+        if (::ftruncate(mJournalFd, 0))
+          diamond_log("msg=\"failed to truncate deletion journal\" errno=%d",
+                      errno);
+    }
+
+    if (DIAMOND_DEBUG)diamond_log("msg=\"removal batch done\" size=%lu "
+                                  "pending=%lu", (unsigned long) jobs.size(),
+                                  (unsigned long) mQueue.size());
+    // wake up writers waiting in Cancel
+    mCond.Broadcast();
+    mCond.UnLock();
+  }
+  return 0;
+}
@@ -0,0 +1,123 @@
+// ----------------------------------------------------------------------
+// File: DiamondDeletionQueue.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#ifndef __DIAMONDDELETIONQUEUE_API_H__
+#define __DIAMONDDELETIONQUEUE_API_H__
+#include "XrdSys/XrdSysPthread.hh"
+
+#include "DiamondWorkerPool.hh"
+
+#include <time.h>
+#include <deque>
+#include <set>
+#include <string>
+
+class XrdSysError;
+
+#define DIAMOND_DEFAULT_DELETION_THREADS 4
+#define DIAMOND_DEFAULT_DELETION_BATCH 64
+#define DIAMOND_DEFAULT_DELETION_RETRIES 5
+#define DIAMOND_DELETION_JOURNAL_COMPACT 1024*1024
+
+//------------------------------------------------------------------------------
+//! Background removal of abandoned files. Removals are run in batches on a
+//! private worker pool, failed removals are retried with an exponential
+//! back-off. Queued paths are recorded in an optional journal which is
+//! replayed by Start, so a restart does not leak queued files.
+//------------------------------------------------------------------------------
+class DiamondDeletionQueue {
+public:
+
+  struct Stats {
+    Stats () : queued(0), removed(0), retried(0), failed(0), pending(0) { }
+    unsigned long long queued; //< paths added to the queue
+    unsigned long long removed; //< paths removed
+    unsigned long long retried; //< removals which had to be retried
+    unsigned long long failed; //< paths given up after all retries
+    unsigned long long pending; //< paths currently queued or in flight
+  };
+
+  DiamondDeletionQueue () : mCond(0),
+                            mRunning(false),
+                            mShutdown(false),
+                            mJournalFd(-1),
+                            mThreads(DIAMOND_DEFAULT_DELETION_THREADS),
+                            mBatch(DIAMOND_DEFAULT_DELETION_BATCH),
+                            mRetries(DIAMOND_DEFAULT_DELETION_RETRIES) { }
+
+  ~DiamondDeletionQueue ();
+
+  //----------------------------------------------------------------------------
+  //! Replay the journal and start the dispatcher thread
+  //----------------------------------------------------------------------------
+  int Start (XrdSysError& err);
+
+  //----------------------------------------------------------------------------
+  //! Queue the removal of path - removes synchronously if not started
+  //----------------------------------------------------------------------------
+  void Add (const std::string& path);
+
+  //----------------------------------------------------------------------------
+  //! Forget a queued removal of path because it is opened for writing again.
+  //! Waits for a removal of path which is already in flight.
+  //----------------------------------------------------------------------------
+  void Cancel (const std::string& path);
+
+  Stats GetStats ();
+
+  void SetJournal (const std::string& journal) { mJournal = journal; }
+  void SetThreads (size_t threads) { mThreads = threads ? threads : 1; }
+  void SetBatch (size_t batch) { mBatch = batch ? batch : 1; }
+  void SetRetries (size_t retries) { mRetries = retries; }
+
+private:
+  struct Request {
+    std::string path;
+    size_t attempts; //< number of failed removals
+    time_t notbefore; //< earliest time of the next attempt
+  };
+
+  static void* StartDispatcher (void* arg);
+  void* Dispatcher ();
+
+  int Replay (XrdSysError& err);
+  void Journal (char op, const std::string& path);
+
+  XrdSysCondVar mCond; //< protects all members, signals finished batches
+  std::deque<Request> mQueue; //< removals waiting for a batch
+  std::set<std::string> mQueued; //< paths in mQueue
+  std::set<std::string> mInFlight; //< paths of the running batch
+  DiamondWorkerPool mPool; //< threads running the removals
+  pthread_t mThread; //< dispatcher thread
+  bool mRunning; //< dispatcher has been started
+  bool mShutdown; //< tells the dispatcher to exit
+  std::string mJournal; //< journal file - empty keeps the queue in memory
+  int mJournalFd; //< file descriptor of the journal
+  size_t mThreads; //< number of removal threads
+  size_t mBatch; //< maximum number of removals per batch
+  size_t mRetries; //< number of retries before a path is given up
+  Stats mStats; //< counters
+};
+
+#endif
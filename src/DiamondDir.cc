@@ -20,3 +20,243 @@
  * You should have received a copy of the GNU General Public License    *
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
  ************************************************************************/
+
+#include "DiamondDir.hh"
+#include "DiamondFs.hh"
+#include "DiamondWorkerPool.hh"
+
+#include "XrdOfs/XrdOfsTrace.hh"
+
+//------------------------------------------------------------------------------
+//! Job stat-ing a slice of a directory listing through the OSS
+//------------------------------------------------------------------------------
+class DiamondDirStatJob : public DiamondJob {
+public:
+  DiamondDirStatJob (const std::string& dir,
+                     DiamondDirCache::Listing* listing,
+                     DiamondStatCache* statcache,
+                     size_t begin,
+                     size_t end) : mDir(dir),
+                                   mListing(listing),
+                                   mStatCache(statcache),
+                                   mBegin(begin),
+                                   mEnd(end) { }
+
+  void
+  DoIt () {
+    std::string path;
+    for (size_t i = mBegin; i < mEnd; i++)
+    {
+      path = mDir;
+      if (path != "/")
+        path += "/";
+      path += mListing->names[i];
+
+      unsigned long long generation = 0;
+      if (mStatCache->Get(path, &mListing->stats[i], &generation) ==
+          DiamondStatCache::kFound)
+        continue;
+
+      // an entry removed since readdir is reported with an empty stat
+      if (XrdOfsOss->Stat(path.c_str(), &mListing->stats[i]))
+      {
+        memset(&mListing->stats[i], 0, sizeof(struct stat));
+      }
+      else
+      {
+        DiamondCompressedFile::FixStat(path.c_str(), &mListing->stats[i]);
+        mStatCache->Put(path, &mListing->stats[i], generation);
+      }
+    }
+  }
+
+private:
+  std::string mDir;
+  DiamondDirCache::Listing* mListing;
+  DiamondStatCache* mStatCache;
+  size_t mBegin;
+  size_t mEnd;
+};
+
+//------------------------------------------------------------------------------
+// Open a directory - the listing is served from the listing cache or read
+// completely from the backend
+//------------------------------------------------------------------------------
+int
+DiamondDir::open (const char* dirName,
+                  const XrdSecEntity* client,
+                  const char* opaque)
+{
+  EPNAME("opendir");
+
+  // authorization and existence are always checked against the backend
+  int rc = XrdOfsDirectory::open(dirName, client, opaque);
+  if (rc)
+    return rc;
+
+  mBackendOpen = true;
+  mPath = DiamondDirCache::DirName(dirName);
+  mIndex = 0;
+  mStated = 0;
+  mOwnListing.reset();
+
+  mListing = DiamondFS.DirCache.Get(mPath);
+  if (mListing)
+  {
+    if (DIAMOND_DEBUG)diamond_log("msg=\"listing cache hit\" path=\"%s\" "
+                                  "entries=%lu stat=%d", mPath.c_str(),
+                                  (unsigned long) mListing->names.size(),
+                                  mListing->hasStat);
+  }
+  else
+  {
+    mGeneration = DiamondFS.DirCache.Generation();
+    mOwnListing.reset(new DiamondDirCache::Listing());
+    const char* entry;
+    while ((entry = XrdOfsDirectory::nextEntry()))
+      mOwnListing->names.push_back(entry);
+
+    if (error.getErrInfo())
+    {
+      mOwnListing.reset();
+      return SFS_ERROR;
+    }
+    mListing = mOwnListing;
+  }
+
+  // the complete listing is in memory, release the backend handle
+  mBackendOpen = false;
+  XrdOfsDirectory::close();
+  return SFS_OK;
+}
+
+//------------------------------------------------------------------------------
+// Return the next entry and fill the autoStat buffer if registered
+//------------------------------------------------------------------------------
+const char*
+DiamondDir::nextEntry ()
+{
+  if (!mListing)
+    return 0;
+
+  if (mStatBuf && !mListing->hasStat && !mOwnListing)
+  {
+    // cached names without stats - stat into a private copy
+    mGeneration = DiamondFS.DirCache.Generation();
+    mOwnListing.reset(new DiamondDirCache::Listing(*mListing));
+    mListing = mOwnListing;
+    mStated = 0;
+  }
+
+  if (mIndex >= mListing->names.size())
+  {
+    Publish();
+    return 0;
+  }
+
+  if (mStatBuf)
+  {
+    if (mListing->hasStat)
+    {
+      *mStatBuf = mListing->stats[mIndex];
+    }
+    else
+    {
+      if (mIndex >= mStated)
+        StatBatch();
+      *mStatBuf = mOwnListing->stats[mIndex];
+    }
+  }
+  return mListing->names[mIndex++].c_str();
+}
+
+//------------------------------------------------------------------------------
+// Close the directory
+//------------------------------------------------------------------------------
+int
+DiamondDir::close ()
+{
+  int rc = SFS_OK;
+  if (mBackendOpen)
+  {
+    mBackendOpen = false;
+    rc = XrdOfsDirectory::close();
+  }
+  mListing.reset();
+  mOwnListing.reset();
+  mStatBuf = 0;
+  return rc;
+}
+
+//------------------------------------------------------------------------------
+// Register the buffer which nextEntry fills with the stat of each entry
+//------------------------------------------------------------------------------
+int
+DiamondDir::autoStat (struct stat* buf)
+{
+  mStatBuf = buf;
+  return SFS_OK;
+}
+
+//------------------------------------------------------------------------------
+// Stat the next batch of entries spreading them over the worker pool
+//------------------------------------------------------------------------------
+void
+DiamondDir::StatBatch ()
+{
+  EPNAME("statbatch");
+  size_t n = mOwnListing->names.size();
+  if (mOwnListing->stats.size() != n)
+    mOwnListing->stats.resize(n);
+
+  size_t end = mStated + DiamondFS.DirStatBatch;
+  if (end > n)
+    end = n;
+
+  size_t nworkers = DiamondFS.WorkerPool.Size();
+  size_t slice = (end - mStated) / (nworkers ? nworkers : 1) + 1;
+  if (slice < 16)
+    slice = 16;
+
+  std::vector<DiamondDirStatJob> jobs;
+  jobs.reserve((end - mStated) / slice + 1);
+  for (size_t i = mStated; i < end; i += slice)
+  {
+    jobs.push_back(DiamondDirStatJob(mPath, mOwnListing.get(),
+                                     &DiamondFS.StatCache, i,
+                                     (i + slice < end) ? (i + slice) : end));
+  }
+
+  DiamondJobGroup group;
+  for (size_t i = 0; i < jobs.size(); i++)
+    DiamondFS.WorkerPool.Schedule(&jobs[i], &group);
+  group.Wait();
+
+  if (DIAMOND_DEBUG)diamond_log("msg=\"stat batch\" path=\"%s\" from=%lu "
+                                "to=%lu jobs=%lu", mPath.c_str(),
+                                (unsigned long) mStated, (unsigned long) end,
+                                (unsigned long) jobs.size());
+  mStated = end;
+}
+
+//------------------------------------------------------------------------------
+// Publish the listing we have read in the listing cache
+//------------------------------------------------------------------------------
+void
+DiamondDir::Publish ()
+{
+  if (!mOwnListing)
+    return;
+
+  if (mStatBuf)
+  {
+    if (mStated < mOwnListing->names.size())
+      return;
+    mOwnListing->stats.resize(mOwnListing->names.size());
+    mOwnListing->hasStat = true;
+  }
+
+  DiamondFS.DirCache.Put(mPath, mOwnListing, mGeneration);
+  // from now on the listing is shared and must not be modified anymore
+  mOwnListing.reset();
+}
@@ -25,11 +25,57 @@
 #define __DIAMONDDIR_API_H__
 #include "XrdOfs/XrdOfs.hh"
 
+#include "DiamondDirCache.hh"
+
+#include <string>
+
+#define DIAMOND_DEFAULT_DIRSTAT_BATCH 256
+
 class DiamondDir : public XrdOfsDirectory {
+private:
+  std::string mPath; //< normalized directory path
+  DiamondDirCache::listing_ptr_t mListing; //< listing served by nextEntry
+  std::shared_ptr<DiamondDirCache::Listing> mOwnListing; //< listing we fill
+  unsigned long long mGeneration; //< cache generation when listing was read
+  size_t mIndex; //< next entry to return
+  size_t mStated; //< number of entries with valid stat in mOwnListing
+  struct stat* mStatBuf; //< caller buffer registered via autoStat
+  bool mBackendOpen; //< backend directory is still open
+
 public:
 
-  DiamondDir (const char *user, int MonID) : XrdOfsDirectory (user, MonID) { }
+  DiamondDir (const char *user, int MonID) : XrdOfsDirectory (user, MonID),
+                                             mGeneration(0),
+                                             mIndex(0),
+                                             mStated(0),
+                                             mStatBuf(0),
+                                             mBackendOpen(false) { }
+
+  ~DiamondDir () { close(); }
+
+  //----------------------------------------------------------------------------
+  //! Overloaded Functions
+  //----------------------------------------------------------------------------
+  int open (const char* dirName,
+            const XrdSecEntity* client = 0,
+            const char* opaque = 0);
+  //----------------------------------------------------------------------------
+  const char* nextEntry ();
+  //----------------------------------------------------------------------------
+  int close ();
+  //----------------------------------------------------------------------------
+  int autoStat (struct stat* buf);
+  //----------------------------------------------------------------------------
+
+private:
+  //----------------------------------------------------------------------------
+  //! Stat the next batch of entries in parallel
+  //----------------------------------------------------------------------------
+  void StatBatch ();
 
-  ~DiamondDir () { }
+  //----------------------------------------------------------------------------
+  //! Publish a completely read listing in the listing cache
+  //----------------------------------------------------------------------------
+  void Publish ();
 };
 #endif
@@ -0,0 +1,143 @@
+// ----------------------------------------------------------------------
+// File: DiamondDirCache.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "DiamondDirCache.hh"
+
+//------------------------------------------------------------------------------
+// Lookup a listing
+//------------------------------------------------------------------------------
+DiamondDirCache::listing_ptr_t
+DiamondDirCache::Get (const std::string& dir)
+{
+  if (!Enabled())
+    return listing_ptr_t();
+
+  XrdSysMutexHelper cLock(mMutex);
+  std::map<std::string, Entry>::iterator it = mCache.find(dir);
+  if (it == mCache.end())
+    return listing_ptr_t();
+
+  if (it->second.expires < time(NULL))
+  {
+    mCache.erase(it);
+    return listing_ptr_t();
+  }
+  return it->second.listing;
+}
+
+//------------------------------------------------------------------------------
+// Publish a listing
+//------------------------------------------------------------------------------
+void
+DiamondDirCache::Put (const std::string& dir, listing_ptr_t listing,
+                      unsigned long long generation)
+{
+  if (!Enabled())
+    return;
+
+  time_t now = time(NULL);
+  XrdSysMutexHelper cLock(mMutex);
+
+  if (generation != mGeneration)
+    return;
+
+  if ((mCache.size() >= mMaxSize) && !mCache.count(dir))
+  {
+    // drop expired listings first, then the one expiring next
+    std::map<std::string, Entry>::iterator it = mCache.begin();
+    std::map<std::string, Entry>::iterator del = mCache.begin();
+    std::map<std::string, Entry>::iterator oldest = mCache.end();
+    while (it != mCache.end())
+    {
+      del = it;
+      it++;
+      if (del->second.expires < now)
+      {
+        mCache.erase(del);
+        continue;
+      }
+      if ((oldest == mCache.end()) ||
+          (del->second.expires < oldest->second.expires))
+        oldest = del;
+    }
+    if ((mCache.size() >= mMaxSize) && (oldest != mCache.end()))
+      mCache.erase(oldest);
+  }
+
+  mCache[dir].listing = listing;
+  mCache[dir].expires = now + mLifeTime;
+}
+
+//------------------------------------------------------------------------------
+// Return the invalidation counter
+//------------------------------------------------------------------------------
+unsigned long long
+DiamondDirCache::Generation ()
+{
+  XrdSysMutexHelper cLock(mMutex);
+  return mGeneration;
+}
+
+//------------------------------------------------------------------------------
+// Drop a listing
+//------------------------------------------------------------------------------
+void
+DiamondDirCache::Invalidate (const std::string& dir)
+{
+  XrdSysMutexHelper cLock(mMutex);
+  mGeneration++;
+  mCache.erase(dir);
+}
+
+//------------------------------------------------------------------------------
+// Drop the listing of the parent directory
+//------------------------------------------------------------------------------
+void
+DiamondDirCache::InvalidateParent (const char* path)
+{
+  if (!path)
+    return;
+
+  std::string parent = DirName(path);
+  size_t pos = parent.rfind("/");
+  if (pos == std::string::npos)
+    return;
+
+  parent.erase(pos ? pos : 1);
+  Invalidate(parent);
+}
+
+//------------------------------------------------------------------------------
+// Normalize a directory path
+//------------------------------------------------------------------------------
+std::string
+DiamondDirCache::DirName (const char* path)
+{
+  std::string dir = path ? path : "";
+  size_t pos = dir.find("?");
+  if (pos != std::string::npos)
+    dir.erase(pos);
+  while ((dir.length() > 1) && (dir[dir.length() - 1] == '/'))
+    dir.erase(dir.length() - 1);
+  return dir;
+}
@@ -0,0 +1,110 @@
+// ----------------------------------------------------------------------
+// File: DiamondDirCache.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef __DIAMONDDIRCACHE_API_H__
+#define __DIAMONDDIRCACHE_API_H__
+#include "XrdSys/XrdSysPthread.hh"
+
+#include <sys/stat.h>
+#include <time.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define DIAMOND_DEFAULT_DIRCACHE_TTL 5
+#define DIAMOND_DEFAULT_DIRCACHE_SIZE 1024
+
+//------------------------------------------------------------------------------
+//! Short lifetime cache of directory listings. A published listing is never
+//! modified, readers share it through a shared pointer.
+//------------------------------------------------------------------------------
+class DiamondDirCache {
+public:
+
+  struct Listing {
+    Listing () : hasStat(false) { }
+    std::vector<std::string> names; //< entry names as returned by readdir
+    std::vector<struct stat> stats; //< stat of each name if hasStat
+    bool hasStat; //< stats are filled
+  };
+
+  typedef std::shared_ptr<const Listing> listing_ptr_t;
+
+  DiamondDirCache () : mLifeTime(DIAMOND_DEFAULT_DIRCACHE_TTL),
+                       mMaxSize(DIAMOND_DEFAULT_DIRCACHE_SIZE),
+                       mGeneration(0) { }
+
+  ~DiamondDirCache () { }
+
+  //----------------------------------------------------------------------------
+  //! Lookup a listing - returns an empty pointer if missing or expired
+  //----------------------------------------------------------------------------
+  listing_ptr_t Get (const std::string& dir);
+
+  //----------------------------------------------------------------------------
+  //! Publish a listing for dir which has been read after Generation returned
+  //! generation - a listing overtaken by an invalidation is dropped
+  //----------------------------------------------------------------------------
+  void Put (const std::string& dir, listing_ptr_t listing,
+            unsigned long long generation);
+
+  //----------------------------------------------------------------------------
+  //! Return the invalidation counter
+  //----------------------------------------------------------------------------
+  unsigned long long Generation ();
+
+  //----------------------------------------------------------------------------
+  //! Drop the listing of dir
+  //----------------------------------------------------------------------------
+  void Invalidate (const std::string& dir);
+
+  //----------------------------------------------------------------------------
+  //! Drop the listing of the directory containing path
+  //----------------------------------------------------------------------------
+  void InvalidateParent (const char* path);
+
+  void SetLifeTime (time_t lifetime) { mLifeTime = lifetime; }
+  void SetMaxSize (size_t maxsize) { mMaxSize = maxsize; }
+
+  bool Enabled () const { return mLifeTime > 0; }
+
+  //----------------------------------------------------------------------------
+  //! Normalize a directory path (strip opaque and trailing slashes)
+  //----------------------------------------------------------------------------
+  static std::string DirName (const char* path);
+
+private:
+  struct Entry {
+    listing_ptr_t listing;
+    time_t expires;
+  };
+
+  XrdSysMutex mMutex; //< mutex protecting mCache
+  std::map<std::string, Entry> mCache; //< dir path => cached listing
+  time_t mLifeTime; //< lifetime of a listing in seconds - 0 disables
+  size_t mMaxSize; //< maximum number of cached directories
+  unsigned long long mGeneration; //< incremented by each invalidation
+};
+
+#endif
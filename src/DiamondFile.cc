@@ -21,11 +21,20 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
  ************************************************************************/
 
+#include <fcntl.h>
+#include <sys/xattr.h>
+#include <sys/syscall.h>
+#include <linux/falloc.h>
 #include <memory>
 
 #include "DiamondFile.hh"
 #include "DiamondFs.hh"
+#include "DiamondChecksum.hh"
+#include "DiamondRangeReader.hh"
+#include "DiamondReadV.hh"
 
+#include "XrdSfs/XrdSfsAio.hh"
+#include "XrdAcc/XrdAccAuthorize.hh"
 #include "XrdOuc/XrdOucEnv.hh"
 #include "XrdOuc/XrdOucTrace.hh"
 #include "XrdOfs/XrdOfsTrace.hh"
@@ -33,9 +42,7 @@
 #include "XrdSys/XrdSysTimer.hh"
 #include "XrdNet/XrdNetAddrInfo.hh"
 #include "XrdCl/XrdClFile.hh"
-
-// poor man's debug just for the initial implementation
-#define DIAMOND_DEBUG 1
+#include <zlib.h>
 
 int
 DiamondFile::open (const char* path,
@@ -55,7 +62,9 @@ DiamondFile::open (const char* path,
   XrdOucString Path = path;
   XrdOucString sec_protocol = client ? client->prot : "";
 
-  client_sec = *client;
+  // bulk TPC transfers open their destination without a client
+  if (client)
+    client_sec = *client;
   isRW = (open_mode) ? true : false;
 
   std::string tpc_stage = tmpOpaque.Get("tpc.stage") ?
@@ -74,6 +83,20 @@ DiamondFile::open (const char* path,
   if (tpc_stage == "placement")
   {
     tpcFlag = kTpcSrcCanDo;
+
+    // a busy source refuses the probe before touching the backend, so the
+    // transfer can be placed on another replica
+    std::string load;
+    if (DiamondFS.TpcLoad.Probe(DiamondFS.TpcQueued(), load))
+    {
+      diamond_log("msg=\"tpc placement refused\" path=%s %s", path,
+                  load.c_str());
+      std::string emsg = "open - tpc source overloaded ";
+      emsg += load;
+      return DiamondFS.Emsg(epname, error, EBUSY, emsg.c_str(), path);
+    }
+    if (DIAMOND_DEBUG)diamond_log("msg=\"tpc placement\" path=%s %s", path,
+                                  load.c_str());
   }
 
   if (tpc_key.length())
@@ -145,6 +168,16 @@ DiamondFile::open (const char* path,
                                 "open - tpc lfn missing",
                                 path);
         }
+        // the server fetches HTTP(S) URLs on behalf of the client only from
+        // configured hosts
+        if (TpcHttpSource(tpc_src) && !DiamondFS.TpcHttpAllowed(tpc_src))
+        {
+          return DiamondFS.Emsg(epname,
+                                error,
+                                EPERM,
+                                "open - tpc http source not allowed",
+                                path);
+        }
       }
       else
       {
@@ -300,6 +333,7 @@ DiamondFile::open (const char* path,
       stringOpaque+= "&";
     }
     stringOpaque += sstream.str().c_str();
+    mStripeSize = stripesize;
     if (DIAMOND_DEBUG)diamond_log( "msg=\"modifying opaque\" val=%s", stringOpaque.c_str());
   }
 
@@ -307,6 +341,9 @@ DiamondFile::open (const char* path,
     mTpcBlockSize = DiamondFS.parseUnit(parseOpaque.Get("diamond.tpc.blocksize"));
     if (mTpcBlockSize < DIAMOND_DEFAULT_TPC_BLOCKSIZE)
       mTpcBlockSize = DIAMOND_DEFAULT_TPC_BLOCKSIZE;
+    // blocks stay aligned for direct writes of a TPC destination
+    mTpcBlockSize = ((mTpcBlockSize + DIAMOND_IO_ALIGNMENT - 1) /
+                     DIAMOND_IO_ALIGNMENT) * DIAMOND_IO_ALIGNMENT;
     if (DIAMOND_DEBUG)diamond_log( "msg=\"setting tpc block size\" block-size=%llu", mTpcBlockSize);
   }
 
@@ -314,6 +351,78 @@ DiamondFile::open (const char* path,
        (open_mode & SFS_O_CREAT) )
     isTruncate = true;
 
+  // a delta TPC destination keeps an existing plain file and patches it
+  if ((tpcFlag == kTpcDstSetup) && isRW &&
+      (parseOpaque.Get("diamond.tpc.delta") ?
+       atoi(parseOpaque.Get("diamond.tpc.delta")) : DiamondFS.TpcDeltaMode) &&
+      !parseOpaque.Get("diamond.compress") &&
+      !parseOpaque.Get("diamond.layout") && DeltaCandidate(Path.c_str()))
+  {
+    open_mode = (open_mode & ~(SFS_O_TRUNC | SFS_O_CREAT)) | SFS_O_RDWR;
+    isTruncate = false;
+    mTpcDelta = true;
+    if (DIAMOND_DEBUG)diamond_log("msg=\"tpc delta destination\" path=%s",
+                                  Path.c_str());
+  }
+
+  // block compression is chosen when a file is written from scratch
+  int compress = 0;
+  if (isRW && parseOpaque.Get("diamond.compress"))
+  {
+    compress = DiamondCompressedFile::Algorithm(parseOpaque.Get("diamond.compress"));
+    if (!compress)
+    {
+      return DiamondFS.Emsg(epname,
+			    error,
+			    EINVAL,
+			    "open - unsupported compression algorithm",
+			    path);
+    }
+    if (!isTruncate)
+    {
+      return DiamondFS.Emsg(epname,
+			    error,
+			    ENOTSUP,
+			    "open - compression requires a new file",
+			    path);
+    }
+  }
+
+  // direct I/O is chosen per open or by the global defaults
+  if (parseOpaque.Get("diamond.direct"))
+    mDirectMode = atoi(parseOpaque.Get("diamond.direct")) ? 1 : 0;
+
+  // a striped layout is chosen when a file is written from scratch
+  bool jbod = false;
+  size_t nstripes = 0;
+  if (isRW && parseOpaque.Get("diamond.layout"))
+  {
+    if (strcmp(parseOpaque.Get("diamond.layout"), "jbod") ||
+        DiamondFS.JbodDirs.empty() || compress)
+    {
+      return DiamondFS.Emsg(epname,
+			    error,
+			    EINVAL,
+			    "open - unsupported layout",
+			    path);
+    }
+    if (!isTruncate)
+    {
+      return DiamondFS.Emsg(epname,
+			    error,
+			    ENOTSUP,
+			    "open - a layout requires a new file",
+			    path);
+    }
+    jbod = true;
+    if (parseOpaque.Get("diamond.stripes"))
+      nstripes = strtoul(parseOpaque.Get("diamond.stripes"), 0, 10);
+  }
+
+  // new plain files are written to the staging directory while it has room
+  bool staged = isRW && isTruncate && !jbod && !compress &&
+    DiamondFS.Staging.Accept();
+
   if ( ( Path.beginswith("/root:") ) ||
        ( Path.beginswith("/xroot:") ) )
   {
@@ -323,13 +432,228 @@ DiamondFile::open (const char* path,
     stringOpaque = noTpcOpaque;
   }
 
+  // a writer changes the backend before XrdOfsFile::open runs - the open is
+  // authorized first
+  if (isRW && client && DiamondFS.Authorization)
+  {
+    XrdOucEnv open_Env(stringOpaque.c_str(), 0, client);
+    if (!DiamondFS.Authorization->Access(client, Path.c_str(),
+                                         (open_mode & SFS_O_CREAT) ?
+                                         AOP_Create : AOP_Update, &open_Env))
+    {
+      return DiamondFS.Emsg(epname,
+                            error,
+                            EACCES,
+                            "open",
+                            path);
+    }
+  }
+
+  // a new writer takes over a file abandoned by a previous one - this waits
+  // for a removal of the path which is already running
+  if (isRW)
+    DiamondFS.Deletions.Cancel(Path.c_str());
+  // a deduplicated file gets a private copy before it is modified
+  if (isRW)
+  {
+    int drc = DiamondFS.Dedup.Unshare(Path.c_str(), isTruncate);
+    if (drc)
+    {
+      return DiamondFS.Emsg(epname,
+                            error,
+                            drc,
+                            "open - unable to unshare deduplicated file",
+                            path);
+    }
+  }
+
+  // an existing file is truncated once a migration of its staged copy has been
+  // cancelled and it is known not to share a stored object, not by the open -
+  // SFS_O_CREAT creates exclusively
+  bool lateTruncate = false;
+  if (isRW && (open_mode & SFS_O_TRUNC) && !(open_mode & SFS_O_CREAT) &&
+      (DiamondFS.Staging.Dir().length() || DiamondFS.Dedup.Enabled()) &&
+      Exists(Path.c_str()))
+  {
+    open_mode = (open_mode & ~SFS_O_TRUNC) | SFS_O_RDWR;
+    lateTruncate = true;
+  }
+
   int rc = XrdOfsFile::open(Path.c_str(),
 			    open_mode,
 			    create_mode,
 			    client,
 			    stringOpaque.c_str());
   if (!rc)
+  {
     isOpen = true;
+
+    // the path may have been deduplicated again since it has been unshared -
+    // a stored object is never modified through a writer
+    struct stat dbuf;
+    if (isRW && DiamondFS.Dedup.Enabled() &&
+        (fstat(BackendFd(), &dbuf) || (dbuf.st_nlink > 1)))
+      return OpenFailed(EBUSY, "open - file has been deduplicated meanwhile",
+                        path);
+
+    // a rewritten file drops the pending migration of its staged copy once the
+    // open succeeded, a migration in flight finishes before the truncate
+    if (isRW && isTruncate)
+      DiamondFS.Staging.Cancel(Path.c_str());
+    if (lateTruncate && ftruncate(BackendFd(), 0))
+      return OpenFailed(errno, "open - unable to truncate file", path);
+
+    // a striped file is recognized by the layout attribute of its placeholder,
+    // a truncated one loses its previous stripes
+    std::string layout = DiamondStripedFile::Layout(BackendFd());
+    if (isTruncate && layout.length())
+    {
+      DiamondStripedFile::Remove(layout);
+      DiamondStripedFile::Drop(BackendFd());
+      layout = "";
+    }
+    // a writer of a staged file holds off its migration - the layout is read
+    // again because a migration may have finished meanwhile
+    if (isRW && layout.length())
+    {
+      mStagedId = DiamondFS.Staging.Begin(BackendFd(), Path.c_str());
+      layout = DiamondStripedFile::Layout(BackendFd());
+    }
+    if (staged)
+    {
+      mStriped = new DiamondStripedFile(&DiamondFS.WorkerPool);
+      int src = mStriped->Create(BackendFd(),
+                                 std::vector<std::string>(1, DiamondFS.Staging.Dir()),
+                                 1, DiamondFS.JbodStripeSize);
+      if (!src)
+      {
+        mStagedId = DiamondFS.Staging.Begin(BackendFd(), Path.c_str());
+      }
+      else
+      {
+        // the file is written to the backend directly
+        diamond_log("msg=\"unable to stage file\" path=%s errno=%d",
+                    Path.c_str(), src);
+        delete mStriped;
+        mStriped = 0;
+      }
+    }
+    else if (jbod || layout.length())
+    {
+      mStriped = new DiamondStripedFile(&DiamondFS.WorkerPool);
+      struct stat buf;
+      int src = jbod ?
+        mStriped->Create(BackendFd(), DiamondFS.JbodDirs, nstripes,
+                         mStripeSize ? mStripeSize : DiamondFS.JbodStripeSize) :
+        (XrdOfsFile::stat(&buf) ? errno :
+         mStriped->Open(layout, buf.st_size, isRW));
+      if (src)
+      {
+        delete mStriped;
+        mStriped = 0;
+        // a reader can race with the migration of a staged file
+        if (jbod || isRW || (src != ENOENT) ||
+            DiamondStripedFile::Layout(BackendFd()).length())
+        {
+          return OpenFailed(src, "open - unable to setup striped file", path);
+        }
+      }
+    }
+
+    // a compressed file is marked by its attribute and recognized by its
+    // header, plain files are not read for it
+    int crc = ENOENT;
+    if (compress || (!isTruncate && !mStriped &&
+                     DiamondCompressedFile::Candidate(BackendFd())))
+    {
+      mCompressed = new DiamondCompressedFile(this, &DiamondFS.WorkerPool);
+      crc = compress ? mCompressed->Create(compress,
+                                           DiamondFS.CompressBlockSize,
+                                           DiamondFS.CompressLevel) :
+        mCompressed->Load();
+    }
+    if (crc)
+    {
+      delete mCompressed;
+      mCompressed = 0;
+      if (crc != ENOENT)
+      {
+        return OpenFailed(crc, "open - unable to setup compressed file",
+                          path);
+      }
+    }
+    else if (isRW && !compress)
+    {
+      return OpenFailed(ENOTSUP, "open - compressed files can not be updated",
+                        path);
+    }
+
+    // a new plain file is hashed while it is written to be deduplicated at
+    // close - the diamond.dedup CGI opts a file out
+    if (isRW && isTruncate && !mStriped && !mCompressed && !mTpcDelta &&
+        DiamondFS.Dedup.Enabled() &&
+        (!parseOpaque.Get("diamond.dedup") ||
+         atoi(parseOpaque.Get("diamond.dedup"))))
+      mDedupHash = new DiamondDedupHash();
+
+    // writers keep the block map of a new file or of a file with a valid map
+    // up to date, readers load it to verify the blocks they read
+    if (isRW ? DiamondFS.BlockMapSize : DiamondFS.BlockMapVerify)
+    {
+      mBlockMap = new DiamondBlockMap(isRW ? DiamondFS.BlockMapSize :
+                                      DIAMOND_DEFAULT_BLOCKMAP_BLOCKSIZE);
+      if (!isTruncate && !mBlockMap->Load(BackendFd()))
+      {
+        delete mBlockMap;
+        mBlockMap = 0;
+      }
+    }
+
+    // a created or truncated file changes the listing of its directory
+    if (isTruncate)
+      DiamondFS.DirCache.InvalidateParent(Path.c_str());
+    // cached metadata and data is not reliable while the file is written
+    if (isRW)
+    {
+      DiamondFS.StatCache.Invalidate(Path.c_str());
+      DiamondFS.BlockCache.Invalidate(Path.c_str());
+      DiamondFS.Handles.Invalidate(Path.c_str());
+      DiamondChecksum::Drop(BackendFd());
+      DiamondBlockMap::Drop(BackendFd());
+      if (isTruncate && !mCompressed)
+        DiamondCompressedFile::DropSize(BackendFd());
+    }
+
+    // plain read-only opens share the block cache - TPC source reads stream
+    // each block once and would only evict the blocks of other readers
+    struct stat buf;
+    if (!isRW && !mCompressed && !mStriped && (tpcFlag != kTpcSrcRead) &&
+        (mDirectMode != 1) &&
+        DiamondFS.BlockCache.Enabled() && !XrdOfsFile::stat(&buf))
+    {
+      mBlockCached = true;
+      mCacheKey = FName();
+      mCacheSize = buf.st_size;
+      mCacheMtime = buf.st_mtime;
+    }
+
+    // TPC transfers and bulk TPC destinations are not client requests
+    if (client && (tpcFlag == kTpcNone))
+      mQosClass = DiamondFS.Qos.Classify(client_sec);
+
+    if (tpcFlag == kTpcSrcRead)
+    {
+      SequentialOpen(DiamondFS.TpcDropBehind);
+      DiamondFS.TpcLoad.Open();
+      mTpcSource = true;
+    }
+    else if (!isRW && (mDirectMode == 1))
+      SequentialOpen(true);
+
+    if (isRW && ((mDirectMode == 1) ||
+                 ((mDirectMode < 0) && DiamondFS.DirectWrites)))
+      DirectOpen();
+  }
   return rc;
 }
 //----------------------------------------------------------------------------
@@ -340,6 +664,8 @@ DiamondFile::close ()
   EPNAME("close");
   //const char* tident = error.getErrUser();
 
+  int rc = SFS_OK;
+
   //............................................................................
   // Any close on a file opened in TPC mode invalidates tpc keys
   
@@ -360,260 +686,1846 @@ DiamondFile::close ()
       if (DIAMOND_DEBUG)diamond_log("msg=\"TPC job join returned %i\"", retc);
     }
 
-    if (viaDelete && isTruncate && isRW)
+    SequentialClose();
+
+    if (mTpcSource)
     {
-      diamond_log("msg=\"via delete truncate rw\"");
-      return DiamondFS.rem(FName(),
-			   error, 
-			   &client_sec, 
-			   "");
+      // reads served with sendfile are accounted with the file size
+      struct stat buf;
+      if (mTpcSendfile && !XrdOfsFile::stat(&buf) && (buf.st_size > mTpcSent))
+        DiamondFS.TpcLoad.Account(buf.st_size - mTpcSent);
+      DiamondFS.TpcLoad.Close();
+      mTpcSource = false;
+      mTpcSendfile = false;
+      mTpcSent = 0;
     }
-  }
-  return SFS_OK;
-}
-
-//------------------------------------------------------------------------------
-// Verify if a TPC key is still valid
-//------------------------------------------------------------------------------
 
-bool
-DiamondFile::TpcValid ()
-{
-  // This call requires to have a lock like
-  // 'XrdSysMutexHelper tpcLock(DiamondFS.TpcMapMutex)'
-  if (TpcKey.length())
-  {
-    if (DiamondFS.TpcMap[isRW].count(TpcKey.c_str()))
+    if (mDirectFd >= 0)
     {
-      return true;
+      ::close(mDirectFd);
+      mDirectFd = -1;
     }
-  }
-  return false;
-}
+    mQosClass = -1;
 
-int
-DiamondFile::sync ()
-{
-  EPNAME("sync");
-  static const int cbWaitTime = 1800;
+    // an abandoned file is removed anyway
+    if (isRW && !viaDelete)
+    {
+      int lrc = FinishLayout();
+      // a staged file is durable in the staging directory when close returns
+      if (!lrc && mStriped && mStagedId.length())
+        lrc = mStriped->Sync();
+      if (lrc)
+        rc = DiamondFS.Emsg(epname, error, lrc,
+                            "close - unable to finish file layout",
+                            FName());
+      else if (mBlockMap && !mDeduped && (lrc = StoreBlockMap()))
+        diamond_log("msg=\"unable to store block map\" path=%s errno=%d",
+                    FName(), lrc);
+      if (!lrc && mDedupHash && !mDeduped)
+        Deduplicate();
+    }
 
-  if (tpcFlag == kTpcDstSetup)
-  {
-    int tpc_state = GetTpcState();
+    if (mDedupHash)
+    {
+      delete mDedupHash;
+      mDedupHash = 0;
+    }
 
-    if (tpc_state == kTpcIdle)
+    if (mBlockMap)
     {
-      if (DIAMOND_DEBUG)diamond_log( "msg=\"tpc enabled - 1st sync\"");
-      SetTpcState(kTpcEnabled);
-      return SFS_OK;
+      delete mBlockMap;
+      mBlockMap = 0;
     }
-    else if (tpc_state == kTpcRun)
+
+    if (mCompressed)
     {
-      if (DIAMOND_DEBUG)diamond_log( "msg=\"tpc already running - >2nd sync\"");
-      error.setErrCode(cbWaitTime);
-      return SFS_STARTED;
+      delete mCompressed;
+      mCompressed = 0;
     }
-    else if (tpc_state == kTpcDone)
+
+    if (mStriped)
     {
-      if (DIAMOND_DEBUG)diamond_log( "msg=\"tpc already finisehd - >2nd sync\"");
-      return SFS_OK;
+      // the queued removal only sees the placeholder
+      std::string layout = DiamondStripedFile::Layout(BackendFd());
+      delete mStriped;
+      mStriped = 0;
+      if (viaDelete && isTruncate && isRW)
+        DiamondStripedFile::Remove(layout);
     }
-    else if (tpc_state == kTpcEnabled)
+
+    if (mStagedId.length())
     {
-      SetTpcState(kTpcRun);
-  
-      if (mTpcInfo.SetCB(&error))
-      {
-	diamond_log("msg=\"failed setting TPC callback\"");
-	return SFS_ERROR;
-      }
-      else
-      {
-	error.setErrCode(cbWaitTime);
-	mTpcThreadStatus = XrdSysThread::Run(&mTpcThread, DiamondFile::StartDoTpcTransfer,
-					     static_cast<void*>(this), XRDSYSTHREAD_HOLD,
-					     "TPC Transfer Thread");
-	return SFS_STARTED;
-      }
+      DiamondFS.Staging.End(mStagedId, !(viaDelete && isTruncate));
+      mStagedId = "";
     }
-    else 
+
+    if (isRW)
+      DiamondFS.Invalidate(FName());
+
+    if (viaDelete && isTruncate && isRW)
     {
-      diamond_log("msg=\"unknown tpc state\"");
-      error.setErrCode(EINVAL);
-      return SFS_ERROR;
+      // don't block the disconnecting thread on a backend removal
+      diamond_log("msg=\"via delete truncate rw - queue removal\"");
+      DiamondFS.Deletions.Add(FName());
     }
   }
-  else
-  {
-    //...........................................................................
-    // Standard file sync
-    //...........................................................................
-    return DiamondFile::sync();
-  }
+  return rc;
 }
 
 //------------------------------------------------------------------------------
-// Static method used to start an asynchronous thread which is doing the TPC
-// transfer
+// Complete the layout of a written file
 //------------------------------------------------------------------------------
-void*
-DiamondFile::StartDoTpcTransfer (void* arg)
+
+int
+DiamondFile::FinishLayout ()
 {
-  return reinterpret_cast<DiamondFile*>(arg)->DoTpcTransfer();
+  if (mCompressed && mCompressed->Writing())
+    return mCompressed->Finish();
+
+  if (mStriped && mStriped->Dirty())
+  {
+    // the sparse placeholder carries the logical size for stat and listings
+    struct stat buf;
+    if (XrdOfsFile::stat(&buf))
+      return errno ? errno : EIO;
+    if ((buf.st_size < mStriped->Size()) &&
+        XrdOfsFile::truncate(mStriped->Size()))
+      return error.getErrInfo() ? error.getErrInfo() : EIO;
+    mStriped->Clean();
+  }
+  return 0;
 }
 
 //------------------------------------------------------------------------------
-//
-// Run method for the thread doing the TPC transfer
+// Store the block map of a written file
 //------------------------------------------------------------------------------
-void*
-DiamondFile::DoTpcTransfer()
+
+int
+DiamondFile::StoreBlockMap ()
 {
-  EPNAME("tpctransfer");
-  diamond_log("msg=\"tpc now running - 2nd sync\"");
-  std::string src_url = "";
-  std::string src_cgi = "";
-  
-  // The sync initiates the third party copy
-  if (!TpcValid())
+  EPNAME("StoreBlockMap");
+  struct stat buf;
+  if (stat(&buf))
+    return error.getErrInfo() ? error.getErrInfo() : EIO;
+
+  // writes bypassing the map (e.g. a local TPC copy) leave blocks behind
+  if (buf.st_size != mBlockMap->Size())
+    mBlockMap->Truncate(buf.st_size);
+
+  // only blocks modified out of order are read back - a file written in
+  // random order gets no map instead of a re-read of the whole file in close
+  std::vector<size_t> stale;
+  mBlockMap->Stale(stale);
+  if (stale.size() > DIAMOND_BLOCKMAP_MAX_STALE)
   {
-    diamond_log("msg=\"tpc session invalidated during sync\"");
-    error.setErrInfo(ECONNABORTED, "sync - TPC session has been closed by disconnect");
-    SetTpcState(kTpcDone);
-    mTpcInfo.Reply(SFS_ERROR, ECONNABORTED, "TPC session closed by diconnect");
+    if (DIAMOND_DEBUG)diamond_log("msg=\"block map dropped\" path=%s "
+                                  "stale=%lu", FName(),
+                                  (unsigned long) stale.size());
     return 0;
   }
-  
+  size_t blocksize = mBlockMap->BlockSize();
+  std::vector<char> buffer(stale.size() ? blocksize : 0);
+  for (size_t i = 0; i < stale.size(); i++)
   {
-    XrdSysMutexHelper tpcLock(DiamondFS.TpcMapMutex);
-    // Construct the source URL
-    src_url = "root://";
-    src_url += DiamondFS.TpcMap[isRW][TpcKey.c_str()].src;
-    src_url += "/";
-    src_url += DiamondFS.TpcMap[isRW][TpcKey.c_str()].lfn;
-    
-    // Construct the source CGI
-    src_cgi = "tpc.key=";
-    src_cgi += TpcKey.c_str();
-    src_cgi += "&tpc.org=";
-    src_cgi += DiamondFS.TpcMap[isRW][TpcKey.c_str()].org;
-    /*    if (DiamondFS.TpcMap[isRW][TpcKey.c_str()].opaque.length()) {
-      if (DiamondFS.TpcMap[isRW][TpcKey.c_str()].opaque[0] != '&')
-	src_cgi += "&";
-      src_cgi += DiamondFS.TpcMap[isRW][TpcKey.c_str()].opaque.c_str();
-    }
-    */
+    XrdSfsXferSize nread = read(stale[i] * (off_t) blocksize, &buffer[0],
+                                blocksize);
+    if (nread < 0)
+      return EIO;
+    mBlockMap->Set(stale[i], &buffer[0], nread);
   }
-  
-  XrdCl::OpenFlags::Flags flags_xrdcl = XrdCl::OpenFlags::Read;
-  XrdCl::Access::Mode mode_xrdcl = XrdCl::Access::None;
-  std::string src_path = src_url.c_str();
-  src_path += "?";
-  src_path += src_cgi.c_str();
 
-  if (DIAMOND_DEBUG) diamond_log("sync-url=%s sync-cgi=%s", src_url.c_str(), src_cgi.c_str());
+  int fd = BackendFd();
+  int rc = mBlockMap->Store(fd);
+  if (rc)
+    return rc;
 
-  XrdCl::File tpcIO; // the remote IO object
+  // the whole file checksum comes for free
+  uint32_t adler = 0;
+  if (mBlockMap->Adler(adler))
+    DiamondChecksum::Store(fd, adler);
 
-  XrdCl::XRootDStatus status =
-    tpcIO.Open(src_path, flags_xrdcl, mode_xrdcl, 30);
+  if (DIAMOND_DEBUG)diamond_log("msg=\"block map stored\" path=%s "
+                                "block-size=%lu read-back=%lu", FName(),
+                                (unsigned long) mBlockMap->BlockSize(),
+                                (unsigned long) stale.size());
+  return 0;
+}
 
-  if (!status.IsOK())
+//------------------------------------------------------------------------------
+// Deduplicate a new file - the file stays as it is if it can not be
+//------------------------------------------------------------------------------
+
+void
+DiamondFile::Deduplicate ()
+{
+  EPNAME("Deduplicate");
+  std::string hash;
+  off_t size = 0;
+  if (!mDedupHash->Final(hash, size))
   {
-    XrdOucString msg = "sync - TPC open failed for url=";
-    msg += src_url.c_str();
-    msg += " cgi=";
-    msg += src_cgi.c_str();
-    error.setErrInfo(EFAULT, msg.c_str());
-    SetTpcState(kTpcDone);
-    mTpcInfo.Reply(SFS_ERROR, EFAULT, "TPC open failed");
-    return 0;
+    if (DIAMOND_DEBUG)diamond_log("msg=\"not deduplicated - written out of "
+                                  "order\" path=%s", FName());
+    return;
   }
-  
-  if (!TpcValid())
+  if (size < DiamondFS.Dedup.MinSize())
+    return;
+
+  bool linked = false;
+  int rc = DiamondFS.Dedup.Commit(BackendFd(), FName(), hash, size, linked);
+  if (rc)
   {
-    diamond_log("msg=\"tpc session invalidated during sync\"");
-    error.setErrInfo(ECONNABORTED, "sync - TPC session has been closed by disconnect");
-    SetTpcState(kTpcDone);
-    mTpcInfo.Reply(SFS_ERROR, ECONNABORTED, "TPC session closed by disconnect");
-    return 0;
+    diamond_log("msg=\"unable to deduplicate file\" path=%s sha256=%s "
+                "errno=%d", FName(), hash.c_str(), rc);
   }
-  
-  uint32_t rbytes = 0;
-  uint64_t wbytes = 0;
-  off_t offset = 0;
-  auto_ptr < std::vector<char> > buffer(
-					new std::vector<char>(mTpcBlockSize));
-  if (DIAMOND_DEBUG)diamond_log("msg=\"tpc pull\"");
-  
-  do
+  else
   {
-    // Read the remote file in chunks and check after each chunk if the TPC
-    // has been aborted already
-    rbytes = 0;
-    status = tpcIO.Read(offset, mTpcBlockSize, &((*buffer)[0]), rbytes, 30);
+    if (DIAMOND_DEBUG)diamond_log("msg=\"%s\" path=%s sha256=%s bytes=%llu",
+                                  linked ? "deduplicated file" :
+                                  "stored new object", FName(), hash.c_str(),
+                                  (unsigned long long) size);
+  }
+}
 
-    if (DIAMOND_DEBUG)diamond_log( "msg=\"tpc read\" rbytes=%u request=%lu",
-			      rbytes,
-			      mTpcBlockSize);
-    if (!status.IsOK())
-    {
-      SetTpcState(kTpcDone);
-      diamond_log("msg=\"tpc transfer terminated - remote read failed\" rbytes=%lu msg=\"%s\"", rbytes, status.ToString().c_str());
-      error.setErrInfo(EIO, "sync - TPC remote read failed");
-      mTpcInfo.Reply(SFS_ERROR, EIO, "TPC remote read failed");
-      return 0;
-    }
-    
-    if (rbytes > 0)
-    {
-      // Write the buffer out through the local object
-      wbytes = write(offset, &((*buffer)[0]), rbytes);
-      if (DIAMOND_DEBUG)diamond_log("msg=\"tpc write\" wbytes=%llu", (unsigned long long)wbytes);
-      
-      if (rbytes != wbytes)
-      {
-	SetTpcState(kTpcDone);
-	diamond_log("msg=\"tpc transfer terminated - local write failed\"");
-	error.setErrInfo(EIO, "sync - tpc local write failed");
-	mTpcInfo.Reply(SFS_ERROR, EIO, "TPC local write failed");
-	return 0;
-      }
-      
-      offset += rbytes;
-    }
-    // Check validity of the TPC key
-    if (!TpcValid())
+//------------------------------------------------------------------------------
+// Read - client reads wait for their turn in the I/O scheduler
+//------------------------------------------------------------------------------
+
+XrdSfsXferSize
+DiamondFile::read (XrdSfsFileOffset offset,
+                   char* buffer,
+                   XrdSfsXferSize size)
+{
+  DiamondQosSlot slot(DiamondFS.Qos, mQosClass, size);
+  return ReadVerified(offset, buffer, size);
+}
+
+//------------------------------------------------------------------------------
+// Read - a reader with a block map verifies the blocks it reads completely
+//------------------------------------------------------------------------------
+
+XrdSfsXferSize
+DiamondFile::ReadVerified (XrdSfsFileOffset offset,
+                           char* buffer,
+                           XrdSfsXferSize size)
+{
+  EPNAME("read");
+  XrdSfsXferSize nread = ReadLayout(offset, buffer, size);
+  if ((nread > 0) && mTpcSource)
+  {
+    DiamondFS.TpcLoad.Account(nread);
+    mTpcSent += nread;
+  }
+  if ((nread > 0) && mBlockMap && !isRW &&
+      !mBlockMap->Verify(offset, buffer, nread))
+    return DiamondFS.Emsg(epname, error, EIO, "read - block checksum mismatch",
+                          FName());
+  return nread;
+}
+
+//------------------------------------------------------------------------------
+// Read through the shared block cache
+//------------------------------------------------------------------------------
+
+XrdSfsXferSize
+DiamondFile::ReadLayout (XrdSfsFileOffset offset,
+                         char* buffer,
+                         XrdSfsXferSize size)
+{
+  EPNAME("read");
+  if (mStriped)
+  {
+    XrdSfsXferSize nread = mStriped->Read(offset, buffer, size);
+    if (nread < 0)
+      return DiamondFS.Emsg(epname, error, errno, "read striped file",
+                            FName());
+    return nread;
+  }
+
+  if (mCompressed)
+  {
+    XrdSfsXferSize nread = mCompressed->Read(offset, buffer, size);
+    if (nread < 0)
+      return DiamondFS.Emsg(epname, error, errno, "read compressed file",
+                            FName());
+    return nread;
+  }
+
+  if (!mBlockCached)
+  {
+    if (mSeqFd >= 0)
+      SequentialAdvise(offset, size);
+    return XrdOfsFile::read(offset, buffer, size);
+  }
+
+  size_t blocksize = DiamondFS.BlockCache.BlockSize();
+  XrdSfsXferSize done = 0;
+
+  while (done < size)
+  {
+    XrdSfsFileOffset pos = offset + done;
+    uint64_t index = pos / blocksize;
+    DiamondBlockCache::block_ptr_t block;
+    unsigned long long generation = 0;
+
+    if (!DiamondFS.BlockCache.Get(mCacheKey, mCacheSize, mCacheMtime, index,
+                                  block, generation))
+    {
+      block.reset(new std::vector<char>(blocksize));
+      XrdSfsXferSize nread = XrdOfsFile::read(index * blocksize, &(*block)[0],
+                                              blocksize);
+      if (nread < 0)
+      {
+        DiamondFS.BlockCache.Fill(mCacheKey, index, generation,
+                                  DiamondBlockCache::block_ptr_t());
+        return nread;
+      }
+      block->resize(nread);
+      DiamondFS.BlockCache.Fill(mCacheKey, index, generation, block);
+    }
+
+    size_t blockoffset = pos - (index * blocksize);
+    if (blockoffset >= block->size())
+      break;
+
+    size_t len = block->size() - blockoffset;
+    if (len > (size_t) (size - done))
+      len = size - done;
+
+    memcpy(buffer + done, &(*block)[blockoffset], len);
+    done += len;
+
+    // a short block is the end of the file
+    if (block->size() < blocksize)
+      break;
+  }
+  return done;
+}
+
+//------------------------------------------------------------------------------
+// Return the backend descriptor - also when fctl refuses it to clients
+//------------------------------------------------------------------------------
+
+int
+DiamondFile::BackendFd ()
+{
+  XrdOucErrInfo fd_error;
+  if (XrdOfsFile::fctl(SFS_FCTL_GETFD, 0, fd_error))
+    return -1;
+  return fd_error.getErrInfo();
+}
+
+//------------------------------------------------------------------------------
+// Enter sequential mode for a TPC source or direct read - the descriptor is
+// only used for advice, reads and sendfile still go through XrdOfsFile
+//------------------------------------------------------------------------------
+
+void
+DiamondFile::SequentialOpen (bool drop)
+{
+  EPNAME("SequentialOpen");
+  if (!DiamondFS.TpcReadAhead && !drop)
+    return;
+
+  // the storage backend might have no local descriptor
+  if ((mSeqFd = BackendFd()) < 0)
+    return;
+
+  mSeqAhead = 0;
+  mSeqBehind = 0;
+  mSeqDrop = drop;
+  posix_fadvise(mSeqFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  SequentialAdvise(0, 0);
+  if (DIAMOND_DEBUG)diamond_log("msg=\"sequential mode\" fd=%d "
+                                "block-size=%lu read-ahead=%lu drop-behind=%d",
+                                mSeqFd, (unsigned long) mTpcBlockSize,
+                                (unsigned long) DiamondFS.TpcReadAhead,
+                                (int) drop);
+}
+
+//------------------------------------------------------------------------------
+// Keep TpcReadAhead blocks announced ahead of the peer and drop what it has
+// already read - the peer reads in blocks of mTpcBlockSize or larger
+//------------------------------------------------------------------------------
+
+void
+DiamondFile::SequentialAdvise (XrdSfsFileOffset offset, XrdSfsXferSize size)
+{
+  off_t block = mTpcBlockSize;
+  if ((off_t) size > block)
+    block = size;
+
+  off_t ahead = offset + size + (off_t) DiamondFS.TpcReadAhead * block;
+  off_t start = (mSeqAhead > offset) ? mSeqAhead : offset;
+
+  // announce in steps of a block to avoid a syscall per read
+  if (DiamondFS.TpcReadAhead && ((ahead - start) >= block))
+  {
+    posix_fadvise(mSeqFd, start, ahead - start, POSIX_FADV_WILLNEED);
+    mSeqAhead = ahead;
+  }
+
+  // keep the block before offset in case the peer retries a read
+  if (mSeqDrop && (offset - block > mSeqBehind))
+  {
+    posix_fadvise(mSeqFd, mSeqBehind, offset - block - mSeqBehind,
+                  POSIX_FADV_DONTNEED);
+    mSeqBehind = offset - block;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Drop the pages of a TPC source - with sendfile the reads bypass
+// SequentialAdvise, so the whole file is dropped here
+//------------------------------------------------------------------------------
+
+void
+DiamondFile::SequentialClose ()
+{
+  if (mSeqFd < 0)
+    return;
+
+  if (mSeqDrop)
+    posix_fadvise(mSeqFd, 0, 0, POSIX_FADV_DONTNEED);
+  mSeqFd = -1;
+}
+
+//------------------------------------------------------------------------------
+// Preallocate the backend file
+//------------------------------------------------------------------------------
+
+int
+DiamondFile::Preallocate (off_t size)
+{
+  if (mCompressed || (size <= 0))
+    return 0;
+  if (mStriped)
+    return mStriped->Reserve(size);
+
+  int fd = BackendFd();
+  if (fd < 0)
+    return 0;
+  if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size))
+  {
+    if ((errno == EOPNOTSUPP) || (errno == ENOSYS))
+      return 0;
+    return errno;
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Open a second descriptor of the backend file with O_DIRECT - the backend
+// descriptor keeps serving reads and unaligned writes
+//------------------------------------------------------------------------------
+
+void
+DiamondFile::DirectOpen ()
+{
+  EPNAME("DirectOpen");
+  if ((mDirectFd >= 0) || mCompressed || mStriped)
+    return;
+
+  int fd = BackendFd();
+  if (fd < 0)
+    return;
+
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  mDirectFd = ::open(path, O_WRONLY | O_DIRECT | O_CLOEXEC);
+  if (mDirectFd < 0)
+  {
+    diamond_log("msg=\"direct i/o unavailable - writing buffered\" "
+                "path=%s errno=%d", FName(), errno);
+    return;
+  }
+  if (DIAMOND_DEBUG)diamond_log("msg=\"direct i/o\" path=%s fd=%d", FName(),
+                                mDirectFd);
+}
+
+//------------------------------------------------------------------------------
+// Write bypassing the page cache
+//------------------------------------------------------------------------------
+
+XrdSfsXferSize
+DiamondFile::DirectWrite (XrdSfsFileOffset offset, const char* buffer,
+                          XrdSfsXferSize size)
+{
+  EPNAME("DirectWrite");
+  if (!(offset % DIAMOND_IO_ALIGNMENT) && !(size % DIAMOND_IO_ALIGNMENT) &&
+      !((uintptr_t) buffer % DIAMOND_IO_ALIGNMENT))
+  {
+    XrdSfsXferSize done = 0;
+    while (done < size)
+    {
+      ssize_t n = pwrite(mDirectFd, buffer + done, size - done, offset + done);
+      if (n < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        return DiamondFS.Emsg(epname, error, errno, "write direct", FName());
+      }
+      done += n;
+    }
+    return done;
+  }
+
+  // an unaligned head or tail goes through the page cache and leaves it again
+  XrdSfsXferSize nwrite = XrdOfsFile::write(offset, buffer, size);
+  int fd = BackendFd();
+  if ((nwrite > 0) && (fd >= 0))
+  {
+    sync_file_range(fd, offset, nwrite, SYNC_FILE_RANGE_WAIT_BEFORE |
+                    SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd, offset, nwrite, POSIX_FADV_DONTNEED);
+  }
+  return nwrite;
+}
+
+//------------------------------------------------------------------------------
+// Asynchronous reads are served synchronously through the read method above
+//------------------------------------------------------------------------------
+
+XrdSfsXferSize
+DiamondFile::read (XrdSfsAio* aioparm)
+{
+  aioparm->Result = read((XrdSfsFileOffset) aioparm->sfsAio.aio_offset,
+                         (char*) aioparm->sfsAio.aio_buf,
+                         (XrdSfsXferSize) aioparm->sfsAio.aio_nbytes);
+  aioparm->doneRead();
+  return SFS_OK;
+}
+
+//------------------------------------------------------------------------------
+// File control - no file descriptor is handed out for sendfile when reads
+// have to go through the read method or the I/O scheduler. A TPC source only
+// needs them for a rate limit, otherwise its egress is accounted at close.
+//------------------------------------------------------------------------------
+
+int
+DiamondFile::fctl (const int cmd, const char* args, XrdOucErrInfo& out_error)
+{
+  if ((cmd == SFS_FCTL_GETFD) && (mBlockCached || mCompressed || mStriped ||
+                                  (mBlockMap && !isRW) ||
+                                  (mTpcSource &&
+                                   DiamondFS.TpcLoad.RateLimited()) ||
+                                  (mQosClass >= 0)))
+  {
+    out_error.setErrInfo(ENOTSUP, "fctl - no file descriptor for cached reads");
+    return SFS_ERROR;
+  }
+  int rc = XrdOfsFile::fctl(cmd, args, out_error);
+  if ((cmd == SFS_FCTL_GETFD) && !rc && mTpcSource)
+    mTpcSendfile = true;
+  return rc;
+}
+
+//------------------------------------------------------------------------------
+// File query - a delta TPC destination asks an open source for its block sums,
+// a deduplicating one for its content hash and one sharing the backend for
+// its path
+//------------------------------------------------------------------------------
+
+int
+DiamondFile::fctl (const int cmd, int alen, const char* args,
+                   const XrdSecEntity* client)
+{
+  EPNAME("fctl");
+  if ((cmd != SFS_FCTL_SPEC1) || !args || (alen <= 0))
+    return XrdOfsFile::fctl(cmd, alen, args, client);
+
+  std::string cgi(args, alen);
+  while (cgi.length() && !cgi[cgi.length() - 1])
+    cgi.erase(cgi.length() - 1);
+  XrdOucEnv env(cgi.c_str());
+  const char* pcmd = env.Get("diamond.pcmd");
+  if (pcmd && !strcmp(pcmd, "tpc.path"))
+  {
+    // a destination sharing the backend copies the path of the TPC key
+    if (tpcFlag != kTpcSrcRead)
+      return DiamondFS.Emsg(epname, error, EPERM, "fctl - not a TPC source",
+                            FName());
+    return DiamondFS.FSctlReply(error, FName());
+  }
+  if (pcmd && !strcmp(pcmd, "dedup.hash"))
+  {
+    // a TPC destination asks for the content hash to skip the pull
+    std::string hash;
+    if (!DiamondDedup::Load(BackendFd(), hash))
+      return DiamondFS.Emsg(epname, error, ENOENT, "fctl - no content hash",
+                            FName());
+    return DiamondFS.FSctlReply(error, hash);
+  }
+  if (!pcmd || strcmp(pcmd, "blocksums"))
+    return XrdOfsFile::fctl(cmd, alen, args, client);
+
+  size_t blocksize = env.Get("diamond.blocksize") ?
+    DiamondFS.parseUnit(env.Get("diamond.blocksize")) : 0;
+  if (!blocksize)
+    blocksize = mTpcBlockSize;
+
+  std::string reply;
+  int rc = BlockSums(blocksize, reply);
+  if (rc)
+    return DiamondFS.Emsg(epname, error, rc, "fctl - compute block sums",
+                          FName());
+  return DiamondFS.FSctlReply(error, reply);
+}
+
+//------------------------------------------------------------------------------
+// Vector read - nearby chunks are merged into extents which do not cross a
+// stripe boundary and the extents are read in parallel
+//------------------------------------------------------------------------------
+
+XrdSfsXferSize
+DiamondFile::readv (XrdOucIOVec* readV, int readCount)
+{
+  EPNAME("readv");
+  if (readCount <= 0)
+    return 0;
+
+  std::vector<DiamondReadVExtent> extents;
+  size_t staging = DiamondReadV::Coalesce(readV, readCount,
+                                          DiamondFS.ReadVGap,
+                                          mStripeSize ? mStripeSize :
+                                          DiamondFS.ReadVStripe,
+                                          extents);
+
+  std::vector<char> buffer(staging);
+  size_t pos = 0;
+  for (size_t i = 0; i < extents.size(); i++)
+  {
+    if (!extents[i].buffer)
+    {
+      extents[i].buffer = &buffer[pos];
+      pos += extents[i].length;
+    }
+  }
+
+  std::vector<DiamondReadVJob> jobs;
+  jobs.reserve(extents.size());
+  uint64_t length = 0;
+  for (size_t i = 0; i < extents.size(); i++)
+  {
+    jobs.push_back(DiamondReadVJob(this, &extents[i]));
+    length += extents[i].length;
+  }
+
+  // the vector read waits once for the I/O scheduler on this thread - its jobs
+  // never wait for a slot on a worker thread
+  DiamondQosSlot slot(DiamondFS.Qos, mQosClass, length);
+
+  // the first extent is read by this thread while the others are in flight -
+  // a striped file spreads each read over the worker threads itself and must
+  // not wait for them from a worker thread
+  DiamondJobGroup group;
+  for (size_t i = 1; i < jobs.size(); i++)
+  {
+    if (mStriped)
+      jobs[i].DoIt();
+    else
+      DiamondFS.WorkerPool.Schedule(&jobs[i], &group);
+  }
+  jobs[0].DoIt();
+  group.Wait();
+
+  XrdSfsXferSize total = 0;
+  for (size_t i = 0; i < jobs.size(); i++)
+  {
+    if (jobs[i].mResult != (XrdSfsXferSize) extents[i].length)
+    {
+      if (jobs[i].mResult < 0)
+        return SFS_ERROR;
+      return DiamondFS.Emsg(epname, error, ESPIPE, "readv - read past eof",
+                            FName());
+    }
+    DiamondReadV::Scatter(extents[i], readV);
+  }
+
+  for (int i = 0; i < readCount; i++)
+    total += readV[i].size;
+
+  if (DIAMOND_DEBUG)diamond_log("msg=\"readv\" chunks=%d extents=%lu "
+                                "staging=%lu bytes=%d", readCount,
+                                (unsigned long) extents.size(),
+                                (unsigned long) staging, total);
+  return total;
+}
+
+//------------------------------------------------------------------------------
+// Write - the written data updates the block map and the content hash, client
+// writes wait for their turn in the I/O scheduler
+//------------------------------------------------------------------------------
+
+XrdSfsXferSize
+DiamondFile::write (XrdSfsFileOffset offset,
+                    const char* buffer,
+                    XrdSfsXferSize size)
+{
+  DiamondQosSlot slot(DiamondFS.Qos, mQosClass, size);
+  XrdSfsXferSize nwrite = WriteLayout(offset, buffer, size);
+  if ((nwrite > 0) && mBlockMap)
+    mBlockMap->Update(offset, buffer, nwrite);
+  // a TPC pull hashes the stream itself, its writes complete out of order
+  if ((nwrite > 0) && mDedupHash && (tpcFlag != kTpcDstSetup))
+    mDedupHash->Update(offset, buffer, nwrite);
+  return nwrite;
+}
+
+//------------------------------------------------------------------------------
+// Write - compressed files are appended through their block layout, striped
+// files are written into their stripe files
+//------------------------------------------------------------------------------
+
+XrdSfsXferSize
+DiamondFile::WriteLayout (XrdSfsFileOffset offset,
+                          const char* buffer,
+                          XrdSfsXferSize size)
+{
+  EPNAME("write");
+  if (mStriped)
+  {
+    XrdSfsXferSize nwrite = mStriped->Write(offset, buffer, size);
+    if (nwrite < 0)
+      return DiamondFS.Emsg(epname, error, errno, "write striped file",
+                            FName());
+    return nwrite;
+  }
+
+  if (mDirectFd >= 0)
+    return DirectWrite(offset, buffer, size);
+
+  if (!mCompressed)
+    return XrdOfsFile::write(offset, buffer, size);
+
+  XrdSfsXferSize nwrite = mCompressed->Write(offset, buffer, size);
+  if (nwrite < 0)
+  {
+    return DiamondFS.Emsg(epname, error, errno, (errno == ESPIPE) ?
+                          "write - compressed files are written sequentially" :
+                          "write compressed file", FName());
+  }
+  return nwrite;
+}
+
+//------------------------------------------------------------------------------
+// Asynchronous writes are served synchronously through the write method above
+//------------------------------------------------------------------------------
+
+int
+DiamondFile::write (XrdSfsAio* aioparm)
+{
+  aioparm->Result = write((XrdSfsFileOffset) aioparm->sfsAio.aio_offset,
+                          (const char*) aioparm->sfsAio.aio_buf,
+                          (XrdSfsXferSize) aioparm->sfsAio.aio_nbytes);
+  aioparm->doneWrite();
+  return SFS_OK;
+}
+
+//------------------------------------------------------------------------------
+// Stat an open file - a compressed or striped file reports its logical size
+//------------------------------------------------------------------------------
+
+int
+DiamondFile::stat (struct stat* buf)
+{
+  int rc = XrdOfsFile::stat(buf);
+  if (!rc && mCompressed)
+    buf->st_size = mCompressed->Size();
+  if (!rc && mStriped)
+    buf->st_size = mStriped->Size();
+  return rc;
+}
+
+//------------------------------------------------------------------------------
+// Truncate an open file
+//------------------------------------------------------------------------------
+
+int
+DiamondFile::truncate (XrdSfsFileOffset fsize)
+{
+  EPNAME("truncate");
+  // the single stripe of a staged file is truncated with its placeholder
+  int src = 0;
+  if (mCompressed || (mStriped && (!mStagedId.length() ||
+                                   (src = mStriped->Truncate(fsize)))))
+    return DiamondFS.Emsg(epname, error, src ? src : ENOTSUP,
+                          mCompressed ? "truncate compressed file" :
+                          "truncate striped file", FName());
+
+  int rc = XrdOfsFile::truncate(fsize);
+  if (!rc && mBlockMap)
+    mBlockMap->Truncate(fsize);
+  if (mDedupHash)
+    mDedupHash->Truncate(fsize);
+  DiamondFS.Invalidate(FName());
+  return rc;
+}
+
+//------------------------------------------------------------------------------
+// Verify if a TPC key is still valid
+//------------------------------------------------------------------------------
+
+bool
+DiamondFile::TpcValid ()
+{
+  // This call requires to have a lock like
+  // 'XrdSysMutexHelper tpcLock(DiamondFS.TpcMapMutex)'
+  if (TpcKey.length())
+  {
+    if (DiamondFS.TpcMap[isRW].count(TpcKey.c_str()))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+int
+DiamondFile::sync ()
+{
+  EPNAME("sync");
+  static const int cbWaitTime = 1800;
+
+  if (tpcFlag == kTpcDstSetup)
+  {
+    int tpc_state = GetTpcState();
+
+    if (tpc_state == kTpcIdle)
+    {
+      if (DIAMOND_DEBUG)diamond_log( "msg=\"tpc enabled - 1st sync\"");
+      SetTpcState(kTpcEnabled);
+      return SFS_OK;
+    }
+    else if (tpc_state == kTpcRun)
+    {
+      if (DIAMOND_DEBUG)diamond_log( "msg=\"tpc already running - >2nd sync\"");
+      error.setErrCode(cbWaitTime);
+      return SFS_STARTED;
+    }
+    else if (tpc_state == kTpcDone)
+    {
+      if (DIAMOND_DEBUG)diamond_log( "msg=\"tpc already finisehd - >2nd sync\"");
+      return SFS_OK;
+    }
+    else if (tpc_state == kTpcEnabled)
+    {
+      SetTpcState(kTpcRun);
+  
+      if (mTpcInfo.SetCB(&error))
+      {
+	diamond_log("msg=\"failed setting TPC callback\"");
+	return SFS_ERROR;
+      }
+      else
+      {
+	error.setErrCode(cbWaitTime);
+	mTpcThreadStatus = XrdSysThread::Run(&mTpcThread, DiamondFile::StartDoTpcTransfer,
+					     static_cast<void*>(this), XRDSYSTHREAD_HOLD,
+					     "TPC Transfer Thread");
+	return SFS_STARTED;
+      }
+    }
+    else 
+    {
+      diamond_log("msg=\"unknown tpc state\"");
+      error.setErrCode(EINVAL);
+      return SFS_ERROR;
+    }
+  }
+  else
+  {
+    //...........................................................................
+    // Standard file sync
+    //...........................................................................
+    if (mStriped)
+    {
+      int src = mStriped->Sync();
+      if (src)
+        return DiamondFS.Emsg(epname, error, src, "sync striped file", FName());
+    }
+    return XrdOfsFile::sync();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Static method used to start an asynchronous thread which is doing the TPC
+// transfer
+//------------------------------------------------------------------------------
+void*
+DiamondFile::StartDoTpcTransfer (void* arg)
+{
+  return reinterpret_cast<DiamondFile*>(arg)->DoTpcTransfer();
+}
+
+//------------------------------------------------------------------------------
+//
+// Run method for the thread doing the TPC transfer
+//------------------------------------------------------------------------------
+void*
+DiamondFile::DoTpcTransfer()
+{
+  EPNAME("tpctransfer");
+  diamond_log("msg=\"tpc now running - 2nd sync\"");
+
+  std::string msg;
+  off_t bytes = 0;
+  std::string path = FName();
+  int rc = TpcPull(msg, bytes);
+
+  if (!rc && close())
+  {
+    rc = EIO;
+    msg = "TPC local close failed";
+  }
+
+  // a failed delta leaves a mix of the previous and the new version behind,
+  // which must not pass for a replica
+  if (rc && mTpcDelta)
+  {
+    diamond_log("msg=\"tpc delta failed - queue removal\" path=%s",
+                path.c_str());
+    DiamondFS.Deletions.Add(path);
+  }
+
+  SetTpcState(kTpcDone);
+  if (rc)
+  {
+    std::string emsg = "sync - ";
+    emsg += msg;
+    error.setErrInfo(rc, emsg.c_str());
+    mTpcInfo.Reply(SFS_ERROR, rc, msg.c_str());
+  }
+  else
+  {
+    mTpcInfo.Reply(SFS_OK, 0, "");
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Pull the source registered for TpcKey into this file
+//------------------------------------------------------------------------------
+int
+DiamondFile::TpcPull (std::string& msg, off_t& bytes)
+{
+  EPNAME("tpcpull");
+  std::string src_url = "";
+  std::string src_cgi = "";
+  std::string src_host = "";
+  std::string src_lfn = "";
+  std::vector<std::string> replica_paths;
+  bool http = false;
+  bytes = 0;
+  
+  // The sync initiates the third party copy
+  if (!TpcValid())
+  {
+    diamond_log("msg=\"tpc session invalidated during sync\"");
+    msg = "TPC session closed by disconnect";
+    return ECONNABORTED;
+  }
+  
+  {
+    XrdSysMutexHelper tpcLock(DiamondFS.TpcMapMutex);
+    // Construct the source URL
+    src_host = DiamondFS.TpcMap[isRW][TpcKey.c_str()].src;
+    src_lfn = DiamondFS.TpcMap[isRW][TpcKey.c_str()].lfn;
+    http = TpcHttpSource(src_host);
+    const std::string& org = DiamondFS.TpcMap[isRW][TpcKey.c_str()].org;
+    XrdOucEnv dstEnv(DiamondFS.TpcMap[isRW][TpcKey.c_str()].opaque.c_str());
+    std::string scgi = dstEnv.Get("tpc.scgi") ?
+      DiamondTpcBulk::Unescape(dstEnv.Get("tpc.scgi")) : "";
+    TpcSourceUrl(src_host, src_lfn, org, scgi, src_url, src_cgi);
+
+    // replicas of the source are given as a list of further sources of the
+    // same path
+    std::vector<std::vector<std::string> > replicas;
+    if (dstEnv.Get("diamond.tpc.sources") &&
+        !DiamondTpcBulk::Parse(dstEnv.Get("diamond.tpc.sources"), 1, replicas))
+    {
+      for (size_t i = 0; i < replicas.size(); i++)
+      {
+        if (TpcHttpSource(replicas[i][0]) &&
+            !DiamondFS.TpcHttpAllowed(replicas[i][0]))
+        {
+          diamond_log("msg=\"tpc http replica not allowed\" url=%s",
+                      replicas[i][0].substr(0, replicas[i][0].find('?')).c_str());
+          continue;
+        }
+        std::string url;
+        std::string cgi;
+        TpcSourceUrl(replicas[i][0], src_lfn, org, scgi, url, cgi);
+        if (cgi.length())
+          url += "?" + cgi;
+        replica_paths.push_back(url);
+      }
+    }
+    /*    if (DiamondFS.TpcMap[isRW][TpcKey.c_str()].opaque.length()) {
+      if (DiamondFS.TpcMap[isRW][TpcKey.c_str()].opaque[0] != '&')
+	src_cgi += "&";
+      src_cgi += DiamondFS.TpcMap[isRW][TpcKey.c_str()].opaque.c_str();
+    }
+    */
+  }
+  
+  XrdCl::OpenFlags::Flags flags_xrdcl = XrdCl::OpenFlags::Read;
+  XrdCl::Access::Mode mode_xrdcl = XrdCl::Access::None;
+  std::string src_path = src_url.c_str();
+  if (src_cgi.length())
+  {
+    src_path += "?";
+    src_path += src_cgi.c_str();
+  }
+
+  if (DIAMOND_DEBUG) diamond_log("sync-url=%s sync-cgi=%s", src_url.c_str(), src_cgi.c_str());
+
+  XrdCl::File tpcIO; // the remote IO object
+
+  XrdCl::XRootDStatus status =
+    tpcIO.Open(src_path, flags_xrdcl, mode_xrdcl, 30);
+
+  if (!status.IsOK())
+  {
+    diamond_log("msg=\"tpc open failed\" url=%s cgi=%s", src_url.c_str(),
+                src_cgi.c_str());
+    msg = "TPC open failed";
+    return EFAULT;
+  }
+  
+  // the source is asked for its checksum on a thread of its own while the data
+  // is transferred - the query can take as long as the source needs to read
+  // its file, an HTTP(S) source needs the token of the transfer for it
+  DiamondRemoteChecksumJob srcChecksum(src_host, src_lfn,
+                                       http ? src_cgi : "");
+  if (DiamondFS.TpcVerify || mTpcDelta)
+    srcChecksum.Start();
+
+  if (!TpcValid())
+  {
+    diamond_log("msg=\"tpc session invalidated during sync\"");
+    msg = "TPC session closed by disconnect";
+    return ECONNABORTED;
+  }
+  
+  // the source size splits the transfer into parallel reads - a missing
+  // source size reads one block at a time and skips the preallocation
+  off_t src_size = -1;
+  XrdCl::StatInfo* srcStat = 0;
+  status = tpcIO.Stat(false, srcStat, 30);
+  if (status.IsOK() && srcStat)
+    src_size = srcStat->GetSize();
+  delete srcStat;
+
+  // a destination storing the content announced by a trusted source references
+  // it instead of pulling the data
+  int rc = ENOTSUP;
+  uint32_t adler = adler32(0L, Z_NULL, 0);
+  if (mDedupHash && !http && (src_size >= 0) &&
+      DiamondFS.DedupTrusted(src_host))
+    rc = TpcDedup(tpcIO, src_size, adler, msg, bytes);
+
+  // the space of the copy is reserved before any byte is moved
+  if (DiamondFS.TpcPreallocate && (src_size >= 0) && (rc == ENOTSUP))
+  {
+    int prc = Preallocate(src_size);
+    if (prc)
+    {
+      diamond_log("msg=\"tpc transfer terminated - preallocation failed\" "
+                  "size=%llu errno=%d", (unsigned long long) src_size, prc);
+      msg = (prc == ENOSPC) ? "TPC destination out of space" :
+        "TPC destination preallocation failed";
+      return prc;
+    }
+    if (DIAMOND_DEBUG)diamond_log("msg=\"tpc preallocated\" size=%llu",
+                                  (unsigned long long) src_size);
+  }
+
+  // a source in the local backend is copied without moving the data through
+  // the network - the remote open above validated the key
+  if ((rc == ENOTSUP) && mTpcDelta)
+    rc = TpcDelta(tpcIO, adler, msg, bytes);
+  if ((rc == ENOTSUP) && !http)
+    rc = TpcLocalCopy(tpcIO, src_host, adler, msg, bytes);
+  bool dropped = false;
+  if (rc == ENOTSUP)
+  {
+    // replicas of the source are read together with it
+    std::vector<XrdCl::File*> sources(1, &tpcIO);
+    std::vector<std::unique_ptr<XrdCl::File> > replicas;
+    if ((src_size >= 0) && replica_paths.size())
+      TpcReplicas(replica_paths, src_size, replicas);
+    for (size_t i = 0; i < replicas.size(); i++)
+      sources.push_back(replicas[i].get());
+    rc = TpcStream(sources, src_size, adler, msg, bytes, dropped);
+    for (size_t i = 0; i < replicas.size(); i++)
+      replicas[i]->Close(DIAMOND_TPC_READ_TIMEOUT);
+    // a delta destination was not truncated at open
+    struct stat buf;
+    if (!rc && mTpcDelta && !XrdOfsFile::stat(&buf) &&
+        (buf.st_size > bytes) && truncate(bytes))
+    {
+      msg = "TPC unable to truncate destination";
+      rc = EIO;
+    }
+  }
+  if (rc)
+    return rc;
+
+  // Close the remote file
+  if (DIAMOND_DEBUG)diamond_log("msg=\"close remote file and exit\"");
+
+  // a source dropped during the transfer can not be closed cleanly
+  status = tpcIO.Close(300);
+  if (!status.IsOK() && !dropped)
+  {
+    msg = "TPC remote close failed - checksum error?";
+    return EIO;
+  }
+
+  // a copy from a source without checksum is accepted unverified, a patched
+  // file is only accepted with a verified checksum
+  if (DiamondFS.TpcVerify || mTpcDelta)
+  {
+    srcChecksum.Wait();
+    if (!srcChecksum.mValid && mTpcDelta)
+    {
+      diamond_log("msg=\"tpc transfer terminated - delta not verified\" "
+                  "msg=\"%s\"", srcChecksum.mMessage.c_str());
+      msg = "TPC source checksum unavailable";
+      return EIO;
+    }
+    else if (!srcChecksum.mValid)
+    {
+      diamond_log("msg=\"tpc copy not verified - source checksum "
+                  "unavailable\" msg=\"%s\"", srcChecksum.mMessage.c_str());
+    }
+    else if (srcChecksum.mAdler != adler)
+    {
+      diamond_log("msg=\"tpc transfer terminated - checksum mismatch\" "
+                  "src-adler32=%08x dst-adler32=%08x", srcChecksum.mAdler,
+                  adler);
+      msg = "TPC checksum mismatch";
+      return EIO;
+    }
+  }
+
+  // the layout is completed before the checksum is stored
+  rc = FinishLayout();
+  if (rc)
+  {
+    msg = "TPC unable to finish file layout";
+    return rc;
+  }
+
+  // the checksum of the written stream saves a re-read by a checksum query -
+  // a referenced object has its own
+  rc = mDeduped ? 0 : DiamondChecksum::Store(BackendFd(), adler);
+  if (rc)
+  {
+    diamond_log("msg=\"failed to store checksum\" errno=%d", rc);
+  }
+  else
+  {
+    if (DIAMOND_DEBUG)diamond_log("msg=\"tpc checksum stored\" "
+                                  "adler32=%08x verified=%d", adler,
+                                  srcChecksum.mValid ? 1 : 0);
+  }
+  return 0;
+}
+
+
+//------------------------------------------------------------------------------
+// Stream the remote source into this file
+//------------------------------------------------------------------------------
+int
+DiamondFile::TpcStream (const std::vector<XrdCl::File*>& sources, off_t size,
+                        uint32_t& adler, std::string& msg, off_t& bytes,
+                        bool& dropped)
+{
+  EPNAME("tpcstream");
+  off_t offset = 0;
+  // the transfer runs on the node of the interface or of the backend device,
+  // so its buffers are allocated there
+  int node = DiamondFS.Numa.Steer(BackendFd());
+  DiamondNumaBinding numaBinding(&DiamondFS.Numa, node, &bytes);
+  // local writes run on the I/O threads while the next blocks are received -
+  // compressed files are written strictly in sequence
+  DiamondIOStream writes(&DiamondFS.IOEngine, this, mTpcBlockSize,
+                         mCompressed != 0, node);
+  if ((mDirectMode == 1) || ((mDirectMode < 0) && DiamondFS.DirectTpc))
+    DirectOpen();
+  // the reads in flight are declared last, so they complete before the
+  // writes and the binding go away on an early return
+  DiamondRangeReader reads(sources, &DiamondFS.IOEngine, mTpcBlockSize,
+                           DiamondFS.TpcStreams, size, node);
+  if (DIAMOND_DEBUG)diamond_log("msg=\"tpc pull\" size=%lld streams=%lu "
+                                "sources=%lu", (long long) size,
+                                (unsigned long) DiamondFS.TpcStreams,
+                                (unsigned long) reads.Sources());
+
+  int64_t rbytes = 0;
+  do
+  {
+    // the remote file is read in blocks and the TPC key is checked after each
+    // block in case the TPC has been aborted
+    char* buffer = 0;
+    std::string emsg;
+    rbytes = reads.Next(buffer, emsg);
+
+    if (DIAMOND_DEBUG)diamond_log("msg=\"tpc read\" rbytes=%lld request=%lu",
+                                  (long long) rbytes, mTpcBlockSize);
+    if (rbytes < 0)
+    {
+      diamond_log("msg=\"tpc transfer terminated - remote read failed\" "
+                  "offset=%llu msg=\"%s\"", (unsigned long long) offset,
+                  emsg.c_str());
+      msg = "TPC remote read failed";
+      return EIO;
+    }
+
+    if (rbytes > 0)
+    {
+      // the checksum is taken before the buffer is handed to the writer
+      adler = adler32(adler, (const Bytef*) buffer, rbytes);
+      if (mDedupHash)
+        mDedupHash->Update(offset, buffer, rbytes);
+
+      // Write the buffer out through the local object
+      if (!writes.Write(offset, rbytes, buffer))
+      {
+        diamond_log("msg=\"tpc transfer terminated - local write failed\"");
+        msg = "TPC local write failed";
+        return EIO;
+      }
+      if (DIAMOND_DEBUG)diamond_log("msg=\"tpc write\" offset=%llu bytes=%lld",
+                                    (unsigned long long) offset,
+                                    (long long) rbytes);
+      offset += rbytes;
+      bytes = offset;
+    }
+    // Check validity of the TPC key
+    if (!TpcValid())
     {
       // terminate
-      SetTpcState(kTpcDone);
       diamond_log("msg=\"tpc transfer invalidated during sync\"");
-      error.setErrInfo(ECONNABORTED, "sync - TPC session has been closed by disconnect");
-      mTpcInfo.Reply(SFS_ERROR, ECONNABORTED, "TPC session closed by diconnect");
-      return 0;
+      msg = "TPC session closed by disconnect";
+      return ECONNABORTED;
     }
   }
   while (rbytes > 0);
-  
-  // Close the remote file
-  if (DIAMOND_DEBUG)diamond_log("msg=\"close remote file and exit\"");
 
-  status = tpcIO.Close(300);
-  if (status.IsOK()) 
+  if (!writes.Drain())
   {
-    if (close()) 
-      mTpcInfo.Reply(SFS_ERROR, EIO, "TPC local close failed");
-    else 
-      mTpcInfo.Reply(SFS_OK, 0, "");    
-    return 0;
+    diamond_log("msg=\"tpc transfer terminated - local write failed\"");
+    msg = "TPC local write failed";
+    return EIO;
+  }
+
+  // the transfer went on without the sources which failed
+  for (size_t i = 0; i < reads.Sources(); i++)
+  {
+    const DiamondRangeReader::SourceStats& stats = reads.GetStats(i);
+    if (stats.dropped)
+    {
+      diamond_log("msg=\"tpc source dropped\" source=%lu msg=\"%s\"",
+                  (unsigned long) i, stats.message.c_str());
+    }
+    if ((reads.Sources() > 1) && DIAMOND_DEBUG)
+    {
+      diamond_log("msg=\"tpc source\" source=%lu bytes=%llu requests=%llu",
+                  (unsigned long) i, stats.bytes, stats.requests);
+    }
+  }
+  if (reads.Hedged())
+  {
+    diamond_log("msg=\"tpc hedged reads\" count=%llu", reads.Hedged());
+  }
+  dropped = reads.GetStats(0).dropped;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Compose the URL and CGI of a TPC source
+//------------------------------------------------------------------------------
+void
+DiamondFile::TpcSourceUrl (const std::string& src, const std::string& lfn,
+                           const std::string& org, const std::string& scgi,
+                           std::string& url, std::string& cgi)
+{
+  if (TpcHttpSource(src))
+  {
+    // an HTTP(S) endpoint has no TPC session, the source CGI given to the
+    // destination (e.g. a token) is passed on instead
+    url = src;
+    while (url.length() && (url[url.length() - 1] == '/'))
+      url.erase(url.length() - 1);
+    if (lfn.empty() || (lfn[0] != '/'))
+      url += "/";
+    url += lfn;
+    cgi = scgi;
   }
   else
   {
-    mTpcInfo.Reply(SFS_ERROR, EIO, "TPC remote close failed - checksum error?");
-    return 0;
+    url = "root://";
+    url += src;
+    url += "/";
+    url += lfn;
+
+    // Construct the source CGI
+    cgi = "tpc.key=";
+    cgi += TpcKey.c_str();
+    cgi += "&tpc.org=";
+    cgi += org;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Open the replicas of a TPC source in parallel
+//------------------------------------------------------------------------------
+void
+DiamondFile::TpcReplicas (const std::vector<std::string>& paths, off_t size,
+                          std::vector<std::unique_ptr<XrdCl::File> >& replicas)
+{
+  EPNAME("tpcreplicas");
+  std::vector<std::unique_ptr<XrdCl::File> > files;
+  std::vector<std::unique_ptr<DiamondRangeOpen> > opens;
+  for (size_t i = 0; i < paths.size(); i++)
+  {
+    files.push_back(std::unique_ptr<XrdCl::File>(new XrdCl::File()));
+    opens.push_back(std::unique_ptr<DiamondRangeOpen>(new DiamondRangeOpen()));
+    XrdCl::XRootDStatus status = files[i]->Open(paths[i],
+                                                XrdCl::OpenFlags::Read,
+                                                XrdCl::Access::None,
+                                                opens[i].get(),
+                                                DIAMOND_TPC_READ_TIMEOUT);
+    if (!status.IsOK())
+    {
+      opens[i]->mMessage = status.ToString();
+      opens[i]->mDone.Post();
+    }
+  }
+
+  for (size_t i = 0; i < paths.size(); i++)
+  {
+    opens[i]->mDone.Wait();
+    // the CGI may carry a key or a token
+    std::string url = paths[i].substr(0, paths[i].find('?'));
+    if (!opens[i]->mOk)
+    {
+      diamond_log("msg=\"tpc replica not used - open failed\" url=%s "
+                  "msg=\"%s\"", url.c_str(), opens[i]->mMessage.c_str());
+      continue;
+    }
+
+    // a replica has to be the same file
+    XrdCl::StatInfo* info = 0;
+    XrdCl::XRootDStatus status = files[i]->Stat(false, info,
+                                                DIAMOND_TPC_READ_TIMEOUT);
+    bool same = status.IsOK() && info && (info->GetSize() == (uint64_t) size);
+    delete info;
+    if (!same)
+    {
+      diamond_log("msg=\"tpc replica not used - size differs\" url=%s",
+                  url.c_str());
+      files[i]->Close(DIAMOND_TPC_READ_TIMEOUT);
+      continue;
+    }
+    replicas.push_back(std::move(files[i]));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Compute the block sums of this file
+//------------------------------------------------------------------------------
+int
+DiamondFile::BlockSums (size_t blocksize, std::string& reply)
+{
+  struct stat buf;
+  if (stat(&buf))
+    return error.getErrInfo() ? error.getErrInfo() : EIO;
+
+  // the reply stays bounded for very large files
+  while ((buf.st_size / blocksize) >= DIAMOND_CHECKSUM_MAX_BLOCKS)
+    blocksize *= 2;
+
+  std::vector<uint64_t> sums;
+  XrdSfsXferSize nread = 0;
+  off_t next = 0;
+  off_t size = 0;
+  DiamondIOStream scrub(&DiamondFS.IOEngine, this, blocksize);
+  for (size_t i = 0; i < (DiamondFS.IOEngine.Depth() ?
+                          DiamondFS.IOEngine.Depth() : 1); i++)
+  {
+    scrub.Read(next);
+    next += blocksize;
+  }
+  do
+  {
+    char* buffer = 0;
+    nread = scrub.Next(buffer);
+    if (nread < 0)
+      return EIO;
+    if (nread > 0)
+    {
+      sums.push_back(DiamondChecksum::BlockSum(buffer, nread));
+      size += nread;
+    }
+    if (nread == (XrdSfsXferSize) blocksize)
+    {
+      scrub.Read(next);
+      next += blocksize;
+    }
+  }
+  while (nread == (XrdSfsXferSize) blocksize);
+
+  reply = DiamondChecksum::EncodeBlockSums(size, blocksize, sums);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Check if a TPC source is an HTTP(S) endpoint
+//------------------------------------------------------------------------------
+bool
+DiamondFile::TpcHttpSource (const std::string& src)
+{
+  return (!src.compare(0, 7, "http://") || !src.compare(0, 8, "https://") ||
+          !src.compare(0, 6, "dav://") || !src.compare(0, 7, "davs://"));
+}
+
+//------------------------------------------------------------------------------
+// Copy a range through the system call - glibc wraps it only since 2.27
+//------------------------------------------------------------------------------
+ssize_t
+DiamondFile::CopyFileRange (int src, loff_t* in, int dst, loff_t* out,
+                            size_t length)
+{
+#ifdef __NR_copy_file_range
+  return syscall(__NR_copy_file_range, src, in, dst, out, length, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+//------------------------------------------------------------------------------
+// Check if path exists in the backend
+//------------------------------------------------------------------------------
+bool
+DiamondFile::Exists (const char* path)
+{
+  char pfn[MAXPATHLEN + 1];
+  struct stat buf;
+  return !XrdOfsOss->Lfn2Pfn(path, pfn, sizeof(pfn)) && !::stat(pfn, &buf);
+}
+
+//------------------------------------------------------------------------------
+// Reject an open after the backend file has been opened - nothing has been
+// written, so the close of the rejected file does not remove it
+//------------------------------------------------------------------------------
+int
+DiamondFile::OpenFailed (int ecode, const char* op, const char* path)
+{
+  isTruncate = false;
+  return DiamondFS.Emsg("open", error, ecode, op, path);
+}
+
+//------------------------------------------------------------------------------
+// Check if a delta TPC can patch path
+//------------------------------------------------------------------------------
+bool
+DiamondFile::DeltaCandidate (const char* path)
+{
+  char pfn[MAXPATHLEN + 1];
+  struct stat buf;
+  if (XrdOfsOss->Lfn2Pfn(path, pfn, sizeof(pfn)) || ::stat(pfn, &buf) ||
+      !S_ISREG(buf.st_mode) || !buf.st_size)
+    return false;
+
+  // compressed and striped files are rewritten from scratch
+  char value[64];
+  if ((getxattr(pfn, DIAMOND_COMPRESS_XATTR, value, sizeof(value)) >= 0) ||
+      DiamondStripedFile::PathLayout(path).length())
+    return false;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Reference a stored object with the content hash of the source
+//------------------------------------------------------------------------------
+int
+DiamondFile::TpcDedup (XrdCl::File& tpcIO, off_t size, uint32_t& adler,
+                       std::string& msg, off_t& bytes)
+{
+  EPNAME("tpcdedup");
+  XrdCl::Buffer arg;
+  arg.FromString("diamond.pcmd=dedup.hash");
+  XrdCl::Buffer* response = 0;
+  XrdCl::XRootDStatus status = tpcIO.Fcntl(arg, response,
+                                           DIAMOND_CHECKSUM_QUERY_TIMEOUT);
+  std::string hash = (status.IsOK() && response) ? response->ToString() : "";
+  delete response;
+  while (hash.length() && !hash[hash.length() - 1])
+    hash.erase(hash.length() - 1);
+  if (!DiamondDedup::Valid(hash))
+  {
+    if (DIAMOND_DEBUG)diamond_log("msg=\"tpc source announces no content hash\" "
+                                  "msg=\"%s\"", status.ToString().c_str());
+    return ENOTSUP;
+  }
+
+  int rc = DiamondFS.Dedup.Reference(BackendFd(), FName(), hash, size);
+  if (rc)
+  {
+    if (DIAMOND_DEBUG)diamond_log("msg=\"tpc content not stored - full copy\" "
+                                  "sha256=%s errno=%d", hash.c_str(), rc);
+    return ENOTSUP;
+  }
+  mDeduped = true;
+  DiamondFS.Invalidate(FName());
+
+  // the referenced object is verified against the source like a copy
+  XrdOucErrInfo cks_error;
+  if (DiamondFS.Adler(FName(), cks_error, 0, 0, adler))
+  {
+    msg = "TPC unable to checksum deduplicated destination";
+    return EIO;
+  }
+  bytes = size;
+  diamond_log("msg=\"tpc destination deduplicated\" sha256=%s bytes=%llu",
+              hash.c_str(), (unsigned long long) size);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Patch this file with the changed blocks of the source
+//------------------------------------------------------------------------------
+int
+DiamondFile::TpcDelta (XrdCl::File& tpcIO, uint32_t& adler, std::string& msg,
+                       off_t& bytes)
+{
+  EPNAME("tpcdelta");
+  char query[128];
+  snprintf(query, sizeof(query), "diamond.pcmd=blocksums&diamond.blocksize=%lu",
+           (unsigned long) mTpcBlockSize);
+
+  XrdCl::Buffer arg;
+  arg.FromString(query);
+  XrdCl::Buffer* response = 0;
+  XrdCl::XRootDStatus status = tpcIO.Fcntl(arg, response,
+                                           DIAMOND_CHECKSUM_QUERY_TIMEOUT);
+
+  off_t size = 0;
+  size_t blocksize = 0;
+  std::vector<uint64_t> sums;
+  bool valid = status.IsOK() && response &&
+    DiamondChecksum::DecodeBlockSums(response->ToString(), size, blocksize,
+                                     sums);
+  delete response;
+  if (!valid)
+  {
+    diamond_log("msg=\"tpc source provides no block sums - full copy\" "
+                "msg=\"%s\"", status.ToString().c_str());
+    return ENOTSUP;
+  }
+
+  struct stat buf;
+  if (XrdOfsFile::stat(&buf))
+  {
+    msg = "TPC delta unable to stat destination";
+    return EIO;
+  }
+
+  // local blocks are read ahead, blocks which differ are fetched with several
+  // reads in flight and written as they arrive - the checksum of the file is
+  // combined from the checksums of its blocks
+  size_t nlocal = (buf.st_size + blocksize - 1) / blocksize;
+  if (nlocal > sums.size())
+    nlocal = sums.size();
+  DiamondIOStream local(&DiamondFS.IOEngine, this, blocksize);
+  size_t nextlocal = 0;
+  DiamondRangeWindow remote(&tpcIO, blocksize, DiamondFS.TpcStreams);
+  std::vector<uint32_t> blockAdler(sums.size());
+  unsigned long long skipped = 0;
+  unsigned long long transferred = 0;
+
+  for (size_t i = 0; i <= sums.size(); i++)
+  {
+    // a full window, and the end of the blocks, writes out the oldest reads
+    while (!remote.Empty() && (remote.Full() || (i == sums.size())))
+    {
+      char* rdata = 0;
+      uint64_t roffset = 0;
+      std::string emsg;
+      int64_t rbytes = remote.Next(rdata, roffset, emsg);
+      size_t rlength = ((size - (off_t) roffset) < (off_t) blocksize) ?
+        (size - roffset) : blocksize;
+      if (rbytes != (int64_t) rlength)
+      {
+        diamond_log("msg=\"tpc transfer terminated - remote read failed\" "
+                    "offset=%llu rbytes=%lld msg=\"%s\"",
+                    (unsigned long long) roffset, (long long) rbytes,
+                    emsg.c_str());
+        msg = "TPC remote read failed";
+        return EIO;
+      }
+      if (write(roffset, rdata, rlength) != (XrdSfsXferSize) rlength)
+      {
+        diamond_log("msg=\"tpc transfer terminated - local write failed\"");
+        msg = "TPC local write failed";
+        return EIO;
+      }
+      blockAdler[roffset / blocksize] = adler32(adler32(0L, Z_NULL, 0),
+                                                (const Bytef*) rdata, rlength);
+      transferred += rlength;
+    }
+    if (i == sums.size())
+      break;
+
+    while ((nextlocal < nlocal) && (nextlocal < (i + (DiamondFS.IOEngine.Depth() ?
+                                                      DiamondFS.IOEngine.Depth() : 1))))
+    {
+      local.Read(nextlocal * blocksize);
+      nextlocal++;
+    }
+
+    off_t offset = i * (off_t) blocksize;
+    size_t length = ((size - offset) < (off_t) blocksize) ? (size - offset) :
+      blocksize;
+
+    char* data = 0;
+    XrdSfsXferSize nread = 0;
+    if (i < nlocal)
+    {
+      nread = local.Next(data);
+      if (nread < 0)
+      {
+        msg = "TPC delta local read failed";
+        return EIO;
+      }
+    }
+
+    if (data && (nread >= (XrdSfsXferSize) length) &&
+        (DiamondChecksum::BlockSum(data, length) == sums[i]))
+    {
+      blockAdler[i] = adler32(adler32(0L, Z_NULL, 0), (const Bytef*) data,
+                              length);
+      skipped += length;
+    }
+    else
+    {
+      remote.Submit(offset, length);
+    }
+    bytes = offset + length;
+
+    if (!TpcValid())
+    {
+      diamond_log("msg=\"tpc transfer invalidated during sync\"");
+      msg = "TPC session closed by disconnect";
+      return ECONNABORTED;
+    }
+  }
+
+  for (size_t i = 0; i < sums.size(); i++)
+  {
+    off_t offset = i * (off_t) blocksize;
+    adler = adler32_combine(adler, blockAdler[i],
+                            ((size - offset) < (off_t) blocksize) ?
+                            (size - offset) : blocksize);
+  }
+
+  // a longer previous version loses its tail
+  if ((buf.st_size > size) && truncate(size))
+  {
+    msg = "TPC delta unable to truncate destination";
+    return EIO;
   }
+  bytes = size;
+
+  diamond_log("msg=\"tpc delta\" size=%llu block-size=%lu transferred=%llu "
+              "skipped=%llu", (unsigned long long) size,
+              (unsigned long) blocksize, transferred, skipped);
+  return 0;
 }
 
+//------------------------------------------------------------------------------
+// Copy a source of the local backend
+//------------------------------------------------------------------------------
+int
+DiamondFile::TpcLocalCopy (XrdCl::File& tpcIO, const std::string& src_host,
+                           uint32_t& adler, std::string& msg, off_t& bytes)
+{
+  EPNAME("tpclocalcopy");
+  if (!DiamondFS.TpcLocal || mCompressed || mStriped)
+    return ENOTSUP;
+
+  // a source session of this server is registered in the reader map, a
+  // server sharing the backend is configured
+  std::string src_path;
+  {
+    XrdSysMutexHelper tpcLock(DiamondFS.TpcMapMutex);
+    if (DiamondFS.TpcMap[0].count(TpcKey.c_str()))
+      src_path = DiamondFS.TpcMap[0][TpcKey.c_str()].path;
+  }
+  if (src_path.empty() && DiamondFS.TpcSharedBackend(src_host))
+  {
+    // the client given lfn is not what the source authorized - the source
+    // reports the path it opened for the TPC key
+    XrdCl::Buffer arg;
+    arg.FromString("diamond.pcmd=tpc.path");
+    XrdCl::Buffer* response = 0;
+    XrdCl::XRootDStatus status = tpcIO.Fcntl(arg, response,
+                                             DIAMOND_CHECKSUM_QUERY_TIMEOUT);
+    if (status.IsOK() && response)
+      src_path = response->ToString();
+    delete response;
+    while (src_path.length() && !src_path[src_path.length() - 1])
+      src_path.erase(src_path.length() - 1);
+    if (src_path.empty() || (src_path[0] != '/'))
+    {
+      if (DIAMOND_DEBUG)diamond_log("msg=\"tpc source reports no path - "
+                                    "network copy\" msg=\"%s\"",
+                                    status.ToString().c_str());
+      return ENOTSUP;
+    }
+    // another server may have replaced the file behind a cached handle
+    DiamondFS.Handles.Invalidate(src_path);
+  }
+  if (src_path.empty())
+    return ENOTSUP;
+
+  int dst = BackendFd();
+  if (dst < 0)
+    return ENOTSUP;
+
+  // the source is read through the shared read-only handles
+  DiamondHandleRef source(DiamondFS.Handles, src_path);
+  int src = source.Fd();
+  if (src < 0)
+    return ENOTSUP;
+
+  // only plain sources are copied as they are
+  char magic[sizeof(DIAMOND_COMPRESS_MAGIC) - 1];
+  if (DiamondStripedFile::Layout(src).length() ||
+      ((pread(src, magic, sizeof(magic), 0) == (ssize_t) sizeof(magic)) &&
+       !memcmp(magic, DIAMOND_COMPRESS_MAGIC, sizeof(magic))))
+    return ENOTSUP;
+
+  // the kernel clones or copies the ranges inside the file system - without
+  // support of the kernel or of the file system the rest is copied through a
+  // buffer
+  loff_t in = 0;
+  loff_t out = 0;
+  size_t chunk = mTpcBlockSize * 16;
+  std::vector<char> buffer;
+  ssize_t n = 0;
+  do
+  {
+    n = buffer.empty() ? CopyFileRange(src, &in, dst, &out, chunk) : -1;
+    if ((n < 0) && buffer.empty() &&
+        ((errno == EXDEV) || (errno == ENOSYS) || (errno == EOPNOTSUPP) ||
+         (errno == EINVAL) || (errno == EBADF)))
+    {
+      if (DIAMOND_DEBUG)diamond_log("msg=\"copy_file_range unsupported - "
+                                    "buffered local copy\" errno=%d", errno);
+      buffer.resize(mTpcBlockSize);
+    }
+    if (!buffer.empty())
+    {
+      n = ::pread(src, &buffer[0], buffer.size(), in);
+      ssize_t nwrite = (n > 0) ? ::pwrite(dst, &buffer[0], n, out) : n;
+      if (nwrite != n)
+      {
+        if (nwrite >= 0)
+          errno = EIO;
+        n = -1;
+      }
+      if (n > 0)
+      {
+        in += n;
+        out += n;
+      }
+    }
+    if (n < 0)
+    {
+      int rc = errno;
+      diamond_log("msg=\"tpc transfer terminated - local copy failed\" "
+                  "errno=%d", rc);
+      msg = "TPC local copy failed";
+      return rc;
+    }
+    bytes = in;
+
+    if (!TpcValid())
+    {
+      diamond_log("msg=\"tpc transfer invalidated during sync\"");
+      msg = "TPC session closed by disconnect";
+      return ECONNABORTED;
+    }
+  }
+  while (n > 0);
+
+  // a valid stored checksum of the source holds for the copy, otherwise the
+  // copy is read back
+  uint32_t stored = 0;
+  bool adopted = DiamondChecksum::Load(src, stored);
+  // the block map of the source holds for the copy as well - without it an
+  // adopted copy gets no map instead of a read back at close
+  if (mBlockMap && adopted && !mBlockMap->Load(src))
+  {
+    delete mBlockMap;
+    mBlockMap = 0;
+  }
+  if (adopted)
+  {
+    adler = stored;
+    if (mDedupHash)
+      mDedupHash->Invalidate();
+  }
+  else
+  {
+    XrdSfsXferSize chunksize = mTpcBlockSize;
+    XrdSfsXferSize nread = 0;
+    off_t next = 0;
+    off_t pos = 0;
+    DiamondIOStream scrub(&DiamondFS.IOEngine, this, chunksize);
+    for (size_t i = 0; i < (DiamondFS.IOEngine.Depth() ?
+                            DiamondFS.IOEngine.Depth() : 1); i++)
+    {
+      scrub.Read(next);
+      next += chunksize;
+    }
+    do
+    {
+      char* buffer = 0;
+      nread = scrub.Next(buffer);
+      if (nread < 0)
+      {
+        msg = "TPC local copy read back failed";
+        return EIO;
+      }
+      if (nread > 0)
+      {
+        adler = adler32(adler, (const Bytef*) buffer, nread);
+        if (mBlockMap)
+          mBlockMap->Update(pos, buffer, nread);
+        if (mDedupHash)
+          mDedupHash->Update(pos, buffer, nread);
+        pos += nread;
+      }
+      if (nread == chunksize)
+      {
+        scrub.Read(next);
+        next += chunksize;
+      }
+    }
+    while (nread == chunksize);
+  }
+
+  diamond_log("msg=\"tpc local copy\" path=%s bytes=%llu checksum=%s",
+              src_path.c_str(), (unsigned long long) bytes,
+              adopted ? "source" : "read-back");
+  return 0;
+}
 
 //------------------------------------------------------------------------------
 // Set the TPC state
@@ -26,29 +26,89 @@
 #include "XrdOfs/XrdOfs.hh"
 #include "XrdOuc/XrdOucString.hh"
 #include "XrdSec/XrdSecEntity.hh"
+#include "XrdCl/XrdClFile.hh"
 
 // WARNING: local include copied out of XRootD source tree
 #include "XrdOfsTPCInfo.hh"
 
+#include "DiamondBlockMap.hh"
+#include "DiamondCompress.hh"
+#include "DiamondDedup.hh"
+#include "DiamondLayout.hh"
+
+#include <memory>
+#include <vector>
+
 #define DIAMOND_DEFAULT_TPC_BLOCKSIZE 2*1024*1024
 
 class DiamondFile : public XrdOfsFile {
+  friend class DiamondTpcBulk;
+  friend class DiamondReadVJob;
+
 private:
   bool isRW;
   bool isOpen;
   bool viaDelete;
   bool isTruncate;
+  size_t mStripeSize; //< stripe size given by the client - 0 if unknown
+
+  bool mBlockCached; //< reads are served through the shared block cache
+  std::string mCacheKey; //< path identifying the file in the block cache
+  off_t mCacheSize; //< file size at open identifying the cached blocks
+  time_t mCacheMtime; //< modification time at open identifying the blocks
+
+  int mSeqFd; //< backend descriptor of a sequential TPC source read - -1 if none
+  off_t mSeqAhead; //< end of the range already announced to the kernel
+  off_t mSeqBehind; //< start of the range still kept in the page cache
+  bool mSeqDrop; //< drop pages behind the reader and at close
+  bool mTpcSource; //< counted as an active session of the TPC source load
+  bool mTpcSendfile; //< descriptor of a TPC source handed out for sendfile
+  off_t mTpcSent; //< bytes of a TPC source accounted by the read method
+
+  int mDirectMode; //< diamond.direct CGI - -1 if not given
+  int mDirectFd; //< O_DIRECT descriptor of the backend file - -1 if buffered
+  bool mTpcDelta; //< TPC destination patched in place with changed blocks
+
+  DiamondCompressedFile* mCompressed; //< block-compressed layout - 0 if plain
+  DiamondStripedFile* mStriped; //< layout striped over local directories - 0 if plain
+  std::string mStagedId; //< staged file registered by this writer - empty if none
+  DiamondBlockMap* mBlockMap; //< block sums maintained by a writer or verified by a reader - 0 if none
+  DiamondDedupHash* mDedupHash; //< content hash of a new file to deduplicate - 0 if none
+  bool mDeduped; //< the path references a stored object instead of this file
+  int mQosClass; //< scheduler class of a client open - -1 if not scheduled
 
   XrdSecEntity client_sec;
 
 public:
   using XrdSfsFile::fctl;
+  using XrdOfsFile::read;
+  using XrdOfsFile::write;
 
   DiamondFile (const char *user, int MonID) : XrdOfsFile (user, MonID),
 					      isRW (false),
 					      isOpen (false),
 					      viaDelete (false),
 					      isTruncate (false),
+					      mStripeSize(0),
+					      mBlockCached(false),
+					      mCacheSize(0),
+					      mCacheMtime(0),
+					      mSeqFd(-1),
+					      mSeqAhead(0),
+					      mSeqBehind(0),
+					      mSeqDrop(false),
+					      mTpcSource(false),
+					      mTpcSendfile(false),
+					      mTpcSent(0),
+					      mDirectMode(-1),
+					      mDirectFd(-1),
+					      mTpcDelta(false),
+					      mCompressed(0),
+					      mStriped(0),
+					      mBlockMap(0),
+					      mDedupHash(0),
+					      mDeduped(false),
+					      mQosClass(-1),
 					      mTpcThreadStatus(EINVAL),
 					      mTpcBlockSize(DIAMOND_DEFAULT_TPC_BLOCKSIZE)
   {
@@ -71,6 +131,35 @@ public:
   //----------------------------------------------------------------------------
   int sync ();
   //----------------------------------------------------------------------------
+  int truncate (XrdSfsFileOffset fsize);
+  //----------------------------------------------------------------------------
+  XrdSfsXferSize read (XrdSfsFileOffset offset,
+                       char* buffer,
+                       XrdSfsXferSize size);
+  //----------------------------------------------------------------------------
+  XrdSfsXferSize read (XrdSfsAio* aioparm);
+  //----------------------------------------------------------------------------
+  XrdSfsXferSize readv (XrdOucIOVec* readV, int readCount);
+  //----------------------------------------------------------------------------
+  XrdSfsXferSize write (XrdSfsFileOffset offset,
+                        const char* buffer,
+                        XrdSfsXferSize size);
+  //----------------------------------------------------------------------------
+  int write (XrdSfsAio* aioparm);
+  //----------------------------------------------------------------------------
+  int stat (struct stat* buf);
+  //----------------------------------------------------------------------------
+  int fctl (const int cmd, const char* args, XrdOucErrInfo& out_error);
+  //----------------------------------------------------------------------------
+  int fctl (const int cmd, int alen, const char* args,
+            const XrdSecEntity* client = 0);
+  //----------------------------------------------------------------------------
+
+  //----------------------------------------------------------------------------
+  //! Return the descriptor of the backend file - -1 if the backend has none
+  //----------------------------------------------------------------------------
+  int BackendFd ();
+  //----------------------------------------------------------------------------
 
   //----------------------------------------------------------------------------
   //! TPC Functionality
@@ -120,6 +209,141 @@ private:
   void* DoTpcTransfer();
 
 
+  //----------------------------------------------------------------------------
+  //! Copy the source registered for TpcKey into this file
+  //!
+  //! @param msg reason of a failure
+  //! @param bytes number of bytes written
+  //! @return 0 or an errno
+  //----------------------------------------------------------------------------
+  int TpcPull (std::string& msg, off_t& bytes);
+
+
+  //----------------------------------------------------------------------------
+  //! Stream the remote source of a TPC into this file
+  //!
+  //! @param sources open remote source followed by its open replicas
+  //! @param size size of the source - -1 if unknown
+  //! @param adler checksum of the received data
+  //! @param msg reason of a failure
+  //! @param bytes number of bytes written
+  //! @param dropped set if the first source failed during the transfer
+  //! @return 0 or an errno
+  //----------------------------------------------------------------------------
+  int TpcStream (const std::vector<XrdCl::File*>& sources, off_t size,
+                 uint32_t& adler, std::string& msg, off_t& bytes,
+                 bool& dropped);
+
+
+  //----------------------------------------------------------------------------
+  //! Compose the URL and CGI of a TPC source - an XRootD source gets the TPC
+  //! key, an HTTP(S) endpoint the source CGI of the destination
+  //----------------------------------------------------------------------------
+  void TpcSourceUrl (const std::string& src, const std::string& lfn,
+                     const std::string& org, const std::string& scgi,
+                     std::string& url, std::string& cgi);
+
+
+  //----------------------------------------------------------------------------
+  //! Open the replicas of a TPC source in parallel - replicas which can not be
+  //! opened or differ in size from the source are left out
+  //!
+  //! @param paths URLs of the replicas including their CGI
+  //! @param size size of the source
+  //! @param replicas open replicas
+  //----------------------------------------------------------------------------
+  void TpcReplicas (const std::vector<std::string>& paths, off_t size,
+                    std::vector<std::unique_ptr<XrdCl::File> >& replicas);
+
+
+  //----------------------------------------------------------------------------
+  //! Patch this file with the blocks of the remote source which differ
+  //!
+  //! @param tpcIO open remote source
+  //! @param adler checksum of the resulting file
+  //! @param msg reason of a failure
+  //! @param bytes size of the resulting file
+  //! @return 0, ENOTSUP if the source provides no block sums or an errno
+  //----------------------------------------------------------------------------
+  int TpcDelta (XrdCl::File& tpcIO, uint32_t& adler, std::string& msg,
+                off_t& bytes);
+
+
+  //----------------------------------------------------------------------------
+  //! Reference a stored object with the content hash announced by the remote
+  //! source instead of pulling the data
+  //!
+  //! @param tpcIO open remote source
+  //! @param size size of the source
+  //! @param adler checksum of the referenced object
+  //! @param msg reason of a failure
+  //! @param bytes size of the referenced object
+  //! @return 0, ENOTSUP if no object matches the source or an errno
+  //----------------------------------------------------------------------------
+  int TpcDedup (XrdCl::File& tpcIO, off_t size, uint32_t& adler,
+                std::string& msg, off_t& bytes);
+
+
+  //----------------------------------------------------------------------------
+  //! Compute the block sums of this file for a delta TPC destination
+  //!
+  //! @param blocksize requested block size - raised for very large files
+  //! @param reply encoded block sums
+  //! @return 0 or an errno
+  //----------------------------------------------------------------------------
+  int BlockSums (size_t blocksize, std::string& reply);
+
+
+  //----------------------------------------------------------------------------
+  //! Check if a TPC source is an HTTP(S) endpoint - http(s):// or dav(s)://
+  //----------------------------------------------------------------------------
+  static bool TpcHttpSource (const std::string& src);
+
+
+  //----------------------------------------------------------------------------
+  //! copy_file_range without the glibc wrapper - ENOSYS if the system call is
+  //! unknown at build time
+  //----------------------------------------------------------------------------
+  static ssize_t CopyFileRange (int src, loff_t* in, int dst, loff_t* out,
+                                size_t length);
+
+  //----------------------------------------------------------------------------
+  //! Check if path exists in the backend
+  //----------------------------------------------------------------------------
+  static bool Exists (const char* path);
+
+  //----------------------------------------------------------------------------
+  //! Fail an open after the backend file has been opened - the file is not
+  //! removed when the rejected file is closed
+  //!
+  //! @return SFS_ERROR
+  //----------------------------------------------------------------------------
+  int OpenFailed (int ecode, const char* op, const char* path);
+
+  //----------------------------------------------------------------------------
+  //! Check if path is an existing plain file a delta TPC can patch
+  //----------------------------------------------------------------------------
+  static bool DeltaCandidate (const char* path);
+
+
+  //----------------------------------------------------------------------------
+  //! Copy a TPC source visible in the local backend inside the backend - the
+  //! source is on this server or on a server sharing the backend. Only the
+  //! path registered with the TPC key is copied: a source on this server is
+  //! found in the reader map, a server sharing the backend reports the path
+  //! of the open source.
+  //!
+  //! @param tpcIO open source of the TPC
+  //! @param src_host source host of the TPC
+  //! @param adler checksum of the copy
+  //! @param msg reason of a failure
+  //! @param bytes number of bytes copied
+  //! @return 0, ENOTSUP if the source can not be copied locally or an errno
+  //----------------------------------------------------------------------------
+  int TpcLocalCopy (XrdCl::File& tpcIO, const std::string& src_host,
+                    uint32_t& adler, std::string& msg, off_t& bytes);
+
+
   //----------------------------------------------------------------------------
   //! Set the TPC state
   //!
@@ -136,6 +360,85 @@ private:
   //----------------------------------------------------------------------------
   TpcState_t GetTpcState();
 
+
+  //----------------------------------------------------------------------------
+  //! Switch a TPC source or direct read to sequential mode - the kernel reads
+  //! ahead of the peer and, with drop, pages already sent are dropped from the
+  //! page cache
+  //----------------------------------------------------------------------------
+  void SequentialOpen (bool drop);
+
+  //----------------------------------------------------------------------------
+  //! Advise the kernel about a sequential read of size bytes at offset
+  //----------------------------------------------------------------------------
+  void SequentialAdvise (XrdSfsFileOffset offset, XrdSfsXferSize size);
+
+  //----------------------------------------------------------------------------
+  //! Leave sequential mode and drop the pages of the file
+  //----------------------------------------------------------------------------
+  void SequentialClose ();
+
+  //----------------------------------------------------------------------------
+  //! Reserve the backend space of a file of size bytes without changing its
+  //! size - compressed files are not preallocated
+  //!
+  //! @return 0 or an errno - file systems without preallocation return 0
+  //----------------------------------------------------------------------------
+  int Preallocate (off_t size);
+
+  //----------------------------------------------------------------------------
+  //! Open an O_DIRECT descriptor of the backend file for writes - stays
+  //! buffered if the backend file system does not support direct I/O
+  //----------------------------------------------------------------------------
+  void DirectOpen ();
+
+  //----------------------------------------------------------------------------
+  //! Write aligned requests through the O_DIRECT descriptor, unaligned ones
+  //! through the page cache which is flushed and dropped afterwards
+  //----------------------------------------------------------------------------
+  XrdSfsXferSize DirectWrite (XrdSfsFileOffset offset, const char* buffer,
+                              XrdSfsXferSize size);
+
+  //----------------------------------------------------------------------------
+  //! Read and verify against the block map - read without the I/O scheduler
+  //----------------------------------------------------------------------------
+  XrdSfsXferSize ReadVerified (XrdSfsFileOffset offset, char* buffer,
+                               XrdSfsXferSize size);
+
+  //----------------------------------------------------------------------------
+  //! Read through the layout of the file
+  //----------------------------------------------------------------------------
+  XrdSfsXferSize ReadLayout (XrdSfsFileOffset offset, char* buffer,
+                             XrdSfsXferSize size);
+
+  //----------------------------------------------------------------------------
+  //! Write through the layout of the file
+  //----------------------------------------------------------------------------
+  XrdSfsXferSize WriteLayout (XrdSfsFileOffset offset, const char* buffer,
+                              XrdSfsXferSize size);
+
+  //----------------------------------------------------------------------------
+  //! Recompute the stale blocks of the block map and store it together with
+  //! the checksum combined from its blocks
+  //!
+  //! @return 0 or an errno
+  //----------------------------------------------------------------------------
+  int StoreBlockMap ();
+
+  //----------------------------------------------------------------------------
+  //! Replace a new file written in order by a reference to a stored object
+  //! with the same content or store it as a new object
+  //----------------------------------------------------------------------------
+  void Deduplicate ();
+
+  //----------------------------------------------------------------------------
+  //! Complete the layout of a written file - writes the index of a compressed
+  //! file and extends the placeholder of a striped file to its logical size
+  //!
+  //! @return 0 or an errno
+  //----------------------------------------------------------------------------
+  int FinishLayout ();
+
   int mTpcThreadStatus; ///< status of the TPC thread - 0 valid otherwise error
   TpcState_t mTpcState; //< uses kTPCXYZ enumgs above to tag the TPC state
   pthread_t mTpcThread; //< thread ID of a tpc thread
@@ -22,14 +22,20 @@
  ************************************************************************/
 
 #include "DiamondFs.hh"
+#include "DiamondChecksum.hh"
 #include "XrdSfs/XrdSfsInterface.hh"
 #include "XrdSys/XrdSysLogger.hh"
 #include "XrdVersion.hh"
+#include "XrdOuc/XrdOucEnv.hh"
 #include "XrdOuc/XrdOucString.hh"
 #include "XrdOuc/XrdOucTrace.hh"
 #include "XrdOfs/XrdOfsTrace.hh"
+#include "XrdAcc/XrdAccAuthorize.hh"
+#include "XrdOuc/XrdOucBuffer.hh"
 #include <zlib.h>
+#include <sys/xattr.h>
 
+#include <memory>
 #include <sstream>
 
 XrdOfs *XrdOfsFS = 0;
@@ -92,227 +98,1277 @@ DiamondFs::Configure (XrdSysError &err)
 int
 DiamondFs::Configure (XrdSysError &err, XrdOucEnv *env)
 {
-  return XrdOfs::Configure(err, env);
+  int rc = XrdOfs::Configure(err, env);
+  if (rc)
+    return rc;
+
+  // the diamond directives have been parsed by ConfigXeq at this point
+  if (WorkerPool.Start(Workers, "Diamond Worker Thread"))
+  {
+    err.Emsg("Config", "failed to start diamond worker threads");
+    return 1;
+  }
+
+  if (ChecksumPool.Start(ChecksumThreads, "Diamond Checksum Thread"))
+  {
+    err.Emsg("Config", "failed to start diamond checksum threads");
+    return 1;
+  }
+
+  if (Numa.Configure(err))
+    return 1;
+
+  if (IOEngine.Start(err, Numa))
+    return 1;
+
+  if (Deletions.Start(err))
+    return 1;
+
+  if (Staging.Start(err))
+    return 1;
+
+  if (Dedup.Start(err))
+    return 1;
+
+  if (TpcBulk.Start(err))
+    return 1;
+
+  if (Qos.Start(err))
+    return 1;
+  return 0;
 }
 
 int
 DiamondFs::ConfigXeq (char *var, XrdOucStream &str, XrdSysError &err)
 {
-  return XrdOfs::ConfigXeq(var, str, err);
-}
+  // ---------------------------------------------------------------------------
+  // diamond directives are given as 'ofs.diamond.<name> <value>'
+  // ---------------------------------------------------------------------------
+  uint64_t value = 0;
 
-int
-DiamondFs::chksum (csFunc Func,
-                   const char *csName,
-                   const char *path,
-                   XrdOucErrInfo &error,
-                   const XrdSecEntity *client,
-                   const char *opaque)
-{
-  EPNAME("cksum");
-  const char* tident = error.getErrUser();
+  if (!strcmp(var, "diamond.workers"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    Workers = value;
+    return 0;
+  }
 
-  diamond_log("name=%s path=\"%s\"", csName, path);
+  if (!strcmp(var, "diamond.checksum.threads"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    ChecksumThreads = value ? value : 1;
+    return 0;
+  }
 
-  char buff[MAXPATHLEN + 8];
-  int rc;
+  if (!strcmp(var, "diamond.tpc.readahead"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    TpcReadAhead = value;
+    return 0;
+  }
 
-  XrdOucString CheckSumName = csName;
-  unsigned int adler = adler32(0L, Z_NULL, 0);
+  if (!strcmp(var, "diamond.tpc.dropbehind"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    TpcDropBehind = value ? true : false;
+    return 0;
+  }
 
-  rc = 0;
+  if (!strcmp(var, "diamond.tpc.verify"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    TpcVerify = value ? true : false;
+    return 0;
+  }
 
-  if (Func == XrdSfsFileSystem::csSize)
+  if (!strcmp(var, "diamond.tpc.delta"))
   {
-    if (CheckSumName != "adler32")
+    if (ConfigUnit(var, str, err, value)) return 1;
+    TpcDeltaMode = value ? true : false;
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.tpc.local"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    TpcLocal = value ? true : false;
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.tpc.sharedbackend"))
+  {
+    TpcSharedHosts.clear();
+    char* val = 0;
+    while ((val = str.GetWord()) && val[0])
+      TpcSharedHosts.push_back(val);
+    if (TpcSharedHosts.empty())
     {
-      strcpy(buff, csName);
-      strcat(buff, "checksum - checksum not supported.");
-      error.setErrInfo(ENOTSUP, buff);
-      return SFS_ERROR;
+      err.Emsg("Config", var, "requires at least one host");
+      return 1;
     }
-    else
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.tpc.http.allow"))
+  {
+    TpcHttpHosts.clear();
+    char* val = 0;
+    while ((val = str.GetWord()) && val[0])
+      TpcHttpHosts.push_back(val);
+    if (TpcHttpHosts.empty())
     {
-      // just return the length of an adler checksum
-      error.setErrCode(4);
-      return SFS_OK;
+      err.Emsg("Config", var, "requires at least one host");
+      return 1;
     }
+    return 0;
   }
 
-  if (!path)
+  if (!strcmp(var, "diamond.tpc.preallocate"))
   {
-    strcpy(buff, csName);
-    strcat(buff, "checksum - checksum path not specified.");
-    error.setErrInfo(EINVAL, buff);
-    return SFS_ERROR;
+    if (ConfigUnit(var, str, err, value)) return 1;
+    TpcPreallocate = value ? true : false;
+    return 0;
   }
 
-  // ---------------------------------------------------------------------------
-  // Now determine what to do
-  // ---------------------------------------------------------------------------
-  if ((Func == XrdSfsFileSystem::csCalc) ||
-      (Func == XrdSfsFileSystem::csGet))
+  if (!strcmp(var, "diamond.direct.writes"))
   {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    DirectWrites = value ? true : false;
+    return 0;
   }
-  else
+
+  if (!strcmp(var, "diamond.direct.tpc"))
   {
-    error.setErrInfo(EINVAL, "checksum - invalid checksum function.");
-    return SFS_ERROR;
+    if (ConfigUnit(var, str, err, value)) return 1;
+    DirectTpc = value ? true : false;
+    return 0;
   }
 
-  // compute the checksum scrubbing this file
+  if (!strcmp(var, "diamond.numa"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    Numa.SetEnabled(value ? true : false);
+    return 0;
+  }
 
-  DiamondFile* file = (DiamondFile*) newFile();
-  if (file)
+  if (!strcmp(var, "diamond.numa.nic"))
   {
-    if (file->open(path, 0, 0, client, opaque))
+    char* val = str.GetWord();
+    if (!val || !val[0])
     {
-      error.setErrInfo(EINVAL, "checksum - unable to open file.");
-      return SFS_ERROR;
+      err.Emsg("Config", var, "requires an interface name");
+      return 1;
+    }
+    Numa.SetNic(val);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.io.threads"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    IOEngine.SetThreads(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.io.depth"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    IOEngine.SetDepth(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.io.buffers"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    IOEngine.SetBuffers(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.tpc.bulk.threads"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    TpcBulk.SetThreads(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.tpc.streams"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    if (!value)
+    {
+      err.Emsg("Config", var, "must not be 0");
+      return 1;
+    }
+    TpcStreams = value;
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.tpc.source.maxsessions"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    TpcLoad.SetMaxSessions(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.tpc.source.maxrate"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    TpcLoad.SetMaxRate(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.tpc.source.maxqueued"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    TpcLoad.SetMaxQueued(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.tpc.bulk.ttl"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    TpcBulk.SetLifeTime(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.dircache.ttl"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    DirCache.SetLifeTime(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.dircache.size"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    DirCache.SetMaxSize(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.statcache.ttl"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    StatCache.SetLifeTime(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.statcache.negttl"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    StatCache.SetNegLifeTime(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.statcache.size"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    StatCache.SetMaxSize(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.handlecache.size"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    Handles.SetMaxHandles(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.handlecache.ttl"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    Handles.SetLifeTime(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.blockcache.size"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    BlockCache.SetMaxSize(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.blockcache.blocksize"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    BlockCache.SetBlockSize(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.deletion.journal"))
+  {
+    char* val = str.GetWord();
+    if (!val || (val[0] != '/'))
+    {
+      err.Emsg("Config", var, "requires an absolute path");
+      return 1;
     }
-    char* buffer = (char*) malloc(4 * 1024 * 1024);
-    off_t offset = 0;
-    size_t chunksize = 4 * 1024 * 1024;
-    size_t nread = 0;
+    Deletions.SetJournal(val);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.deletion.threads"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    Deletions.SetThreads(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.deletion.batch"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    Deletions.SetBatch(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.deletion.retries"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    Deletions.SetRetries(value);
+    return 0;
+  }
 
-    if (buffer)
+  if (!strcmp(var, "diamond.staging.dir"))
+  {
+    char* val = str.GetWord();
+    if (!val || (val[0] != '/'))
+    {
+      err.Emsg("Config", var, "requires an absolute path");
+      return 1;
+    }
+    std::string dir = val;
+    while ((dir.length() > 1) && (dir[dir.length() - 1] == '/'))
+      dir.erase(dir.length() - 1);
+    Staging.SetDir(dir);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.staging.threads"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    Staging.SetThreads(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.staging.minfree"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    Staging.SetMinFree(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.dedup.dir"))
+  {
+    char* val = str.GetWord();
+    if (!val || (val[0] != '/'))
+    {
+      err.Emsg("Config", var, "requires an absolute path");
+      return 1;
+    }
+    std::string dir = val;
+    while ((dir.length() > 1) && (dir[dir.length() - 1] == '/'))
+      dir.erase(dir.length() - 1);
+    Dedup.SetDir(dir);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.dedup.minsize"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    Dedup.SetMinSize(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.dedup.trust"))
+  {
+    DedupTrustHosts.clear();
+    char* val = 0;
+    while ((val = str.GetWord()) && val[0])
+      DedupTrustHosts.push_back(val);
+    if (DedupTrustHosts.empty())
+    {
+      err.Emsg("Config", var, "requires at least one host");
+      return 1;
+    }
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.compress.blocksize"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    if (!value || (value > DIAMOND_COMPRESS_MAX_BLOCKSIZE))
     {
-      do
+      err.Emsg("Config", var, "must be between 1 and 1G");
+      return 1;
+    }
+    CompressBlockSize = value;
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.compress.level"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    if (value > 9)
+    {
+      err.Emsg("Config", var, "must be between 0 and 9");
+      return 1;
+    }
+    CompressLevel = value;
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.jbod.dirs"))
+  {
+    JbodDirs.clear();
+    char* val = 0;
+    while ((val = str.GetWord()) && val[0])
+    {
+      if (val[0] != '/')
       {
-        nread = file->read(offset, buffer, chunksize);
-        if (nread > 0)
-        {
-          adler = adler32(adler, (const Bytef*) buffer, nread);
-          offset += nread;
-        }
+        err.Emsg("Config", var, "requires absolute paths");
+        return 1;
       }
-      while (nread == chunksize);
-      free(buffer);
+      std::string dir = val;
+      while ((dir.length() > 1) && (dir[dir.length() - 1] == '/'))
+        dir.erase(dir.length() - 1);
+      JbodDirs.push_back(dir);
     }
-    else
+    if (JbodDirs.empty())
     {
-      error.setErrInfo(EINVAL, "checksum - buffer allocation failed.");
-      return SFS_ERROR;
+      err.Emsg("Config", var, "requires at least one directory");
+      return 1;
     }
+    return 0;
   }
-  else
+
+  if (!strcmp(var, "diamond.blockmap.blocksize"))
   {
-    error.setErrInfo(EINVAL, "checksum - file allocation failed.");
-    return SFS_ERROR;
+    if (ConfigUnit(var, str, err, value)) return 1;
+    BlockMapSize = value;
+    return 0;
   }
-  snprintf(buff, 9, "%08x", adler);
-  error.setErrInfo(0, buff);
-  return SFS_OK;
+
+  if (!strcmp(var, "diamond.blockmap.verify"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    BlockMapVerify = value ? true : false;
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.jbod.stripesize"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    if (!value)
+    {
+      err.Emsg("Config", var, "must not be 0");
+      return 1;
+    }
+    JbodStripeSize = value;
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.readv.gap"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    ReadVGap = value;
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.readv.stripe"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    ReadVStripe = value;
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.qos.slots"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    Qos.SetSlots(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.qos.small"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    Qos.SetSmall(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.qos.target"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    Qos.SetTarget(value);
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.qos.class"))
+  {
+    char* val = str.GetWord();
+    if (!val || !val[0])
+    {
+      err.Emsg("Config", var, "requires a class name");
+      return 1;
+    }
+    std::string name = val;
+    if (ConfigUnit(var, str, err, value)) return 1;
+    std::vector<std::string> rules;
+    while ((val = str.GetWord()) && val[0])
+      rules.push_back(val);
+    const char* emsg = Qos.AddClass(name, value, rules);
+    if (emsg)
+    {
+      err.Emsg("Config", var, emsg, name.c_str());
+      return 1;
+    }
+    return 0;
+  }
+
+  if (!strcmp(var, "diamond.dirstat.batch"))
+  {
+    if (ConfigUnit(var, str, err, value)) return 1;
+    DirStatBatch = value ? value : 1;
+    return 0;
+  }
+
+  return XrdOfs::ConfigXeq(var, str, err);
 }
 
-const char *
-DiamondFs::getVersion ()
+//------------------------------------------------------------------------------
+// Parse the value of a numeric directive - accepts the units of parseUnit
+//------------------------------------------------------------------------------
+int
+DiamondFs::ConfigUnit (const char *var, XrdOucStream &str, XrdSysError &err,
+                       uint64_t &value)
 {
+  char* val = str.GetWord();
+  if (!val || !val[0])
+  {
+    err.Emsg("Config", var, "value not specified");
+    return 1;
+  }
 
-  static XrdOucString FullVersion = XrdVERSION;
-  FullVersion += " DiamondFs ";
-  FullVersion += VERSION;
-  return FullVersion.c_str();
+  value = parseUnit(val);
+  if (errno)
+  {
+    err.Emsg("Config", var, "illegal value", val);
+    return 1;
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Drop cached metadata of a modified path
+//------------------------------------------------------------------------------
+void
+DiamondFs::Invalidate (const char* path)
+{
+  StatCache.Invalidate(path);
+  BlockCache.Invalidate(path);
+  Handles.Invalidate(path);
+  DirCache.InvalidateParent(path);
 }
 
-uint64_t 
-DiamondFs::parseUnit(const char* instring)
+//------------------------------------------------------------------------------
+// Plug-in queries - the CGI is either the whole argument or follows a path
+//------------------------------------------------------------------------------
+int
+DiamondFs::FSctl (const int cmd,
+                  XrdSfsFSctl &args,
+                  XrdOucErrInfo &error,
+                  const XrdSecEntity *client)
 {
-  if (!instring)
+  EPNAME("FSctl");
+  if (cmd != SFS_FSCTL_PLUGIN)
+    return XrdOfs::FSctl(cmd, args, error, client);
+
+  std::string cgi;
+  if (args.Arg2 && (args.Arg2Len > 0))
+    cgi.assign(args.Arg2, args.Arg2Len);
+  else if (args.Arg1 && (args.Arg1Len > 0))
+    cgi.assign(args.Arg1, args.Arg1Len);
+
+  size_t pos = cgi.find("?");
+  if (pos != std::string::npos)
+    cgi.erase(0, pos + 1);
+  while (cgi.length() && !cgi[cgi.length() - 1])
+    cgi.erase(cgi.length() - 1);
+
+  XrdOucEnv env(cgi.c_str());
+  const char* pcmd = env.Get("diamond.pcmd");
+  if (!pcmd)
+    return XrdOfs::FSctl(cmd, args, error, client);
+
+  std::string reply;
+  std::string emsg;
+  int rc = EINVAL;
+
+  if (!strcmp(pcmd, "tpc.load"))
   {
-    errno = EINVAL;
-    return 0;
+    reply = TpcLoad.Report(TpcQueued());
+    rc = 0;
   }
-  
-  XrdOucString sizestring = instring;
-  errno = 0;
-  unsigned long long convfactor;
-  convfactor = 1ll;
-  if (!sizestring.length())
+  else if (!strncmp(pcmd, "tpc.", 4))
   {
-      errno = EINVAL;
-      return 0;
+    rc = TpcBulk.Execute(pcmd, env, client, reply, emsg);
   }
+  else if (!strcmp(pcmd, "checksum"))
+  {
+    rc = Checksums(env, client, error.getErrUser(), reply, emsg);
+  }
+  else
+  {
+    emsg = "unknown plug-in command ";
+    emsg += pcmd;
+  }
+
+  if (rc)
+    return Emsg(epname, error, rc, "execute", emsg.c_str());
 
-  if (sizestring.endswith("B") || sizestring.endswith("b"))
+  if (DIAMOND_DEBUG)
   {
-    sizestring.erase(sizestring.length() - 1);
+    const char* tident = error.getErrUser();
+    diamond_log("msg=\"plug-in query\" pcmd=%s reply-len=%lu", pcmd,
+                (unsigned long) reply.length());
   }
-  
-  if (sizestring.endswith("E") || sizestring.endswith("e"))
+  return FSctlReply(error, reply);
+}
+
+//------------------------------------------------------------------------------
+// Hand the data of a plug-in query reply over to the client
+//------------------------------------------------------------------------------
+int
+DiamondFs::FSctlReply (XrdOucErrInfo& error, const std::string& data)
+{
+  char* buff = (char*) malloc(data.length() + 1);
+  if (!buff)
   {
-    convfactor = 1024ll * 1024ll * 1024ll * 1024ll * 1024ll * 1024ll;
+    error.setErrInfo(ENOMEM, "execute - reply allocation failed");
+    return SFS_ERROR;
   }
+  memcpy(buff, data.c_str(), data.length() + 1);
 
-  if (sizestring.endswith("P") || sizestring.endswith("p"))
+  XrdOucBuffer* reply = new XrdOucBuffer(buff, data.length() + 1);
+  error.setErrInfo(data.length() + 1, reply);
+  return SFS_DATA;
+}
+
+//------------------------------------------------------------------------------
+// Stat a path through the stat cache
+//------------------------------------------------------------------------------
+int
+DiamondFs::stat (const char *path,
+                 struct stat *buf,
+                 XrdOucErrInfo &error,
+                 const XrdSecEntity *client,
+                 const char *opaque)
+{
+  EPNAME("stat");
+  unsigned long long generation = 0;
+  DiamondStatCache::Lookup_t cached = StatCache.Get(path, buf, &generation);
+
+  if (cached != DiamondStatCache::kMiss)
   {
-    convfactor = 1024ll * 1024ll * 1024ll * 1024ll * 1024ll;
+    // a cached answer still has to pass the authorization of XrdOfs::stat
+    XrdOucEnv stat_Env(opaque, 0, client);
+    if (client && Authorization &&
+        !Authorization->Access(client, path, AOP_Stat, &stat_Env))
+      return Emsg(epname, error, EACCES, "locate", path);
+
+    if (cached == DiamondStatCache::kMissing)
+      return Emsg(epname, error, ENOENT, "locate", path);
+    return SFS_OK;
   }
 
-  if (sizestring.endswith("T") || sizestring.endswith("t"))
+  int rc = XrdOfs::stat(path, buf, error, client, opaque);
+  if (rc == SFS_OK)
   {
-    convfactor = 1024ll * 1024ll * 1024ll * 1024ll;
+    DiamondCompressedFile::FixStat(path, buf);
+    StatCache.Put(path, buf, generation);
   }
+  else if ((rc == SFS_ERROR) && (error.getErrInfo() == ENOENT))
+    StatCache.Put(path, 0, generation);
+  return rc;
+}
+
+//------------------------------------------------------------------------------
+// Return the mode of a path through the stat cache
+//------------------------------------------------------------------------------
+int
+DiamondFs::stat (const char *path,
+                 mode_t &mode,
+                 XrdOucErrInfo &error,
+                 const XrdSecEntity *client,
+                 const char *opaque)
+{
+  struct stat buf;
+  int rc = stat(path, &buf, error, client, opaque);
+  if (rc == SFS_OK)
+    mode = buf.st_mode;
+  return rc;
+}
 
-  if (sizestring.endswith("G") || sizestring.endswith("g"))
+//------------------------------------------------------------------------------
+// Check the existence of a path through the stat cache
+//------------------------------------------------------------------------------
+int
+DiamondFs::exists (const char *path,
+                   XrdSfsFileExistence &exists_flag,
+                   XrdOucErrInfo &error,
+                   const XrdSecEntity *client,
+                   const char *opaque)
+{
+  struct stat buf;
+  int rc = stat(path, &buf, error, client, opaque);
+
+  if (rc == SFS_OK)
   {
-    convfactor = 1024ll * 1024ll * 1024ll;
+    if (S_ISDIR(buf.st_mode))
+      exists_flag = XrdSfsFileExistIsDirectory;
+    else if (S_ISREG(buf.st_mode))
+      exists_flag = XrdSfsFileExistIsFile;
+    else
+      exists_flag = XrdSfsFileExistNo;
+    return SFS_OK;
   }
 
-  if (sizestring.endswith("M") || sizestring.endswith("m"))
+  if ((rc == SFS_ERROR) && (error.getErrInfo() == ENOENT))
   {
-    convfactor = 1024ll * 1024ll;
+    exists_flag = XrdSfsFileExistNo;
+    return SFS_OK;
   }
+  return rc;
+}
+
+//------------------------------------------------------------------------------
+// Create a directory
+//------------------------------------------------------------------------------
+int
+DiamondFs::mkdir (const char *path,
+                  XrdSfsMode mode,
+                  XrdOucErrInfo &error,
+                  const XrdSecEntity *client,
+                  const char *opaque)
+{
+  int rc = XrdOfs::mkdir(path, mode, error, client, opaque);
+  Invalidate(path);
+  return rc;
+}
 
-  if (sizestring.endswith("K") || sizestring.endswith("k"))
+//------------------------------------------------------------------------------
+// Match a TPC source against the servers sharing the backend - entries without
+// a port match any port of the host
+//------------------------------------------------------------------------------
+bool
+DiamondFs::TpcSharedBackend (const std::string& host)
+{
+  std::string name = host.substr(0, host.rfind(':'));
+  for (size_t i = 0; i < TpcSharedHosts.size(); i++)
   {
-    convfactor = 1024ll;
+    if ((TpcSharedHosts[i] == host) || (TpcSharedHosts[i] == name))
+      return true;
   }
+  return false;
+}
 
-  if (sizestring.endswith("S") || sizestring.endswith("s"))
+//------------------------------------------------------------------------------
+// Match a TPC source against the sources trusted to announce content hashes -
+// entries without a port match any port of the host
+//------------------------------------------------------------------------------
+bool
+DiamondFs::DedupTrusted (const std::string& host)
+{
+  std::string name = host.substr(0, host.rfind(':'));
+  for (size_t i = 0; i < DedupTrustHosts.size(); i++)
   {
-    convfactor = 1ll;
+    if ((DedupTrustHosts[i] == host) || (DedupTrustHosts[i] == name))
+      return true;
   }
+  return false;
+}
 
-  if ((sizestring.length() > 3) && (sizestring.endswith("MIN") || sizestring.endswith("min")))
+//------------------------------------------------------------------------------
+// Check the host of an HTTP(S) TPC source against the allowed hosts
+//------------------------------------------------------------------------------
+bool
+DiamondFs::TpcHttpAllowed (const std::string& url)
+{
+  size_t pos = url.find("://");
+  if (pos == std::string::npos)
+    return false;
+
+  std::string host = url.substr(pos + 3);
+  host = host.substr(0, host.find_first_of("/?#"));
+  if ((pos = host.rfind('@')) != std::string::npos)
+    host.erase(0, pos + 1);
+  std::string name = (host.length() && (host[0] == '[')) ?
+    host.substr(0, host.find(']') + 1) : host.substr(0, host.rfind(':'));
+  if (name.empty())
+    return false;
+
+  for (size_t i = 0; i < TpcHttpHosts.size(); i++)
   {
-    convfactor = 60ll;
+    const std::string& allowed = TpcHttpHosts[i];
+    if ((allowed == host) || (allowed == name))
+      return true;
+    if ((allowed[0] == '.') && (name.length() > allowed.length()) &&
+        !name.compare(name.length() - allowed.length(), allowed.length(),
+                      allowed))
+      return true;
   }
+  return false;
+}
 
-  if (sizestring.endswith("H") || sizestring.endswith("h"))
+//------------------------------------------------------------------------------
+// Remove a file
+//------------------------------------------------------------------------------
+int
+DiamondFs::rem (const char *path,
+                XrdOucErrInfo &error,
+                const XrdSecEntity *client,
+                const char *opaque)
+{
+  // the stripe files of a striped file go with its placeholder - a staged
+  // file is not migrated anymore, an unreferenced object is collected
+  Staging.Cancel(path);
+  std::string layout = DiamondStripedFile::PathLayout(path);
+  std::string hash = Dedup.Enabled() ? DiamondDedup::PathHash(path) : "";
+  int rc = XrdOfs::rem(path, error, client, opaque);
+  if (!rc && layout.length())
+    DiamondStripedFile::Remove(layout);
+  if (!rc && hash.length())
+    Dedup.Release(hash);
+  Invalidate(path);
+  return rc;
+}
+
+//------------------------------------------------------------------------------
+// Remove a directory
+//------------------------------------------------------------------------------
+int
+DiamondFs::remdir (const char *path,
+                   XrdOucErrInfo &error,
+                   const XrdSecEntity *client,
+                   const char *opaque)
+{
+  int rc = XrdOfs::remdir(path, error, client, opaque);
+  Invalidate(path);
+  DirCache.Invalidate(DiamondDirCache::DirName(path));
+  return rc;
+}
+
+//------------------------------------------------------------------------------
+// Rename a file or directory
+//------------------------------------------------------------------------------
+int
+DiamondFs::rename (const char *old_path,
+                   const char *new_path,
+                   XrdOucErrInfo &error,
+                   const XrdSecEntity *client,
+                   const char *opaque_old,
+                   const char *opaque_new)
+{
+  int rc = 0;
+  // a replaced target may have been the last reference to an object
+  std::string hash = Dedup.Enabled() ? DiamondDedup::PathHash(new_path) : "";
   {
-    convfactor = 3600ll;
+    // staged files follow the rename before a migration looks them up
+    XrdSysMutexHelper nsLock(Staging.Namespace());
+    rc = XrdOfs::rename(old_path, new_path, error, client,
+                        opaque_old, opaque_new);
+    if (!rc)
+      Staging.Rename(old_path, new_path);
   }
+  if (!rc && hash.length())
+    Dedup.Release(hash);
+  Invalidate(old_path);
+  Invalidate(new_path);
+  DirCache.Invalidate(DiamondDirCache::DirName(old_path));
+  return rc;
+}
+
+//------------------------------------------------------------------------------
+// Truncate a file by path
+//------------------------------------------------------------------------------
+int
+DiamondFs::truncate (const char *path,
+                     XrdSfsFileOffset size,
+                     XrdOucErrInfo &error,
+                     const XrdSecEntity *client,
+                     const char *opaque)
+{
+  EPNAME("truncate");
+  // the file is migrated and unshared before XrdOfs::truncate runs - the
+  // truncate is authorized first
+  XrdOucEnv trunc_Env(opaque, 0, client);
+  if (client && Authorization &&
+      !Authorization->Access(client, path, AOP_Update, &trunc_Env))
+    return Emsg(epname, error, EACCES, "truncate", path);
 
-  if (sizestring.endswith("D") || sizestring.endswith("d"))
+  // a staged file which is not written anymore is migrated first
+  int src = Staging.Flush(path);
+  if (src)
+    return Emsg(epname, error, src, "truncate staged file", path);
+
+  if (DiamondStripedFile::PathLayout(path).length())
+    return Emsg(epname, error, ENOTSUP, "truncate striped file", path);
+
+  // a deduplicated file gets a private copy - an empty one if it is emptied
+  src = Dedup.Unshare(path, !size);
+  if (src)
+    return Emsg(epname, error, src, "truncate deduplicated file", path);
+
+  int rc = XrdOfs::truncate(path, size, error, client, opaque);
+  Invalidate(path);
+  return rc;
+}
+
+//------------------------------------------------------------------------------
+// Count registered source sessions - a key which is being read is expired
+//------------------------------------------------------------------------------
+uint64_t
+DiamondFs::TpcQueued ()
+{
+  uint64_t queued = 0;
+  time_t now = time(NULL);
+  XrdSysMutexHelper tpcLock(TpcMapMutex);
+  for (tpc_info_map_t::const_iterator it = TpcMap[0].begin();
+       it != TpcMap[0].end(); ++it)
   {
-    convfactor = 86400ll;
+    if (it->second.expires > now)
+      queued++;
   }
-  
-  if (sizestring.endswith("W") || sizestring.endswith("w"))
+  return queued;
+}
+
+//------------------------------------------------------------------------------
+// Append to the statistics - output which does not fit is cut and the length
+// stays within the buffer
+//------------------------------------------------------------------------------
+static void
+StatsAppend (char* buff, int blen, int& n, const char* fmt, ...)
+{
+  if (n >= (blen - 1))
+    return;
+
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(buff + n, blen - n, fmt, args);
+  va_end(args);
+  if (len > 0)
+    n = (len < (blen - n)) ? (n + len) : (blen - 1);
+}
+
+//------------------------------------------------------------------------------
+// Append the diamond counters to the OFS statistics
+//------------------------------------------------------------------------------
+int
+DiamondFs::getStats (char *buff, int blen)
+{
+  // the records per NUMA node and per scheduling class grow with the
+  // configuration
+  std::vector<DiamondNuma::NodeStats> numa = Numa.GetStats();
+  std::vector<DiamondQos::ClassStats> qos = Qos.GetStats();
+  int maxlen = DIAMOND_STATS_MAXLEN +
+    numa.size() * DIAMOND_STATS_NODE_MAXLEN +
+    qos.size() * DIAMOND_STATS_CLASS_MAXLEN;
+
+  if (!buff)
+    return XrdOfs::getStats(0, 0) + maxlen;
+
+  int n = XrdOfs::getStats(buff, blen);
+  if ((blen - n) < maxlen)
+    return n;
+
+  DiamondStatCache::Stats sc = StatCache.GetStats();
+  unsigned long long lookups = sc.hits + sc.neghits + sc.misses;
+
+  StatsAppend(buff, blen, n,
+              "<stats id=\"diamond\"><statcache>"
+              "<hits>%llu</hits><neghits>%llu</neghits><misses>%llu</misses>"
+              "<hitrate>%.02f</hitrate><invalidations>%llu</invalidations>"
+              "<entries>%llu</entries></statcache>",
+              sc.hits, sc.neghits, sc.misses,
+              lookups ? (100.0 * (sc.hits + sc.neghits) / lookups) : 0.0,
+              sc.invalidations, sc.entries);
+
+  DiamondBlockCache::Stats bc = BlockCache.GetStats();
+  lookups = bc.hits + bc.misses;
+
+  StatsAppend(buff, blen, n,
+              "<blockcache><hits>%llu</hits><misses>%llu</misses>"
+              "<hitrate>%.02f</hitrate><evictions>%llu</evictions>"
+              "<invalidations>%llu</invalidations><bytes>%llu</bytes>"
+              "<blocks>%llu</blocks></blockcache>",
+              bc.hits, bc.misses,
+              lookups ? (100.0 * bc.hits / lookups) : 0.0,
+              bc.evictions, bc.invalidations, bc.bytes, bc.blocks);
+
+  DiamondHandleCache::Stats hc = Handles.GetStats();
+  lookups = hc.hits + hc.misses;
+
+  StatsAppend(buff, blen, n,
+              "<handlecache><hits>%llu</hits><misses>%llu</misses>"
+              "<hitrate>%.02f</hitrate><evictions>%llu</evictions>"
+              "<invalidations>%llu</invalidations><handles>%llu</handles>"
+              "<inuse>%llu</inuse></handlecache>",
+              hc.hits, hc.misses,
+              lookups ? (100.0 * hc.hits / lookups) : 0.0,
+              hc.evictions, hc.invalidations, hc.handles, hc.inuse);
+
+  DiamondDeletionQueue::Stats dq = Deletions.GetStats();
+
+  StatsAppend(buff, blen, n,
+              "<deletions><queued>%llu</queued><removed>%llu</removed>"
+              "<retried>%llu</retried><failed>%llu</failed>"
+              "<pending>%llu</pending></deletions>",
+              dq.queued, dq.removed, dq.retried, dq.failed, dq.pending);
+
+  DiamondStaging::Stats st = Staging.GetStats();
+
+  StatsAppend(buff, blen, n,
+              "<staging><staged>%llu</staged><migrated>%llu</migrated>"
+              "<bytes>%llu</bytes><retried>%llu</retried>"
+              "<writing>%llu</writing><pending>%llu</pending></staging>",
+              st.staged, st.migrated, st.bytes, st.retried, st.writing,
+              st.pending);
+
+  DiamondDedup::Stats dd = Dedup.GetStats();
+
+  StatsAppend(buff, blen, n,
+              "<dedup><objects>%llu</objects><stored>%llu</stored>"
+              "<linked>%llu</linked><saved>%llu</saved>"
+              "<unshared>%llu</unshared><collected>%llu</collected></dedup>",
+              dd.objects, dd.stored, dd.linked, dd.saved, dd.unshared,
+              dd.collected);
+
+  DiamondTpcBulk::Stats tb = TpcBulk.GetStats();
+
+  StatsAppend(buff, blen, n,
+              "<tpcbulk><registered>%llu</registered>"
+              "<submitted>%llu</submitted><done>%llu</done>"
+              "<failed>%llu</failed><cancelled>%llu</cancelled>"
+              "<batches>%llu</batches></tpcbulk>",
+              tb.registered, tb.submitted, tb.done, tb.failed, tb.cancelled,
+              tb.batches);
+
+  DiamondTpcLoad::Stats tl = TpcLoad.GetStats();
+
+  StatsAppend(buff, blen, n,
+              "<tpcsource><sessions>%llu</sessions><rate>%llu</rate>"
+              "<bytes>%llu</bytes><probes>%llu</probes>"
+              "<refused>%llu</refused></tpcsource>",
+              tl.sessions, tl.rate, tl.bytes, tl.probes, tl.refused);
+
+  DiamondIOEngine::Stats io = IOEngine.GetStats();
+
+  StatsAppend(buff, blen, n,
+              "<io><requests>%llu</requests><inlined>%llu</inlined>"
+              "<allocated>%llu</allocated><reused>%llu</reused>"
+              "<bytes>%llu</bytes></io>",
+              io.requests, io.inlined, io.allocated, io.reused, io.bytes);
+
+  if (numa.size())
   {
-    convfactor = 7 * 86400ll;
+    StatsAppend(buff, blen, n, "<numa>");
+    for (size_t i = 0; i < numa.size(); i++)
+    {
+      StatsAppend(buff, blen, n,
+                  "<node><id>%lu</id><transfers>%llu</transfers>"
+                  "<bytes>%llu</bytes></node>", (unsigned long) i,
+                  numa[i].transfers, numa[i].bytes);
+    }
+    StatsAppend(buff, blen, n, "</numa>");
   }
-  
-  if ((sizestring.length() > 2) && (sizestring.endswith("MO") || sizestring.endswith("mo")))
+
+  if (qos.size())
   {
-    convfactor = 31 * 86400ll;
+    StatsAppend(buff, blen, n, "<qos>");
+    for (size_t i = 0; i < qos.size(); i++)
+    {
+      StatsAppend(buff, blen, n,
+                  "<class><name>%.64s</name><weight>%llu</weight>"
+                  "<requests>%llu</requests><bytes>%llu</bytes>"
+                  "<queued>%llu</queued><waitus>%llu</waitus>"
+                  "<maxwaitus>%llu</maxwaitus><small>%llu</small>"
+                  "<late>%llu</late><active>%llu</active></class>",
+                  qos[i].name.c_str(), qos[i].weight, qos[i].requests,
+                  qos[i].bytes, qos[i].queued, qos[i].waitus,
+                  qos[i].maxwaitus, qos[i].small, qos[i].late,
+                  qos[i].active);
+    }
+    StatsAppend(buff, blen, n, "</qos>");
+  }
+
+  StatsAppend(buff, blen, n, "</stats>");
+  return n;
+}
+
+int
+DiamondFs::chksum (csFunc Func,
+                   const char *csName,
+                   const char *path,
+                   XrdOucErrInfo &error,
+                   const XrdSecEntity *client,
+                   const char *opaque)
+{
+  EPNAME("cksum");
+  const char* tident = error.getErrUser();
+
+  diamond_log("name=%s path=\"%s\"", csName, path);
+
+  char buff[MAXPATHLEN + 8];
+  int rc;
+
+  XrdOucString CheckSumName = csName;
+
+  rc = 0;
+
+  if (Func == XrdSfsFileSystem::csSize)
+  {
+    if (CheckSumName != "adler32")
+    {
+      strcpy(buff, csName);
+      strcat(buff, "checksum - checksum not supported.");
+      error.setErrInfo(ENOTSUP, buff);
+      return SFS_ERROR;
+    }
+    else
+    {
+      // just return the length of an adler checksum
+      error.setErrCode(4);
+      return SFS_OK;
+    }
   }
-  
-  if (sizestring.endswith("Y") || sizestring.endswith("y"))
+
+  if (!path)
   {
-    convfactor = 365 * 86400ll;
+    strcpy(buff, csName);
+    strcat(buff, "checksum - checksum path not specified.");
+    error.setErrInfo(EINVAL, buff);
+    return SFS_ERROR;
   }
 
-  if (convfactor > 1)
-    sizestring.erase(sizestring.length() - 1);
-  
-  if ((sizestring.find(".")) != STR_NPOS)
+  // ---------------------------------------------------------------------------
+  // Now determine what to do
+  // ---------------------------------------------------------------------------
+  if ((Func == XrdSfsFileSystem::csCalc) ||
+      (Func == XrdSfsFileSystem::csGet))
   {
-    return ((unsigned long long) (strtod(sizestring.c_str(), NULL) * convfactor));
   }
   else
   {
-    return (strtoll(sizestring.c_str(), 0, 10) * convfactor);
+    error.setErrInfo(EINVAL, "checksum - invalid checksum function.");
+    return SFS_ERROR;
   }
+
+  uint32_t adler = 0;
+  if ((rc = Adler(path, error, client, opaque, adler)))
+    return rc;
+
+  snprintf(buff, 9, "%08x", adler);
+  error.setErrInfo(0, buff);
+  return SFS_OK;
 }
+
+//------------------------------------------------------------------------------
+// Compute the adler32 checksum of a file - from its stored checksum or block
+// map if they are valid, else by reading it
+//------------------------------------------------------------------------------
+int
+DiamondFs::Adler (const char* path,
+                  XrdOucErrInfo& error,
+                  const XrdSecEntity* client,
+                  const char* opaque,
+                  uint32_t& adler)
+{
+  // a missing file is answered from the stat cache without opening it
+  struct stat buf;
+  int rc = 0;
+  if ((rc = stat(path, &buf, error, client, opaque)))
+    return rc;
+
+  // the shared handle is not opened through XrdOfs - check the authorization
+  // of a read open
+  XrdOucEnv open_Env(opaque, 0, client);
+  if (client && Authorization &&
+      !Authorization->Access(client, path, AOP_Read, &open_Env))
+    return Emsg("cksum", error, EACCES, "open", path);
+
+  DiamondHandleRef handle(Handles, path);
+  int fd = handle.Fd();
+  if (fd < 0)
+  {
+    error.setErrInfo(EINVAL, "checksum - unable to open file.");
+    return SFS_ERROR;
+  }
+
+  // a checksum stored for the current content saves the scrubbing
+  if (DiamondChecksum::Load(fd, adler))
+    return SFS_OK;
+
+  // a block map rebuilds the checksum without reading the data
+  DiamondBlockMap map(DIAMOND_DEFAULT_BLOCKMAP_BLOCKSIZE);
+  if (map.Load(fd) && map.Adler(adler))
+  {
+    DiamondChecksum::Store(fd, adler);
+    return SFS_OK;
+  }
+
+  // compressed and striped files are read through their layout, plain files
+  // through the block cache if it is enabled - the read has been authorized,
+  // a cached open is not scheduled as a client request
+  char value[64];
+  DiamondFile file(0, 0);
+  bool layout = ((fgetxattr(fd, DIAMOND_COMPRESS_XATTR, value,
+                            sizeof(value)) >= 0) ||
+                 DiamondStripedFile::Layout(fd).length());
+  bool cached = !layout && BlockCache.Enabled();
+  if ((layout || cached) && file.open(path, 0, 0, layout ? client : 0, opaque))
+  {
+    error.setErrInfo(EINVAL, "checksum - unable to open file.");
+    return SFS_ERROR;
+  }
+
+  adler = adler32(0L, Z_NULL, 0);
+
+  // the next chunks are read while the current one is checksummed
+  XrdSfsXferSize chunksize = 4 * 1024 * 1024;
+  XrdSfsXferSize nread = 0;
+  off_t next = 0;
+  {
+    std::unique_ptr<DiamondIOStream> scrub((layout || cached) ?
+      new DiamondIOStream(&IOEngine, &file, chunksize, false, Numa.NodeOf(fd)) :
+      new DiamondIOStream(&IOEngine, fd, chunksize, false, Numa.NodeOf(fd)));
+
+    for (size_t i = 0; i < (IOEngine.Depth() ? IOEngine.Depth() : 1); i++)
+    {
+      scrub->Read(next);
+      next += chunksize;
+    }
+
+    do
+    {
+      char* buffer = 0;
+      nread = scrub->Next(buffer);
+      if (nread < 0)
+        break;
+      if (nread > 0)
+        adler = adler32(adler, (const Bytef*) buffer, nread);
+      if (nread == chunksize)
+      {
+        scrub->Read(next);
+        next += chunksize;
+      }
+    }
+    while (nread == chunksize);
+  }
+  file.close();
+
+  if (nread < 0)
+  {
+    error.setErrInfo(EIO, "checksum - read failed.");
+    return SFS_ERROR;
+  }
+  return SFS_OK;
+}
+
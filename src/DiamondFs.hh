@@ -27,9 +27,25 @@
 #include "XrdOuc/XrdOucTrace.hh"
 #include "XrdOfs/XrdOfs.hh"
 #include "XrdSys/XrdSysPthread.hh"
+#include "XrdOss/XrdOss.hh"
 
 #include "DiamondFile.hh"
 #include "DiamondDir.hh"
+#include "DiamondBlockCache.hh"
+#include "DiamondDedup.hh"
+#include "DiamondDeletionQueue.hh"
+#include "DiamondDirCache.hh"
+#include "DiamondHandleCache.hh"
+#include "DiamondIOEngine.hh"
+#include "DiamondNuma.hh"
+#include "DiamondQos.hh"
+#include "DiamondRangeReader.hh"
+#include "DiamondReadV.hh"
+#include "DiamondStaging.hh"
+#include "DiamondStatCache.hh"
+#include "DiamondTpcBulk.hh"
+#include "DiamondTpcLoad.hh"
+#include "DiamondWorkerPool.hh"
 
 #include <map>
 #include <vector>
@@ -38,6 +54,18 @@
 struct XrdVersionInfo;
 
 extern XrdOucTrace      OfsTrace;
+extern XrdOss*          XrdOfsOss;
+
+// poor man's debug just for the initial implementation
+#define DIAMOND_DEBUG 1
+
+#define DIAMOND_DEFAULT_WORKERS 16
+#define DIAMOND_DEFAULT_TPC_READAHEAD 4
+#define DIAMOND_DEFAULT_CHECKSUM_THREADS 8
+// room of the monitoring summary - fixed sections, per NUMA node, per class
+#define DIAMOND_STATS_MAXLEN 6144
+#define DIAMOND_STATS_NODE_MAXLEN 192
+#define DIAMOND_STATS_CLASS_MAXLEN 512
 
 #define diamond_log(...)   TRACES(diamond_ofs_log(__FUNCTION__, __FILE__, __LINE__,  __VA_ARGS__).c_str())
 
@@ -63,12 +91,143 @@ private:
 
 protected:
   friend class DiamondFile;
+  friend class DiamondDir;
+  friend class DiamondTpcBulk;
 
   XrdSysMutex TpcMapMutex; //< a mutex protecting a Tpc Map
   typedef std::map<std::string, struct TpcInfo> tpc_info_map_t;
   typedef std::vector<tpc_info_map_t > tpc_map_t;
 
   tpc_map_t TpcMap; //< a vector map pointing from tpc key => tpc information for reads, [0] are readers [1] are writers
+  size_t TpcReadAhead; //< TPC source blocks announced ahead of a read - 0 disables
+  bool TpcDropBehind; //< drop TPC source pages from the page cache once sent
+  bool TpcVerify; //< compare the TPC stream checksum with the source checksum
+  bool TpcLocal; //< copy sources of the local backend inside the backend
+  bool TpcDeltaMode; //< TPC destinations transfer only changed blocks
+  std::vector<std::string> TpcSharedHosts; //< servers sharing the backend
+  std::vector<std::string> TpcHttpHosts; //< HTTP(S) TPC sources allowed - none if empty
+  bool DirectTpc; //< TPC destinations write with direct I/O
+  bool TpcPreallocate; //< reserve the source size before a TPC transfer
+  size_t TpcStreams; //< remote block reads in flight per TPC transfer
+  DiamondTpcBulk TpcBulk; //< bulk registration and submission of TPCs
+  DiamondTpcLoad TpcLoad; //< load of this server as a TPC source
+
+  //----------------------------------------------------------------------------
+  //! Check if a TPC source host:port shares the local backend
+  //----------------------------------------------------------------------------
+  bool TpcSharedBackend (const std::string& host);
+
+  //----------------------------------------------------------------------------
+  //! Check if the content hash announced by a TPC source host:port can be
+  //! trusted to reference a stored object
+  //----------------------------------------------------------------------------
+  bool DedupTrusted (const std::string& host);
+
+  //----------------------------------------------------------------------------
+  //! Check if the host of an HTTP(S) TPC source URL may be pulled from - an
+  //! entry starting with '.' allows a domain
+  //----------------------------------------------------------------------------
+  bool TpcHttpAllowed (const std::string& url);
+
+  //----------------------------------------------------------------------------
+  //! Return the number of registered TPC source sessions not yet read
+  //----------------------------------------------------------------------------
+  uint64_t TpcQueued ();
+
+  //----------------------------------------------------------------------------
+  //! Streaming I/O of TPC transfers and checksum scrubs
+  //----------------------------------------------------------------------------
+  DiamondIOEngine IOEngine;
+  DiamondNuma Numa; //< placement of transfers on NUMA nodes
+  bool DirectWrites; //< all files opened for writing use direct I/O
+
+  //----------------------------------------------------------------------------
+  //! Scheduling of client reads and writes
+  //----------------------------------------------------------------------------
+  DiamondQos Qos; //< weighted fair queueing of client requests by class
+
+  //----------------------------------------------------------------------------
+  //! Directory Listing
+  //----------------------------------------------------------------------------
+  DiamondDirCache DirCache; //< short lifetime cache of directory listings
+  size_t DirStatBatch; //< number of entries stat'ed at once by a listing
+
+  //----------------------------------------------------------------------------
+  //! Metadata Cache
+  //----------------------------------------------------------------------------
+  DiamondStatCache StatCache; //< positive and negative stat results
+  DiamondHandleCache Handles; //< read-only backend handles of internal readers
+
+  //----------------------------------------------------------------------------
+  //! Data Cache
+  //----------------------------------------------------------------------------
+  DiamondBlockCache BlockCache; //< blocks shared by all read-only opens
+
+  //----------------------------------------------------------------------------
+  //! Vector Reads
+  //----------------------------------------------------------------------------
+  size_t ReadVGap; //< maximum gap between two readv chunks read at once
+  size_t ReadVStripe; //< default stripe size limiting a merged readv extent
+
+  //----------------------------------------------------------------------------
+  //! Block Compression
+  //----------------------------------------------------------------------------
+  size_t CompressBlockSize; //< logical block size of new compressed files
+  int CompressLevel; //< zlib level of new compressed files
+
+  //----------------------------------------------------------------------------
+  //! Block Integrity
+  //----------------------------------------------------------------------------
+  size_t BlockMapSize; //< block size of new block maps - 0 disables them
+  bool BlockMapVerify; //< readers verify the blocks they read
+
+  //----------------------------------------------------------------------------
+  //! Striped Layout
+  //----------------------------------------------------------------------------
+  std::vector<std::string> JbodDirs; //< local directories holding stripe files
+  size_t JbodStripeSize; //< default stripe size of new striped files
+
+  //----------------------------------------------------------------------------
+  //! Drop cached metadata and data of path and the listing of its directory
+  //----------------------------------------------------------------------------
+  void Invalidate (const char* path);
+
+  //----------------------------------------------------------------------------
+  //! Return data to a plug-in query
+  //----------------------------------------------------------------------------
+  int FSctlReply (XrdOucErrInfo& error, const std::string& data);
+
+  //----------------------------------------------------------------------------
+  //! Worker threads for parallel backend operations
+  //----------------------------------------------------------------------------
+  DiamondWorkerPool WorkerPool; //< shared pool running DiamondJob objects
+  size_t Workers; //< number of threads in the WorkerPool - 0 runs inline
+
+  //----------------------------------------------------------------------------
+  //! Batched checksum queries
+  //----------------------------------------------------------------------------
+  DiamondWorkerPool ChecksumPool; //< threads checksumming the files of a query
+  size_t ChecksumThreads; //< number of threads in the ChecksumPool
+
+  //----------------------------------------------------------------------------
+  //! Compute the checksums of the diamond.checksum.list paths of a query
+  //!
+  //! @return 0 or an errno
+  //----------------------------------------------------------------------------
+  int Checksums (XrdOucEnv& env, const XrdSecEntity* client,
+                 const char* tident, std::string& reply, std::string& emsg);
+
+  //----------------------------------------------------------------------------
+  //! Background removal of abandoned files
+  //----------------------------------------------------------------------------
+  DiamondDeletionQueue Deletions; //< journaled queue of pending removals
+
+  //----------------------------------------------------------------------------
+  //! Write-back staging of new files
+  //----------------------------------------------------------------------------
+  DiamondStaging Staging; //< staged files and their migration to the backend
+  DiamondDedup Dedup; //< content deduplication of written files
+  std::vector<std::string> DedupTrustHosts; //< TPC sources whose content hash is trusted - none if empty
 
 public:
 
@@ -95,10 +254,92 @@ public:
                       XrdOucErrInfo &out_error,
                       const XrdSecEntity *client = 0,
                       const char *opaque = 0);
+  //----------------------------------------------------------------------------
+  //! Compute the adler32 checksum of a file - used by chksum and batched
+  //! checksum queries
+  //----------------------------------------------------------------------------
+  int Adler (const char* path,
+             XrdOucErrInfo& error,
+             const XrdSecEntity* client,
+             const char* opaque,
+             uint32_t& adler);
+  //----------------------------------------------------------------------------
+  virtual int exists (const char *path,
+                      XrdSfsFileExistence &exists_flag,
+                      XrdOucErrInfo &out_error,
+                      const XrdSecEntity *client = 0,
+                      const char *opaque = 0);
+  //----------------------------------------------------------------------------
+  virtual int FSctl (const int cmd,
+                     XrdSfsFSctl &args,
+                     XrdOucErrInfo &out_error,
+                     const XrdSecEntity *client = 0);
+  //----------------------------------------------------------------------------
+  virtual int getStats (char *buff, int blen);
+  //----------------------------------------------------------------------------
+  virtual int mkdir (const char *path,
+                     XrdSfsMode mode,
+                     XrdOucErrInfo &out_error,
+                     const XrdSecEntity *client = 0,
+                     const char *opaque = 0);
+  //----------------------------------------------------------------------------
+  virtual int rem (const char *path,
+                   XrdOucErrInfo &out_error,
+                   const XrdSecEntity *client = 0,
+                   const char *opaque = 0);
+  //----------------------------------------------------------------------------
+  virtual int remdir (const char *path,
+                      XrdOucErrInfo &out_error,
+                      const XrdSecEntity *client = 0,
+                      const char *opaque = 0);
+  //----------------------------------------------------------------------------
+  virtual int rename (const char *old_path,
+                      const char *new_path,
+                      XrdOucErrInfo &out_error,
+                      const XrdSecEntity *client = 0,
+                      const char *opaque_old = 0,
+                      const char *opaque_new = 0);
+  //----------------------------------------------------------------------------
+  virtual int stat (const char *path,
+                    struct stat *buf,
+                    XrdOucErrInfo &out_error,
+                    const XrdSecEntity *client = 0,
+                    const char *opaque = 0);
+  //----------------------------------------------------------------------------
+  virtual int stat (const char *path,
+                    mode_t &mode,
+                    XrdOucErrInfo &out_error,
+                    const XrdSecEntity *client = 0,
+                    const char *opaque = 0);
+  //----------------------------------------------------------------------------
+  virtual int truncate (const char *path,
+                        XrdSfsFileOffset size,
+                        XrdOucErrInfo &out_error,
+                        const XrdSecEntity *client = 0,
+                        const char *opaque = 0);
 
   DiamondFs () {
     XrdOfs::XrdOfs();
     TpcMap.resize(2);
+    DirStatBatch = DIAMOND_DEFAULT_DIRSTAT_BATCH;
+    ReadVGap = DIAMOND_DEFAULT_READV_GAP;
+    ReadVStripe = DIAMOND_DEFAULT_READV_STRIPE;
+    Workers = DIAMOND_DEFAULT_WORKERS;
+    ChecksumThreads = DIAMOND_DEFAULT_CHECKSUM_THREADS;
+    CompressBlockSize = DIAMOND_DEFAULT_COMPRESS_BLOCKSIZE;
+    CompressLevel = DIAMOND_DEFAULT_COMPRESS_LEVEL;
+    JbodStripeSize = DIAMOND_DEFAULT_JBOD_STRIPESIZE;
+    BlockMapSize = 0;
+    BlockMapVerify = false;
+    TpcReadAhead = DIAMOND_DEFAULT_TPC_READAHEAD;
+    TpcDropBehind = true;
+    TpcVerify = true;
+    TpcLocal = true;
+    TpcDeltaMode = false;
+    DirectTpc = false;
+    TpcPreallocate = true;
+    TpcStreams = DIAMOND_DEFAULT_TPC_STREAMS;
+    DirectWrites = false;
   }
 
   virtual ~DiamondFs ();
@@ -106,6 +347,8 @@ public:
   virtual int Configure (XrdSysError &err);
   virtual int Configure (XrdSysError &err, XrdOucEnv *env);
   virtual int ConfigXeq (char *var, XrdOucStream &str, XrdSysError &err);
+  int ConfigUnit (const char *var, XrdOucStream &str, XrdSysError &err,
+                  uint64_t &value);
 
   const char* getVersion ();
 
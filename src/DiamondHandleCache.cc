@@ -0,0 +1,179 @@
+// ----------------------------------------------------------------------
+// File: DiamondHandleCache.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#include "DiamondHandleCache.hh"
+
+#include "XrdOss/XrdOss.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+extern XrdOss* XrdOfsOss;
+
+//------------------------------------------------------------------------------
+// Close the cached handles - handles still referenced belong to their users
+//------------------------------------------------------------------------------
+DiamondHandleCache::~DiamondHandleCache ()
+{
+  XrdSysMutexHelper hLock(mMutex);
+  while (!mLru.empty())
+    Detach(mLru.front());
+}
+
+//------------------------------------------------------------------------------
+// Remove a handle from the cache - requires the lock
+//------------------------------------------------------------------------------
+void
+DiamondHandleCache::Detach (Handle* handle)
+{
+  mHandles.erase(handle->path);
+  mLru.erase(handle->lru);
+  handle->cached = false;
+  if (!handle->refs)
+  {
+    ::close(handle->fd);
+    delete handle;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Return a referenced handle of path
+//------------------------------------------------------------------------------
+DiamondHandleCache::Handle*
+DiamondHandleCache::Get (const std::string& path)
+{
+  time_t now = time(NULL);
+  unsigned long long generation = 0;
+  {
+    XrdSysMutexHelper hLock(mMutex);
+    std::map<std::string, Handle*>::iterator it = mHandles.find(path);
+    if (it != mHandles.end())
+    {
+      Handle* handle = it->second;
+      if (handle->expires > now)
+      {
+        handle->refs++;
+        mLru.splice(mLru.begin(), mLru, handle->lru);
+        mStats.hits++;
+        return handle;
+      }
+      Detach(handle);
+      mStats.evictions++;
+    }
+    mStats.misses++;
+    generation = mGeneration;
+  }
+
+  // the backend is opened without holding the lock
+  char pfn[MAXPATHLEN + 1];
+  if (!XrdOfsOss || XrdOfsOss->Lfn2Pfn(path.c_str(), pfn, sizeof(pfn)))
+  {
+    errno = EINVAL;
+    return 0;
+  }
+  int fd = ::open(pfn, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+
+  Handle* handle = new Handle(fd, path);
+
+  XrdSysMutexHelper hLock(mMutex);
+  // a handle opened across an invalidation may be stale and stays private
+  if (Enabled() && (generation == mGeneration) && !mHandles.count(path))
+  {
+    handle->cached = true;
+    handle->expires = now + mLifeTime;
+    mLru.push_front(handle);
+    handle->lru = mLru.begin();
+    mHandles[path] = handle;
+
+    while (mHandles.size() > mMaxHandles)
+    {
+      Detach(mLru.back());
+      mStats.evictions++;
+    }
+  }
+  return handle;
+}
+
+//------------------------------------------------------------------------------
+// Return a reference - the last reference of an uncached handle closes it
+//------------------------------------------------------------------------------
+void
+DiamondHandleCache::Release (Handle* handle)
+{
+  XrdSysMutexHelper hLock(mMutex);
+  if (--handle->refs || handle->cached)
+    return;
+  ::close(handle->fd);
+  delete handle;
+}
+
+//------------------------------------------------------------------------------
+// Drop the handles of path and below
+//------------------------------------------------------------------------------
+void
+DiamondHandleCache::Invalidate (const std::string& path)
+{
+  std::string prefix = path + "/";
+  XrdSysMutexHelper hLock(mMutex);
+  mGeneration++;
+
+  std::map<std::string, Handle*>::iterator it = mHandles.find(path);
+  if (it != mHandles.end())
+  {
+    Detach(it->second);
+    mStats.invalidations++;
+  }
+
+  it = mHandles.lower_bound(prefix);
+  while ((it != mHandles.end()) &&
+         !it->first.compare(0, prefix.length(), prefix))
+  {
+    Handle* handle = it->second;
+    it++;
+    Detach(handle);
+    mStats.invalidations++;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Return the counters
+//------------------------------------------------------------------------------
+DiamondHandleCache::Stats
+DiamondHandleCache::GetStats ()
+{
+  XrdSysMutexHelper hLock(mMutex);
+  Stats stats = mStats;
+  stats.handles = mHandles.size();
+  for (std::list<Handle*>::const_iterator it = mLru.begin();
+       it != mLru.end(); ++it)
+  {
+    if ((*it)->refs)
+      stats.inuse++;
+  }
+  return stats;
+}
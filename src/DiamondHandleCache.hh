@@ -0,0 +1,137 @@
+// ----------------------------------------------------------------------
+// File: DiamondHandleCache.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#ifndef __DIAMONDHANDLECACHE_API_H__
+#define __DIAMONDHANDLECACHE_API_H__
+#include "XrdSys/XrdSysPthread.hh"
+
+#include <time.h>
+#include <list>
+#include <map>
+#include <string>
+
+#define DIAMOND_DEFAULT_HANDLECACHE_SIZE 1024
+#define DIAMOND_DEFAULT_HANDLECACHE_TTL 30
+
+//------------------------------------------------------------------------------
+//! LRU cache of read-only backend file descriptors used by internal readers
+//! (checksums, local TPC copies). Handles are reference counted: a handle
+//! which is evicted, expires or is invalidated while in use is closed by its
+//! last release, so descriptors can not leak. Handles opened while the cache
+//! is disabled or while the path is invalidated are never cached.
+//------------------------------------------------------------------------------
+class DiamondHandleCache {
+public:
+
+  struct Stats {
+    Stats () : hits(0), misses(0), evictions(0), invalidations(0),
+               handles(0), inuse(0) { }
+    unsigned long long hits; //< lookups answered with a cached handle
+    unsigned long long misses; //< lookups opening the backend file
+    unsigned long long evictions; //< handles dropped to make room or expired
+    unsigned long long invalidations; //< handles dropped by modifications
+    unsigned long long handles; //< handles currently cached
+    unsigned long long inuse; //< cached handles currently referenced
+  };
+
+  struct Handle {
+    Handle (int f, const std::string& p) : fd(f), refs(1), expires(0),
+                                           cached(false), path(p) { }
+    int fd; //< read-only backend descriptor
+    size_t refs; //< references handed out by Get
+    time_t expires; //< end of the lifetime in the cache
+    bool cached; //< still reachable through the cache
+    std::string path;
+    std::list<Handle*>::iterator lru; //< position in mLru if cached
+  };
+
+  DiamondHandleCache () : mGeneration(0),
+                          mMaxHandles(DIAMOND_DEFAULT_HANDLECACHE_SIZE),
+                          mLifeTime(DIAMOND_DEFAULT_HANDLECACHE_TTL) { }
+
+  ~DiamondHandleCache ();
+
+  //----------------------------------------------------------------------------
+  //! Return a referenced read-only handle of path - opens the backend file on
+  //! a miss
+  //!
+  //! @return handle or 0 with errno set
+  //----------------------------------------------------------------------------
+  Handle* Get (const std::string& path);
+
+  //----------------------------------------------------------------------------
+  //! Return a reference taken by Get
+  //----------------------------------------------------------------------------
+  void Release (Handle* handle);
+
+  //----------------------------------------------------------------------------
+  //! Drop the handles of path and of everything below it because it has been
+  //! modified, removed or renamed
+  //----------------------------------------------------------------------------
+  void Invalidate (const std::string& path);
+
+  Stats GetStats ();
+
+  void SetMaxHandles (size_t maxhandles) { mMaxHandles = maxhandles; }
+  void SetLifeTime (time_t lifetime) { mLifeTime = lifetime; }
+
+  bool Enabled () const { return mMaxHandles && (mLifeTime > 0); }
+
+private:
+  void Detach (Handle* handle);
+
+  XrdSysMutex mMutex; //< protects all members and the cached handles
+  std::map<std::string, Handle*> mHandles; //< path => cached handle
+  std::list<Handle*> mLru; //< cached handles, most recently used first
+  unsigned long long mGeneration; //< incremented by each invalidation
+  size_t mMaxHandles; //< maximum number of cached handles - 0 disables them
+  time_t mLifeTime; //< lifetime of a cached handle - 0 disables them
+  Stats mStats; //< counters
+};
+
+//------------------------------------------------------------------------------
+//! Reference to a cached handle released when it goes out of scope
+//------------------------------------------------------------------------------
+class DiamondHandleRef {
+public:
+  DiamondHandleRef (DiamondHandleCache& cache, const std::string& path) :
+    mCache(cache), mHandle(cache.Get(path)) { }
+
+  ~DiamondHandleRef () {
+    if (mHandle)
+      mCache.Release(mHandle);
+  }
+
+  //! backend descriptor - -1 with errno set if the open failed
+  int Fd () const { return mHandle ? mHandle->fd : -1; }
+
+private:
+  DiamondHandleRef (const DiamondHandleRef&);
+  DiamondHandleRef& operator= (const DiamondHandleRef&);
+
+  DiamondHandleCache& mCache;
+  DiamondHandleCache::Handle* mHandle;
+};
+
+#endif
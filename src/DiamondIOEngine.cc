@@ -0,0 +1,360 @@
+// ----------------------------------------------------------------------
+// File: DiamondIOEngine.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#include "DiamondIOEngine.hh"
+
+#include "XrdSys/XrdSysError.hh"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// memory policy of mbind - numaif.h belongs to libnuma, which is not required
+#define DIAMOND_MPOL_PREFERRED 1
+#define DIAMOND_MPOL_MF_MOVE (1 << 1)
+
+//------------------------------------------------------------------------------
+// Free the pooled buffers
+//------------------------------------------------------------------------------
+DiamondIOEngine::~DiamondIOEngine ()
+{
+  std::map<buffer_key_t, std::vector<char*> >::iterator it;
+  for (it = mBuffers.begin(); it != mBuffers.end(); ++it)
+  {
+    for (size_t i = 0; i < it->second.size(); i++)
+      free(it->second[i]);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Start the I/O threads
+//------------------------------------------------------------------------------
+int
+DiamondIOEngine::Start (XrdSysError& err, const DiamondNuma& numa)
+{
+  mNodes = numa.Enabled() ? numa.Nodes() : 1;
+  for (int node = 0; node < mNodes; node++)
+  {
+    if (numa.Enabled())
+      mPools[node].Pin(numa.Cpus(node));
+    if (mPools[node].Start(mDepth ? mThreads : 0, "Diamond IO Thread"))
+    {
+      err.Emsg("Config", "failed to start diamond io threads");
+      return 1;
+    }
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Run a request
+//------------------------------------------------------------------------------
+void
+DiamondIOEngine::Submit (DiamondJob* job, DiamondJobGroup* group, int node)
+{
+  DiamondWorkerPool& pool = mPools[Node(node)];
+  {
+    XrdSysMutexHelper sLock(mMutex);
+    if (pool.Size())
+      mStats.requests++;
+    else
+      mStats.inlined++;
+  }
+  pool.Schedule(job, group);
+}
+
+//------------------------------------------------------------------------------
+// Take a buffer from the pool - the pages of a new buffer are bound to node
+// and touched here, so they do not land on the node of the I/O or network
+// thread touching them first
+//------------------------------------------------------------------------------
+char*
+DiamondIOEngine::GetBuffer (size_t size, int node)
+{
+  {
+    XrdSysMutexHelper sLock(mMutex);
+    std::map<buffer_key_t, std::vector<char*> >::iterator it =
+      mBuffers.find(buffer_key_t(Node(node), size));
+    if ((it != mBuffers.end()) && !it->second.empty())
+    {
+      char* buffer = it->second.back();
+      it->second.pop_back();
+      mStats.bytes -= size;
+      mStats.reused++;
+      return buffer;
+    }
+    mStats.allocated++;
+  }
+
+  void* buffer = 0;
+  size_t aligned = ((size + DIAMOND_IO_ALIGNMENT - 1) / DIAMOND_IO_ALIGNMENT) *
+    DIAMOND_IO_ALIGNMENT;
+  if (!aligned)
+    aligned = DIAMOND_IO_ALIGNMENT;
+  if (posix_memalign(&buffer, DIAMOND_IO_ALIGNMENT, aligned))
+    return 0;
+
+  if ((mNodes > 1) && (node >= 0) && (node < mNodes))
+  {
+    unsigned long mask[DIAMOND_NUMA_MAX_NODES / (8 * sizeof(unsigned long)) +
+                       1] = { 0 };
+    mask[node / (8 * sizeof(unsigned long))] |=
+      1ul << (node % (8 * sizeof(unsigned long)));
+    // without a policy the pages follow this thread, which is bound to node
+    syscall(SYS_mbind, buffer, aligned, DIAMOND_MPOL_PREFERRED, mask,
+            8 * sizeof(mask), DIAMOND_MPOL_MF_MOVE);
+    for (size_t offset = 0; offset < aligned; offset += DIAMOND_IO_ALIGNMENT)
+      ((volatile char*) buffer)[offset] = 0;
+  }
+  return (char*) buffer;
+}
+
+//------------------------------------------------------------------------------
+// Return a buffer to the pool
+//------------------------------------------------------------------------------
+void
+DiamondIOEngine::PutBuffer (char* buffer, size_t size, int node)
+{
+  if (!buffer)
+    return;
+
+  {
+    XrdSysMutexHelper sLock(mMutex);
+    if ((mStats.bytes + size) <= mMaxBytes)
+    {
+      mBuffers[buffer_key_t(Node(node), size)].push_back(buffer);
+      mStats.bytes += size;
+      return;
+    }
+  }
+  free(buffer);
+}
+
+//------------------------------------------------------------------------------
+// Return the counters
+//------------------------------------------------------------------------------
+DiamondIOEngine::Stats
+DiamondIOEngine::GetStats ()
+{
+  XrdSysMutexHelper sLock(mMutex);
+  return mStats;
+}
+
+//------------------------------------------------------------------------------
+// Run one request through the file methods or the backend descriptor
+//------------------------------------------------------------------------------
+void
+DiamondIORequest::DoIt ()
+{
+  if (mFd >= 0)
+  {
+    ssize_t n = mWrite ? ::pwrite(mFd, mBuffer, mLength, mOffset) :
+      ::pread(mFd, mBuffer, mLength, mOffset);
+    mResult = (n < 0) ? SFS_ERROR : n;
+    return;
+  }
+  mResult = mWrite ? mFile->write(mOffset, mBuffer, mLength) :
+    mFile->read(mOffset, mBuffer, mLength);
+}
+
+//------------------------------------------------------------------------------
+// Constructor
+//------------------------------------------------------------------------------
+DiamondIOStream::DiamondIOStream (DiamondIOEngine* engine, XrdSfsFile* file,
+                                  size_t blocksize, bool ordered, int node) :
+  mEngine(engine), mFile(file), mFd(-1), mBlockSize(blocksize),
+  mDepth(engine->Depth() ? engine->Depth() : 1), mOrdered(ordered),
+  mNode(node), mCurrent(0), mLast(0), mFailed(false) { }
+
+DiamondIOStream::DiamondIOStream (DiamondIOEngine* engine, int fd,
+                                  size_t blocksize, bool ordered, int node) :
+  mEngine(engine), mFile(0), mFd(fd), mBlockSize(blocksize),
+  mDepth(engine->Depth() ? engine->Depth() : 1), mOrdered(ordered),
+  mNode(node), mCurrent(0), mLast(0), mFailed(false) { }
+
+//------------------------------------------------------------------------------
+// Destructor
+//------------------------------------------------------------------------------
+DiamondIOStream::~DiamondIOStream ()
+{
+  while (!mInFlight.empty())
+    Complete();
+  Release(mCurrent);
+  Release(mLast);
+}
+
+//------------------------------------------------------------------------------
+// Allocate a request with a stream buffer
+//------------------------------------------------------------------------------
+DiamondIORequest*
+DiamondIOStream::NewRequest ()
+{
+  char* buffer = mEngine->GetBuffer(mBlockSize, mNode);
+  if (!buffer)
+    return 0;
+  return new DiamondIORequest(mFile, mFd, buffer);
+}
+
+//------------------------------------------------------------------------------
+// Free a request and return its buffer
+//------------------------------------------------------------------------------
+void
+DiamondIOStream::Release (DiamondIORequest* request)
+{
+  if (!request)
+    return;
+  mEngine->PutBuffer(request->mBuffer, mBlockSize, mNode);
+  delete request;
+}
+
+//------------------------------------------------------------------------------
+// Wait for the oldest write
+//------------------------------------------------------------------------------
+void
+DiamondIOStream::Complete ()
+{
+  DiamondIORequest* request = mInFlight.front();
+  mInFlight.pop_front();
+  request->mDone.Wait();
+  if (request->mResult != request->mLength)
+    mFailed = true;
+  Release(request);
+}
+
+//------------------------------------------------------------------------------
+// Buffer for the next write
+//------------------------------------------------------------------------------
+char*
+DiamondIOStream::Buffer ()
+{
+  // an ordered stream fills the next buffer while one request runs
+  while (!mOrdered && (mInFlight.size() >= mDepth))
+    Complete();
+
+  if (mFailed)
+    return 0;
+  if (!mCurrent)
+    mCurrent = NewRequest();
+  return mCurrent ? mCurrent->mBuffer : 0;
+}
+
+//------------------------------------------------------------------------------
+// Submit a write
+//------------------------------------------------------------------------------
+void
+DiamondIOStream::Write (XrdSfsFileOffset offset, XrdSfsXferSize size)
+{
+  if (!mCurrent)
+    return;
+
+  // an ordered stream starts a write when the previous one is done
+  if (mOrdered)
+  {
+    while (!mInFlight.empty())
+      Complete();
+  }
+
+  mCurrent->mWrite = true;
+  mCurrent->mOffset = offset;
+  mCurrent->mLength = size;
+  mInFlight.push_back(mCurrent);
+  mEngine->Submit(mCurrent, &mCurrent->mDone, mNode);
+  mCurrent = 0;
+}
+
+//------------------------------------------------------------------------------
+// Submit a write of a buffer filled elsewhere
+//------------------------------------------------------------------------------
+bool
+DiamondIOStream::Write (XrdSfsFileOffset offset, XrdSfsXferSize size,
+                        char* buffer)
+{
+  while (!mInFlight.empty() && (mOrdered || (mInFlight.size() >= mDepth)))
+    Complete();
+
+  DiamondIORequest* request = new DiamondIORequest(mFile, mFd, buffer);
+  if (mFailed)
+  {
+    Release(request);
+    return false;
+  }
+
+  request->mWrite = true;
+  request->mOffset = offset;
+  request->mLength = size;
+  mInFlight.push_back(request);
+  mEngine->Submit(request, &request->mDone, mNode);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Wait for all writes
+//------------------------------------------------------------------------------
+bool
+DiamondIOStream::Drain ()
+{
+  while (!mInFlight.empty())
+    Complete();
+  return !mFailed;
+}
+
+//------------------------------------------------------------------------------
+// Submit a read
+//------------------------------------------------------------------------------
+void
+DiamondIOStream::Read (XrdSfsFileOffset offset)
+{
+  DiamondIORequest* request = NewRequest();
+  if (!request)
+  {
+    mFailed = true;
+    return;
+  }
+  request->mOffset = offset;
+  request->mLength = mBlockSize;
+  mInFlight.push_back(request);
+  mEngine->Submit(request, &request->mDone, mNode);
+}
+
+//------------------------------------------------------------------------------
+// Wait for the oldest read
+//------------------------------------------------------------------------------
+XrdSfsXferSize
+DiamondIOStream::Next (char*& buffer)
+{
+  Release(mLast);
+  mLast = 0;
+  buffer = 0;
+
+  if (mFailed)
+    return SFS_ERROR;
+  if (mInFlight.empty())
+    return 0;
+
+  mLast = mInFlight.front();
+  mInFlight.pop_front();
+  mLast->mDone.Wait();
+  buffer = mLast->mBuffer;
+  return mLast->mResult;
+}
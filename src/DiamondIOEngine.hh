@@ -0,0 +1,220 @@
+// ----------------------------------------------------------------------
+// File: DiamondIOEngine.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#ifndef __DIAMONDIOENGINE_API_H__
+#define __DIAMONDIOENGINE_API_H__
+#include "XrdSfs/XrdSfsInterface.hh"
+#include "XrdSys/XrdSysPthread.hh"
+
+#include "DiamondNuma.hh"
+#include "DiamondWorkerPool.hh"
+
+#include <deque>
+#include <map>
+#include <vector>
+
+class XrdSysError;
+
+#define DIAMOND_DEFAULT_IO_THREADS 8
+#define DIAMOND_DEFAULT_IO_DEPTH 4
+#define DIAMOND_DEFAULT_IO_BUFFERS 256*1024*1024
+#define DIAMOND_IO_ALIGNMENT 4096
+
+//------------------------------------------------------------------------------
+//! Engine running the streaming I/O of TPC transfers and checksum scrubs. Each
+//! stream keeps up to 'depth' requests in flight on a private thread pool, so
+//! the backend works on the next blocks while the caller moves data over the
+//! network or checksums it. I/O buffers are aligned and recycled through a
+//! shared pool instead of being allocated per transfer. With NUMA placement
+//! every node has its own pinned threads and buffers.
+//------------------------------------------------------------------------------
+class DiamondIOEngine {
+public:
+
+  struct Stats {
+    Stats () : requests(0), inlined(0), allocated(0), reused(0), bytes(0) { }
+    unsigned long long requests; //< requests run on the I/O threads
+    unsigned long long inlined; //< requests run in the calling thread
+    unsigned long long allocated; //< buffers allocated
+    unsigned long long reused; //< buffers taken from the pool
+    unsigned long long bytes; //< bytes of buffers kept in the pool
+  };
+
+  DiamondIOEngine () : mNodes(1),
+                       mThreads(DIAMOND_DEFAULT_IO_THREADS),
+                       mDepth(DIAMOND_DEFAULT_IO_DEPTH),
+                       mMaxBytes(DIAMOND_DEFAULT_IO_BUFFERS) { }
+
+  ~DiamondIOEngine ();
+
+  //----------------------------------------------------------------------------
+  //! Start the I/O threads - a depth of 0 runs all requests inline. With NUMA
+  //! placement enabled every node gets its own pinned threads.
+  //----------------------------------------------------------------------------
+  int Start (XrdSysError& err, const DiamondNuma& numa);
+
+  //----------------------------------------------------------------------------
+  //! Run a request on the I/O threads of node or inline
+  //----------------------------------------------------------------------------
+  void Submit (DiamondJob* job, DiamondJobGroup* group, int node = -1);
+
+  //----------------------------------------------------------------------------
+  //! Take an aligned buffer of size bytes of node from the pool
+  //----------------------------------------------------------------------------
+  char* GetBuffer (size_t size, int node = -1);
+
+  //----------------------------------------------------------------------------
+  //! Return a buffer of size bytes of node to the pool
+  //----------------------------------------------------------------------------
+  void PutBuffer (char* buffer, size_t size, int node = -1);
+
+  Stats GetStats ();
+
+  size_t Depth () const { return mDepth; }
+
+  void SetThreads (size_t threads) { mThreads = threads ? threads : 1; }
+  void SetDepth (size_t depth) { mDepth = depth; }
+  void SetBuffers (size_t bytes) { mMaxBytes = bytes; }
+
+private:
+  typedef std::pair<int, size_t> buffer_key_t; //< node and size of a buffer
+
+  int
+  Node (int node) const {
+    return ((node >= 0) && (node < mNodes)) ? node : 0;
+  }
+
+  DiamondWorkerPool mPools[DIAMOND_NUMA_MAX_NODES]; //< threads by node
+  int mNodes; //< number of nodes with threads
+  XrdSysMutex mMutex; //< protects the buffer pool and the counters
+  std::map<buffer_key_t, std::vector<char*> > mBuffers; //< free buffers
+  size_t mThreads; //< number of I/O threads
+  size_t mDepth; //< requests in flight per stream
+  size_t mMaxBytes; //< maximum bytes of free buffers kept in the pool
+  Stats mStats; //< counters
+};
+
+//------------------------------------------------------------------------------
+//! One read or write of a stream
+//------------------------------------------------------------------------------
+class DiamondIORequest : public DiamondJob {
+public:
+  DiamondIORequest (XrdSfsFile* file, int fd, char* buffer) :
+    mFile(file), mFd(fd), mBuffer(buffer), mWrite(false), mOffset(0),
+    mLength(0), mResult(0) { }
+
+  void DoIt ();
+
+  XrdSfsFile* mFile;
+  int mFd; //< backend descriptor used instead of mFile - -1 if none
+  char* mBuffer; //< buffer owned by the stream
+  bool mWrite;
+  XrdSfsFileOffset mOffset;
+  XrdSfsXferSize mLength;
+  XrdSfsXferSize mResult; //< bytes transferred or SFS_ERROR
+  DiamondJobGroup mDone; //< signalled when the request finished
+};
+
+//------------------------------------------------------------------------------
+//! Sequential stream of block sized reads or writes of one file. Requests are
+//! completed in the order they were submitted. An ordered stream runs one
+//! request at a time, for layouts which have to be written sequentially.
+//------------------------------------------------------------------------------
+class DiamondIOStream {
+public:
+  DiamondIOStream (DiamondIOEngine* engine, XrdSfsFile* file, size_t blocksize,
+                   bool ordered = false, int node = -1);
+
+  //----------------------------------------------------------------------------
+  //! Stream of a plain backend file descriptor
+  //----------------------------------------------------------------------------
+  DiamondIOStream (DiamondIOEngine* engine, int fd, size_t blocksize,
+                   bool ordered = false, int node = -1);
+
+  //----------------------------------------------------------------------------
+  //! Wait for all requests in flight and return the buffers to the pool
+  //----------------------------------------------------------------------------
+  ~DiamondIOStream ();
+
+  //----------------------------------------------------------------------------
+  //! Return the buffer to fill for the next Write - waits for a free slot
+  //!
+  //! @return buffer of blocksize bytes or 0 if a previous write failed
+  //----------------------------------------------------------------------------
+  char* Buffer ();
+
+  //----------------------------------------------------------------------------
+  //! Submit a write of the first size bytes of the buffer returned by Buffer
+  //----------------------------------------------------------------------------
+  void Write (XrdSfsFileOffset offset, XrdSfsXferSize size);
+
+  //----------------------------------------------------------------------------
+  //! Submit a write of the first size bytes of an engine buffer of blocksize
+  //! bytes - the stream takes the buffer over
+  //!
+  //! @return false if a previous write failed
+  //----------------------------------------------------------------------------
+  bool Write (XrdSfsFileOffset offset, XrdSfsXferSize size, char* buffer);
+
+  //----------------------------------------------------------------------------
+  //! Wait for all writes
+  //!
+  //! @return true if all writes succeeded
+  //----------------------------------------------------------------------------
+  bool Drain ();
+
+  //----------------------------------------------------------------------------
+  //! Submit a read of blocksize bytes at offset
+  //----------------------------------------------------------------------------
+  void Read (XrdSfsFileOffset offset);
+
+  //----------------------------------------------------------------------------
+  //! Wait for the oldest read
+  //!
+  //! @param buffer data of the read - valid until the next call
+  //! @return bytes read or SFS_ERROR
+  //----------------------------------------------------------------------------
+  XrdSfsXferSize Next (char*& buffer);
+
+  size_t Pending () const { return mInFlight.size(); }
+
+private:
+  DiamondIORequest* NewRequest ();
+  void Release (DiamondIORequest* request);
+  void Complete ();
+
+  DiamondIOEngine* mEngine;
+  XrdSfsFile* mFile;
+  int mFd; //< backend descriptor of a plain stream - -1 if mFile is used
+  size_t mBlockSize; //< size of the stream buffers
+  size_t mDepth; //< maximum number of requests in flight
+  bool mOrdered; //< requests run one at a time in submission order
+  int mNode; //< NUMA node of the threads and buffers - -1 for any
+  std::deque<DiamondIORequest*> mInFlight; //< requests in submission order
+  DiamondIORequest* mCurrent; //< request being filled by the caller
+  DiamondIORequest* mLast; //< completed read handed out by Next
+  bool mFailed; //< a write failed
+};
+
+#endif
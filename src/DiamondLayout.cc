@@ -0,0 +1,417 @@
+// ----------------------------------------------------------------------
+// File: DiamondLayout.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#include "DiamondLayout.hh"
+#include "DiamondFs.hh"
+
+#include "XrdOss/XrdOss.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sstream>
+#include <sys/xattr.h>
+
+//------------------------------------------------------------------------------
+// Read or write one segment
+//------------------------------------------------------------------------------
+void
+DiamondStripeJob::DoIt ()
+{
+  size_t done = 0;
+  while (done < mLength)
+  {
+    ssize_t n = mWrite ?
+      pwrite(mFd, mBuffer + done, mLength - done, mOffset + done) :
+      pread(mFd, mBuffer + done, mLength - done, mOffset + done);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      mError = errno;
+      return;
+    }
+    if (!n)
+    {
+      // a hole at the end of a stripe file reads as zeros
+      memset(mBuffer + done, 0, mLength - done);
+      return;
+    }
+    done += n;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Close the stripe files
+//------------------------------------------------------------------------------
+DiamondStripedFile::~DiamondStripedFile ()
+{
+  for (size_t i = 0; i < mFds.size(); i++)
+  {
+    if (mFds[i] >= 0)
+      ::close(mFds[i]);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Return the layout attribute of a placeholder
+//------------------------------------------------------------------------------
+std::string
+DiamondStripedFile::Layout (int fd)
+{
+  if (fd < 0)
+    return "";
+
+  char value[4096];
+  ssize_t len = fgetxattr(fd, DIAMOND_LAYOUT_XATTR, value, sizeof(value) - 1);
+  if (len <= 0)
+    return "";
+  return std::string(value, len);
+}
+
+//------------------------------------------------------------------------------
+// Return the layout attribute of a namespace path
+//------------------------------------------------------------------------------
+std::string
+DiamondStripedFile::PathLayout (const char* path)
+{
+  char pfn[MAXPATHLEN + 1];
+  if (!path || XrdOfsOss->Lfn2Pfn(path, pfn, sizeof(pfn)))
+    return "";
+
+  char value[4096];
+  ssize_t len = getxattr(pfn, DIAMOND_LAYOUT_XATTR, value, sizeof(value) - 1);
+  if (len <= 0)
+    return "";
+  return std::string(value, len);
+}
+
+//------------------------------------------------------------------------------
+// Split a layout attribute into stripe size, id and stripe file paths
+//------------------------------------------------------------------------------
+int
+DiamondStripedFile::Parse (const std::string& layout, size_t& stripesize,
+                           std::string& id, std::vector<std::string>& paths)
+{
+  std::istringstream in(layout);
+  std::string token;
+  std::string dirs;
+  size_t nstripes = 0;
+
+  if (!(in >> token) || (token != "jbod"))
+    return EINVAL;
+
+  stripesize = 0;
+  while (in >> token)
+  {
+    size_t pos = token.find("=");
+    if (pos == std::string::npos)
+      return EINVAL;
+    std::string key = token.substr(0, pos);
+    std::string val = token.substr(pos + 1);
+    if (key == "stripes")
+      nstripes = strtoul(val.c_str(), 0, 10);
+    else if (key == "stripesize")
+      stripesize = strtoul(val.c_str(), 0, 10);
+    else if (key == "id")
+      id = val;
+    else if (key == "dirs")
+      dirs = val;
+  }
+
+  paths.clear();
+  size_t start = 0;
+  while (start <= dirs.length())
+  {
+    size_t end = dirs.find(",", start);
+    if (end == std::string::npos)
+      end = dirs.length();
+    std::stringstream path;
+    path << dirs.substr(start, end - start) << "/" << id << "." << paths.size();
+    paths.push_back(path.str());
+    start = end + 1;
+  }
+
+  if (!stripesize || id.empty() || dirs.empty() || (paths.size() != nstripes))
+    return EINVAL;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Create the stripe files of a new file
+//------------------------------------------------------------------------------
+int
+DiamondStripedFile::Create (int fd, const std::vector<std::string>& dirs,
+                            size_t nstripes, size_t stripesize)
+{
+  static XrdSysMutex sMutex;
+  static unsigned long sCounter = 0;
+
+  if ((fd < 0) || dirs.empty())
+    return ENOTSUP;
+  if (!nstripes || (nstripes > dirs.size()))
+    nstripes = dirs.size();
+
+  unsigned long counter = 0;
+  {
+    XrdSysMutexHelper sLock(sMutex);
+    counter = sCounter++;
+  }
+
+  // the id is unique per process start, pid and file - the first stripe
+  // rotates over the directories
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  char id[64];
+  snprintf(id, sizeof(id), "%08lx%08lx%06x%08lx", (unsigned long) ts.tv_sec,
+           (unsigned long) ts.tv_nsec, (unsigned int) (getpid() & 0xffffff),
+           counter);
+
+  std::stringstream layout;
+  layout << "jbod stripes=" << nstripes << " stripesize=" << stripesize
+         << " id=" << id << " dirs=";
+  for (size_t i = 0; i < nstripes; i++)
+    layout << (i ? "," : "") << dirs[(counter + i) % dirs.size()];
+
+  std::vector<std::string> paths;
+  std::string sid;
+  if (Parse(layout.str(), mStripeSize, sid, paths))
+    return EINVAL;
+
+  for (size_t i = 0; i < paths.size(); i++)
+  {
+    int sfd = ::open(paths[i].c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+    if (sfd < 0)
+    {
+      int rc = errno;
+      Remove(layout.str());
+      return rc;
+    }
+    mFds.push_back(sfd);
+  }
+
+  if (fsetxattr(fd, DIAMOND_LAYOUT_XATTR, layout.str().c_str(),
+                layout.str().length(), 0))
+  {
+    int rc = errno;
+    Remove(layout.str());
+    return rc;
+  }
+
+  mSize = 0;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Open the stripe files of an existing layout
+//------------------------------------------------------------------------------
+int
+DiamondStripedFile::Open (const std::string& layout, off_t size, bool rw)
+{
+  std::vector<std::string> paths;
+  std::string id;
+  if (Parse(layout, mStripeSize, id, paths))
+    return EINVAL;
+
+  for (size_t i = 0; i < paths.size(); i++)
+  {
+    int sfd = ::open(paths[i].c_str(), rw ? O_RDWR : O_RDONLY);
+    if (sfd < 0)
+      return errno;
+    mFds.push_back(sfd);
+  }
+  mSize = size;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Split a request into stripe segments and serve them in parallel - the first
+// segment is served by the calling thread
+//------------------------------------------------------------------------------
+int
+DiamondStripedFile::IO (bool write, XrdSfsFileOffset offset, char* buffer,
+                        size_t size)
+{
+  std::vector<DiamondStripeJob> jobs;
+  size_t done = 0;
+  size_t nstripes = mFds.size();
+
+  while (done < size)
+  {
+    XrdSfsFileOffset pos = offset + done;
+    uint64_t block = pos / mStripeSize;
+    size_t inblock = pos % mStripeSize;
+    size_t len = mStripeSize - inblock;
+    if (len > (size - done))
+      len = size - done;
+
+    jobs.push_back(DiamondStripeJob(mFds[block % nstripes], buffer + done,
+                                    (block / nstripes) * mStripeSize + inblock,
+                                    len, write));
+    done += len;
+  }
+
+  DiamondJobGroup group;
+  for (size_t i = 1; i < jobs.size(); i++)
+    mPool->Schedule(&jobs[i], &group);
+  if (!jobs.empty())
+    jobs[0].DoIt();
+  group.Wait();
+
+  for (size_t i = 0; i < jobs.size(); i++)
+  {
+    if (jobs[i].mError)
+      return jobs[i].mError;
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Read logical data
+//------------------------------------------------------------------------------
+XrdSfsXferSize
+DiamondStripedFile::Read (XrdSfsFileOffset offset, char* buffer,
+                          XrdSfsXferSize size)
+{
+  off_t fsize = Size();
+  if ((offset < 0) || (offset >= fsize) || (size <= 0))
+    return 0;
+  if ((off_t) (offset + size) > fsize)
+    size = fsize - offset;
+
+  if ((errno = IO(false, offset, buffer, size)))
+    return SFS_ERROR;
+  return size;
+}
+
+//------------------------------------------------------------------------------
+// Write logical data
+//------------------------------------------------------------------------------
+XrdSfsXferSize
+DiamondStripedFile::Write (XrdSfsFileOffset offset, const char* buffer,
+                           XrdSfsXferSize size)
+{
+  if ((offset < 0) || (size < 0))
+  {
+    errno = EINVAL;
+    return SFS_ERROR;
+  }
+
+  if ((errno = IO(true, offset, (char*) buffer, size)))
+    return SFS_ERROR;
+
+  XrdSysMutexHelper sLock(mSizeMutex);
+  if ((off_t) (offset + size) > mSize)
+    mSize = offset + size;
+  mDirty = true;
+  return size;
+}
+
+//------------------------------------------------------------------------------
+// Preallocate every stripe file for its share of size
+//------------------------------------------------------------------------------
+int
+DiamondStripedFile::Reserve (off_t size)
+{
+  size_t nstripes = mFds.size();
+  if (!nstripes || (size <= 0))
+    return 0;
+
+  uint64_t nblocks = (size + mStripeSize - 1) / mStripeSize;
+  for (size_t i = 0; i < nstripes; i++)
+  {
+    if (i >= nblocks)
+      break;
+    off_t length = ((nblocks - i + nstripes - 1) / nstripes) * mStripeSize;
+    if (fallocate(mFds[i], FALLOC_FL_KEEP_SIZE, 0, length))
+    {
+      if ((errno == EOPNOTSUPP) || (errno == ENOSYS))
+        return 0;
+      return errno;
+    }
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Truncate a single stripe file
+//------------------------------------------------------------------------------
+int
+DiamondStripedFile::Truncate (off_t size)
+{
+  if (mFds.size() != 1)
+    return ENOTSUP;
+  if (ftruncate(mFds[0], size))
+    return errno;
+
+  XrdSysMutexHelper sLock(mSizeMutex);
+  mSize = size;
+  mDirty = true;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Flush all stripe files
+//------------------------------------------------------------------------------
+int
+DiamondStripedFile::Sync ()
+{
+  for (size_t i = 0; i < mFds.size(); i++)
+  {
+    if (fdatasync(mFds[i]))
+      return errno;
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Remove the stripe files of a layout
+//------------------------------------------------------------------------------
+void
+DiamondStripedFile::Remove (const std::string& layout)
+{
+  std::vector<std::string> paths;
+  std::string id;
+  size_t stripesize = 0;
+  if (Parse(layout, stripesize, id, paths))
+    return;
+
+  for (size_t i = 0; i < paths.size(); i++)
+    unlink(paths[i].c_str());
+}
+
+//------------------------------------------------------------------------------
+// Remove the layout attribute
+//------------------------------------------------------------------------------
+void
+DiamondStripedFile::Drop (int fd)
+{
+  if (fd >= 0)
+    fremovexattr(fd, DIAMOND_LAYOUT_XATTR);
+}
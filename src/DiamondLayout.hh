@@ -0,0 +1,168 @@
+// ----------------------------------------------------------------------
+// File: DiamondLayout.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#ifndef __DIAMONDLAYOUT_API_H__
+#define __DIAMONDLAYOUT_API_H__
+#include "XrdSfs/XrdSfsInterface.hh"
+#include "XrdSys/XrdSysPthread.hh"
+
+#include "DiamondWorkerPool.hh"
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+#define DIAMOND_DEFAULT_JBOD_STRIPESIZE 1024*1024
+#define DIAMOND_LAYOUT_XATTR "user.diamond.layout"
+
+//------------------------------------------------------------------------------
+//! Job reading or writing one stripe segment
+//------------------------------------------------------------------------------
+class DiamondStripeJob : public DiamondJob {
+public:
+  DiamondStripeJob (int fd, char* buffer, off_t offset, size_t length,
+                    bool write) :
+    mFd(fd), mBuffer(buffer), mOffset(offset), mLength(length),
+    mWrite(write), mError(0) { }
+
+  void DoIt ();
+
+  int mFd; //< stripe file
+  char* mBuffer;
+  off_t mOffset; //< offset in the stripe file
+  size_t mLength;
+  bool mWrite;
+  int mError; //< errno of a failed read or write
+};
+
+//------------------------------------------------------------------------------
+//! Round-robin striping of a file over local directories (e.g. one per disk of
+//! a JBOD). The file in the namespace is a sparse placeholder with the logical
+//! size, its data lives in one file per stripe named <dir>/<id>.<stripe>. The
+//! layout is stored in an extended attribute of the placeholder:
+//!
+//!   jbod stripes=<n> stripesize=<size> id=<id> dirs=<dir0>,<dir1>,...
+//!
+//! The stripe segments of a read or write are served in parallel on the
+//! worker pool.
+//------------------------------------------------------------------------------
+class DiamondStripedFile {
+public:
+  DiamondStripedFile (DiamondWorkerPool* pool) :
+    mPool(pool), mStripeSize(0), mSize(0), mDirty(false) { }
+
+  ~DiamondStripedFile ();
+
+  //----------------------------------------------------------------------------
+  //! Return the layout attribute of a placeholder - empty for a plain file
+  //----------------------------------------------------------------------------
+  static std::string Layout (int fd);
+
+  //----------------------------------------------------------------------------
+  //! Return the layout attribute of a namespace path - empty for a plain file
+  //----------------------------------------------------------------------------
+  static std::string PathLayout (const char* path);
+
+  //----------------------------------------------------------------------------
+  //! Create the stripe files of a new file and store its layout on the
+  //! placeholder fd. Files are spread round-robin over dirs.
+  //!
+  //! @return 0 or an errno
+  //----------------------------------------------------------------------------
+  int Create (int fd, const std::vector<std::string>& dirs, size_t nstripes,
+              size_t stripesize);
+
+  //----------------------------------------------------------------------------
+  //! Open the stripe files of an existing layout
+  //!
+  //! @return 0 or an errno
+  //----------------------------------------------------------------------------
+  int Open (const std::string& layout, off_t size, bool rw);
+
+  XrdSfsXferSize Read (XrdSfsFileOffset offset, char* buffer,
+                       XrdSfsXferSize size);
+
+  XrdSfsXferSize Write (XrdSfsFileOffset offset, const char* buffer,
+                        XrdSfsXferSize size);
+
+  //----------------------------------------------------------------------------
+  //! Preallocate the stripe files for a logical size
+  //!
+  //! @return 0 or an errno - file systems without preallocation return 0
+  //----------------------------------------------------------------------------
+  int Reserve (off_t size);
+
+  //----------------------------------------------------------------------------
+  //! Truncate the logical file - only supported with a single stripe
+  //!
+  //! @return 0 or an errno
+  //----------------------------------------------------------------------------
+  int Truncate (off_t size);
+
+  //----------------------------------------------------------------------------
+  //! Flush all stripe files
+  //----------------------------------------------------------------------------
+  int Sync ();
+
+  //----------------------------------------------------------------------------
+  //! Remove the stripe files of a layout
+  //----------------------------------------------------------------------------
+  static void Remove (const std::string& layout);
+
+  //----------------------------------------------------------------------------
+  //! Remove the layout attribute of a placeholder
+  //----------------------------------------------------------------------------
+  static void Drop (int fd);
+
+  off_t
+  Size () {
+    XrdSysMutexHelper sLock(mSizeMutex);
+    return mSize;
+  }
+
+  //! written since the placeholder size has been updated
+  bool Dirty () const { return mDirty; }
+  void Clean () { mDirty = false; }
+
+  //----------------------------------------------------------------------------
+  //! Split a layout attribute into stripe size, id and stripe file paths
+  //!
+  //! @return 0 or EINVAL
+  //----------------------------------------------------------------------------
+  static int Parse (const std::string& layout, size_t& stripesize,
+                    std::string& id, std::vector<std::string>& paths);
+
+private:
+
+  int IO (bool write, XrdSfsFileOffset offset, char* buffer, size_t size);
+
+  DiamondWorkerPool* mPool; //< pool running the stripe segments
+  size_t mStripeSize;
+  std::vector<int> mFds; //< stripe file descriptors
+  XrdSysMutex mSizeMutex; //< protects mSize and mDirty against parallel writes
+  off_t mSize; //< logical size
+  bool mDirty;
+};
+
+#endif
@@ -0,0 +1,226 @@
+// ----------------------------------------------------------------------
+// File: DiamondNuma.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#include "DiamondNuma.hh"
+
+#include "XrdSys/XrdSysError.hh"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <fstream>
+
+//------------------------------------------------------------------------------
+// Read the topology
+//------------------------------------------------------------------------------
+int
+DiamondNuma::Configure (XrdSysError& err)
+{
+  if (!mEnabled)
+    return 0;
+
+  std::ifstream online("/sys/devices/system/node/online");
+  std::string list;
+  cpu_set_t nodes;
+  if (!(online >> list) || !ParseCpuList(list, nodes))
+  {
+    err.Emsg("Config", "numa topology unavailable - numa placement disabled");
+    mEnabled = false;
+    return 0;
+  }
+
+  // nodes are expected to be numbered without gaps
+  mNodes = 0;
+  while ((mNodes < DIAMOND_NUMA_MAX_NODES) && CPU_ISSET(mNodes, &nodes))
+  {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             mNodes);
+    std::ifstream cpulist(path);
+    if (!(cpulist >> list) || !ParseCpuList(list, mCpus[mNodes]))
+      break;
+    mNodes++;
+  }
+
+  if (mNodes < 2)
+  {
+    err.Emsg("Config", "single numa node - numa placement disabled");
+    mEnabled = false;
+    return 0;
+  }
+
+  if (mNic.length())
+  {
+    mNicNode = ReadNode("/sys/class/net/" + mNic + "/device/numa_node");
+    if (mNicNode < 0)
+      err.Emsg("Config", "numa node of interface unknown", mNic.c_str());
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Parse a sysfs list like 0-15,32-47
+//------------------------------------------------------------------------------
+bool
+DiamondNuma::ParseCpuList (const std::string& list, cpu_set_t& cpus)
+{
+  CPU_ZERO(&cpus);
+  const char* p = list.c_str();
+  while (*p)
+  {
+    char* end = 0;
+    long first = strtol(p, &end, 10);
+    if (end == p)
+      return false;
+    long last = first;
+    p = end;
+    if (*p == '-')
+    {
+      last = strtol(p + 1, &end, 10);
+      if (end == (p + 1))
+        return false;
+      p = end;
+    }
+    for (long cpu = first; (cpu <= last) && (cpu < CPU_SETSIZE); cpu++)
+      CPU_SET(cpu, &cpus);
+    if (*p == ',')
+      p++;
+    else if (*p)
+      return false;
+  }
+  return CPU_COUNT(&cpus) > 0;
+}
+
+//------------------------------------------------------------------------------
+// Read a numa_node attribute
+//------------------------------------------------------------------------------
+int
+DiamondNuma::ReadNode (const std::string& path)
+{
+  std::ifstream in(path.c_str());
+  int node = -1;
+  if (!(in >> node) || (node >= DIAMOND_NUMA_MAX_NODES))
+    return -1;
+  return node;
+}
+
+//------------------------------------------------------------------------------
+// Find the node of the device of a file - the block device is resolved in
+// sysfs and its parents are searched for the numa_node of the controller
+//------------------------------------------------------------------------------
+int
+DiamondNuma::NodeOf (int fd) const
+{
+  struct stat buf;
+  if (!mEnabled || (fd < 0) || fstat(fd, &buf))
+    return -1;
+
+  char link[64];
+  snprintf(link, sizeof(link), "/sys/dev/block/%u:%u", major(buf.st_dev),
+           minor(buf.st_dev));
+  char real[PATH_MAX];
+  if (!realpath(link, real))
+    return -1;
+
+  std::string dir = real;
+  while (dir.length() > strlen("/sys/devices"))
+  {
+    int node = ReadNode(dir + "/numa_node");
+    if (node >= 0)
+      return (node < mNodes) ? node : -1;
+    size_t pos = dir.rfind('/');
+    if (pos == std::string::npos)
+      break;
+    dir.erase(pos);
+  }
+  return -1;
+}
+
+//------------------------------------------------------------------------------
+// Choose the node of a transfer
+//------------------------------------------------------------------------------
+int
+DiamondNuma::Steer (int fd) const
+{
+  if (!mEnabled)
+    return -1;
+  if ((mNicNode >= 0) && (mNicNode < mNodes))
+    return mNicNode;
+  return NodeOf(fd);
+}
+
+//------------------------------------------------------------------------------
+// Account a transfer
+//------------------------------------------------------------------------------
+void
+DiamondNuma::Account (int node, unsigned long long bytes)
+{
+  if ((node < 0) || (node >= mNodes))
+    return;
+  XrdSysMutexHelper sLock(mMutex);
+  mStats[node].transfers++;
+  mStats[node].bytes += bytes;
+}
+
+//------------------------------------------------------------------------------
+// Return the counters of all nodes
+//------------------------------------------------------------------------------
+std::vector<DiamondNuma::NodeStats>
+DiamondNuma::GetStats ()
+{
+  XrdSysMutexHelper sLock(mMutex);
+  return std::vector<NodeStats>(mStats, mStats + (mEnabled ? mNodes : 0));
+}
+
+//------------------------------------------------------------------------------
+// Bind the calling thread to node
+//------------------------------------------------------------------------------
+DiamondNumaBinding::DiamondNumaBinding (DiamondNuma* numa, int node,
+                                        off_t* bytes) :
+  mNuma(numa), mNode(-1), mBytes(bytes)
+{
+  if (!numa->Enabled() || (node < 0) || (node >= numa->Nodes()))
+    return;
+
+  if (pthread_getaffinity_np(pthread_self(), sizeof(mSaved), &mSaved) ||
+      pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                             &numa->Cpus(node)))
+    return;
+  mNode = node;
+}
+
+//------------------------------------------------------------------------------
+// Restore the CPUs of the thread and account the transfer
+//------------------------------------------------------------------------------
+DiamondNumaBinding::~DiamondNumaBinding ()
+{
+  if (mNode < 0)
+    return;
+  pthread_setaffinity_np(pthread_self(), sizeof(mSaved), &mSaved);
+  mNuma->Account(mNode, mBytes ? *mBytes : 0);
+}
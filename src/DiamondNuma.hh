@@ -0,0 +1,113 @@
+// ----------------------------------------------------------------------
+// File: DiamondNuma.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#ifndef __DIAMONDNUMA_API_H__
+#define __DIAMONDNUMA_API_H__
+#include "XrdSys/XrdSysPthread.hh"
+
+#include <sched.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+class XrdSysError;
+
+#define DIAMOND_NUMA_MAX_NODES 8
+
+//------------------------------------------------------------------------------
+//! NUMA topology of the host read from sysfs. Transfers are steered to the
+//! node of the backend device or of a configured network interface, per node
+//! counters track the bytes moved on each node.
+//------------------------------------------------------------------------------
+class DiamondNuma {
+public:
+
+  struct NodeStats {
+    NodeStats () : transfers(0), bytes(0) { }
+    unsigned long long transfers; //< transfers run on the node
+    unsigned long long bytes; //< bytes moved by these transfers
+  };
+
+  DiamondNuma () : mEnabled(false), mNodes(0), mNicNode(-1) { }
+
+  //----------------------------------------------------------------------------
+  //! Read the topology - leaves NUMA disabled on a single node host
+  //----------------------------------------------------------------------------
+  int Configure (XrdSysError& err);
+
+  bool Enabled () const { return mEnabled; }
+  int Nodes () const { return mNodes; }
+  const cpu_set_t& Cpus (int node) const { return mCpus[node]; }
+
+  //----------------------------------------------------------------------------
+  //! Return the node of the device holding the file fd - -1 if unknown
+  //----------------------------------------------------------------------------
+  int NodeOf (int fd) const;
+
+  //----------------------------------------------------------------------------
+  //! Return the node a transfer of the file fd should run on - the node of the
+  //! configured interface or of the backend device, -1 if unknown
+  //----------------------------------------------------------------------------
+  int Steer (int fd) const;
+
+  //----------------------------------------------------------------------------
+  //! Account a transfer of bytes on node
+  //----------------------------------------------------------------------------
+  void Account (int node, unsigned long long bytes);
+
+  std::vector<NodeStats> GetStats ();
+
+  void SetEnabled (bool enabled) { mEnabled = enabled; }
+  void SetNic (const std::string& nic) { mNic = nic; }
+
+private:
+  static int ReadNode (const std::string& path);
+  static bool ParseCpuList (const std::string& list, cpu_set_t& cpus);
+
+  bool mEnabled;
+  int mNodes; //< number of nodes
+  std::string mNic; //< interface transfers are steered to - empty for devices
+  int mNicNode; //< node of mNic
+  cpu_set_t mCpus[DIAMOND_NUMA_MAX_NODES]; //< CPUs by node
+  XrdSysMutex mMutex; //< protects mStats
+  NodeStats mStats[DIAMOND_NUMA_MAX_NODES]; //< counters by node
+};
+
+//------------------------------------------------------------------------------
+//! Runs the calling thread on a node for the lifetime of the object and
+//! accounts the bytes moved meanwhile
+//------------------------------------------------------------------------------
+class DiamondNumaBinding {
+public:
+  DiamondNumaBinding (DiamondNuma* numa, int node, off_t* bytes);
+  ~DiamondNumaBinding ();
+
+private:
+  DiamondNuma* mNuma;
+  int mNode; //< bound node - -1 if the thread is not bound
+  off_t* mBytes; //< bytes to account when the binding ends
+  cpu_set_t mSaved; //< CPUs of the thread before the binding
+};
+
+#endif
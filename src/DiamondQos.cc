@@ -0,0 +1,332 @@
+// ----------------------------------------------------------------------
+// File: DiamondQos.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+
+#include "DiamondQos.hh"
+
+#include "XrdSec/XrdSecEntity.hh"
+#include "XrdSys/XrdSysError.hh"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+//------------------------------------------------------------------------------
+// Monotonic time in us
+//------------------------------------------------------------------------------
+static uint64_t
+DiamondQosNow ()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//------------------------------------------------------------------------------
+// Check if value is one of the entries of a list separated by blanks or commas
+//------------------------------------------------------------------------------
+static bool
+DiamondQosInList (const char* list, const std::string& value)
+{
+  if (!list)
+    return false;
+
+  const char* pos = list;
+  while (*pos)
+  {
+    size_t len = strcspn(pos, " ,");
+    if ((len == value.length()) && !value.compare(0, len, pos, len))
+      return true;
+    pos += len;
+    while (*pos == ' ' || *pos == ',')
+      pos++;
+  }
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// Add the default class
+//------------------------------------------------------------------------------
+int
+DiamondQos::Start (XrdSysError& err)
+{
+  // classes without slots would silently schedule nothing
+  if (!mSlots)
+  {
+    if (mClasses.empty())
+      return 0;
+    err.Emsg("Config", "diamond.qos.class", "requires diamond.qos.slots");
+    return 1;
+  }
+
+  if (mDefault < 0)
+  {
+    const char* emsg = AddClass("default", 1, std::vector<std::string>());
+    if (emsg)
+    {
+      err.Emsg("Config", "diamond.qos.class", emsg);
+      return 1;
+    }
+  }
+
+  char config[128];
+  snprintf(config, sizeof(config), "%llu slots, %lu classes, target %llu ms "
+           "up to %llu bytes", (unsigned long long) mSlots,
+           (unsigned long) mClasses.size(), (unsigned long long) mTarget,
+           (unsigned long long) mSmall);
+  err.Say("++++++ diamond qos scheduling ", config);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Add a class - the classes are only changed while the configuration is read
+//------------------------------------------------------------------------------
+const char*
+DiamondQos::AddClass (const std::string& name, uint64_t weight,
+                      const std::vector<std::string>& rules)
+{
+  if (name.empty())
+    return "requires a class name";
+  if (!weight)
+    return "weight must not be 0";
+  if (mClasses.size() >= DIAMOND_QOS_MAX_CLASSES)
+    return "too many classes";
+  for (size_t i = 0; i < mClasses.size(); i++)
+  {
+    if (mClasses[i].stats.name == name)
+      return "class defined twice";
+  }
+  if (rules.empty() && (mDefault >= 0))
+    return "default class defined twice";
+
+  Class c;
+  c.weight = weight;
+  c.stats.name = name;
+  c.stats.weight = weight;
+  for (size_t i = 0; i < rules.size(); i++)
+  {
+    size_t pos = rules[i].find(':');
+    if ((pos == std::string::npos) || (pos + 1 == rules[i].length()))
+      return "rules are given as <type>:<value>";
+    std::string type = rules[i].substr(0, pos);
+    if ((type != "vo") && (type != "user") && (type != "group") &&
+        (type != "role") && (type != "prot"))
+      return "rule type must be vo, user, group, role or prot";
+    c.rules.push_back(std::make_pair(type, rules[i].substr(pos + 1)));
+  }
+
+  if (rules.empty())
+    mDefault = mClasses.size();
+  mClasses.push_back(c);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Check the rules of a class
+//------------------------------------------------------------------------------
+bool
+DiamondQos::Match (const Class& c, const XrdSecEntity& client)
+{
+  for (size_t i = 0; i < c.rules.size(); i++)
+  {
+    const std::string& type = c.rules[i].first;
+    const std::string& value = c.rules[i].second;
+    if (((type == "vo") && DiamondQosInList(client.vorg, value)) ||
+        ((type == "group") && DiamondQosInList(client.grps, value)) ||
+        ((type == "role") && DiamondQosInList(client.role, value)) ||
+        ((type == "user") && client.name && (value == client.name)) ||
+        ((type == "prot") && (value == client.prot)))
+      return true;
+  }
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// Classify a client by the first matching class
+//------------------------------------------------------------------------------
+int
+DiamondQos::Classify (const XrdSecEntity& client)
+{
+  if (!mSlots)
+    return -1;
+
+  for (size_t i = 0; i < mClasses.size(); i++)
+  {
+    if (!mClasses[i].rules.empty() && Match(mClasses[i], client))
+      return i;
+  }
+  return mDefault;
+}
+
+//------------------------------------------------------------------------------
+// Start tag of a request - a class which has been idle starts at the virtual
+// time, so it can not claim the share it did not use
+//------------------------------------------------------------------------------
+double
+DiamondQos::Tag (int cls, uint64_t length)
+{
+  Class& c = mClasses[cls];
+  double start = (c.finish > mVirtual) ? c.finish : mVirtual;
+  c.finish = start + (double) (length + 1) / c.weight;
+  return start;
+}
+
+//------------------------------------------------------------------------------
+// Account a started request
+//------------------------------------------------------------------------------
+void
+DiamondQos::Run (int cls, uint64_t length, double tag, uint64_t waitus)
+{
+  ClassStats& stats = mClasses[cls].stats;
+  mBusy++;
+  stats.active++;
+  if (tag > mVirtual)
+    mVirtual = tag;
+
+  stats.waitus += waitus;
+  if (waitus > stats.maxwaitus)
+    stats.maxwaitus = waitus;
+  if ((length <= mSmall) && (waitus > mTarget * 1000))
+    stats.late++;
+}
+
+//------------------------------------------------------------------------------
+// Wait for a slot - a small request past its latency target starts without
+//------------------------------------------------------------------------------
+void
+DiamondQos::Acquire (int cls, uint64_t length)
+{
+  uint64_t now = DiamondQosNow();
+  bool small = (length <= mSmall);
+
+  mMutex.Lock();
+  ClassStats& stats = mClasses[cls].stats;
+  stats.requests++;
+  stats.bytes += length;
+  if (small)
+    stats.small++;
+
+  double tag = Tag(cls, length);
+  if (mQueue.empty() && (mBusy < mSlots))
+  {
+    Run(cls, length, tag, 0);
+    mMutex.UnLock();
+    return;
+  }
+
+  Waiter waiter(cls, length, tag, now);
+  mQueue.push_back(&waiter);
+  stats.queued++;
+  mMutex.UnLock();
+
+  uint64_t deadline = now + mTarget * 1000;
+  waiter.cond.Lock();
+  while (!waiter.granted)
+  {
+    if (!small)
+    {
+      waiter.cond.Wait();
+      continue;
+    }
+
+    now = DiamondQosNow();
+    if (now < deadline)
+    {
+      waiter.cond.WaitMS((deadline - now + 999) / 1000);
+      continue;
+    }
+
+    // a slot might be handed over while the queue is locked
+    waiter.cond.UnLock();
+    mMutex.Lock();
+    if (waiter.queued)
+    {
+      mQueue.remove(&waiter);
+      Run(cls, length, tag, DiamondQosNow() - waiter.arrival);
+      mMutex.UnLock();
+      return;
+    }
+    mMutex.UnLock();
+    waiter.cond.Lock();
+    small = false;
+  }
+  waiter.cond.UnLock();
+}
+
+//------------------------------------------------------------------------------
+// Hand the slot to the next request - an overdue small request before the
+// smallest start tag
+//------------------------------------------------------------------------------
+void
+DiamondQos::Release (int cls)
+{
+  uint64_t now = DiamondQosNow();
+  Waiter* next = 0;
+
+  mMutex.Lock();
+  mClasses[cls].stats.active--;
+  mBusy--;
+  if ((mBusy < mSlots) && !mQueue.empty())
+  {
+    std::list<Waiter*>::iterator pick = mQueue.end();
+    for (std::list<Waiter*>::iterator it = mQueue.begin(); it != mQueue.end();
+         it++)
+    {
+      if (((*it)->length <= mSmall) &&
+          ((now - (*it)->arrival) >= mTarget * 1000))
+      {
+        pick = it;
+        break;
+      }
+      if ((pick == mQueue.end()) || ((*it)->tag < (*pick)->tag))
+        pick = it;
+    }
+    next = *pick;
+    mQueue.erase(pick);
+    next->queued = false;
+    Run(next->cls, next->length, next->tag, now - next->arrival);
+  }
+  mMutex.UnLock();
+
+  if (next)
+  {
+    next->cond.Lock();
+    next->granted = true;
+    next->cond.Signal();
+    next->cond.UnLock();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Return the counters of all classes
+//------------------------------------------------------------------------------
+std::vector<DiamondQos::ClassStats>
+DiamondQos::GetStats ()
+{
+  std::vector<ClassStats> stats;
+  XrdSysMutexHelper lLock(mMutex);
+  for (size_t i = 0; i < mClasses.size(); i++)
+    stats.push_back(mClasses[i].stats);
+  return stats;
+}
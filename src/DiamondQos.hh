@@ -0,0 +1,181 @@
+// ----------------------------------------------------------------------
+// File: DiamondQos.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#ifndef __DIAMONDQOS_API_H__
+#define __DIAMONDQOS_API_H__
+#include "XrdSys/XrdSysPthread.hh"
+
+#include <stdint.h>
+#include <list>
+#include <string>
+#include <vector>
+
+class XrdSecEntity;
+class XrdSysError;
+
+#define DIAMOND_QOS_MAX_CLASSES 16
+#define DIAMOND_DEFAULT_QOS_SMALL 64*1024
+#define DIAMOND_DEFAULT_QOS_TARGET 10
+
+//------------------------------------------------------------------------------
+//! I/O scheduler of client reads and writes. At most 'slots' requests reach
+//! the backend at once, the others wait in the order of weighted fair queueing
+//! over the classes of their clients: each request gets a start tag of its
+//! class advanced by its length divided by the class weight, and the waiting
+//! request with the smallest tag runs next. A small request waiting longer
+//! than the latency target runs even when all slots are busy. A client gets
+//! the first class matching its identity, unmatched clients the default class.
+//------------------------------------------------------------------------------
+class DiamondQos {
+public:
+
+  struct ClassStats {
+    ClassStats () : weight(0), requests(0), bytes(0), queued(0), waitus(0),
+                    maxwaitus(0), small(0), late(0), active(0) { }
+    std::string name; //< class name
+    unsigned long long weight; //< share of the backend
+    unsigned long long requests; //< requests scheduled
+    unsigned long long bytes; //< bytes requested
+    unsigned long long queued; //< requests which had to wait for a slot
+    unsigned long long waitus; //< total wait of the queued requests
+    unsigned long long maxwaitus; //< longest wait of a request
+    unsigned long long small; //< requests up to the small request size
+    unsigned long long late; //< small requests started past the latency target
+    unsigned long long active; //< requests running on the backend
+  };
+
+  DiamondQos () : mSlots(0), mSmall(DIAMOND_DEFAULT_QOS_SMALL),
+                  mTarget(DIAMOND_DEFAULT_QOS_TARGET), mBusy(0), mVirtual(0),
+                  mDefault(-1) { }
+
+  //----------------------------------------------------------------------------
+  //! Add the default class if none has been configured - does nothing
+  //! without slots and refuses classes configured without slots
+  //----------------------------------------------------------------------------
+  int Start (XrdSysError& err);
+
+  bool Enabled () const { return mSlots; }
+
+  //----------------------------------------------------------------------------
+  //! Add a class from its configuration
+  //!
+  //! @param rules 'vo:<vo>', 'user:<name>', 'group:<group>', 'role:<role>' or
+  //!        'prot:<protocol>' - a class without rules is the default class
+  //! @return 0 or an error message
+  //----------------------------------------------------------------------------
+  const char* AddClass (const std::string& name, uint64_t weight,
+                        const std::vector<std::string>& rules);
+
+  //----------------------------------------------------------------------------
+  //! Return the class of a client - -1 if the scheduler is disabled
+  //----------------------------------------------------------------------------
+  int Classify (const XrdSecEntity& client);
+
+  //----------------------------------------------------------------------------
+  //! Wait until a request of length bytes of class cls may run
+  //----------------------------------------------------------------------------
+  void Acquire (int cls, uint64_t length);
+
+  //----------------------------------------------------------------------------
+  //! A request of class cls finished on the backend
+  //----------------------------------------------------------------------------
+  void Release (int cls);
+
+  std::vector<ClassStats> GetStats ();
+
+  void SetSlots (uint64_t slots) { mSlots = slots; }
+  void SetSmall (uint64_t small) { mSmall = small; }
+  void SetTarget (uint64_t ms) { mTarget = ms; }
+
+private:
+
+  struct Class {
+    Class () : weight(1), finish(0) { }
+    std::vector<std::pair<std::string, std::string> > rules; //< type and value
+    uint64_t weight; //< share of the backend
+    double finish; //< finish tag of the last request of the class
+    ClassStats stats; //< counters
+  };
+
+  struct Waiter {
+    Waiter (int c, uint64_t l, double t, uint64_t now) : cls(c), length(l),
+      tag(t), arrival(now), queued(true), granted(false), cond(0) { }
+    int cls; //< class of the request
+    uint64_t length; //< bytes of the request
+    double tag; //< start tag - the smallest runs next
+    uint64_t arrival; //< monotonic time of arrival in us
+    bool queued; //< in mQueue - protected by mMutex
+    bool granted; //< a slot has been handed over - protected by cond
+    XrdSysCondVar cond; //< wakes the waiting thread
+  };
+
+  //----------------------------------------------------------------------------
+  //! Check if client matches a rule of a class
+  //----------------------------------------------------------------------------
+  static bool Match (const Class& c, const XrdSecEntity& client);
+
+  //----------------------------------------------------------------------------
+  //! Assign the start tag of a request - called with mMutex held
+  //----------------------------------------------------------------------------
+  double Tag (int cls, uint64_t length);
+
+  //----------------------------------------------------------------------------
+  //! Account the start of a request - called with mMutex held
+  //----------------------------------------------------------------------------
+  void Run (int cls, uint64_t length, double tag, uint64_t waitus);
+
+  XrdSysMutex mMutex; //< protects the classes, the queue and the slots
+  uint64_t mSlots; //< requests running on the backend at once - 0 disables
+  uint64_t mSmall; //< largest request with a latency target
+  uint64_t mTarget; //< latency target of small requests in ms
+  uint64_t mBusy; //< requests running on the backend
+  double mVirtual; //< virtual time - start tag of the latest started request
+  int mDefault; //< class of unmatched clients
+  std::vector<Class> mClasses; //< classes in configuration order
+  std::list<Waiter*> mQueue; //< requests waiting for a slot
+};
+
+//------------------------------------------------------------------------------
+//! Holds a scheduler slot for the lifetime of a request - a negative class
+//! is not scheduled
+//------------------------------------------------------------------------------
+class DiamondQosSlot {
+public:
+  DiamondQosSlot (DiamondQos& qos, int cls, uint64_t length) : mQos(qos),
+    mClass(cls) {
+    if (mClass >= 0)
+      mQos.Acquire(mClass, length);
+  }
+
+  ~DiamondQosSlot () {
+    if (mClass >= 0)
+      mQos.Release(mClass);
+  }
+
+private:
+  DiamondQos& mQos;
+  int mClass;
+};
+
+#endif
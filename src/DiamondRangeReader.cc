@@ -0,0 +1,559 @@
+// ----------------------------------------------------------------------
+// File: DiamondRangeReader.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#include "DiamondRangeReader.hh"
+
+#include <time.h>
+
+//------------------------------------------------------------------------------
+// Monotonic time in ms
+//------------------------------------------------------------------------------
+static uint64_t
+DiamondRangeNow ()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//------------------------------------------------------------------------------
+// Response of an open - runs in a client thread
+//------------------------------------------------------------------------------
+void
+DiamondRangeOpen::HandleResponse (XrdCl::XRootDStatus* status,
+                                  XrdCl::AnyObject* response)
+{
+  mOk = status && status->IsOK();
+  if (!mOk)
+    mMessage = status ? status->ToString() : "no response";
+  delete status;
+  delete response;
+  mDone.Post();
+}
+
+//------------------------------------------------------------------------------
+// Response of a block read - runs in a client thread
+//------------------------------------------------------------------------------
+void
+DiamondRangeRequest::HandleResponse (XrdCl::XRootDStatus* status,
+                                     XrdCl::AnyObject* response)
+{
+  int64_t result = -1;
+  std::string message;
+  if (status && status->IsOK() && response)
+  {
+    XrdCl::ChunkInfo* chunk = 0;
+    response->Get(chunk);
+    result = chunk ? chunk->length : 0;
+  }
+  else
+  {
+    message = status ? status->ToString() : "no response";
+  }
+  delete status;
+  delete response;
+
+  // the reader may delete the request as soon as the lock is released
+  XrdSysCondVar* cond = mCond;
+  cond->Lock();
+  mResult = result;
+  mMessage = message;
+  mEnd = DiamondRangeNow();
+  mComplete = true;
+  cond->Broadcast();
+  cond->UnLock();
+}
+
+//------------------------------------------------------------------------------
+// Constructor - a file of unknown size is read from the first source only
+//------------------------------------------------------------------------------
+DiamondRangeReader::DiamondRangeReader (const std::vector<XrdCl::File*>& files,
+                                        DiamondIOEngine* engine,
+                                        size_t blocksize, size_t streams,
+                                        off_t size, int node) :
+  mCond(0), mLive(0), mEngine(engine), mBlockSize(blocksize),
+  mStreams((streams && (size >= 0)) ? streams : 1), mSize(size), mNode(node),
+  mNext(0), mEnd(false), mHedged(0)
+{
+  for (size_t i = 0; i < files.size(); i++)
+  {
+    if ((size < 0) && i)
+      break;
+    mSources.push_back(Source(files[i]));
+    mLive++;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Destructor
+//------------------------------------------------------------------------------
+DiamondRangeReader::~DiamondRangeReader ()
+{
+  while (!mInFlight.empty())
+  {
+    Range* range = mInFlight.front();
+    mInFlight.pop_front();
+    for (size_t i = 0; i < range->requests.size(); i++)
+    {
+      Wait(range->requests[i]);
+      mEngine->PutBuffer(range->requests[i]->mBuffer, mBlockSize, mNode);
+      delete range->requests[i];
+    }
+    delete range;
+  }
+  for (size_t i = 0; i < mAbandoned.size(); i++)
+  {
+    Wait(mAbandoned[i]);
+    mEngine->PutBuffer(mAbandoned[i]->mBuffer, mBlockSize, mNode);
+    delete mAbandoned[i];
+  }
+}
+
+//------------------------------------------------------------------------------
+// Wait for the response of a request
+//------------------------------------------------------------------------------
+void
+DiamondRangeReader::Wait (DiamondRangeRequest* request)
+{
+  XrdSysCondVarHelper lock(mCond);
+  while (!request->mComplete)
+    mCond.Wait();
+}
+
+//------------------------------------------------------------------------------
+// Check if a response holds the complete block - without a size any length
+// up to the block size is complete
+//------------------------------------------------------------------------------
+bool
+DiamondRangeReader::Complete (const DiamondRangeRequest* request) const
+{
+  if (request->mResult < 0)
+    return false;
+  return (mSize < 0) || (request->mResult == (int64_t) request->mLength);
+}
+
+//------------------------------------------------------------------------------
+// Account a response to the throughput of its source
+//------------------------------------------------------------------------------
+void
+DiamondRangeReader::Account (DiamondRangeRequest* request)
+{
+  Source& source = mSources[request->mSource];
+  if (source.inflight)
+    source.inflight--;
+  if (!Complete(request))
+  {
+    Drop(request->mSource, (request->mResult < 0) ? request->mMessage :
+         "short read - the source changed during the transfer");
+    return;
+  }
+  uint64_t ms = request->mEnd - request->mStart;
+  double rate = (1000.0 * request->mResult) / (ms ? ms : 1);
+  source.rate = source.rate ? (0.7 * source.rate + 0.3 * rate) : rate;
+}
+
+//------------------------------------------------------------------------------
+// Account a response which is not handed out and return its buffer
+//------------------------------------------------------------------------------
+void
+DiamondRangeReader::Reap (DiamondRangeRequest* request)
+{
+  Account(request);
+  mEngine->PutBuffer(request->mBuffer, mBlockSize, mNode);
+  delete request;
+}
+
+//------------------------------------------------------------------------------
+// Stop reading from a failed source
+//------------------------------------------------------------------------------
+void
+DiamondRangeReader::Drop (size_t source, const std::string& message)
+{
+  if (mSources[source].stats.dropped)
+    return;
+  mSources[source].stats.dropped = true;
+  mSources[source].stats.message = message;
+  mMessage = message;
+  mLive--;
+}
+
+//------------------------------------------------------------------------------
+// Reap the slower reads of blocks already handed out which have finished
+//------------------------------------------------------------------------------
+void
+DiamondRangeReader::Collect ()
+{
+  std::vector<DiamondRangeRequest*> done;
+  mCond.Lock();
+  for (size_t i = 0; i < mAbandoned.size();)
+  {
+    if (mAbandoned[i]->mComplete)
+    {
+      done.push_back(mAbandoned[i]);
+      mAbandoned.erase(mAbandoned.begin() + i);
+    }
+    else
+    {
+      i++;
+    }
+  }
+  mCond.UnLock();
+
+  for (size_t i = 0; i < done.size(); i++)
+    Reap(done[i]);
+}
+
+//------------------------------------------------------------------------------
+// Choose the source of a new read - a source without samples is assumed to
+// be as fast as the fastest one, so every source gets probed
+//------------------------------------------------------------------------------
+int
+DiamondRangeReader::Pick (int exclude)
+{
+  double best = 0;
+  for (size_t i = 0; i < mSources.size(); i++)
+  {
+    if (!mSources[i].stats.dropped && (mSources[i].rate > best))
+      best = mSources[i].rate;
+  }
+  if (!best)
+    best = 1;
+
+  int pick = -1;
+  double cost = 0;
+  for (size_t i = 0; i < mSources.size(); i++)
+  {
+    if (mSources[i].stats.dropped || ((int) i == exclude))
+      continue;
+    double rate = mSources[i].rate ? mSources[i].rate : best;
+    double c = (mSources[i].inflight + 1) / rate;
+    if ((pick < 0) || (c < cost))
+    {
+      pick = i;
+      cost = c;
+    }
+  }
+  return pick;
+}
+
+//------------------------------------------------------------------------------
+// Read a block from a source
+//------------------------------------------------------------------------------
+bool
+DiamondRangeReader::Submit (Range* range, size_t source)
+{
+  char* buffer = mEngine->GetBuffer(mBlockSize, mNode);
+  if (!buffer)
+    return false;
+
+  DiamondRangeRequest* request = new DiamondRangeRequest(&mCond, buffer,
+                                                         range->offset,
+                                                         range->length,
+                                                         source);
+  request->mStart = DiamondRangeNow();
+  range->requests.push_back(request);
+  mSources[source].inflight++;
+  mSources[source].stats.requests++;
+
+  XrdCl::XRootDStatus status = mSources[source].file->Read(range->offset,
+                                                           range->length,
+                                                           buffer, request,
+                                                           DIAMOND_TPC_READ_TIMEOUT);
+  if (!status.IsOK())
+  {
+    XrdSysCondVarHelper lock(mCond);
+    request->mResult = -1;
+    request->mMessage = status.ToString();
+    request->mEnd = request->mStart;
+    request->mComplete = true;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Time until a block is requested again - a straggler is a read taking
+// DIAMOND_TPC_HEDGE_FACTOR times longer than its source's throughput predicts
+//------------------------------------------------------------------------------
+int64_t
+DiamondRangeReader::HedgeWait (const Range* range)
+{
+  if (range->hedged || range->requests.empty())
+    return -1;
+
+  // a read from a dropped source is taken over right away
+  const DiamondRangeRequest* request = range->requests.front();
+  bool dropped = mSources[request->mSource].stats.dropped;
+  if (mLive < (dropped ? 1u : 2u))
+    return -1;
+  if (dropped)
+    return 0;
+
+  double rate = mSources[request->mSource].rate;
+  uint64_t delay = DIAMOND_TPC_HEDGE_MIN_MS * DIAMOND_TPC_HEDGE_FACTOR;
+  if (rate)
+  {
+    delay = (uint64_t) (DIAMOND_TPC_HEDGE_FACTOR * 1000.0 * range->length / rate);
+    if (delay < DIAMOND_TPC_HEDGE_MIN_MS)
+      delay = DIAMOND_TPC_HEDGE_MIN_MS;
+  }
+
+  uint64_t now = DiamondRangeNow();
+  if (now >= (request->mStart + delay))
+    return 0;
+  return request->mStart + delay - now;
+}
+
+//------------------------------------------------------------------------------
+// Keep mStreams reads in flight per source
+//------------------------------------------------------------------------------
+void
+DiamondRangeReader::Fill ()
+{
+  while (!mEnd && (mInFlight.size() < (mStreams * mLive)))
+  {
+    // a known size bounds the ranges, so no read is issued beyond the end
+    if ((mSize >= 0) && (mNext >= mSize))
+    {
+      mEnd = true;
+      break;
+    }
+
+    uint32_t length = mBlockSize;
+    if ((mSize >= 0) && ((mSize - mNext) < (off_t) length))
+      length = mSize - mNext;
+
+    int source = Pick(-1);
+    if (source < 0)
+      break;
+
+    Range* range = new Range(mNext, length);
+    if (!Submit(range, source))
+    {
+      delete range;
+      break;
+    }
+    mInFlight.push_back(range);
+    mNext += length;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Hand out the next block
+//------------------------------------------------------------------------------
+int64_t
+DiamondRangeReader::Next (char*& buffer, std::string& emsg)
+{
+  buffer = 0;
+  Collect();
+  Fill();
+  if (mInFlight.empty())
+  {
+    if (!mEnd)
+    {
+      emsg = mLive ? "no I/O buffer available" : mMessage;
+      return -1;
+    }
+    return 0;
+  }
+
+  Range* range = mInFlight.front();
+  DiamondRangeRequest* winner = 0;
+  while (!winner)
+  {
+    // wait for a response to the block or until it is due for a hedge
+    std::vector<DiamondRangeRequest*> done;
+    mCond.Lock();
+    while (1)
+    {
+      for (size_t i = 0; i < range->requests.size();)
+      {
+        if (range->requests[i]->mComplete)
+        {
+          done.push_back(range->requests[i]);
+          range->requests.erase(range->requests.begin() + i);
+        }
+        else
+        {
+          i++;
+        }
+      }
+      if (!done.empty())
+        break;
+      int64_t wait = HedgeWait(range);
+      if (!wait)
+        break;
+      if (wait < 0)
+        mCond.Wait();
+      else
+        mCond.WaitMS(wait);
+    }
+    mCond.UnLock();
+
+    // the first complete response wins, failed sources are dropped
+    for (size_t i = 0; i < done.size(); i++)
+    {
+      if (!winner && Complete(done[i]))
+        winner = done[i];
+      else
+        Reap(done[i]);
+    }
+    if (winner)
+      break;
+
+    if (done.empty())
+    {
+      // a straggler - its source is considered slower from now on
+      range->hedged = true;
+      size_t slow = range->requests.front()->mSource;
+      int source = Pick(slow);
+      if ((source >= 0) && Submit(range, source))
+      {
+        mSources[slow].rate /= 2;
+        mHedged++;
+      }
+      continue;
+    }
+
+    if (range->requests.empty())
+    {
+      // every read of the block failed - another source takes over
+      int source = Pick(-1);
+      if ((source < 0) || !Submit(range, source))
+      {
+        emsg = mLive ? "no I/O buffer available" : mMessage;
+        mInFlight.pop_front();
+        delete range;
+        return -1;
+      }
+    }
+  }
+
+  // a slower read of the block is reaped once it finished
+  mInFlight.pop_front();
+  for (size_t i = 0; i < range->requests.size(); i++)
+    mAbandoned.push_back(range->requests[i]);
+  delete range;
+
+  Account(winner);
+  int64_t result = winner->mResult;
+  mSources[winner->mSource].stats.bytes += result;
+
+  // without a size the first short read is the end
+  if ((mSize < 0) && (result < (int64_t) winner->mLength))
+    mEnd = true;
+
+  if (result > 0)
+  {
+    buffer = winner->mBuffer;
+  }
+  else
+  {
+    mEngine->PutBuffer(winner->mBuffer, mBlockSize, mNode);
+  }
+  delete winner;
+
+  // the next reads are in flight while the caller handles this block
+  if (result > 0)
+    Fill();
+  return result;
+}
+
+//------------------------------------------------------------------------------
+// Constructor
+//------------------------------------------------------------------------------
+DiamondRangeWindow::DiamondRangeWindow (XrdCl::File* file, size_t blocksize,
+                                        size_t depth) :
+  mFile(file), mCond(0),
+  mBuffers(depth ? depth : 1, std::vector<char>(blocksize)), mSubmitted(0)
+{
+}
+
+//------------------------------------------------------------------------------
+// Destructor - the responses must not arrive after the buffers are gone
+//------------------------------------------------------------------------------
+DiamondRangeWindow::~DiamondRangeWindow ()
+{
+  while (!mInFlight.empty())
+  {
+    Wait(mInFlight.front());
+    delete mInFlight.front();
+    mInFlight.pop_front();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Wait for the response of a request
+//------------------------------------------------------------------------------
+void
+DiamondRangeWindow::Wait (DiamondRangeRequest* request)
+{
+  XrdSysCondVarHelper lock(mCond);
+  while (!request->mComplete)
+    mCond.Wait();
+}
+
+//------------------------------------------------------------------------------
+// Submit a read - the buffers are used round robin, a full window has handed
+// out the oldest read of the buffer before
+//------------------------------------------------------------------------------
+void
+DiamondRangeWindow::Submit (uint64_t offset, uint32_t length)
+{
+  char* buffer = &mBuffers[mSubmitted++ % mBuffers.size()][0];
+  DiamondRangeRequest* request = new DiamondRangeRequest(&mCond, buffer,
+                                                         offset, length, 0);
+  request->mStart = DiamondRangeNow();
+  mInFlight.push_back(request);
+
+  XrdCl::XRootDStatus status = mFile->Read(offset, length, buffer, request,
+                                           DIAMOND_TPC_READ_TIMEOUT);
+  if (!status.IsOK())
+  {
+    XrdSysCondVarHelper lock(mCond);
+    request->mResult = -1;
+    request->mMessage = status.ToString();
+    request->mEnd = request->mStart;
+    request->mComplete = true;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Hand out the oldest read
+//------------------------------------------------------------------------------
+int64_t
+DiamondRangeWindow::Next (char*& buffer, uint64_t& offset, std::string& emsg)
+{
+  if (mInFlight.empty())
+    return -1;
+
+  DiamondRangeRequest* request = mInFlight.front();
+  mInFlight.pop_front();
+  Wait(request);
+  buffer = request->mBuffer;
+  offset = request->mOffset;
+  emsg = request->mMessage;
+  int64_t result = request->mResult;
+  delete request;
+  return result;
+}
@@ -0,0 +1,240 @@
+// ----------------------------------------------------------------------
+// File: DiamondRangeReader.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#ifndef __DIAMONDRANGEREADER_API_H__
+#define __DIAMONDRANGEREADER_API_H__
+#include "XrdCl/XrdClFile.hh"
+#include "XrdSys/XrdSysPthread.hh"
+
+#include "DiamondIOEngine.hh"
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#define DIAMOND_DEFAULT_TPC_STREAMS 4
+#define DIAMOND_TPC_READ_TIMEOUT 30
+#define DIAMOND_TPC_HEDGE_MIN_MS 1000
+#define DIAMOND_TPC_HEDGE_FACTOR 4
+
+//------------------------------------------------------------------------------
+//! Asynchronous open of a remote source
+//------------------------------------------------------------------------------
+class DiamondRangeOpen : public XrdCl::ResponseHandler {
+public:
+  DiamondRangeOpen () : mOk(false) { }
+
+  void HandleResponse (XrdCl::XRootDStatus* status,
+                       XrdCl::AnyObject* response);
+
+  bool mOk; //< the source has been opened
+  std::string mMessage; //< reason of a failure
+  XrdSysSemaphore mDone; //< posted when the response arrived
+};
+
+//------------------------------------------------------------------------------
+//! One asynchronous block read of a remote file
+//------------------------------------------------------------------------------
+class DiamondRangeRequest : public XrdCl::ResponseHandler {
+public:
+  DiamondRangeRequest (XrdSysCondVar* cond, char* buffer, uint64_t offset,
+                       uint32_t length, size_t source) :
+    mCond(cond), mBuffer(buffer), mOffset(offset), mLength(length),
+    mSource(source), mStart(0), mEnd(0), mComplete(false), mResult(0) { }
+
+  void HandleResponse (XrdCl::XRootDStatus* status,
+                       XrdCl::AnyObject* response);
+
+  XrdSysCondVar* mCond; //< broadcast when the response arrived
+  char* mBuffer; //< I/O engine buffer receiving the data
+  uint64_t mOffset;
+  uint32_t mLength;
+  size_t mSource; //< index of the source the block is read from
+  uint64_t mStart; //< submission time in ms
+  uint64_t mEnd; //< response time in ms
+  bool mComplete; //< the response arrived - protected by mCond
+  int64_t mResult; //< bytes read or -1
+  std::string mMessage; //< reason of a failure
+};
+
+//------------------------------------------------------------------------------
+//! Reads a remote file with several block reads in flight and hands the blocks
+//! out in order. With an HTTP(S) source each read is a Range request on the
+//! keep-alive connections of the client, XRootD sources get pipelined reads.
+//! Without a known size the file is read from the first source one block at a
+//! time up to a short read.
+//!
+//! A file of known size can be read from several replicas at once: each block
+//! goes to the source with the shortest expected completion, estimated from
+//! its reads in flight and its observed throughput. The block the caller waits
+//! for is requested again from another source when it takes much longer than
+//! expected, the first complete response is used. A source failing a read is
+//! dropped and its blocks are read from the others - the transfer only fails
+//! without a source left.
+//------------------------------------------------------------------------------
+class DiamondRangeReader {
+public:
+
+  struct SourceStats {
+    SourceStats () : bytes(0), requests(0), dropped(false) { }
+    unsigned long long bytes; //< bytes of the blocks handed out
+    unsigned long long requests; //< block reads submitted
+    bool dropped; //< the source failed a read
+    std::string message; //< reason of the failure
+  };
+
+  DiamondRangeReader (const std::vector<XrdCl::File*>& files,
+                      DiamondIOEngine* engine, size_t blocksize,
+                      size_t streams, off_t size, int node = -1);
+
+  //----------------------------------------------------------------------------
+  //! Wait for all reads in flight and return their buffers
+  //----------------------------------------------------------------------------
+  ~DiamondRangeReader ();
+
+  //----------------------------------------------------------------------------
+  //! Wait for the next block
+  //!
+  //! @param buffer I/O engine buffer of blocksize bytes holding the block - it
+  //!        belongs to the caller afterwards
+  //! @param emsg reason of a failure
+  //! @return bytes of the block, 0 at the end of the file or -1
+  //----------------------------------------------------------------------------
+  int64_t Next (char*& buffer, std::string& emsg);
+
+  size_t Sources () const { return mSources.size(); }
+  const SourceStats& GetStats (size_t source) const
+  {
+    return mSources[source].stats;
+  }
+  unsigned long long Hedged () const { return mHedged; }
+
+private:
+  struct Source {
+    Source (XrdCl::File* f) : file(f), inflight(0), rate(0) { }
+    XrdCl::File* file;
+    size_t inflight; //< reads in flight
+    double rate; //< observed throughput in bytes/s - 0 if unknown
+    SourceStats stats;
+  };
+
+  struct Range {
+    Range (uint64_t o, uint32_t l) : offset(o), length(l), hedged(false) { }
+    uint64_t offset;
+    uint32_t length;
+    bool hedged; //< a second source has been asked
+    std::vector<DiamondRangeRequest*> requests; //< reads in flight
+  };
+
+  //----------------------------------------------------------------------------
+  //! Submit reads until the configured number is in flight
+  //----------------------------------------------------------------------------
+  void Fill ();
+
+  //----------------------------------------------------------------------------
+  //! Read range from source
+  //!
+  //! @return false if no I/O buffer is available
+  //----------------------------------------------------------------------------
+  bool Submit (Range* range, size_t source);
+
+  //----------------------------------------------------------------------------
+  //! Return the source with the shortest expected completion of a new read -
+  //! -1 if no source other than exclude is left
+  //----------------------------------------------------------------------------
+  int Pick (int exclude);
+
+  //----------------------------------------------------------------------------
+  //! Return the ms until range is requested again - 0 if due, -1 if never
+  //----------------------------------------------------------------------------
+  int64_t HedgeWait (const Range* range);
+
+  bool Complete (const DiamondRangeRequest* request) const;
+  void Account (DiamondRangeRequest* request);
+  void Reap (DiamondRangeRequest* request);
+  void Drop (size_t source, const std::string& message);
+  void Collect ();
+  void Wait (DiamondRangeRequest* request);
+
+  XrdSysCondVar mCond; //< protects the responses of the requests
+  std::vector<Source> mSources;
+  size_t mLive; //< sources which have not been dropped
+  DiamondIOEngine* mEngine;
+  size_t mBlockSize;
+  size_t mStreams; //< maximum number of blocks in flight per source
+  off_t mSize; //< size of the remote file - -1 if unknown
+  int mNode; //< NUMA node of the buffers
+  off_t mNext; //< offset of the next read to submit
+  bool mEnd; //< the end of the file has been reached
+  std::string mMessage; //< reason of the last source failure
+  unsigned long long mHedged; //< blocks requested from a second source
+  std::deque<Range*> mInFlight; //< blocks in offset order
+  std::vector<DiamondRangeRequest*> mAbandoned; //< slower reads of blocks already handed out
+};
+
+//------------------------------------------------------------------------------
+//! Keeps a number of reads of arbitrary blocks of one remote file in flight
+//! and hands them out in submission order - used for the changed blocks of a
+//! delta TPC
+//------------------------------------------------------------------------------
+class DiamondRangeWindow {
+public:
+  DiamondRangeWindow (XrdCl::File* file, size_t blocksize, size_t depth);
+
+  //----------------------------------------------------------------------------
+  //! Wait for all reads in flight
+  //----------------------------------------------------------------------------
+  ~DiamondRangeWindow ();
+
+  bool Full () const { return mInFlight.size() >= mBuffers.size(); }
+  bool Empty () const { return mInFlight.empty(); }
+
+  //----------------------------------------------------------------------------
+  //! Read length bytes at offset - requires a window which is not full
+  //----------------------------------------------------------------------------
+  void Submit (uint64_t offset, uint32_t length);
+
+  //----------------------------------------------------------------------------
+  //! Wait for the oldest read and remove it from the window
+  //!
+  //! @param buffer data of the read - valid until the next Submit
+  //! @param offset offset of the read
+  //! @param emsg reason of a failure
+  //! @return bytes read or -1
+  //----------------------------------------------------------------------------
+  int64_t Next (char*& buffer, uint64_t& offset, std::string& emsg);
+
+private:
+  void Wait (DiamondRangeRequest* request);
+
+  XrdCl::File* mFile;
+  XrdSysCondVar mCond; //< protects the responses of the requests
+  std::vector<std::vector<char> > mBuffers; //< one buffer per read in flight
+  size_t mSubmitted; //< reads submitted - selects the buffer of the next one
+  std::deque<DiamondRangeRequest*> mInFlight; //< reads in submission order
+};
+
+#endif
@@ -0,0 +1,128 @@
+// ----------------------------------------------------------------------
+// File: DiamondReadV.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#include "DiamondReadV.hh"
+#include "DiamondFile.hh"
+
+#include <string.h>
+#include <algorithm>
+
+//------------------------------------------------------------------------------
+//! Orders chunk indices by offset
+//------------------------------------------------------------------------------
+struct DiamondReadVOrder {
+  DiamondReadVOrder (const XrdOucIOVec* readV) : mReadV(readV) { }
+
+  bool
+  operator() (int a, int b) const {
+    return mReadV[a].offset < mReadV[b].offset;
+  }
+
+  const XrdOucIOVec* mReadV;
+};
+
+//------------------------------------------------------------------------------
+// Merge nearby chunks into extents
+//------------------------------------------------------------------------------
+size_t
+DiamondReadV::Coalesce (const XrdOucIOVec* readV,
+                        int readCount,
+                        size_t gap,
+                        size_t stripe,
+                        std::vector<DiamondReadVExtent>& extents)
+{
+  std::vector<int> order(readCount);
+  for (int i = 0; i < readCount; i++)
+    order[i] = i;
+  std::sort(order.begin(), order.end(), DiamondReadVOrder(readV));
+
+  extents.clear();
+  for (int i = 0; i < readCount; i++)
+  {
+    const XrdOucIOVec& chunk = readV[order[i]];
+    long long chunk_end = chunk.offset + chunk.size;
+
+    if (!extents.empty())
+    {
+      DiamondReadVExtent& last = extents.back();
+      long long last_end = last.offset + last.length;
+      long long new_end = std::max(last_end, chunk_end);
+
+      if ((chunk.offset <= (long long) (last_end + gap)) &&
+          (!stripe || ((last.offset / (long long) stripe) ==
+                       ((new_end - 1) / (long long) stripe))))
+      {
+        last.length = new_end - last.offset;
+        last.chunks.push_back(order[i]);
+        continue;
+      }
+    }
+
+    DiamondReadVExtent extent;
+    extent.offset = chunk.offset;
+    extent.length = chunk.size;
+    extent.buffer = 0;
+    extent.chunks.push_back(order[i]);
+    extents.push_back(extent);
+  }
+
+  size_t staging = 0;
+  for (size_t i = 0; i < extents.size(); i++)
+  {
+    const DiamondReadVExtent& extent = extents[i];
+    const XrdOucIOVec& first = readV[extent.chunks[0]];
+    // a single chunk is read straight into the client buffer
+    if ((extent.chunks.size() == 1) &&
+        (first.offset == extent.offset) &&
+        ((size_t) first.size == extent.length))
+      extents[i].buffer = first.data;
+    else
+      staging += extent.length;
+  }
+  return staging;
+}
+
+//------------------------------------------------------------------------------
+// Copy the chunks of an extent into the client buffers
+//------------------------------------------------------------------------------
+void
+DiamondReadV::Scatter (const DiamondReadVExtent& extent, XrdOucIOVec* readV)
+{
+  for (size_t i = 0; i < extent.chunks.size(); i++)
+  {
+    XrdOucIOVec& chunk = readV[extent.chunks[i]];
+    if (chunk.data != extent.buffer)
+      memcpy(chunk.data, extent.buffer + (chunk.offset - extent.offset),
+             chunk.size);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Read one extent through the file without waiting for the I/O scheduler
+//------------------------------------------------------------------------------
+void
+DiamondReadVJob::DoIt ()
+{
+  mResult = mFile->ReadVerified(mExtent->offset, mExtent->buffer, mExtent->length);
+}
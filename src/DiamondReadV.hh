@@ -0,0 +1,91 @@
+// ----------------------------------------------------------------------
+// File: DiamondReadV.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#ifndef __DIAMONDREADV_API_H__
+#define __DIAMONDREADV_API_H__
+#include "XrdOuc/XrdOucIOVec.hh"
+#include "XrdSfs/XrdSfsInterface.hh"
+
+#include "DiamondWorkerPool.hh"
+
+#include <sys/types.h>
+#include <vector>
+
+#define DIAMOND_DEFAULT_READV_GAP 64*1024
+#define DIAMOND_DEFAULT_READV_STRIPE 4*1024*1024
+
+//------------------------------------------------------------------------------
+//! One backend read covering one or more (nearby) readv chunks
+//------------------------------------------------------------------------------
+struct DiamondReadVExtent {
+  long long offset; //< backend offset
+  size_t length; //< backend length
+  char* buffer; //< destination of the backend read
+  std::vector<int> chunks; //< readv chunks served by this extent
+};
+
+//------------------------------------------------------------------------------
+//! Planning of vector reads
+//------------------------------------------------------------------------------
+class DiamondReadV {
+public:
+  //----------------------------------------------------------------------------
+  //! Sort the chunks of a vector read and merge chunks separated by at most
+  //! gap bytes into extents which do not cross a stripe boundary. Chunks which
+  //! are read as they are get the client buffer as extent buffer, all others
+  //! get 0 and need a staging buffer.
+  //!
+  //! @return number of bytes of staging buffer required
+  //----------------------------------------------------------------------------
+  static size_t Coalesce (const XrdOucIOVec* readV,
+                          int readCount,
+                          size_t gap,
+                          size_t stripe,
+                          std::vector<DiamondReadVExtent>& extents);
+
+  //----------------------------------------------------------------------------
+  //! Copy the chunks of an extent out of its staging buffer
+  //----------------------------------------------------------------------------
+  static void Scatter (const DiamondReadVExtent& extent, XrdOucIOVec* readV);
+};
+
+class DiamondFile;
+
+//------------------------------------------------------------------------------
+//! Job reading one extent of a file - the vector read holds the I/O scheduler
+//! slot of all its extents
+//------------------------------------------------------------------------------
+class DiamondReadVJob : public DiamondJob {
+public:
+  DiamondReadVJob (DiamondFile* file, DiamondReadVExtent* extent) :
+    mFile(file), mExtent(extent), mResult(0) { }
+
+  void DoIt ();
+
+  DiamondFile* mFile;
+  DiamondReadVExtent* mExtent;
+  XrdSfsXferSize mResult; //< bytes read or SFS_ERROR
+};
+
+#endif
@@ -0,0 +1,595 @@
+// ----------------------------------------------------------------------
+// File: DiamondStaging.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "DiamondStaging.hh"
+#include "DiamondFs.hh"
+#include "DiamondLayout.hh"
+
+#include "XrdOfs/XrdOfsTrace.hh"
+#include "XrdSys/XrdSysError.hh"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+
+//------------------------------------------------------------------------------
+// Tell the migrators to exit
+//------------------------------------------------------------------------------
+DiamondStaging::~DiamondStaging ()
+{
+  mCond.Lock();
+  mShutdown = true;
+  mCond.Broadcast();
+  mCond.UnLock();
+}
+
+//------------------------------------------------------------------------------
+// Queue the staged files left by a previous run and start the migrators
+//------------------------------------------------------------------------------
+int
+DiamondStaging::Start (XrdSysError& err)
+{
+  if (mDir.empty())
+    return 0;
+
+  DIR* dir = opendir(mDir.c_str());
+  if (!dir)
+  {
+    err.Emsg("Config", errno, "open staging directory", mDir.c_str());
+    return 1;
+  }
+
+  size_t resumed = 0;
+  struct dirent* entry = 0;
+  while ((entry = readdir(dir)))
+  {
+    std::string name = entry->d_name;
+    if ((name.length() < 3) || name.compare(name.length() - 2, 2, ".0"))
+      continue;
+
+    std::string id = name.substr(0, name.length() - 2);
+    char path[MAXPATHLEN + 1];
+    ssize_t len = getxattr(StripePath(id).c_str(), DIAMOND_STAGING_XATTR, path,
+                           sizeof(path) - 1);
+    if (len <= 0)
+      continue;
+    path[len] = 0;
+
+    // a staged copy without its placeholder is kept for inspection
+    if (Id(DiamondStripedFile::PathLayout(path)) != id)
+    {
+      err.Emsg("Config", "orphaned staged file", StripePath(id).c_str(), path);
+      continue;
+    }
+
+    Entry& staged = mEntries[id];
+    staged.path = path;
+    staged.queued = true;
+    mQueue.push_back(id);
+    resumed++;
+  }
+  closedir(dir);
+
+  if (resumed)
+  {
+    char count[32];
+    snprintf(count, sizeof(count), "%lu", (unsigned long) resumed);
+    err.Say("++++++ diamond staging resumed ", count, " pending migrations");
+  }
+
+  mCond.Lock();
+  mRunning = true;
+  mCond.UnLock();
+
+  for (size_t i = 0; i < mThreads; i++)
+  {
+    pthread_t tid;
+    if (XrdSysThread::Run(&tid, DiamondStaging::StartMigrator,
+                          static_cast<void*>(this), 0,
+                          "Diamond Staging Migrator"))
+    {
+      err.Emsg("Config", "failed to start diamond staging migrators");
+      return 1;
+    }
+    mThreadIds.push_back(tid);
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Check the free space of the staging directory
+//------------------------------------------------------------------------------
+bool
+DiamondStaging::Accept ()
+{
+  mCond.Lock();
+  bool running = mRunning;
+  mCond.UnLock();
+  if (!running)
+    return false;
+
+  struct statvfs buf;
+  if (statvfs(mDir.c_str(), &buf))
+    return false;
+  return ((uint64_t) buf.f_bavail * buf.f_frsize) >= mMinFree;
+}
+
+//------------------------------------------------------------------------------
+// Return the id of a single stripe layout in the staging directory
+//------------------------------------------------------------------------------
+std::string
+DiamondStaging::Id (const std::string& layout)
+{
+  size_t stripesize = 0;
+  std::string id;
+  std::vector<std::string> paths;
+  if (mDir.empty() || layout.empty() ||
+      DiamondStripedFile::Parse(layout, stripesize, id, paths) ||
+      (paths.size() != 1) || (paths[0] != StripePath(id)))
+    return "";
+  return id;
+}
+
+//------------------------------------------------------------------------------
+// Return the path of a staged copy
+//------------------------------------------------------------------------------
+std::string
+DiamondStaging::StripePath (const std::string& id)
+{
+  return mDir + "/" + id + ".0";
+}
+
+//------------------------------------------------------------------------------
+// Record the namespace path on a staged copy
+//------------------------------------------------------------------------------
+void
+DiamondStaging::Tag (const std::string& id, const std::string& path)
+{
+  if (setxattr(StripePath(id).c_str(), DIAMOND_STAGING_XATTR, path.c_str(),
+               path.length(), 0))
+  {
+    const char* tident = "diamond";
+    EPNAME("staging");
+    diamond_log("msg=\"failed to tag staged file\" errno=%d id=%s path=\"%s\"",
+                errno, id.c_str(), path.c_str());
+  }
+}
+
+//------------------------------------------------------------------------------
+// Register a writer of a staged file
+//------------------------------------------------------------------------------
+std::string
+DiamondStaging::Begin (int fd, const std::string& path)
+{
+  // the layout is read under the lock which also covers dropping it
+  mCond.Lock();
+  std::string id = Id(DiamondStripedFile::Layout(fd));
+  if (id.empty())
+  {
+    mCond.UnLock();
+    return "";
+  }
+
+  std::map<std::string, Entry>::iterator it = mEntries.find(id);
+  if (it == mEntries.end())
+  {
+    it = mEntries.insert(std::make_pair(id, Entry())).first;
+    it->second.path = path;
+    Tag(id, path);
+    mStats.staged++;
+  }
+  it->second.writers++;
+
+  if (it->second.queued)
+  {
+    for (std::deque<std::string>::iterator qit = mQueue.begin();
+         qit != mQueue.end(); qit++)
+    {
+      if (*qit == id)
+      {
+        mQueue.erase(qit);
+        break;
+      }
+    }
+    it->second.queued = false;
+  }
+  if (it->second.inflight)
+    it->second.dirty = true;
+  mCond.UnLock();
+  return id;
+}
+
+//------------------------------------------------------------------------------
+// Queue the migration of a staged file closed by its last writer
+//------------------------------------------------------------------------------
+void
+DiamondStaging::End (const std::string& id, bool migrate)
+{
+  mCond.Lock();
+  std::map<std::string, Entry>::iterator it = mEntries.find(id);
+  if ((it != mEntries.end()) && it->second.writers &&
+      !--it->second.writers)
+  {
+    if (it->second.inflight)
+    {
+      // the running migration is repeated when it finishes
+      it->second.dirty = true;
+    }
+    else if (!migrate)
+    {
+      mEntries.erase(it);
+    }
+    else
+    {
+      it->second.queued = true;
+      it->second.attempts = 0;
+      it->second.notbefore = 0;
+      mQueue.push_back(id);
+      mCond.Broadcast();
+    }
+  }
+  mCond.UnLock();
+}
+
+//------------------------------------------------------------------------------
+// Wait until no migration of path is in flight - requires the lock
+//------------------------------------------------------------------------------
+void
+DiamondStaging::WaitInFlight (const std::string& path)
+{
+  bool inflight = true;
+  while (inflight)
+  {
+    inflight = false;
+    for (std::map<std::string, Entry>::const_iterator it = mEntries.begin();
+         it != mEntries.end(); ++it)
+    {
+      if (it->second.inflight && (it->second.path == path))
+      {
+        inflight = true;
+        mCond.Wait();
+        break;
+      }
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Forget the queued migrations of a path
+//------------------------------------------------------------------------------
+void
+DiamondStaging::Cancel (const std::string& path)
+{
+  mCond.Lock();
+  WaitInFlight(path);
+
+  std::deque<std::string>::iterator it = mQueue.begin();
+  while (it != mQueue.end())
+  {
+    if (mEntries[*it].path == path)
+    {
+      mEntries.erase(*it);
+      it = mQueue.erase(it);
+    }
+    else
+    {
+      it++;
+    }
+  }
+  mCond.UnLock();
+}
+
+//------------------------------------------------------------------------------
+// Run the queued migration of a path in the calling thread
+//------------------------------------------------------------------------------
+int
+DiamondStaging::Flush (const std::string& path)
+{
+  mCond.Lock();
+  WaitInFlight(path);
+
+  std::string id;
+  for (std::deque<std::string>::iterator it = mQueue.begin();
+       it != mQueue.end(); it++)
+  {
+    Entry& staged = mEntries[*it];
+    if (staged.path == path)
+    {
+      id = *it;
+      staged.queued = false;
+      staged.inflight = true;
+      staged.dirty = false;
+      mQueue.erase(it);
+      break;
+    }
+  }
+  mCond.UnLock();
+
+  if (id.empty())
+    return 0;
+
+  off_t bytes = 0;
+  int rc = Migrate(id, bytes);
+  Finish(id, rc, bytes);
+  return rc;
+}
+
+//------------------------------------------------------------------------------
+// Move the staged files of a renamed file or directory
+//------------------------------------------------------------------------------
+void
+DiamondStaging::Rename (const std::string& oldpath, const std::string& newpath)
+{
+  std::string prefix = oldpath + "/";
+  mCond.Lock();
+  for (std::map<std::string, Entry>::iterator it = mEntries.begin();
+       it != mEntries.end(); ++it)
+  {
+    if (it->second.path == oldpath)
+      it->second.path = newpath;
+    else if (!it->second.path.compare(0, prefix.length(), prefix))
+      it->second.path = newpath + it->second.path.substr(oldpath.length());
+    else
+      continue;
+    Tag(it->first, it->second.path);
+  }
+  mCond.UnLock();
+}
+
+//------------------------------------------------------------------------------
+// Return the counters
+//------------------------------------------------------------------------------
+DiamondStaging::Stats
+DiamondStaging::GetStats ()
+{
+  mCond.Lock();
+  Stats stats = mStats;
+  for (std::map<std::string, Entry>::const_iterator it = mEntries.begin();
+       it != mEntries.end(); ++it)
+  {
+    if (it->second.writers)
+      stats.writing++;
+    else
+      stats.pending++;
+  }
+  mCond.UnLock();
+  return stats;
+}
+
+//------------------------------------------------------------------------------
+// Copy a staged file into its placeholder and drop the staged copy
+//------------------------------------------------------------------------------
+int
+DiamondStaging::Migrate (const std::string& id, off_t& bytes)
+{
+  std::string path;
+  int fd = -1;
+  {
+    // a rename can not move the placeholder between lookup and open
+    XrdSysMutexHelper nsLock(mNamespace);
+    mCond.Lock();
+    path = mEntries[id].path;
+    mCond.UnLock();
+
+    char pfn[MAXPATHLEN + 1];
+    if (XrdOfsOss->Lfn2Pfn(path.c_str(), pfn, sizeof(pfn)))
+      return EINVAL;
+    fd = ::open(pfn, O_RDWR);
+  }
+
+  // a removed or rewritten file has nothing left to migrate
+  if (fd < 0)
+    return (errno == ENOENT) ? 0 : errno;
+
+  if (Id(DiamondStripedFile::Layout(fd)) != id)
+  {
+    ::close(fd);
+    return 0;
+  }
+
+  int sfd = ::open(StripePath(id).c_str(), O_RDONLY);
+  if (sfd < 0)
+  {
+    int rc = (errno == ENOENT) ? 0 : errno;
+    ::close(fd);
+    return rc;
+  }
+
+  // the placeholder already has the logical size - holes stay holes
+  struct stat buf;
+  int rc = fstat(fd, &buf) ? errno : 0;
+  std::vector<char> buffer(rc ? 0 : DIAMOND_STAGING_COPY_BLOCKSIZE);
+  off_t offset = 0;
+  while (!rc && (offset < buf.st_size))
+  {
+    size_t length = buffer.size();
+    if ((off_t) length > (buf.st_size - offset))
+      length = buf.st_size - offset;
+    ssize_t nread = ::pread(sfd, &buffer[0], length, offset);
+    if (nread <= 0)
+    {
+      rc = nread ? errno : 0;
+      break;
+    }
+    if (::pwrite(fd, &buffer[0], nread, offset) != nread)
+      rc = errno ? errno : EIO;
+    offset += nread;
+  }
+  posix_fadvise(sfd, 0, 0, POSIX_FADV_DONTNEED);
+  ::close(sfd);
+
+  // the data is durable in the backend before the staged copy goes, the
+  // modification time stamps the checksum and block map attributes
+  if (!rc && ::fsync(fd))
+    rc = errno;
+  if (!rc)
+  {
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1] = buf.st_mtim;
+    if (futimens(fd, times))
+      rc = errno;
+  }
+  if (!rc)
+  {
+    // a writer which opened the staged file meanwhile keeps it
+    mCond.Lock();
+    if (mEntries[id].writers || mEntries[id].dirty)
+      rc = EBUSY;
+    else
+      DiamondStripedFile::Drop(fd);
+    mCond.UnLock();
+  }
+  ::close(fd);
+
+  if (rc)
+    return rc;
+
+  // readers which opened the staged file keep reading the unlinked copy
+  ::unlink(StripePath(id).c_str());
+  bytes = offset;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Account a finished migration or queue it for a retry
+//------------------------------------------------------------------------------
+void
+DiamondStaging::Finish (const std::string& id, int rc, off_t bytes)
+{
+  const char* tident = "diamond";
+  EPNAME("staging");
+
+  mCond.Lock();
+  std::map<std::string, Entry>::iterator it = mEntries.find(id);
+  it->second.inflight = false;
+  if (!rc)
+  {
+    if (DIAMOND_DEBUG)diamond_log("msg=\"migrated staged file\" id=%s "
+                                  "path=\"%s\" bytes=%lld", id.c_str(),
+                                  it->second.path.c_str(), (long long) bytes);
+    mEntries.erase(it);
+    mStats.migrated++;
+    mStats.bytes += bytes;
+  }
+  else if (it->second.writers)
+  {
+    // the last writer queues the migration again
+    it->second.dirty = false;
+  }
+  else if (it->second.dirty)
+  {
+    it->second.dirty = false;
+    it->second.queued = true;
+    it->second.attempts = 0;
+    it->second.notbefore = 0;
+    mQueue.push_back(id);
+  }
+  else
+  {
+    // staged data is never given up
+    it->second.queued = true;
+    it->second.attempts++;
+    it->second.notbefore = time(NULL) + ((it->second.attempts < 8) ?
+                                         (1 << it->second.attempts) : 300);
+    mQueue.push_back(id);
+    mStats.retried++;
+    diamond_log("msg=\"retry migration\" id=%s path=\"%s\" errno=%d "
+                "attempt=%lu", id.c_str(), it->second.path.c_str(), rc,
+                (unsigned long) it->second.attempts);
+  }
+  // wake up writers waiting in Cancel or Flush
+  mCond.Broadcast();
+  mCond.UnLock();
+}
+
+//------------------------------------------------------------------------------
+// Static thread entry point
+//------------------------------------------------------------------------------
+void*
+DiamondStaging::StartMigrator (void* arg)
+{
+  return reinterpret_cast<DiamondStaging*>(arg)->Migrator();
+}
+
+//------------------------------------------------------------------------------
+// Take due migrations off the queue - the number of migrators bounds the
+// parallelism
+//------------------------------------------------------------------------------
+void*
+DiamondStaging::Migrator ()
+{
+  while (1)
+  {
+    std::string id;
+
+    mCond.Lock();
+    while (!mShutdown)
+    {
+      time_t now = time(NULL);
+      for (std::deque<std::string>::iterator it = mQueue.begin();
+           it != mQueue.end(); it++)
+      {
+        Entry& staged = mEntries[*it];
+        if (staged.notbefore <= now)
+        {
+          id = *it;
+          staged.queued = false;
+          staged.inflight = true;
+          staged.dirty = false;
+          mQueue.erase(it);
+          break;
+        }
+      }
+
+      if (!id.empty())
+        break;
+
+      // retries become due by time - closed files signal
+      if (mQueue.empty())
+        mCond.Wait();
+      else
+        mCond.Wait(1);
+    }
+
+    if (mShutdown)
+    {
+      mCond.UnLock();
+      return 0;
+    }
+    mCond.UnLock();
+
+    off_t bytes = 0;
+    int rc = Migrate(id, bytes);
+    Finish(id, rc, bytes);
+  }
+  return 0;
+}
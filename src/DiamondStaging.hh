@@ -0,0 +1,170 @@
+// ----------------------------------------------------------------------
+// File: DiamondStaging.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef __DIAMONDSTAGING_API_H__
+#define __DIAMONDSTAGING_API_H__
+#include "XrdSys/XrdSysPthread.hh"
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+class XrdSysError;
+
+#define DIAMOND_DEFAULT_STAGING_THREADS 4
+#define DIAMOND_DEFAULT_STAGING_MINFREE 1024ull*1024*1024
+#define DIAMOND_STAGING_COPY_BLOCKSIZE 4*1024*1024
+#define DIAMOND_STAGING_XATTR "user.diamond.staged"
+
+//------------------------------------------------------------------------------
+//! Write-back staging of new files on a fast local directory (e.g. an SSD).
+//! A staged file is a striped file with a single stripe in the staging
+//! directory, so reads of a file which has not been migrated yet are served
+//! from the staged copy. Once the writer closed it, a migrator thread copies
+//! the data into the placeholder in the backend, drops the layout attribute
+//! and removes the staged copy. Each staged copy carries the namespace path
+//! of its placeholder in an extended attribute which is scanned by Start, so a
+//! restart resumes the pending migrations.
+//------------------------------------------------------------------------------
+class DiamondStaging {
+public:
+
+  struct Stats {
+    Stats () : staged(0), migrated(0), bytes(0), retried(0), writing(0),
+               pending(0) { }
+    unsigned long long staged; //< files written to the staging directory
+    unsigned long long migrated; //< files migrated to the backend
+    unsigned long long bytes; //< bytes migrated to the backend
+    unsigned long long retried; //< migrations which had to be retried
+    unsigned long long writing; //< staged files currently written
+    unsigned long long pending; //< staged files waiting for or in migration
+  };
+
+  DiamondStaging () : mCond(0),
+                      mRunning(false),
+                      mShutdown(false),
+                      mThreads(DIAMOND_DEFAULT_STAGING_THREADS),
+                      mMinFree(DIAMOND_DEFAULT_STAGING_MINFREE) { }
+
+  ~DiamondStaging ();
+
+  //----------------------------------------------------------------------------
+  //! Queue the staged files found in the staging directory and start the
+  //! migrator threads - does nothing without a staging directory
+  //----------------------------------------------------------------------------
+  int Start (XrdSysError& err);
+
+  //----------------------------------------------------------------------------
+  //! Check if a new file can be staged - the staging directory needs to keep
+  //! the configured free space
+  //----------------------------------------------------------------------------
+  bool Accept ();
+
+  //----------------------------------------------------------------------------
+  //! Register a writer of the staged file opened on the placeholder fd for
+  //! path - a migration in flight keeps the staged copy
+  //!
+  //! @return the id of the staged file - empty if the layout is not staged
+  //----------------------------------------------------------------------------
+  std::string Begin (int fd, const std::string& path);
+
+  //----------------------------------------------------------------------------
+  //! A writer of a staged file closed it - the last one queues its migration
+  //! or forgets it if the file has been abandoned
+  //----------------------------------------------------------------------------
+  void End (const std::string& id, bool migrate);
+
+  //----------------------------------------------------------------------------
+  //! Forget a queued migration of path because it is removed or rewritten.
+  //! Waits for a migration of path which is already in flight.
+  //----------------------------------------------------------------------------
+  void Cancel (const std::string& path);
+
+  //----------------------------------------------------------------------------
+  //! Migrate a queued staged file of path right away because it is truncated.
+  //! Waits for a migration of path which is already in flight.
+  //!
+  //! @return 0 or an errno
+  //----------------------------------------------------------------------------
+  int Flush (const std::string& path);
+
+  //----------------------------------------------------------------------------
+  //! Follow a rename of a file or directory - requires the namespace mutex
+  //----------------------------------------------------------------------------
+  void Rename (const std::string& oldpath, const std::string& newpath);
+
+  //----------------------------------------------------------------------------
+  //! Mutex serializing renames with migrations opening a placeholder
+  //----------------------------------------------------------------------------
+  XrdSysMutex& Namespace () { return mNamespace; }
+
+  const std::string& Dir () const { return mDir; }
+
+  Stats GetStats ();
+
+  void SetDir (const std::string& dir) { mDir = dir; }
+  void SetThreads (size_t threads) { mThreads = threads ? threads : 1; }
+  void SetMinFree (uint64_t minfree) { mMinFree = minfree; }
+
+private:
+  struct Entry {
+    Entry () : writers(0), queued(false), inflight(false), dirty(false),
+               attempts(0), notbefore(0) { }
+    std::string path; //< namespace path of the placeholder
+    size_t writers; //< open writers of the staged file
+    bool queued; //< waiting in mQueue
+    bool inflight; //< a migration is running
+    bool dirty; //< written since the running migration started
+    size_t attempts; //< number of failed migrations
+    time_t notbefore; //< earliest time of the next attempt
+  };
+
+  static void* StartMigrator (void* arg);
+  void* Migrator ();
+
+  int Migrate (const std::string& id, off_t& bytes);
+  void Finish (const std::string& id, int rc, off_t bytes);
+
+  std::string Id (const std::string& layout);
+  std::string StripePath (const std::string& id);
+  void Tag (const std::string& id, const std::string& path);
+  void WaitInFlight (const std::string& path);
+
+  XrdSysCondVar mCond; //< protects all members, signals finished migrations
+  XrdSysMutex mNamespace; //< serializes renames with opening placeholders
+  std::map<std::string, Entry> mEntries; //< staged files by id
+  std::deque<std::string> mQueue; //< ids waiting for a migration
+  std::vector<pthread_t> mThreadIds; //< migrator threads
+  bool mRunning; //< migrators have been started
+  bool mShutdown; //< tells the migrators to exit
+  std::string mDir; //< staging directory - empty disables staging
+  size_t mThreads; //< number of migrator threads
+  uint64_t mMinFree; //< free space the staging directory keeps
+  Stats mStats; //< counters
+};
+
+#endif
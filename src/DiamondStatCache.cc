@@ -0,0 +1,177 @@
+// ----------------------------------------------------------------------
+// File: DiamondStatCache.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "DiamondStatCache.hh"
+
+#include <functional>
+
+//------------------------------------------------------------------------------
+// Select the shard of a path
+//------------------------------------------------------------------------------
+DiamondStatCache::Shard&
+DiamondStatCache::GetShard (const std::string& path)
+{
+  return mShards[std::hash<std::string>()(path) % DIAMOND_STATCACHE_SHARDS];
+}
+
+//------------------------------------------------------------------------------
+// Lookup a path
+//------------------------------------------------------------------------------
+DiamondStatCache::Lookup_t
+DiamondStatCache::Get (const std::string& path, struct stat* buf,
+                       unsigned long long* generation)
+{
+  if (!Enabled())
+    return kMiss;
+
+  Shard& shard = GetShard(path);
+  XrdSysMutexHelper sLock(shard.mutex);
+
+  if (generation)
+    *generation = shard.generation;
+
+  std::unordered_map<std::string, Entry>::iterator it =
+    shard.entries.find(path);
+
+  if (it == shard.entries.end())
+  {
+    shard.stats.misses++;
+    return kMiss;
+  }
+
+  if (it->second.expires < time(NULL))
+  {
+    shard.lru.erase(it->second.lru);
+    shard.entries.erase(it);
+    shard.stats.misses++;
+    return kMiss;
+  }
+
+  // move to the front of the LRU list
+  shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru);
+
+  if (!it->second.exists)
+  {
+    shard.stats.neghits++;
+    return kMissing;
+  }
+
+  if (buf)
+    *buf = it->second.buf;
+  shard.stats.hits++;
+  return kFound;
+}
+
+//------------------------------------------------------------------------------
+// Store a stat result if path has not been invalidated meanwhile
+//------------------------------------------------------------------------------
+void
+DiamondStatCache::Put (const std::string& path, const struct stat* buf,
+                       unsigned long long generation)
+{
+  if (!Enabled())
+    return;
+
+  Shard& shard = GetShard(path);
+  XrdSysMutexHelper sLock(shard.mutex);
+  if (shard.generation != generation)
+    return;
+  Store(shard, path, buf);
+}
+
+//------------------------------------------------------------------------------
+// Insert or replace an entry - requires the shard lock
+//------------------------------------------------------------------------------
+void
+DiamondStatCache::Store (Shard& shard, const std::string& path,
+                         const struct stat* buf)
+{
+  time_t lifetime = buf ? mLifeTime : mNegLifeTime;
+  if (lifetime <= 0)
+    return;
+
+  std::unordered_map<std::string, Entry>::iterator it =
+    shard.entries.find(path);
+
+  if (it == shard.entries.end())
+  {
+    // evict the least recently used entries
+    while (shard.entries.size() >= mShardSize && !shard.lru.empty())
+    {
+      shard.entries.erase(shard.lru.back());
+      shard.lru.pop_back();
+    }
+    shard.lru.push_front(path);
+    it = shard.entries.insert(std::make_pair(path, Entry())).first;
+    it->second.lru = shard.lru.begin();
+  }
+  else
+  {
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru);
+  }
+
+  if (buf)
+    it->second.buf = *buf;
+  it->second.exists = buf ? true : false;
+  it->second.expires = time(NULL) + lifetime;
+}
+
+//------------------------------------------------------------------------------
+// Drop a path
+//------------------------------------------------------------------------------
+void
+DiamondStatCache::Invalidate (const std::string& path)
+{
+  Shard& shard = GetShard(path);
+  XrdSysMutexHelper sLock(shard.mutex);
+  shard.generation++;
+
+  std::unordered_map<std::string, Entry>::iterator it =
+    shard.entries.find(path);
+
+  if (it != shard.entries.end())
+  {
+    shard.lru.erase(it->second.lru);
+    shard.entries.erase(it);
+    shard.stats.invalidations++;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Sum up the counters of all shards
+//------------------------------------------------------------------------------
+DiamondStatCache::Stats
+DiamondStatCache::GetStats ()
+{
+  Stats sum;
+  for (size_t i = 0; i < DIAMOND_STATCACHE_SHARDS; i++)
+  {
+    XrdSysMutexHelper sLock(mShards[i].mutex);
+    sum.hits += mShards[i].stats.hits;
+    sum.neghits += mShards[i].stats.neghits;
+    sum.misses += mShards[i].stats.misses;
+    sum.invalidations += mShards[i].stats.invalidations;
+    sum.entries += mShards[i].entries.size();
+  }
+  return sum;
+}
@@ -0,0 +1,129 @@
+// ----------------------------------------------------------------------
+// File: DiamondStatCache.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef __DIAMONDSTATCACHE_API_H__
+#define __DIAMONDSTATCACHE_API_H__
+#include "XrdSys/XrdSysPthread.hh"
+
+#include <sys/stat.h>
+#include <time.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+#define DIAMOND_DEFAULT_STATCACHE_TTL 30
+#define DIAMOND_DEFAULT_STATCACHE_NEGTTL 5
+#define DIAMOND_DEFAULT_STATCACHE_SIZE 1000000
+#define DIAMOND_STATCACHE_SHARDS 64
+
+//------------------------------------------------------------------------------
+//! Sharded LRU cache of backend stat results. Missing files are cached as
+//! negative entries with their own (usually shorter) lifetime.
+//------------------------------------------------------------------------------
+class DiamondStatCache {
+public:
+
+  struct Stats {
+    Stats () : hits(0), neghits(0), misses(0), invalidations(0), entries(0) { }
+    unsigned long long hits; //< lookups answered with a stat
+    unsigned long long neghits; //< lookups answered with ENOENT
+    unsigned long long misses; //< lookups going to the backend
+    unsigned long long invalidations; //< entries dropped by modifications
+    unsigned long long entries; //< entries currently cached
+  };
+
+  DiamondStatCache () : mLifeTime(DIAMOND_DEFAULT_STATCACHE_TTL),
+                        mNegLifeTime(DIAMOND_DEFAULT_STATCACHE_NEGTTL),
+                        mShardSize(DIAMOND_DEFAULT_STATCACHE_SIZE /
+                                   DIAMOND_STATCACHE_SHARDS) { }
+
+  ~DiamondStatCache () { }
+
+  enum Lookup_t {
+    kMiss = 0, //! not cached - ask the backend
+    kFound = 1, //! buf has been filled
+    kMissing = 2, //! cached negative entry - file does not exist
+  };
+
+  //----------------------------------------------------------------------------
+  //! Lookup path - on a miss generation is set for a following Put
+  //----------------------------------------------------------------------------
+  Lookup_t Get (const std::string& path, struct stat* buf,
+                unsigned long long* generation = 0);
+
+  //----------------------------------------------------------------------------
+  //! Store a stat result - buf = 0 stores a negative entry. The entry is
+  //! dropped if path has been invalidated since Get returned generation.
+  //----------------------------------------------------------------------------
+  void Put (const std::string& path, const struct stat* buf,
+            unsigned long long generation);
+
+  //----------------------------------------------------------------------------
+  //! Drop path because it has been modified
+  //----------------------------------------------------------------------------
+  void Invalidate (const std::string& path);
+
+  //----------------------------------------------------------------------------
+  //! Sum up the counters of all shards
+  //----------------------------------------------------------------------------
+  Stats GetStats ();
+
+  void SetLifeTime (time_t lifetime) { mLifeTime = lifetime; }
+  void SetNegLifeTime (time_t lifetime) { mNegLifeTime = lifetime; }
+
+  void
+  SetMaxSize (size_t maxsize) {
+    mShardSize = maxsize / DIAMOND_STATCACHE_SHARDS;
+    if (!mShardSize)
+      mShardSize = 1;
+  }
+
+  bool Enabled () const { return (mLifeTime > 0) || (mNegLifeTime > 0); }
+
+private:
+  struct Entry {
+    struct stat buf;
+    bool exists; //< false for a negative entry
+    time_t expires;
+    std::list<std::string>::iterator lru; //< position in Shard::lru
+  };
+
+  struct Shard {
+    Shard () : generation(0) { }
+    XrdSysMutex mutex; //< mutex protecting this shard
+    std::unordered_map<std::string, Entry> entries; //< path => cached stat
+    std::list<std::string> lru; //< paths, most recently used first
+    unsigned long long generation; //< incremented by each invalidation
+    Stats stats; //< counters of this shard
+  };
+
+  Shard& GetShard (const std::string& path);
+  void Store (Shard& shard, const std::string& path, const struct stat* buf);
+
+  Shard mShards[DIAMOND_STATCACHE_SHARDS];
+  time_t mLifeTime; //< lifetime of existing entries - 0 disables them
+  time_t mNegLifeTime; //< lifetime of negative entries - 0 disables them
+  size_t mShardSize; //< maximum number of entries per shard
+};
+
+#endif
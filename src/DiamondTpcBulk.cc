@@ -0,0 +1,523 @@
+// ----------------------------------------------------------------------
+// File: DiamondTpcBulk.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#include "DiamondTpcBulk.hh"
+#include "DiamondFs.hh"
+
+#include "XrdAcc/XrdAccAuthorize.hh"
+#include "XrdNet/XrdNetAddrInfo.hh"
+#include "XrdOfs/XrdOfsTrace.hh"
+#include "XrdOuc/XrdOucEnv.hh"
+#include "XrdSec/XrdSecEntity.hh"
+#include "XrdSys/XrdSysError.hh"
+
+#include <sstream>
+#include <stdlib.h>
+
+//------------------------------------------------------------------------------
+// Start the transfer threads
+//------------------------------------------------------------------------------
+int
+DiamondTpcBulk::Start (XrdSysError& err)
+{
+  if (mPool.Start(mThreads, "Diamond TPC Bulk Thread"))
+  {
+    err.Emsg("Config", "failed to start diamond tpc bulk threads");
+    return 1;
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Execute a tpc.* plug-in query
+//------------------------------------------------------------------------------
+int
+DiamondTpcBulk::Execute (const char* pcmd, XrdOucEnv& env,
+                         const XrdSecEntity* client, std::string& reply,
+                         std::string& emsg)
+{
+  std::string org = Origin(client);
+  if (org.empty())
+  {
+    emsg = "tpc - client origin unknown";
+    return EPERM;
+  }
+
+  std::string cmd = pcmd;
+  std::vector<std::vector<std::string> > tuples;
+  std::stringstream out;
+
+  if ((cmd == "tpc.register") || (cmd == "tpc.submit"))
+  {
+    bool submit = (cmd == "tpc.submit");
+    if (Parse(env.Get("diamond.tpc.list"), submit ? 4 : 3, tuples))
+    {
+      emsg = "tpc - illegal transfer list";
+      return EINVAL;
+    }
+
+    // transfers run without a client, so each path is authorized here
+    for (size_t i = 0; i < tuples.size(); i++)
+    {
+      const std::string& path = submit ? tuples[i][3] : tuples[i][2];
+      if (client && DiamondFS.Authorization &&
+          !DiamondFS.Authorization->Access(client, path.c_str(),
+                                           submit ? AOP_Create : AOP_Read,
+                                           &env))
+      {
+        emsg = "tpc - permission denied for ";
+        emsg += path;
+        return EACCES;
+      }
+      // HTTP(S) sources are only pulled from configured hosts
+      if (submit && DiamondFile::TpcHttpSource(tuples[i][1]) &&
+          !DiamondFS.TpcHttpAllowed(tuples[i][1]))
+      {
+        emsg = "tpc - http source not allowed for ";
+        emsg += path;
+        return EPERM;
+      }
+    }
+
+    if (!submit)
+    {
+      if (Register(org, tuples))
+      {
+        emsg = "tpc - tpc key replayed";
+        return EPERM;
+      }
+      out << "registered=" << tuples.size() << "\n";
+      reply = out.str();
+      return 0;
+    }
+
+    unsigned long long id = 0;
+    if (Submit(org, tuples, id))
+    {
+      emsg = "tpc - tpc key replayed";
+      return EPERM;
+    }
+    out << "batch=" << id << " transfers=" << tuples.size() << "\n";
+    reply = out.str();
+    return 0;
+  }
+
+  if ((cmd == "tpc.status") || (cmd == "tpc.cancel"))
+  {
+    batch_ptr_t batch = Find(env, org);
+    if (!batch)
+    {
+      emsg = "tpc - no such batch";
+      return ENOENT;
+    }
+
+    if (cmd == "tpc.cancel")
+      Cancel(*batch);
+
+    const char* all = env.Get("diamond.tpc.all");
+    Report(*batch, all && (atoi(all) == 1), reply);
+    return 0;
+  }
+
+  emsg = "tpc - unknown command ";
+  emsg += cmd;
+  return EINVAL;
+}
+
+//------------------------------------------------------------------------------
+// Register source sessions - tuples are <key>,<dst>,<lfn>
+//------------------------------------------------------------------------------
+int
+DiamondTpcBulk::Register (const std::string& org,
+                          const std::vector<std::vector<std::string> >& tuples)
+{
+  time_t now = time(NULL);
+  XrdSysMutexHelper tpcLock(DiamondFS.TpcMapMutex);
+  DiamondFs::tpc_info_map_t& sessions = DiamondFS.TpcMap[0];
+
+  for (size_t i = 0; i < tuples.size(); i++)
+  {
+    if (sessions.count(tuples[i][0]))
+      return EEXIST;
+  }
+
+  for (size_t i = 0; i < tuples.size(); i++)
+  {
+    DiamondFs::TpcInfo& info = sessions[tuples[i][0]];
+    info.key = tuples[i][0];
+    info.org = org;
+    info.dst = tuples[i][1];
+    info.path = tuples[i][2];
+    info.lfn = tuples[i][2];
+    info.expires = now + mLifeTime;
+  }
+
+  XrdSysMutexHelper bLock(mMutex);
+  mStats.registered += tuples.size();
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Submit destination transfers - tuples are <key>,<src>,<lfn>,<path>
+//------------------------------------------------------------------------------
+int
+DiamondTpcBulk::Submit (const std::string& org,
+                        const std::vector<std::vector<std::string> >& tuples,
+                        unsigned long long& id)
+{
+  time_t now = time(NULL);
+  batch_ptr_t batch(new Batch());
+  batch->org = org;
+  batch->transfers.resize(tuples.size());
+
+  for (size_t i = 0; i < tuples.size(); i++)
+  {
+    batch->transfers[i].key = tuples[i][0];
+    batch->transfers[i].src = tuples[i][1];
+    batch->transfers[i].lfn = tuples[i][2];
+    batch->transfers[i].path = tuples[i][3];
+  }
+
+  {
+    // a transfer is valid as long as its key is in the writer map
+    XrdSysMutexHelper tpcLock(DiamondFS.TpcMapMutex);
+    DiamondFs::tpc_info_map_t& sessions = DiamondFS.TpcMap[1];
+
+    for (size_t i = 0; i < tuples.size(); i++)
+    {
+      if (sessions.count(tuples[i][0]))
+        return EEXIST;
+    }
+
+    for (size_t i = 0; i < tuples.size(); i++)
+    {
+      const Transfer& transfer = batch->transfers[i];
+      DiamondFs::TpcInfo& info = sessions[transfer.key];
+      info.key = transfer.key;
+      info.org = org;
+      info.src = transfer.src;
+      info.path = transfer.path;
+      info.lfn = transfer.lfn;
+      info.expires = now + mLifeTime;
+    }
+  }
+
+  {
+    XrdSysMutexHelper bLock(mMutex);
+    Expire(now);
+    id = batch->id = mNextId++;
+    batch->count[kQueued] = tuples.size();
+    if (!tuples.size())
+      batch->finished = now;
+    mBatches[id] = batch;
+    mStats.submitted += tuples.size();
+  }
+
+  for (size_t i = 0; i < tuples.size(); i++)
+    mPool.Schedule(new DiamondTpcBulkJob(this, batch, i));
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Lookup the batch given by diamond.tpc.batch - only for its submitter
+//------------------------------------------------------------------------------
+DiamondTpcBulk::batch_ptr_t
+DiamondTpcBulk::Find (XrdOucEnv& env, const std::string& org)
+{
+  const char* val = env.Get("diamond.tpc.batch");
+  if (!val)
+    return batch_ptr_t();
+
+  unsigned long long id = strtoull(val, 0, 10);
+  XrdSysMutexHelper bLock(mMutex);
+  std::map<unsigned long long, batch_ptr_t>::iterator it = mBatches.find(id);
+  if ((it == mBatches.end()) || (it->second->org != org))
+    return batch_ptr_t();
+  return it->second;
+}
+
+//------------------------------------------------------------------------------
+// Aggregated status - one summary line, then one line per failed transfer or
+// per transfer if all is set
+//------------------------------------------------------------------------------
+void
+DiamondTpcBulk::Report (const Batch& batch, bool all, std::string& reply)
+{
+  static const char* states[kStates] = {
+    "queued", "running", "done", "failed", "cancelled"
+  };
+
+  std::stringstream out;
+  XrdSysMutexHelper bLock(mMutex);
+  unsigned long long bytes = 0;
+  for (size_t i = 0; i < batch.transfers.size(); i++)
+    bytes += batch.transfers[i].bytes;
+
+  out << "batch=" << batch.id
+      << " total=" << batch.transfers.size();
+  for (size_t i = 0; i < kStates; i++)
+    out << " " << states[i] << "=" << batch.count[i];
+  out << " bytes=" << bytes
+      << " complete=" << (batch.finished ? 1 : 0) << "\n";
+
+  for (size_t i = 0; i < batch.transfers.size(); i++)
+  {
+    const Transfer& transfer = batch.transfers[i];
+    if (!all && (transfer.state != kFailed))
+      continue;
+    out << "key=" << transfer.key
+        << " state=" << states[transfer.state]
+        << " errno=" << transfer.errc
+        << " bytes=" << transfer.bytes
+        << " path=" << transfer.path
+        << " msg=\"" << transfer.msg << "\"\n";
+  }
+  reply = out.str();
+}
+
+//------------------------------------------------------------------------------
+// Cancel a batch - queued transfers are skipped, running transfers see their
+// key disappear from the writer map and abort
+//------------------------------------------------------------------------------
+void
+DiamondTpcBulk::Cancel (Batch& batch)
+{
+  {
+    XrdSysMutexHelper bLock(mMutex);
+    if (batch.cancelled)
+      return;
+    batch.cancelled = true;
+  }
+
+  XrdSysMutexHelper tpcLock(DiamondFS.TpcMapMutex);
+  for (size_t i = 0; i < batch.transfers.size(); i++)
+    DiamondFS.TpcMap[1].erase(batch.transfers[i].key);
+}
+
+//------------------------------------------------------------------------------
+// Run one transfer of a batch
+//------------------------------------------------------------------------------
+void
+DiamondTpcBulk::Run (Batch& batch, size_t index)
+{
+  const char* tident = "diamond";
+  EPNAME("TpcBulk");
+  Transfer& transfer = batch.transfers[index];
+
+  bool cancelled = false;
+  {
+    XrdSysMutexHelper bLock(mMutex);
+    batch.count[kQueued]--;
+    batch.count[kRunning]++;
+    transfer.state = kRunning;
+    cancelled = batch.cancelled;
+  }
+
+  if (cancelled)
+  {
+    Finish(batch, transfer, kCancelled, ECANCELED, "cancelled", 0);
+    return;
+  }
+
+  std::string msg;
+  off_t bytes = 0;
+  int rc = 0;
+
+  DiamondFile* file = (DiamondFile*) DiamondFS.newFile();
+  if (file->open(transfer.path.c_str(),
+                 SFS_O_RDWR | SFS_O_CREAT | SFS_O_TRUNC | SFS_O_MKPTH,
+                 S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH, 0, 0))
+  {
+    rc = file->error.getErrInfo() ? file->error.getErrInfo() : EIO;
+    msg = file->error.getErrText();
+    delete file;
+
+    XrdSysMutexHelper tpcLock(DiamondFS.TpcMapMutex);
+    DiamondFS.TpcMap[1].erase(transfer.key);
+  }
+  else
+  {
+    // close drops the key from the writer map, a file deleted without a close
+    // is queued for removal
+    file->TpcKey = transfer.key.c_str();
+    rc = file->TpcPull(msg, bytes);
+    if (!rc)
+      file->close();
+    delete file;
+  }
+
+  if (rc)
+  {
+    diamond_log("msg=\"tpc bulk transfer failed\" batch=%llu key=%s path=%s "
+                "errno=%d msg=\"%s\"", batch.id, transfer.key.c_str(),
+                transfer.path.c_str(), rc, msg.c_str());
+  }
+  Finish(batch, transfer, rc ? kFailed : kDone, rc, msg, bytes);
+}
+
+//------------------------------------------------------------------------------
+// Account a finished transfer
+//------------------------------------------------------------------------------
+void
+DiamondTpcBulk::Finish (Batch& batch, Transfer& transfer, State_t state,
+                        int errc, const std::string& msg,
+                        unsigned long long bytes)
+{
+  XrdSysMutexHelper bLock(mMutex);
+  // a transfer aborted by a cancel fails with ECONNABORTED
+  if ((state == kFailed) && batch.cancelled)
+    state = kCancelled;
+
+  batch.count[kRunning]--;
+  batch.count[state]++;
+  transfer.state = state;
+  transfer.errc = errc;
+  transfer.msg = msg;
+  transfer.bytes = bytes;
+
+  if (state == kDone)
+    mStats.done++;
+  else if (state == kFailed)
+    mStats.failed++;
+  else
+    mStats.cancelled++;
+
+  if (!batch.count[kQueued] && !batch.count[kRunning])
+    batch.finished = time(NULL);
+}
+
+//------------------------------------------------------------------------------
+// Forget batches which finished more than mLifeTime ago - requires mMutex
+//------------------------------------------------------------------------------
+void
+DiamondTpcBulk::Expire (time_t now)
+{
+  std::map<unsigned long long, batch_ptr_t>::iterator it = mBatches.begin();
+  while (it != mBatches.end())
+  {
+    if (it->second->finished && ((it->second->finished + mLifeTime) < now))
+      mBatches.erase(it++);
+    else
+      it++;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Return the counters
+//------------------------------------------------------------------------------
+DiamondTpcBulk::Stats
+DiamondTpcBulk::GetStats ()
+{
+  XrdSysMutexHelper bLock(mMutex);
+  Stats stats = mStats;
+  stats.batches = mBatches.size();
+  return stats;
+}
+
+//------------------------------------------------------------------------------
+// Split a transfer list
+//------------------------------------------------------------------------------
+int
+DiamondTpcBulk::Parse (const char* list, size_t nfields,
+                       std::vector<std::vector<std::string> >& tuples)
+{
+  if (!list || !*list)
+    return EINVAL;
+
+  std::string entries = list;
+  size_t start = 0;
+
+  while (start < entries.length())
+  {
+    size_t end = entries.find(';', start);
+    if (end == std::string::npos)
+      end = entries.length();
+
+    std::string entry = entries.substr(start, end - start);
+    start = end + 1;
+    if (entry.empty())
+      continue;
+
+    std::vector<std::string> fields;
+    size_t pos = 0;
+    while (1)
+    {
+      size_t comma = entry.find(',', pos);
+      fields.push_back(Unescape(entry.substr(pos, comma == std::string::npos ?
+                                             std::string::npos : comma - pos)));
+      if (fields.back().empty())
+        return EINVAL;
+      if (comma == std::string::npos)
+        break;
+      pos = comma + 1;
+    }
+
+    if (fields.size() != nfields)
+      return EINVAL;
+    tuples.push_back(fields);
+  }
+  return tuples.empty() ? EINVAL : 0;
+}
+
+//------------------------------------------------------------------------------
+// Decode %XX escapes - needed for ',', ';' and '&' in paths
+//------------------------------------------------------------------------------
+std::string
+DiamondTpcBulk::Unescape (const std::string& in)
+{
+  std::string out;
+  for (size_t i = 0; i < in.length(); i++)
+  {
+    if ((in[i] == '%') && ((i + 2) < in.length()) &&
+        isxdigit(in[i + 1]) && isxdigit(in[i + 2]))
+    {
+      out += (char) strtol(in.substr(i + 1, 2).c_str(), 0, 16);
+      i += 2;
+    }
+    else
+    {
+      out += in[i];
+    }
+  }
+  return out;
+}
+
+//------------------------------------------------------------------------------
+// Compute the TPC origin of a client e.g. <name>:<pid>@<host.domain> as done
+// by DiamondFile::open
+//------------------------------------------------------------------------------
+std::string
+DiamondTpcBulk::Origin (const XrdSecEntity* client)
+{
+  if (!client || !client->tident || !client->addrInfo)
+    return "";
+
+  std::string origin = client->tident;
+  size_t pos = origin.find(":");
+  if (pos != std::string::npos)
+    origin.erase(pos);
+  origin += "@";
+  origin += client->addrInfo->Name();
+  return origin;
+}
@@ -0,0 +1,193 @@
+// ----------------------------------------------------------------------
+// File: DiamondTpcBulk.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#ifndef __DIAMONDTPCBULK_API_H__
+#define __DIAMONDTPCBULK_API_H__
+#include "XrdSys/XrdSysPthread.hh"
+
+#include "DiamondWorkerPool.hh"
+
+#include <time.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+class XrdOucEnv;
+class XrdSecEntity;
+class XrdSysError;
+
+#define DIAMOND_DEFAULT_TPC_BULK_THREADS 8
+#define DIAMOND_DEFAULT_TPC_BULK_TTL 3600
+
+//------------------------------------------------------------------------------
+//! Bulk third party copies. A client registers many source sessions or
+//! submits many destination transfers with a single plug-in query instead of
+//! an open and two syncs per file. Submitted transfers form a batch which is
+//! run on a private worker pool and reported with one aggregated status.
+//!
+//! Plug-in queries (diamond.pcmd=<cmd>):
+//!  tpc.register diamond.tpc.list=<key>,<dst>,<lfn>;...       (source)
+//!  tpc.submit   diamond.tpc.list=<key>,<src>,<lfn>,<path>;... (destination)
+//!  tpc.status   diamond.tpc.batch=<id> [diamond.tpc.all=1]
+//!  tpc.cancel   diamond.tpc.batch=<id>
+//------------------------------------------------------------------------------
+class DiamondTpcBulk {
+public:
+
+  enum State_t {
+    kQueued = 0, //! waiting for a worker
+    kRunning = 1, //! being copied
+    kDone = 2, //! copied
+    kFailed = 3, //! copy failed - the partial file is removed
+    kCancelled = 4, //! cancelled before or while running
+    kStates = 5
+  };
+
+  struct Transfer {
+    Transfer () : state(kQueued), errc(0), bytes(0) { }
+    std::string key; //< TPC key presented to the source
+    std::string src; //< source host[:port]
+    std::string lfn; //< path on the source
+    std::string path; //< local destination path
+    State_t state;
+    int errc; //< errno of a failed transfer
+    std::string msg; //< reason of a failed transfer
+    unsigned long long bytes; //< bytes written
+  };
+
+  struct Stats {
+    Stats () : registered(0), submitted(0), done(0), failed(0), cancelled(0),
+      batches(0) { }
+    unsigned long long registered; //< source sessions registered
+    unsigned long long submitted; //< transfers submitted
+    unsigned long long done; //< transfers copied
+    unsigned long long failed; //< transfers failed
+    unsigned long long cancelled; //< transfers cancelled
+    unsigned long long batches; //< batches currently known
+  };
+
+  DiamondTpcBulk () : mNextId(1),
+                      mThreads(DIAMOND_DEFAULT_TPC_BULK_THREADS),
+                      mLifeTime(DIAMOND_DEFAULT_TPC_BULK_TTL) { }
+
+  ~DiamondTpcBulk () { }
+
+  //----------------------------------------------------------------------------
+  //! Start the transfer threads
+  //----------------------------------------------------------------------------
+  int Start (XrdSysError& err);
+
+  //----------------------------------------------------------------------------
+  //! Execute a tpc.* plug-in query
+  //!
+  //! @param reply text returned to the client
+  //! @param emsg reason of a failure
+  //! @return 0 or an errno
+  //----------------------------------------------------------------------------
+  int Execute (const char* pcmd, XrdOucEnv& env, const XrdSecEntity* client,
+               std::string& reply, std::string& emsg);
+
+  Stats GetStats ();
+
+  void SetThreads (size_t threads) { mThreads = threads ? threads : 1; }
+  void SetLifeTime (time_t lifetime) { mLifeTime = lifetime; }
+
+  //----------------------------------------------------------------------------
+  //! Split a transfer list into tuples of nfields %-escaped fields
+  //!
+  //! @return 0 or EINVAL
+  //----------------------------------------------------------------------------
+  static int Parse (const char* list, size_t nfields,
+                    std::vector<std::vector<std::string> >& tuples);
+
+  //----------------------------------------------------------------------------
+  //! Decode %XX escapes
+  //----------------------------------------------------------------------------
+  static std::string Unescape (const std::string& in);
+
+private:
+  friend class DiamondTpcBulkJob;
+
+  struct Batch {
+    Batch () : id(0), cancelled(false), finished(0) {
+      for (size_t i = 0; i < kStates; i++)
+        count[i] = 0;
+    }
+    unsigned long long id;
+    std::string org; //< origin of the submitting client
+    std::vector<Transfer> transfers; //< never resized after submission
+    size_t count[kStates]; //< number of transfers per state
+    bool cancelled;
+    time_t finished; //< time the last transfer finished - 0 while running
+  };
+
+  typedef std::shared_ptr<Batch> batch_ptr_t;
+
+  int Register (const std::string& org,
+                const std::vector<std::vector<std::string> >& tuples);
+  int Submit (const std::string& org,
+              const std::vector<std::vector<std::string> >& tuples,
+              unsigned long long& id);
+  batch_ptr_t Find (XrdOucEnv& env, const std::string& org);
+  void Report (const Batch& batch, bool all, std::string& reply);
+  void Cancel (Batch& batch);
+  void Run (Batch& batch, size_t index);
+  void Finish (Batch& batch, Transfer& transfer, State_t state, int errc,
+               const std::string& msg, unsigned long long bytes);
+  void Expire (time_t now);
+
+  static std::string Origin (const XrdSecEntity* client);
+
+  XrdSysMutex mMutex; //< protects mBatches, the batches and mStats
+  std::map<unsigned long long, batch_ptr_t> mBatches; //< id => batch
+  unsigned long long mNextId; //< id of the next batch
+  DiamondWorkerPool mPool; //< threads running the transfers
+  size_t mThreads; //< number of transfer threads
+  time_t mLifeTime; //< lifetime of registered keys and finished batches
+  Stats mStats; //< counters
+};
+
+//------------------------------------------------------------------------------
+//! Job running one transfer of a batch - deletes itself
+//------------------------------------------------------------------------------
+class DiamondTpcBulkJob : public DiamondJob {
+public:
+  DiamondTpcBulkJob (DiamondTpcBulk* bulk, DiamondTpcBulk::batch_ptr_t batch,
+                     size_t index) :
+    mBulk(bulk), mBatch(batch), mIndex(index) { }
+
+  void
+  DoIt () {
+    mBulk->Run(*mBatch, mIndex);
+    delete this;
+  }
+
+private:
+  DiamondTpcBulk* mBulk;
+  DiamondTpcBulk::batch_ptr_t mBatch;
+  size_t mIndex;
+};
+
+#endif
@@ -0,0 +1,158 @@
+// ----------------------------------------------------------------------
+// File: DiamondTpcLoad.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#include "DiamondTpcLoad.hh"
+
+#include <stdio.h>
+
+//------------------------------------------------------------------------------
+// Constructor
+//------------------------------------------------------------------------------
+DiamondTpcLoad::DiamondTpcLoad () :
+  mSessions(0), mMaxSessions(0), mMaxRate(0), mMaxQueued(0)
+{
+  for (size_t i = 0; i < DIAMOND_TPC_LOAD_WINDOW; i++)
+  {
+    mSecond[i] = 0;
+    mBytes[i] = 0;
+  }
+}
+
+//------------------------------------------------------------------------------
+// A source read session starts
+//------------------------------------------------------------------------------
+void
+DiamondTpcLoad::Open ()
+{
+  XrdSysMutexHelper lLock(mMutex);
+  mSessions++;
+}
+
+//------------------------------------------------------------------------------
+// A source read session ends
+//------------------------------------------------------------------------------
+void
+DiamondTpcLoad::Close ()
+{
+  XrdSysMutexHelper lLock(mMutex);
+  if (mSessions)
+    mSessions--;
+}
+
+//------------------------------------------------------------------------------
+// Account sent bytes in the bucket of the current second
+//------------------------------------------------------------------------------
+void
+DiamondTpcLoad::Account (uint64_t bytes)
+{
+  time_t now = time(NULL);
+  size_t bucket = now % DIAMOND_TPC_LOAD_WINDOW;
+  XrdSysMutexHelper lLock(mMutex);
+  if (mSecond[bucket] != now)
+  {
+    mSecond[bucket] = now;
+    mBytes[bucket] = 0;
+  }
+  mBytes[bucket] += bytes;
+  mStats.bytes += bytes;
+}
+
+//------------------------------------------------------------------------------
+// Answer a placement probe
+//------------------------------------------------------------------------------
+bool
+DiamondTpcLoad::Probe (uint64_t queued, std::string& report)
+{
+  XrdSysMutexHelper lLock(mMutex);
+  mStats.probes++;
+  bool busy = Check(queued, report);
+  if (busy)
+    mStats.refused++;
+  return busy;
+}
+
+//------------------------------------------------------------------------------
+// Report the load
+//------------------------------------------------------------------------------
+std::string
+DiamondTpcLoad::Report (uint64_t queued)
+{
+  std::string report;
+  XrdSysMutexHelper lLock(mMutex);
+  bool busy = Check(queued, report);
+
+  char limits[256];
+  snprintf(limits, sizeof(limits), " max-sessions=%llu max-rate=%llu "
+           "max-queued=%llu overloaded=%d", (unsigned long long) mMaxSessions,
+           (unsigned long long) mMaxRate, (unsigned long long) mMaxQueued,
+           (int) busy);
+  report += limits;
+  return report;
+}
+
+//------------------------------------------------------------------------------
+// Return the counters
+//------------------------------------------------------------------------------
+DiamondTpcLoad::Stats
+DiamondTpcLoad::GetStats ()
+{
+  XrdSysMutexHelper lLock(mMutex);
+  Stats stats = mStats;
+  stats.sessions = mSessions;
+  stats.rate = Rate(time(NULL));
+  return stats;
+}
+
+//------------------------------------------------------------------------------
+// Egress rate over the completed seconds of the window
+//------------------------------------------------------------------------------
+uint64_t
+DiamondTpcLoad::Rate (time_t now)
+{
+  uint64_t bytes = 0;
+  for (size_t i = 0; i < DIAMOND_TPC_LOAD_WINDOW; i++)
+  {
+    if ((mSecond[i] < now) && (mSecond[i] >= (now - DIAMOND_TPC_LOAD_WINDOW)))
+      bytes += mBytes[i];
+  }
+  return bytes / DIAMOND_TPC_LOAD_WINDOW;
+}
+
+//------------------------------------------------------------------------------
+// Check the limits
+//------------------------------------------------------------------------------
+bool
+DiamondTpcLoad::Check (uint64_t queued, std::string& report)
+{
+  uint64_t rate = Rate(time(NULL));
+  char load[256];
+  snprintf(load, sizeof(load), "sessions=%llu rate=%llu queued=%llu",
+           (unsigned long long) mSessions, (unsigned long long) rate,
+           (unsigned long long) queued);
+  report = load;
+
+  return ((mMaxSessions && (mSessions >= mMaxSessions)) ||
+          (mMaxRate && (rate >= mMaxRate)) ||
+          (mMaxQueued && (queued >= mMaxQueued)));
+}
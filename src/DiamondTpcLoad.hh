@@ -0,0 +1,111 @@
+// ----------------------------------------------------------------------
+// File: DiamondTpcLoad.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#ifndef __DIAMONDTPCLOAD_API_H__
+#define __DIAMONDTPCLOAD_API_H__
+#include "XrdSys/XrdSysPthread.hh"
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+
+#define DIAMOND_TPC_LOAD_WINDOW 10
+
+//------------------------------------------------------------------------------
+//! Load of this server as a TPC source - active source read sessions, egress
+//! rate of these sessions over the last DIAMOND_TPC_LOAD_WINDOW seconds and
+//! limits above which placement probes are refused
+//------------------------------------------------------------------------------
+class DiamondTpcLoad {
+public:
+
+  struct Stats {
+    Stats () : probes(0), refused(0), sessions(0), rate(0), bytes(0) { }
+    unsigned long long probes; //< placement probes answered
+    unsigned long long refused; //< placement probes refused
+    unsigned long long sessions; //< active source read sessions
+    unsigned long long rate; //< egress bytes per second
+    unsigned long long bytes; //< egress bytes since startup
+  };
+
+  DiamondTpcLoad ();
+
+  //----------------------------------------------------------------------------
+  //! Account the start and the end of a source read session
+  //----------------------------------------------------------------------------
+  void Open ();
+  void Close ();
+
+  //----------------------------------------------------------------------------
+  //! Account bytes sent by a source read session
+  //----------------------------------------------------------------------------
+  void Account (uint64_t bytes);
+
+  //----------------------------------------------------------------------------
+  //! Answer a placement probe
+  //!
+  //! @param queued registered source sessions which have not started reading
+  //! @param report current load - "sessions=<n> rate=<n> queued=<n>"
+  //! @return true if the source is above one of its limits
+  //----------------------------------------------------------------------------
+  bool Probe (uint64_t queued, std::string& report);
+
+  //----------------------------------------------------------------------------
+  //! Return the current load and limits without counting a probe
+  //----------------------------------------------------------------------------
+  std::string Report (uint64_t queued);
+
+  Stats GetStats ();
+
+  //----------------------------------------------------------------------------
+  //! Check if the egress rate is limited - the bytes of every read count then
+  //----------------------------------------------------------------------------
+  bool RateLimited () const { return mMaxRate; }
+
+  void SetMaxSessions (uint64_t sessions) { mMaxSessions = sessions; }
+  void SetMaxRate (uint64_t rate) { mMaxRate = rate; }
+  void SetMaxQueued (uint64_t queued) { mMaxQueued = queued; }
+
+private:
+  //----------------------------------------------------------------------------
+  //! Return the egress rate over the window - called with mMutex held
+  //----------------------------------------------------------------------------
+  uint64_t Rate (time_t now);
+
+  //----------------------------------------------------------------------------
+  //! Check the limits and format the report - called with mMutex held
+  //----------------------------------------------------------------------------
+  bool Check (uint64_t queued, std::string& report);
+
+  XrdSysMutex mMutex;
+  uint64_t mSessions; //< active source read sessions
+  time_t mSecond[DIAMOND_TPC_LOAD_WINDOW]; //< second of each bucket
+  uint64_t mBytes[DIAMOND_TPC_LOAD_WINDOW]; //< bytes sent in that second
+  uint64_t mMaxSessions; //< 0 is unlimited
+  uint64_t mMaxRate; //< bytes per second - 0 is unlimited
+  uint64_t mMaxQueued; //< 0 is unlimited
+  Stats mStats;
+};
+
+#endif
@@ -0,0 +1,164 @@
+// ----------------------------------------------------------------------
+// File: DiamondWorkerPool.cc
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "DiamondWorkerPool.hh"
+
+//------------------------------------------------------------------------------
+// Account one more pending job
+//------------------------------------------------------------------------------
+void
+DiamondJobGroup::Add ()
+{
+  mCond.Lock();
+  mPending++;
+  mCond.UnLock();
+}
+
+//------------------------------------------------------------------------------
+// Account one finished job and wake up waiters if it was the last
+//------------------------------------------------------------------------------
+void
+DiamondJobGroup::Done ()
+{
+  mCond.Lock();
+  if (!--mPending)
+    mCond.Broadcast();
+  mCond.UnLock();
+}
+
+//------------------------------------------------------------------------------
+// Wait until all jobs of this group have finished
+//------------------------------------------------------------------------------
+void
+DiamondJobGroup::Wait ()
+{
+  mCond.Lock();
+  while (mPending)
+    mCond.Wait();
+  mCond.UnLock();
+}
+
+//------------------------------------------------------------------------------
+// Tell the workers to exit - they are detached and not joined
+//------------------------------------------------------------------------------
+DiamondWorkerPool::~DiamondWorkerPool ()
+{
+  mCond.Lock();
+  mShutdown = true;
+  mCond.Broadcast();
+  mCond.UnLock();
+}
+
+//------------------------------------------------------------------------------
+// Start the worker threads
+//------------------------------------------------------------------------------
+int
+DiamondWorkerPool::Start (size_t nthreads, const char* name)
+{
+  for (size_t i = 0; i < nthreads; i++)
+  {
+    pthread_t tid;
+    int rc = XrdSysThread::Run(&tid, DiamondWorkerPool::StartWorker,
+                               static_cast<void*>(this), 0, name);
+    if (rc)
+      return rc;
+    mThreads.push_back(tid);
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Pin the threads started afterwards
+//------------------------------------------------------------------------------
+void
+DiamondWorkerPool::Pin (const cpu_set_t& cpus)
+{
+  mCpus = cpus;
+  mPinned = true;
+}
+
+//------------------------------------------------------------------------------
+// Queue a job or run it inline if the pool has no threads
+//------------------------------------------------------------------------------
+void
+DiamondWorkerPool::Schedule (DiamondJob* job, DiamondJobGroup* group)
+{
+  job->mGroup = group;
+  if (group)
+    group->Add();
+
+  if (mThreads.empty())
+  {
+    job->DoIt();
+    if (group)
+      group->Done();
+    return;
+  }
+
+  mCond.Lock();
+  mQueue.push_back(job);
+  mCond.Signal();
+  mCond.UnLock();
+}
+
+//------------------------------------------------------------------------------
+// Static thread entry point
+//------------------------------------------------------------------------------
+void*
+DiamondWorkerPool::StartWorker (void* arg)
+{
+  return reinterpret_cast<DiamondWorkerPool*>(arg)->Worker();
+}
+
+//------------------------------------------------------------------------------
+// Worker loop
+//------------------------------------------------------------------------------
+void*
+DiamondWorkerPool::Worker ()
+{
+  if (mPinned)
+    pthread_setaffinity_np(pthread_self(), sizeof(mCpus), &mCpus);
+
+  while (1)
+  {
+    mCond.Lock();
+    while (mQueue.empty() && !mShutdown)
+      mCond.Wait();
+    if (mShutdown)
+    {
+      mCond.UnLock();
+      return 0;
+    }
+    DiamondJob* job = mQueue.front();
+    mQueue.pop_front();
+    mCond.UnLock();
+
+    // the group pointer has to be fetched before DoIt - a job without a group
+    // may delete itself
+    DiamondJobGroup* group = job->mGroup;
+    job->DoIt();
+    if (group)
+      group->Done();
+  }
+  return 0;
+}
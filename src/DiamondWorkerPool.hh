@@ -0,0 +1,105 @@
+// ----------------------------------------------------------------------
+// File: DiamondWorkerPool.hh
+// Author: Andreas-Joachim Peters - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * EOS DIAMOND - the CERN Disk Storage System                           *
+ * Copyright (C) 2014 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef __DIAMONDWORKERPOOL_API_H__
+#define __DIAMONDWORKERPOOL_API_H__
+#include "XrdSys/XrdSysPthread.hh"
+
+#include <sched.h>
+#include <deque>
+#include <vector>
+
+class DiamondJobGroup;
+
+//------------------------------------------------------------------------------
+//! A unit of work executed by a DiamondWorkerPool thread. The job is owned by
+//! the caller and must stay valid until its group has been waited for.
+//------------------------------------------------------------------------------
+class DiamondJob {
+public:
+  DiamondJob () : mGroup(0) { }
+  virtual ~DiamondJob () { }
+
+  virtual void DoIt () = 0;
+
+  DiamondJobGroup* mGroup; //< group notified when DoIt returns
+};
+
+//------------------------------------------------------------------------------
+//! Completion counter for a set of jobs scheduled together
+//------------------------------------------------------------------------------
+class DiamondJobGroup {
+public:
+  DiamondJobGroup () : mPending(0), mCond(0) { }
+  ~DiamondJobGroup () { Wait(); }
+
+  void Add ();
+  void Done ();
+  void Wait ();
+
+private:
+  int mPending; //< number of jobs not yet finished
+  XrdSysCondVar mCond; //< condition variable protecting mPending
+};
+
+//------------------------------------------------------------------------------
+//! Fixed size thread pool executing DiamondJob objects in FIFO order
+//------------------------------------------------------------------------------
+class DiamondWorkerPool {
+public:
+  DiamondWorkerPool () : mCond(0), mShutdown(false), mPinned(false) { }
+  ~DiamondWorkerPool ();
+
+  //----------------------------------------------------------------------------
+  //! Start nthreads worker threads - without threads jobs run inline
+  //----------------------------------------------------------------------------
+  int Start (size_t nthreads, const char* name);
+
+  //----------------------------------------------------------------------------
+  //! Restrict the threads started afterwards to a set of CPUs
+  //----------------------------------------------------------------------------
+  void Pin (const cpu_set_t& cpus);
+
+  //----------------------------------------------------------------------------
+  //! Queue a job, optionally accounting it in a completion group
+  //----------------------------------------------------------------------------
+  void Schedule (DiamondJob* job, DiamondJobGroup* group = 0);
+
+  size_t
+  Size () const {
+    return mThreads.size();
+  }
+
+private:
+  static void* StartWorker (void* arg);
+  void* Worker ();
+
+  XrdSysCondVar mCond; //< condition variable protecting the queue
+  std::deque<DiamondJob*> mQueue; //< jobs waiting for a worker
+  std::vector<pthread_t> mThreads; //< worker thread IDs
+  bool mShutdown; //< tells workers to exit
+  bool mPinned; //< workers run on mCpus only
+  cpu_set_t mCpus; //< CPUs of pinned workers
+};
+
+#endif